@@ -11,6 +11,41 @@
 #include <utility>
 #include <limits>
 #include <cstring>
+#include <cstdlib>
+#include <new>
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#else
+#include <ctime>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WPNGIMAGE_SSE2 1
+#include <emmintrin.h>
+#else
+#define WPNGIMAGE_SSE2 0
+#endif
+
+// Code paths for later instruction sets are compiled with the target attribute, and chosen at
+// runtime depending on what the CPU supports.
+#if WPNGIMAGE_SSE2 && (defined(__x86_64__) || defined(_M_X64)) && \
+    (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define WPNGIMAGE_X86_DISPATCH 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define WPNGIMAGE_TARGET(features)
+#else
+#include <cpuid.h>
+#define WPNGIMAGE_TARGET(features) __attribute__((target(features)))
+#endif
+#else
+#define WPNGIMAGE_X86_DISPATCH 0
+#endif
 
 typedef WPngImage::Byte Byte;
 typedef WPngImage::UInt16 UInt16;
@@ -117,14 +152,17 @@ namespace
         return res < 0 ? 0 : res > 65535 ? 65535 : res;
     }
 
+    // Int32 may be only 32 bits wide, so the saturation is checked before multiplying.
     inline Byte mulValues(Byte v1, Int32 v2)
     {
+        if(v2 > 0 && Int32(v1) > 255 / v2) return 255;
         const Int32 res = Int32(v1) * v2;
         return res > 255 ? 255 : res;
     }
 
     inline UInt16 mulValues(UInt16 v1, Int32 v2)
     {
+        if(v2 > 0 && Int32(v1) > 65535 / v2) return 65535;
         const Int32 res = Int32(v1) * v2;
         return res > 65535 ? 65535 : res;
     }
@@ -1199,54 +1237,421 @@ template struct WPngImage::IPixel<WPngImage::Pixel16, UInt16>;
 
 
 
+//============================================================================
+// Running jobs in parallel
+//============================================================================
+namespace
+{
+    // A requested amount of 0 means "as many as there are hardware threads".
+    inline unsigned getThreadsAmount(unsigned requestedAmount)
+    {
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+        if(requestedAmount == 0)
+        {
+            requestedAmount = std::thread::hardware_concurrency();
+            if(requestedAmount == 0) requestedAmount = 1;
+        }
+        return requestedAmount;
+#else
+        (void)requestedAmount;
+        return 1;
+#endif
+    }
+
+    // A point in time after which work that hasn't finished is abandoned. In C++98 mode the
+    // processor time used by the program is measured instead, which is the same thing without
+    // threads.
+    class Deadline
+    {
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+        std::chrono::steady_clock::time_point mTime;
+
+     public:
+        explicit Deadline(double seconds):
+            mTime(std::chrono::steady_clock::now() +
+                  std::chrono::duration_cast<std::chrono::steady_clock::duration>
+                  (std::chrono::duration<double>(seconds))) {}
+
+        bool passed() const { return std::chrono::steady_clock::now() >= mTime; }
+#else
+        std::clock_t mTime;
+
+     public:
+        explicit Deadline(double seconds):
+            mTime(std::clock() + std::clock_t(seconds * CLOCKS_PER_SEC)) {}
+
+        bool passed() const { return std::clock() >= mTime; }
+#endif
+    };
+
+    // Calls job(index, workerIndex) for every index in [0, jobsAmount), where workerIndex
+    // (in [0, threadsAmount)) identifies the thread running the job. The calling thread
+    // takes part in the work, and the remaining jobs are picked up by whichever thread is
+    // free. If threads can't be created, the jobs are simply run by fewer threads (or
+    // serially).
+    template<typename Job_t>
+    void runJobs(std::size_t jobsAmount, unsigned threadsAmount, Job_t& job)
+    {
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+        if(threadsAmount > jobsAmount) threadsAmount = unsigned(jobsAmount);
+        if(threadsAmount > 1)
+        {
+            std::atomic<std::size_t> nextJobIndex(0);
+            auto worker = [&](unsigned workerIndex)
+            {
+                for(std::size_t index; (index = nextJobIndex++) < jobsAmount;)
+                    job(index, workerIndex);
+            };
+
+            std::vector<std::thread> threads;
+            try
+            {
+                threads.reserve(threadsAmount - 1);
+                for(unsigned i = 1; i < threadsAmount; ++i)
+                    threads.emplace_back(worker, i);
+            }
+            catch(...) {}
+
+            worker(0);
+            for(std::size_t i = 0; i < threads.size(); ++i)
+                threads[i].join();
+            return;
+        }
+#else
+        (void)threadsAmount;
+#endif
+        for(std::size_t index = 0; index < jobsAmount; ++index)
+            job(index, 0U);
+    }
+
+    // Per-pixel work is split into chunks of at least kMinPixelsPerChunk pixels (so that
+    // small images are processed by one thread), with a few chunks per thread to even out
+    // the load. The chunk size is a multiple of 64 pixels, which makes the chunks consist of
+    // whole cache lines for every pixel type.
+    const std::size_t kMinPixelsPerChunk = 1 << 15;
+
+    inline std::size_t getPixelChunkSize(std::size_t pixelsAmount, unsigned threadsAmount)
+    {
+        const std::size_t chunksAmount = std::size_t(threadsAmount) * 4;
+        const std::size_t chunkSize =
+            std::max((pixelsAmount + chunksAmount - 1) / chunksAmount, kMinPixelsPerChunk);
+        return (chunkSize + 63) & ~std::size_t(63);
+    }
+}
+
+
+//============================================================================
+// Pixel storage
+//============================================================================
+namespace
+{
+    // The pixel data is aligned to cache lines, so that with padded rows every row begins
+    // at an aligned address.
+    const std::size_t kStorageAlignment = 64;
+
+    // Images may be created in other threads while the default resource is changed. In C++98
+    // mode the library has no threads.
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+    std::atomic<WPngImage::MemoryResource*> gDefaultMemoryResource(nullptr);
+#else
+    WPngImage::MemoryResource* gDefaultMemoryResource = 0;
+#endif
+
+    // Without a memory resource, the pointer returned by malloc() is stored right before
+    // the aligned block.
+    void* allocateStorage(WPngImage::MemoryResource* resource,
+                          std::size_t bytes, std::size_t alignment)
+    {
+        if(resource)
+        {
+            void* data = resource->allocate(bytes, alignment);
+            if(!data) throw std::bad_alloc();
+            return data;
+        }
+
+        char* block = static_cast<char*>(std::malloc(bytes + alignment + sizeof(void*)));
+        if(!block) throw std::bad_alloc();
+        char* data = block + sizeof(void*);
+        data += (alignment - reinterpret_cast<std::size_t>(data) % alignment) % alignment;
+        std::memcpy(data - sizeof(void*), &block, sizeof(void*));
+        return data;
+    }
+
+    void deallocateStorage(WPngImage::MemoryResource* resource, void* data,
+                           std::size_t bytes, std::size_t alignment)
+    {
+        if(resource)
+        {
+            resource->deallocate(data, bytes, alignment);
+            return;
+        }
+
+        void* block;
+        std::memcpy(&block, static_cast<char*>(data) - sizeof(void*), sizeof(void*));
+        std::free(block);
+    }
+
+    // Allocates from the given memory resource, or from the heap if there is none.
+    template<typename T>
+    struct AlignedAllocator
+    {
+        typedef T value_type;
+        typedef T* pointer;
+        typedef const T* const_pointer;
+        typedef T& reference;
+        typedef const T& const_reference;
+        typedef std::size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+        template<typename U> struct rebind { typedef AlignedAllocator<U> other; };
+
+        WPngImage::MemoryResource* resource;
+
+        explicit AlignedAllocator(WPngImage::MemoryResource* memoryResource = 0):
+            resource(memoryResource) {}
+        template<typename U> AlignedAllocator(const AlignedAllocator<U>& other):
+            resource(other.resource) {}
+
+        T* address(T& value) const { return &value; }
+        const T* address(const T& value) const { return &value; }
+        std::size_t max_size() const
+        { return (std::size_t(-1) - kStorageAlignment - sizeof(void*)) / sizeof(T); }
+        void construct(T* ptr, const T& value) { new(ptr) T(value); }
+        void destroy(T* ptr) { ptr->~T(); }
+
+        T* allocate(std::size_t amount, const void* = 0)
+        {
+            if(amount > max_size()) throw std::bad_alloc();
+            return static_cast<T*>
+                (allocateStorage(resource, amount * sizeof(T), kStorageAlignment));
+        }
+
+        void deallocate(T* ptr, std::size_t amount)
+        {
+            deallocateStorage(resource, ptr, amount * sizeof(T), kStorageAlignment);
+        }
+    };
+
+    template<typename T, typename U>
+    bool operator==(const AlignedAllocator<T>& lhs, const AlignedAllocator<U>& rhs)
+    { return lhs.resource == rhs.resource; }
+    template<typename T, typename U>
+    bool operator!=(const AlignedAllocator<T>& lhs, const AlignedAllocator<U>& rhs)
+    { return lhs.resource != rhs.resource; }
+
+    // The pixel data of an image. It's normally owned, and stored in a std::vector, but it
+    // can also refer to an external buffer of rows of rowLength elements, which are 'stride'
+    // elements apart. External storage is never reallocated, and only its rows are written
+    // (the memory between them, and after the last row, may belong to something else).
+    // Copies are always owned, and any function which would reallocate the storage first
+    // makes it owned.
+    template<typename T>
+    class PixelStorage
+    {
+     public:
+        typedef T value_type;
+        typedef AlignedAllocator<T> allocator_type;
+
+        explicit PixelStorage(const allocator_type& allocator = allocator_type()):
+            mOwnedData(allocator), mExternalData(0), mRowLength(0), mStride(0), mRows(0),
+            mReadOnly(false) {}
+
+        PixelStorage(std::size_t amount, const T& value, const allocator_type& allocator):
+            mOwnedData(amount, value, allocator),
+            mExternalData(0), mRowLength(0), mStride(0), mRows(0), mReadOnly(false) {}
+
+        PixelStorage(T* externalData, std::size_t rowLength, std::size_t stride,
+                     std::size_t rows, bool readOnly, const allocator_type& allocator):
+            mOwnedData(allocator), mExternalData(externalData),
+            mRowLength(rowLength), mStride(stride), mRows(rows), mReadOnly(readOnly) {}
+
+        PixelStorage(const PixelStorage& rhs):
+            mOwnedData(rhs.get_allocator()),
+            mExternalData(0), mRowLength(0), mStride(0), mRows(0), mReadOnly(false)
+        {
+            copyFrom(rhs);
+        }
+
+        PixelStorage& operator=(const PixelStorage& rhs)
+        {
+            if(this != &rhs)
+            {
+                mExternalData = 0;
+                copyFrom(rhs);
+            }
+            return *this;
+        }
+
+        bool isExternal() const { return mExternalData != 0; }
+        bool isReadOnly() const { return mExternalData && mReadOnly; }
+        std::size_t size() const { return mExternalData ? mStride * mRows : mOwnedData.size(); }
+        bool empty() const { return size() == 0; }
+        allocator_type get_allocator() const { return mOwnedData.get_allocator(); }
+
+        T& operator[](std::size_t index)
+        { return mExternalData ? mExternalData[index] : mOwnedData[index]; }
+        const T& operator[](std::size_t index) const
+        { return mExternalData ? mExternalData[index] : mOwnedData[index]; }
+
+        void assign(std::size_t amount, const T& value)
+        {
+            if(mExternalData && amount == size())
+            {
+                for(std::size_t row = 0; row < mRows; ++row)
+                    std::fill(mExternalData + row * mStride,
+                              mExternalData + row * mStride + mRowLength, value);
+                return;
+            }
+            mExternalData = 0;
+            mOwnedData.assign(amount, value);
+        }
+
+        void reserve(std::size_t amount) { makeOwned(); mOwnedData.reserve(amount); }
+        void push_back(const T& value) { makeOwned(); mOwnedData.push_back(value); }
+        void resize(std::size_t amount, const T& value)
+        { makeOwned(); mOwnedData.resize(amount, value); }
+
+        void swap(PixelStorage& rhs)
+        {
+            mOwnedData.swap(rhs.mOwnedData);
+            std::swap(mExternalData, rhs.mExternalData);
+            std::swap(mRowLength, rhs.mRowLength);
+            std::swap(mStride, rhs.mStride);
+            std::swap(mRows, rhs.mRows);
+            std::swap(mReadOnly, rhs.mReadOnly);
+        }
+
+     private:
+        std::vector<T, AlignedAllocator<T> > mOwnedData;
+        T* mExternalData;
+        std::size_t mRowLength, mStride, mRows;
+        bool mReadOnly;
+
+        // The padding of an owned copy of external storage gets copies of the first pixel.
+        void copyFrom(const PixelStorage& rhs)
+        {
+            if(!rhs.mExternalData)
+            {
+                mOwnedData = rhs.mOwnedData;
+                return;
+            }
+
+            mOwnedData.assign(rhs.size(), rhs.mExternalData[0]);
+            for(std::size_t row = 0; row < rhs.mRows; ++row)
+                std::copy(rhs.mExternalData + row * rhs.mStride,
+                          rhs.mExternalData + row * rhs.mStride + rhs.mRowLength,
+                          mOwnedData.begin() + row * rhs.mStride);
+        }
+
+        void makeOwned()
+        {
+            if(mExternalData) *this = PixelStorage(*this);
+        }
+    };
+
+    // Padded rows take a whole number of cache lines. A row whose size is a multiple of
+    // 4 kB gets an extra cache line, because otherwise the same columns of consecutive rows
+    // would map to the same cache sets (and alias each other in the store buffer). Every
+    // element size divides the alignment.
+    inline std::size_t getRowStride(std::size_t rowLength, std::size_t elementSize,
+                                    bool padRows)
+    {
+        if(!padRows) return rowLength;
+        std::size_t rowBytes = (rowLength * elementSize + kStorageAlignment - 1) /
+            kStorageAlignment * kStorageAlignment;
+        if(rowBytes % 4096 == 0) rowBytes += kStorageAlignment;
+        return rowBytes / elementSize;
+    }
+
+    // The pixels are stored in rows of 'stride' elements, of which the first 'length' belong
+    // to the image and the rest are padding. The pixel indices used by the image data
+    // functions don't count the padding.
+    struct RowLayout
+    {
+        std::size_t length, stride;
+
+        RowLayout(std::size_t rowLength, std::size_t rowStride):
+            length(rowLength), stride(rowStride) {}
+
+        std::size_t pixelsAmount(std::size_t storageSize) const
+        {
+            return stride ? storageSize / stride * length : 0;
+        }
+
+        std::size_t storageIndex(std::size_t index) const
+        {
+            return stride == length ? index : index + index / length * (stride - length);
+        }
+
+        // How many of the pixels starting from the index are contiguous in the storage.
+        std::size_t contiguousAmount(std::size_t index, std::size_t amount) const
+        {
+            return stride == length ? amount : std::min(amount, length - index % length);
+        }
+    };
+}
+
+
 //============================================================================
 // Structs for handling grayscale pixels
 //============================================================================
 namespace
 {
+    // The public gray pixel types are used as the base, so that the gray pixel data can be
+    // accessed directly as them.
+    template<typename CT> struct PublicPixelG;
+    template<> struct PublicPixelG<Byte> { typedef WPngImage::PixelGA8 Type; };
+    template<> struct PublicPixelG<UInt16> { typedef WPngImage::PixelGA16 Type; };
+    template<> struct PublicPixelG<Float> { typedef WPngImage::PixelGAF Type; };
+
     template<typename CT>
-    struct PixelG
+    struct PixelG: public PublicPixelG<CT>::Type
     {
         typedef CT Component_t;
-        CT g, a;
+
+        PixelG(CT gray, CT alpha)
+        {
+            this->g = gray;
+            this->a = alpha;
+        }
 
         template<typename OtherCT>
-        PixelG(const PixelG<OtherCT>& other):
-            g(convertType<CT>(other.g)),
-            a(convertType<CT>(other.a)) {}
+        PixelG(const PixelG<OtherCT>& other)
+        {
+            this->g = convertType<CT>(other.g);
+            this->a = convertType<CT>(other.a);
+        }
 
         template<typename Pixel_t>
-        PixelG(const Pixel_t& pixel):
-            g(convertType<CT>(WPngImage::PixelF(pixel).toGrayCIE())),
-            a(convertType<CT>(pixel.a)) {}
+        PixelG(const Pixel_t& pixel)
+        {
+            this->g = convertType<CT>(WPngImage::PixelF(pixel).toGrayCIE());
+            this->a = convertType<CT>(pixel.a);
+        }
 
-        PixelG(const WPngImage::PixelF& pixel):
-            g(convertType<CT>(pixel.toGrayCIE())),
-            a(convertType<CT>(pixel.a)) {}
+        PixelG(const WPngImage::PixelF& pixel)
+        {
+            this->g = convertType<CT>(pixel.toGrayCIE());
+            this->a = convertType<CT>(pixel.a);
+        }
 
         template<typename Pixel_t>
         Pixel_t toPixel() const
         {
             typedef typename Pixel_t::Component_t ToCT;
-            const ToCT c = convertType<ToCT>(g);
-            return Pixel_t(c, c, c, convertType<ToCT>(a));
+            const ToCT c = convertType<ToCT>(this->g);
+            return Pixel_t(c, c, c, convertType<ToCT>(this->a));
         }
 
         void blendWith(const PixelG& src)
         {
-            const CT blendedA = blendAlphas(a, src.a);
-            g = blendComponents(g, a, src.g, src.a, blendedA);
-            a = blendedA;
+            const CT blendedA = blendAlphas(this->a, src.a);
+            this->g = blendComponents(this->g, this->a, src.g, src.a, blendedA);
+            this->a = blendedA;
         }
 
         void premultiplyAlpha()
         {
-            g = componentMultipliedByAlpha(g, a);
-        }
-
-        PixelG premultipliedAlphaPixel() const
-        {
-            return PixelG(componentMultipliedByAlpha(g, a), a);
+            this->g = componentMultipliedByAlpha(this->g, this->a);
         }
     };
 
@@ -1322,23 +1727,217 @@ namespace
 //============================================================================
 // WPngImage::PngData
 //============================================================================
+namespace
+{
+    inline bool pixelHasFullAlpha(const PixelG8& pixel) { return pixel.a == 255; }
+    inline bool pixelHasFullAlpha(const PixelG16& pixel) { return pixel.a == 65535; }
+    inline bool pixelHasFullAlpha(const PixelGF& pixel) { return pixel.a >= 1.0f; }
+    inline bool pixelHasFullAlpha(const WPngImage::Pixel8& pixel) { return pixel.a == 255; }
+    inline bool pixelHasFullAlpha(const WPngImage::Pixel16& pixel) { return pixel.a == 65535; }
+    inline bool pixelHasFullAlpha(const WPngImage::PixelF& pixel) { return pixel.a >= 1.0f; }
+
+    // The alpha plane of the planar pixel formats.
+    inline bool pixelHasFullAlpha(Float alpha) { return alpha >= 1.0f; }
+
+    // The pixels are checked in fixed-size blocks. The inner loop has no early exit, which
+    // allows the compiler to vectorize it, and the scan stops at the first block that has a
+    // pixel without full alpha.
+    template<typename PixelData_t>
+    bool allPixelsHaveFullAlpha(const PixelData_t* pixels, std::size_t pixelsAmount)
+    {
+        const std::size_t kBlockSize = 256;
+        std::size_t index = 0;
+
+        for(; index + kBlockSize <= pixelsAmount; index += kBlockSize)
+        {
+            unsigned nonOpaqueFound = 0;
+            for(std::size_t i = 0; i < kBlockSize; ++i)
+                nonOpaqueFound |= !pixelHasFullAlpha(pixels[index + i]);
+            if(nonOpaqueFound) return false;
+        }
+
+        for(; index < pixelsAmount; ++index)
+            if(!pixelHasFullAlpha(pixels[index]))
+                return false;
+        return true;
+    }
+
+    // Transforms one chunk of the pixels in place, and records whether all of the resulting
+    // pixels of the chunk are opaque.
+    template<typename Pixel_t, typename PixelData_t, typename Func_t>
+    struct TransformPixelsJob
+    {
+        PixelData_t* pixels;
+        RowLayout layout;
+        std::size_t pixelsAmount, chunkSize;
+        const Func_t* func;
+        char* chunkIsOpaque;
+
+        TransformPixelsJob(const RowLayout& rowLayout): layout(rowLayout) {}
+
+        void operator()(std::size_t chunkIndex, unsigned) const
+        {
+            const std::size_t begin = chunkIndex * chunkSize;
+            const std::size_t end = std::min(begin + chunkSize, pixelsAmount);
+            bool allOpaque = true;
+            for(std::size_t index = begin; index < end;)
+            {
+                const std::size_t amount = layout.contiguousAmount(index, end - index);
+                PixelData_t* run = pixels + layout.storageIndex(index);
+                for(std::size_t i = 0; i < amount; ++i)
+                {
+                    assignPixel(run[i], (*func)(convertToPixel<Pixel_t>(run[i])));
+                    allOpaque = allOpaque && pixelHasFullAlpha(run[i]);
+                }
+                index += amount;
+            }
+            chunkIsOpaque[chunkIndex] = allOpaque;
+        }
+    };
+
+    // Returns whether all the transformed pixels are opaque.
+    template<typename Pixel_t, typename Vector_t, typename Func_t>
+    bool transformPixels(Vector_t& pixels, const RowLayout& layout, const Func_t& func,
+                         unsigned threadsAmount)
+    {
+        if(pixels.empty()) return true;
+
+        threadsAmount = getThreadsAmount(threadsAmount);
+        TransformPixelsJob<Pixel_t, typename Vector_t::value_type, Func_t> job(layout);
+        job.pixels = &pixels[0];
+        job.pixelsAmount = layout.pixelsAmount(pixels.size());
+        job.chunkSize = getPixelChunkSize(job.pixelsAmount, threadsAmount);
+        job.func = &func;
+
+        const std::size_t chunksAmount = (job.pixelsAmount + job.chunkSize - 1) / job.chunkSize;
+        std::vector<char> chunkIsOpaque(chunksAmount);
+        job.chunkIsOpaque = &chunkIsOpaque[0];
+        runJobs(chunksAmount, threadsAmount, job);
+
+        return std::find(chunkIsOpaque.begin(), chunkIsOpaque.end(), 0) == chunkIsOpaque.end();
+    }
+
+    // Transforms one chunk of the pixels into the destination image data, a few pixels at
+    // a time. The opacity of the destination is left for the caller to update.
+    template<typename Pixel_t, typename PixelData_t, typename Func_t, typename DestData_t>
+    struct TransformPixelsToJob
+    {
+        const PixelData_t* pixels;
+        RowLayout layout;
+        std::size_t pixelsAmount, chunkSize;
+        const Func_t* func;
+        DestData_t* dest;
+
+        TransformPixelsToJob(const RowLayout& rowLayout): layout(rowLayout) {}
+
+        void operator()(std::size_t chunkIndex, unsigned) const
+        {
+            const std::size_t kBufferSize = 256;
+            Pixel_t buffer[kBufferSize];
+            const std::size_t end = std::min((chunkIndex + 1) * chunkSize, pixelsAmount);
+            for(std::size_t index = chunkIndex * chunkSize; index < end; index += kBufferSize)
+            {
+                const std::size_t amount = std::min(kBufferSize, end - index);
+                for(std::size_t i = 0; i < amount;)
+                {
+                    const std::size_t runAmount = layout.contiguousAmount(index + i, amount - i);
+                    const PixelData_t* run = pixels + layout.storageIndex(index + i);
+                    for(std::size_t j = 0; j < runAmount; ++j, ++i)
+                        buffer[i] = (*func)(convertToPixel<Pixel_t>(run[j]));
+                }
+                dest->setPixels(index, amount, buffer);
+            }
+        }
+    };
+
+    template<typename Pixel_t, typename Vector_t, typename Func_t, typename DestData_t>
+    void transformPixels(const Vector_t& pixels, const RowLayout& layout, const Func_t& func,
+                         DestData_t& dest, unsigned threadsAmount)
+    {
+        if(pixels.empty()) return;
+
+        threadsAmount = getThreadsAmount(threadsAmount);
+        TransformPixelsToJob<Pixel_t, typename Vector_t::value_type, Func_t, DestData_t>
+            job(layout);
+        job.pixels = &pixels[0];
+        job.pixelsAmount = layout.pixelsAmount(pixels.size());
+        job.chunkSize = getPixelChunkSize(job.pixelsAmount, threadsAmount);
+        job.func = &func;
+        job.dest = &dest;
+        runJobs((job.pixelsAmount + job.chunkSize - 1) / job.chunkSize, threadsAmount, job);
+        dest.mOpacity = DestData_t::kOpacity_unknown;
+    }
+}
+
 struct WPngImage::PngDataBase
 {
+    // Whether every pixel has a full alpha is tracked by the operations that modify the
+    // pixels, so that saving doesn't need to scan the image to find it out. Operations
+    // whose effect isn't cheap to determine just set it to unknown. Once a modifiable
+    // pointer to the pixel data has been given out, the pixels are always scanned.
+    enum Opacity { kOpacity_unknown, kOpacity_allOpaque, kOpacity_notAllOpaque };
+
+    // The opacity of shared pixel data may be found out by several threads at once, which
+    // all store the same value. The accesses don't order anything else, so they are relaxed
+    // and cost the same as plain ones.
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+    class OpacityValue
+    {
+     public:
+        explicit OpacityValue(Opacity value): mValue(value) {}
+        operator Opacity() const { return mValue.load(std::memory_order_relaxed); }
+        OpacityValue& operator=(Opacity value)
+        { mValue.store(value, std::memory_order_relaxed); return *this; }
+
+     private:
+        std::atomic<Opacity> mValue;
+    };
+#else
+    typedef Opacity OpacityValue;
+#endif
+
     PixelFormat mPixelFormat;
     PngFileFormat mPngFileFormat;
+    mutable OpacityValue mOpacity;
+    bool mPixelDataExposed;
+    bool mPadRows;
+    RowLayout mLayout;
+    MemoryResource* mMemoryResource;
+
+    // Copies of an image share the pixel data until one of them modifies it. In C++98 mode
+    // the library has no threads, and the count isn't atomic.
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+    mutable std::atomic<unsigned> mReferencesAmount;
+#else
+    mutable unsigned mReferencesAmount;
+#endif
 
-    PngDataBase(PixelFormat);
+    PngDataBase(PixelFormat, const RowLayout&, bool padRows, MemoryResource*);
+    PngDataBase(const PngDataBase&);
     virtual ~PngDataBase() {}
 
+    bool isShared() const { return mReferencesAmount > 1; }
+
+    // The objects are allocated from the same memory resource as their pixel data.
+    static void* operator new(std::size_t, MemoryResource*);
+    static void operator delete(void*, MemoryResource*);
+    static void operator delete(void*);
+
+    bool allPixelsHaveFullAlpha() const;
+    void updateOpacity(bool pixelIsOpaque);
+    void blendPixelLineTo(std::size_t, std::size_t, PngDataBase*, std::size_t) const;
+
     virtual bool assignAllDataFrom(const PngDataBase*) = 0;
     virtual PngDataBase* createCopy() const = 0;
+    virtual bool hasExternalPixels() const = 0;
+    virtual bool hasReadOnlyPixels() const = 0;
 
     virtual Pixel8 getPixel8(std::size_t) const = 0;
     virtual Pixel16 getPixel16(std::size_t) const = 0;
     virtual PixelF getPixelF(std::size_t) const = 0;
     virtual PixelG8 getPixelG8(std::size_t) const = 0;
     virtual PixelG16 getPixelG16(std::size_t) const = 0;
-    virtual bool allPixelsHaveFullAlpha() const = 0;
+    virtual bool scanForFullAlphas() const = 0;
     virtual void setPixel(std::size_t, const Pixel8&) = 0;
     virtual void setPixel(std::size_t, const Pixel16&) = 0;
     virtual void setPixel(std::size_t, const PixelF&) = 0;
@@ -1351,12 +1950,24 @@ struct WPngImage::PngDataBase
     virtual void fill(const Pixel8&) = 0;
     virtual void fill(const Pixel16&) = 0;
     virtual void fill(const PixelF&) = 0;
-    virtual void transform(TransformFunc8) = 0;
-    virtual void transform(TransformFunc16) = 0;
-    virtual void transform(TransformFuncF) = 0;
-    virtual void transform(TransformFunc8, WPngImage& dest) const = 0;
-    virtual void transform(TransformFunc16, WPngImage& dest) const = 0;
-    virtual void transform(TransformFuncF, WPngImage& dest) const = 0;
+    virtual void transform(TransformFunc8, unsigned) = 0;
+    virtual void transform(TransformFunc16, unsigned) = 0;
+    virtual void transform(TransformFuncF, unsigned) = 0;
+    virtual void transform(TransformFunc8, WPngImage& dest, unsigned) const = 0;
+    virtual void transform(TransformFunc16, WPngImage& dest, unsigned) const = 0;
+    virtual void transform(TransformFuncF, WPngImage& dest, unsigned) const = 0;
+    virtual void getPixels(std::size_t, std::size_t, Pixel8*) const = 0;
+    virtual void getPixels(std::size_t, std::size_t, Pixel16*) const = 0;
+    virtual void getPixels(std::size_t, std::size_t, PixelF*) const = 0;
+    virtual void setPixels(std::size_t, std::size_t, const Pixel8*) = 0;
+    virtual void setPixels(std::size_t, std::size_t, const Pixel16*) = 0;
+    virtual void setPixels(std::size_t, std::size_t, const PixelF*) = 0;
+    virtual void getPixels(std::size_t, std::size_t, PixelGA8*) const = 0;
+    virtual void getPixels(std::size_t, std::size_t, PixelGA16*) const = 0;
+    virtual void getPixels(std::size_t, std::size_t, PixelGAF*) const = 0;
+    virtual void setPixels(std::size_t, std::size_t, const PixelGA8*) = 0;
+    virtual void setPixels(std::size_t, std::size_t, const PixelGA16*) = 0;
+    virtual void setPixels(std::size_t, std::size_t, const PixelGAF*) = 0;
     virtual void copyPixelTo(std::size_t, PngDataBase*, std::size_t) const = 0;
     virtual void copyAllPixelsTo(PngDataBase*) const = 0;
     virtual void copyPixelLineTo
@@ -1378,28 +1989,143 @@ struct WPngImage::PngDataBase
     virtual void translate(int, int, int, int, PixelF) = 0;
 };
 
-WPngImage::PngDataBase::PngDataBase(PixelFormat pixelFormat):
+WPngImage::PngDataBase::PngDataBase
+(PixelFormat pixelFormat, const RowLayout& layout, bool padRows, MemoryResource* resource):
     mPixelFormat(pixelFormat),
-    mPngFileFormat(kPngFileFormat_none)
+    mPngFileFormat(kPngFileFormat_none),
+    mOpacity(kOpacity_unknown),
+    mPixelDataExposed(false),
+    mPadRows(padRows),
+    mLayout(layout),
+    mMemoryResource(resource),
+    mReferencesAmount(1)
+{}
+
+// The pixel data of a copy hasn't been given out, but if the original's has, its opacity
+// hasn't been tracked.
+WPngImage::PngDataBase::PngDataBase(const PngDataBase& rhs):
+    mPixelFormat(rhs.mPixelFormat),
+    mPngFileFormat(rhs.mPngFileFormat),
+    mOpacity(rhs.mPixelDataExposed ? kOpacity_unknown : Opacity(rhs.mOpacity)),
+    mPixelDataExposed(false),
+    mPadRows(rhs.mPadRows),
+    mLayout(rhs.mLayout),
+    mMemoryResource(rhs.mMemoryResource),
+    mReferencesAmount(1)
 {}
 
+// The resource and the size of the allocation are stored in a header before the object,
+// since the size of the derived object isn't known when it's deleted.
+namespace
+{
+    const std::size_t kObjectHeaderSize = 16;
+
+    struct ObjectHeader
+    {
+        WPngImage::MemoryResource* resource;
+        std::size_t size;
+    };
+}
+
+void* WPngImage::PngDataBase::operator new(std::size_t size, MemoryResource* resource)
+{
+    char* block = static_cast<char*>
+        (allocateStorage(resource, size + kObjectHeaderSize, kObjectHeaderSize));
+    ObjectHeader header = { resource, size + kObjectHeaderSize };
+    std::memcpy(block, &header, sizeof(header));
+    return block + kObjectHeaderSize;
+}
+
+void WPngImage::PngDataBase::operator delete(void* ptr, MemoryResource*)
+{
+    operator delete(ptr);
+}
+
+void WPngImage::PngDataBase::operator delete(void* ptr)
+{
+    if(!ptr) return;
+    char* block = static_cast<char*>(ptr) - kObjectHeaderSize;
+    ObjectHeader header;
+    std::memcpy(&header, block, sizeof(header));
+    deallocateStorage(header.resource, block, header.size, kObjectHeaderSize);
+}
+
+// Shared pixel data isn't modified, so the result can be stored even if the data is being
+// read by other threads.
+bool WPngImage::PngDataBase::allPixelsHaveFullAlpha() const
+{
+    if(mPixelDataExposed) return scanForFullAlphas();
+    const Opacity opacity = mOpacity;
+    if(opacity != kOpacity_unknown) return opacity == kOpacity_allOpaque;
+    const bool allOpaque = scanForFullAlphas();
+    mOpacity = allOpaque ? kOpacity_allOpaque : kOpacity_notAllOpaque;
+    return allOpaque;
+}
+
+// Called after a pixel has been overwritten with a new value. A non-opaque pixel settles
+// the matter, but an opaque one may have replaced the only non-opaque pixel there was.
+inline void WPngImage::PngDataBase::updateOpacity(bool pixelIsOpaque)
+{
+    if(!pixelIsOpaque)
+        mOpacity = kOpacity_notAllOpaque;
+    else if(mOpacity == kOpacity_notAllOpaque)
+        mOpacity = kOpacity_unknown;
+}
+
+// The pixels are blended in the precision of the destination.
+void WPngImage::PngDataBase::blendPixelLineTo
+(std::size_t srcStartIndex, std::size_t amount, PngDataBase* dest, std::size_t destStartIndex) const
+{
+    switch(dest->mPixelFormat)
+    {
+      case kPixelFormat_GA8:
+      case kPixelFormat_RGBA8:
+          for(std::size_t i = 0; i < amount; ++i)
+              dest->setPixel(destStartIndex + i, dest->getPixel8(destStartIndex + i)
+                             .blendedPixel(getPixel8(srcStartIndex + i)));
+          break;
+
+      case kPixelFormat_GA16:
+      case kPixelFormat_RGBA16:
+          for(std::size_t i = 0; i < amount; ++i)
+              dest->setPixel(destStartIndex + i, dest->getPixel16(destStartIndex + i)
+                             .blendedPixel(getPixel16(srcStartIndex + i)));
+          break;
+
+      case kPixelFormat_GAF:
+      case kPixelFormat_RGBAF:
+      case kPixelFormat_GAF_Planar:
+      case kPixelFormat_RGBAF_Planar:
+          for(std::size_t i = 0; i < amount; ++i)
+              dest->setPixel(destStartIndex + i, dest->getPixelF(destStartIndex + i)
+                             .blendedPixel(getPixelF(srcStartIndex + i)));
+          break;
+    }
+}
+
 template<typename PixelData_t>
 struct WPngImage::PngData: public PngDataBase
 {
-    std::vector<PixelData_t> mPixelData;
+    typedef PixelStorage<PixelData_t> PixelVector;
+
+    PixelVector mPixelData;
 
     template<typename Pixel_t>
-    PngData(int, int, Pixel_t, PixelFormat);
+    PngData(int, int, Pixel_t, PixelFormat, bool padRows, MemoryResource*);
+    PngData(PixelData_t*, int, int, std::size_t, bool readOnly, PixelFormat, bool padRows,
+            MemoryResource*);
 
     virtual bool assignAllDataFrom(const PngDataBase*);
     virtual PngDataBase* createCopy() const;
+    virtual bool hasExternalPixels() const { return mPixelData.isExternal(); }
+    virtual bool hasReadOnlyPixels() const { return mPixelData.isReadOnly(); }
 
     virtual Pixel8 getPixel8(std::size_t) const;
     virtual Pixel16 getPixel16(std::size_t) const;
     virtual PixelF getPixelF(std::size_t) const;
     virtual PixelG8 getPixelG8(std::size_t) const;
     virtual PixelG16 getPixelG16(std::size_t) const;
-    virtual bool allPixelsHaveFullAlpha() const;
+    virtual bool scanForFullAlphas() const;
     virtual void setPixel(std::size_t, const Pixel8&);
     virtual void setPixel(std::size_t, const Pixel16&);
     virtual void setPixel(std::size_t, const PixelF&);
@@ -1412,12 +2138,26 @@ struct WPngImage::PngData: public PngDataBase
     virtual void fill(const Pixel8&);
     virtual void fill(const Pixel16&);
     virtual void fill(const PixelF&);
-    virtual void transform(TransformFunc8);
-    virtual void transform(TransformFunc16);
-    virtual void transform(TransformFuncF);
-    virtual void transform(TransformFunc8, WPngImage& dest) const;
-    virtual void transform(TransformFunc16, WPngImage& dest) const;
-    virtual void transform(TransformFuncF, WPngImage& dest) const;
+    virtual void transform(TransformFunc8, unsigned);
+    virtual void transform(TransformFunc16, unsigned);
+    virtual void transform(TransformFuncF, unsigned);
+    virtual void transform(TransformFunc8, WPngImage& dest, unsigned) const;
+    virtual void transform(TransformFunc16, WPngImage& dest, unsigned) const;
+    virtual void transform(TransformFuncF, WPngImage& dest, unsigned) const;
+    virtual void getPixels(std::size_t, std::size_t, Pixel8*) const;
+    virtual void getPixels(std::size_t, std::size_t, Pixel16*) const;
+    virtual void getPixels(std::size_t, std::size_t, PixelF*) const;
+    virtual void setPixels(std::size_t, std::size_t, const Pixel8*);
+    virtual void setPixels(std::size_t, std::size_t, const Pixel16*);
+    virtual void setPixels(std::size_t, std::size_t, const PixelF*);
+    virtual void getPixels(std::size_t, std::size_t, PixelGA8*) const;
+    virtual void getPixels(std::size_t, std::size_t, PixelGA16*) const;
+    virtual void getPixels(std::size_t, std::size_t, PixelGAF*) const;
+    virtual void setPixels(std::size_t, std::size_t, const PixelGA8*);
+    virtual void setPixels(std::size_t, std::size_t, const PixelGA16*);
+    virtual void setPixels(std::size_t, std::size_t, const PixelGAF*);
+    template<typename Pixel_t> void getPixelsAs(std::size_t, std::size_t, Pixel_t*) const;
+    template<typename Pixel_t> void setPixelsFrom(std::size_t, std::size_t, const Pixel_t*);
     virtual void copyPixelTo(std::size_t, PngDataBase*, std::size_t) const;
     virtual void copyAllPixelsTo(PngDataBase*) const;
     virtual void copyPixelLineTo
@@ -1444,84 +2184,351 @@ struct WPngImage::PngData: public PngDataBase
 
 
 //============================================================================
-// WPngImage::PngData implementations
+// Moving the pixels of an image
 //============================================================================
-// Constructor
-//----------------------------------------------------------------------------
-template<typename PixelData_t>
-template<typename Pixel_t>
-WPngImage::PngData<PixelData_t>::PngData
-(int width, int height, Pixel_t pixel, PixelFormat pixelFormat):
-    PngDataBase(pixelFormat),
-    mPixelData(width * height, PixelData_t(pixel))
-{}
-
-template<typename PixelData_t>
-bool WPngImage::PngData<PixelData_t>::assignAllDataFrom(const PngDataBase* src)
+// These are used for the pixel arrays of PngData and for each plane of PlanarPngData. The
+// rows are 'stride' elements apart, and the padding at their ends is left as it is.
+namespace
 {
-    const PngData<PixelData_t>* srcPngData = dynamic_cast<const PngData<PixelData_t>*>(src);
-    if(!srcPngData) return false;
-    mPixelFormat = srcPngData->mPixelFormat;
-    mPngFileFormat = srcPngData->mPngFileFormat;
-    mPixelData = srcPngData->mPixelData;
-    return true;
-}
+    template<typename Vector_t>
+    void flipPixelsHorizontally(Vector_t& pixels, int width, int height, std::size_t stride)
+    {
+        const int maxX = width / 2;
+        typename Vector_t::value_type *data = &pixels[0];
+        for(int y = 0; y < height; ++y, data += stride)
+            for(int x1 = 0, x2 = width - 1; x1 < maxX; ++x1, --x2)
+                std::swap(data[x1], data[x2]);
+    }
 
-template<typename PixelData_t>
-WPngImage::PngDataBase* WPngImage::PngData<PixelData_t>::createCopy() const
-{
-    return new PngData<PixelData_t>(*this);
-}
+    template<typename Vector_t>
+    void flipPixelsVertically(Vector_t& pixels, int width, int height, std::size_t stride)
+    {
+        const int maxY = height / 2;
+        typename Vector_t::value_type *data1 = &pixels[0];
+        typename Vector_t::value_type *data2 = &pixels[stride * (height - 1)];
+        for(int y = 0; y < maxY; ++y, data1 += stride, data2 -= stride)
+            for(int x = 0; x < width; ++x)
+                std::swap(data1[x], data2[x]);
+    }
 
-//----------------------------------------------------------------------------
-// Get pixel
-//----------------------------------------------------------------------------
-template<typename PixelData_t>
-WPngImage::Pixel8 WPngImage::PngData<PixelData_t>::getPixel8(std::size_t index) const
-{
-    return convertToPixel<Pixel8>(mPixelData[index]);
-}
+    template<typename Vector_t>
+    void rotatePixels180(Vector_t& pixels, int width, int height, std::size_t stride)
+    {
+        const int maxY = height / 2;
+        typename Vector_t::value_type *data1 = &pixels[0];
+        typename Vector_t::value_type *data2 = &pixels[stride * (height - 1)];
+        for(int y = 0; y < maxY; ++y, data1 += stride, data2 -= stride)
+            for(int x1 = 0, x2 = width - 1; x1 < width; ++x1, --x2)
+                std::swap(data1[x1], data2[x2]);
+
+        if(height % 2 == 1)
+        {
+            const int maxX = width / 2;
+            for(int x1 = 0, x2 = width - 1; x1 < maxX; ++x1, --x2)
+                std::swap(data1[x1], data1[x2]);
+        }
+    }
+
+    template<typename Vector_t>
+    void rotatePixels90cwSquare(Vector_t& pixels, int width, std::size_t stride)
+    {
+        typedef typename Vector_t::value_type PixelData_t;
+        const std::ptrdiff_t rowStep = std::ptrdiff_t(stride);
+        PixelData_t *startPtr1 = &pixels[0];
+        PixelData_t *startPtr2 = &pixels[width - 1];
+        PixelData_t *startPtr3 = &pixels[stride*(width - 1) + width - 1];
+        PixelData_t *startPtr4 = &pixels[stride*(width - 1)];
+
+        for(int length = width - 1; length > 0; length -= 2)
+        {
+            PixelData_t *ptr1 = startPtr1, *ptr2 = startPtr2, *ptr3 = startPtr3, *ptr4 = startPtr4;
+            for(int x = 0; x < length; ++x)
+            {
+                const PixelData_t pixel = *ptr4;
+                *ptr4 = *ptr3;
+                *ptr3 = *ptr2;
+                *ptr2 = *ptr1;
+                *ptr1 = pixel;
+                ++ptr1;
+                ptr2 += rowStep;
+                --ptr3;
+                ptr4 -= rowStep;
+            }
+
+            startPtr1 += rowStep + 1;
+            startPtr2 += rowStep - 1;
+            startPtr3 -= rowStep + 1;
+            startPtr4 -= rowStep - 1;
+        }
+    }
+
+    // The rotated image has rows of 'height' pixels, which are newStride elements apart.
+    template<typename Vector_t>
+    void rotatePixels90cwNonsquare(Vector_t& pixels, int width, int height, std::size_t stride,
+                                   std::size_t newStride)
+    {
+        Vector_t newPixelData(pixels.get_allocator());
+        newPixelData.reserve(newStride * width);
+
+        for(int x = 0; x < width; ++x)
+        {
+            for(int y = height - 1; y >= 0; --y)
+                newPixelData.push_back(pixels[stride * y + x]);
+            newPixelData.resize(newStride * (x + 1), pixels[0]);
+        }
+
+        pixels.swap(newPixelData);
+    }
+
+    template<typename Vector_t>
+    void rotatePixels90ccwSquare(Vector_t& pixels, int width, std::size_t stride)
+    {
+        typedef typename Vector_t::value_type PixelData_t;
+        const std::ptrdiff_t rowStep = std::ptrdiff_t(stride);
+        PixelData_t *startPtr1 = &pixels[0];
+        PixelData_t *startPtr2 = &pixels[width - 1];
+        PixelData_t *startPtr3 = &pixels[stride*(width - 1) + width - 1];
+        PixelData_t *startPtr4 = &pixels[stride*(width - 1)];
+
+        for(int length = width - 1; length > 0; length -= 2)
+        {
+            PixelData_t *ptr1 = startPtr1, *ptr2 = startPtr2, *ptr3 = startPtr3, *ptr4 = startPtr4;
+            for(int x = 0; x < length; ++x)
+            {
+                const PixelData_t pixel = *ptr1;
+                *ptr1 = *ptr2;
+                *ptr2 = *ptr3;
+                *ptr3 = *ptr4;
+                *ptr4 = pixel;
+                ++ptr1;
+                ptr2 += rowStep;
+                --ptr3;
+                ptr4 -= rowStep;
+            }
+
+            startPtr1 += rowStep + 1;
+            startPtr2 += rowStep - 1;
+            startPtr3 -= rowStep + 1;
+            startPtr4 -= rowStep - 1;
+        }
+    }
+
+    template<typename Vector_t>
+    void rotatePixels90ccwNonsquare(Vector_t& pixels, int width, int height, std::size_t stride,
+                                    std::size_t newStride)
+    {
+        Vector_t newPixelData(pixels.get_allocator());
+        newPixelData.reserve(newStride * width);
+
+        for(int x = width - 1; x >= 0; --x)
+        {
+            for(int y = 0; y < height; ++y)
+                newPixelData.push_back(pixels[stride * y + x]);
+            newPixelData.resize(newStride * (width - x), pixels[0]);
+        }
+
+        pixels.swap(newPixelData);
+    }
+
+    // Returns whether any pixels were moved.
+    template<typename Vector_t>
+    bool translatePixels(Vector_t& pixels, int imageWidth, int imageHeight, std::size_t stride,
+                         int xOffset, int yOffset)
+    {
+        typedef typename Vector_t::value_type PixelData_t;
+
+        if(xOffset == 0 && yOffset == 0)
+            return false;
+
+        const int absXOffset = std::abs(xOffset), absYOffset = std::abs(yOffset);
+        if(absXOffset >= imageWidth || absYOffset >= imageHeight)
+            return false;
+
+        const int areaWidth = imageWidth - absXOffset, areaHeight = imageHeight - absYOffset;
+        const std::size_t lastRow = stride * (imageHeight - 1);
+
+        if(xOffset <= 0)
+        {
+            if(yOffset <= 0)
+            {
+                PixelData_t *destPtr = &pixels[0];
+                const PixelData_t *srcPtr = &pixels[absYOffset*stride + absXOffset];
+                for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr += stride, srcPtr += stride)
+                    for(int xInd = 0; xInd < areaWidth; ++xInd)
+                        destPtr[xInd] = srcPtr[xInd];
+            }
+            else // yOffset > 0
+            {
+                PixelData_t *destPtr = &pixels[lastRow];
+                const PixelData_t *srcPtr = &pixels[(imageHeight-1-absYOffset)*stride + absXOffset];
+                for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr -= stride, srcPtr -= stride)
+                    for(int xInd = 0; xInd < areaWidth; ++xInd)
+                        destPtr[xInd] = srcPtr[xInd];
+            }
+        }
+        else // xOffset > 0
+        {
+            if(yOffset <= 0)
+            {
+                PixelData_t *destPtr = &pixels[imageWidth-areaWidth];
+                const PixelData_t *srcPtr = &pixels[absYOffset*stride + (imageWidth-areaWidth-absXOffset)];
+                for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr += stride, srcPtr += stride)
+                    for(int xInd = areaWidth-1; xInd >= 0; --xInd)
+                        destPtr[xInd] = srcPtr[xInd];
+            }
+            else // yOffset > 0
+            {
+                PixelData_t *destPtr = &pixels[lastRow + imageWidth - areaWidth];
+                const PixelData_t *srcPtr = &pixels[(imageHeight-1-absYOffset)*stride +
+                                                        (imageWidth-areaWidth-absXOffset)];
+                for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr -= stride, srcPtr -= stride)
+                    for(int xInd = areaWidth-1; xInd >= 0; --xInd)
+                        destPtr[xInd] = srcPtr[xInd];
+            }
+        }
+        return true;
+    }
+
+    template<typename Vector_t>
+    void fillSidesAfterTranslate
+    (Vector_t& pixels, int imageWidth, int imageHeight, std::size_t stride,
+     int xOffset, int yOffset, const typename Vector_t::value_type& pixel)
+    {
+        typedef typename Vector_t::value_type PixelData_t;
+
+        if(xOffset == 0 && yOffset == 0)
+            return;
+
+        const int absXOffset = std::abs(xOffset), absYOffset = std::abs(yOffset);
+        if(absXOffset >= imageWidth || absYOffset >= imageHeight)
+        {
+            pixels.assign(pixels.size(), pixel);
+            return;
+        }
+
+        const int areaHeight = imageHeight - absYOffset;
+        int yBegin, yEnd, xBegin, xEnd;
+
+        if(yOffset >= 0) { yBegin = 0; yEnd = absYOffset; }
+        else { yBegin = imageHeight - absYOffset; yEnd = imageHeight; }
+        if(xOffset >= 0) { xBegin = 0; xEnd = absXOffset; }
+        else { xBegin = imageWidth - absXOffset; xEnd = imageWidth; }
+        const int xDiff = xEnd - xBegin;
+
+        PixelData_t *dest = &pixels[yBegin*stride];
+        for(int yInd = yBegin; yInd < yEnd; ++yInd, dest += stride)
+            for(int xInd = 0; xInd < imageWidth; ++xInd)
+                dest[xInd] = pixel;
+
+        if(yOffset >= 0)
+            dest = &pixels[yEnd*stride + xBegin];
+        else
+            dest = &pixels[xBegin];
+
+        for(int yInd = 0; yInd < areaHeight; ++yInd, dest += stride)
+            for(int xInd = 0; xInd < xDiff; ++xInd)
+                dest[xInd] = pixel;
+    }
+}
+
+
+//============================================================================
+// WPngImage::PngData implementations
+//============================================================================
+// Constructor
+//----------------------------------------------------------------------------
+template<typename PixelData_t>
+template<typename Pixel_t>
+WPngImage::PngData<PixelData_t>::PngData
+(int width, int height, Pixel_t pixel, PixelFormat pixelFormat, bool padRows,
+ MemoryResource* resource):
+    PngDataBase(pixelFormat,
+                RowLayout(std::size_t(width),
+                          getRowStride(std::size_t(width), sizeof(PixelData_t), padRows)),
+                padRows, resource),
+    mPixelData(mLayout.stride * std::size_t(height), PixelData_t(pixel),
+               AlignedAllocator<PixelData_t>(resource))
+{
+    mOpacity = pixelHasFullAlpha(mPixelData[0]) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
+}
+
+// The contents of external pixel data can change behind the image's back, so its opacity
+// is never tracked.
+template<typename PixelData_t>
+WPngImage::PngData<PixelData_t>::PngData
+(PixelData_t* pixels, int width, int height, std::size_t stride, bool readOnly,
+ PixelFormat pixelFormat, bool padRows, MemoryResource* resource):
+    PngDataBase(pixelFormat, RowLayout(std::size_t(width), stride), padRows, resource),
+    mPixelData(pixels, std::size_t(width), stride, std::size_t(height), readOnly,
+               AlignedAllocator<PixelData_t>(resource))
+{
+    mPixelDataExposed = true;
+}
+
+template<typename PixelData_t>
+bool WPngImage::PngData<PixelData_t>::assignAllDataFrom(const PngDataBase* src)
+{
+    const PngData<PixelData_t>* srcPngData = dynamic_cast<const PngData<PixelData_t>*>(src);
+    if(!srcPngData) return false;
+    mPixelFormat = srcPngData->mPixelFormat;
+    mPngFileFormat = srcPngData->mPngFileFormat;
+    mOpacity = srcPngData->mPixelDataExposed ? kOpacity_unknown : srcPngData->mOpacity;
+    mPadRows = srcPngData->mPadRows;
+    mLayout = srcPngData->mLayout;
+    mPixelData = srcPngData->mPixelData;
+    return true;
+}
+
+template<typename PixelData_t>
+WPngImage::PngDataBase* WPngImage::PngData<PixelData_t>::createCopy() const
+{
+    return new(mMemoryResource) PngData<PixelData_t>(*this);
+}
+
+//----------------------------------------------------------------------------
+// Get pixel
+//----------------------------------------------------------------------------
+template<typename PixelData_t>
+WPngImage::Pixel8 WPngImage::PngData<PixelData_t>::getPixel8(std::size_t index) const
+{
+    return convertToPixel<Pixel8>(mPixelData[mLayout.storageIndex(index)]);
+}
 
 template<typename PixelData_t>
 WPngImage::Pixel16 WPngImage::PngData<PixelData_t>::getPixel16(std::size_t index) const
 {
-    return convertToPixel<Pixel16>(mPixelData[index]);
+    return convertToPixel<Pixel16>(mPixelData[mLayout.storageIndex(index)]);
 }
 
 template<typename PixelData_t>
 PixelG8 WPngImage::PngData<PixelData_t>::getPixelG8(std::size_t index) const
 {
-    return convertToPixelG<Byte>(mPixelData[index]);
+    return convertToPixelG<Byte>(mPixelData[mLayout.storageIndex(index)]);
 }
 
 template<typename PixelData_t>
 PixelG16 WPngImage::PngData<PixelData_t>::getPixelG16(std::size_t index) const
 {
-    return convertToPixelG<UInt16>(mPixelData[index]);
+    return convertToPixelG<UInt16>(mPixelData[mLayout.storageIndex(index)]);
 }
 
 template<typename PixelData_t>
 WPngImage::PixelF WPngImage::PngData<PixelData_t>::getPixelF(std::size_t index) const
 {
-    return convertToPixel<PixelF>(mPixelData[index]);
-}
-
-namespace
-{
-    bool pixelHasFullAlpha(const PixelG8& pixel) { return pixel.a == 255; }
-    bool pixelHasFullAlpha(const PixelG16& pixel) { return pixel.a == 65535; }
-    bool pixelHasFullAlpha(const PixelGF& pixel) { return pixel.a >= 1.0f; }
-    bool pixelHasFullAlpha(const WPngImage::Pixel8& pixel) { return pixel.a == 255; }
-    bool pixelHasFullAlpha(const WPngImage::Pixel16& pixel) { return pixel.a == 65535; }
-    bool pixelHasFullAlpha(const WPngImage::PixelF& pixel) { return pixel.a >= 1.0f; }
+    return convertToPixel<PixelF>(mPixelData[mLayout.storageIndex(index)]);
 }
 
 template<typename PixelData_t>
-bool WPngImage::PngData<PixelData_t>::allPixelsHaveFullAlpha() const
+bool WPngImage::PngData<PixelData_t>::scanForFullAlphas() const
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        if(!pixelHasFullAlpha(mPixelData[i]))
+    const std::size_t pixelsAmount = mLayout.pixelsAmount(mPixelData.size());
+    for(std::size_t index = 0; index < pixelsAmount;)
+    {
+        const std::size_t amount = mLayout.contiguousAmount(index, pixelsAmount - index);
+        if(!::allPixelsHaveFullAlpha(&mPixelData[mLayout.storageIndex(index)], amount))
             return false;
+        index += amount;
+    }
     return true;
 }
 
@@ -1531,115 +2538,253 @@ bool WPngImage::PngData<PixelData_t>::allPixelsHaveFullAlpha() const
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::setPixel(std::size_t index, const Pixel8& pixel)
 {
-    assignPixel(mPixelData[index], pixel);
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    assignPixel(dest, pixel);
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::setPixel(std::size_t index, const Pixel16& pixel)
 {
-    assignPixel(mPixelData[index], pixel);
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    assignPixel(dest, pixel);
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::setPixel(std::size_t index, const PixelF& pixel)
 {
-    assignPixel(mPixelData[index], pixel);
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    assignPixel(dest, pixel);
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::setPixel(std::size_t index, const PixelG8& pixel)
 {
-    assignPixel(mPixelData[index], pixel);
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    assignPixel(dest, pixel);
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::setPixel(std::size_t index, const PixelG16& pixel)
 {
-    assignPixel(mPixelData[index], pixel);
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    assignPixel(dest, pixel);
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::setPixel(std::size_t index, const PixelGF& pixel)
 {
-    assignPixel(mPixelData[index], pixel);
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    assignPixel(dest, pixel);
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::drawPixel(std::size_t index, const Pixel8& pixel)
 {
-    mPixelData[index].blendWith(PixelData_t(pixel));
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    dest.blendWith(PixelData_t(pixel));
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::drawPixel(std::size_t index, const Pixel16& pixel)
 {
-    mPixelData[index].blendWith(PixelData_t(pixel));
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    dest.blendWith(PixelData_t(pixel));
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::drawPixel(std::size_t index, const PixelF& pixel)
 {
-    mPixelData[index].blendWith(PixelData_t(pixel));
+    PixelData_t& dest = mPixelData[mLayout.storageIndex(index)];
+    dest.blendWith(PixelData_t(pixel));
+    updateOpacity(pixelHasFullAlpha(dest));
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::fill(const Pixel8& srcPixel)
 {
-    mPixelData.assign(mPixelData.size(), PixelData_t(srcPixel));
+    const PixelData_t pixel(srcPixel);
+    mPixelData.assign(mPixelData.size(), pixel);
+    mOpacity = pixelHasFullAlpha(pixel) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::fill(const Pixel16& srcPixel)
 {
-    mPixelData.assign(mPixelData.size(), PixelData_t(srcPixel));
+    const PixelData_t pixel(srcPixel);
+    mPixelData.assign(mPixelData.size(), pixel);
+    mOpacity = pixelHasFullAlpha(pixel) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::fill(const PixelF& srcPixel)
 {
-    mPixelData.assign(mPixelData.size(), PixelData_t(srcPixel));
+    const PixelData_t pixel(srcPixel);
+    mPixelData.assign(mPixelData.size(), pixel);
+    mOpacity = pixelHasFullAlpha(pixel) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::transform(TransformFunc8 func, unsigned threadsAmount)
+{
+    const bool allOpaque = transformPixels<Pixel8>(mPixelData, mLayout, func, threadsAmount);
+    mOpacity = allOpaque ? kOpacity_allOpaque : kOpacity_notAllOpaque;
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::transform(TransformFunc16 func, unsigned threadsAmount)
+{
+    const bool allOpaque = transformPixels<Pixel16>(mPixelData, mLayout, func, threadsAmount);
+    mOpacity = allOpaque ? kOpacity_allOpaque : kOpacity_notAllOpaque;
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::transform(TransformFuncF func, unsigned threadsAmount)
+{
+    const bool allOpaque = transformPixels<PixelF>(mPixelData, mLayout, func, threadsAmount);
+    mOpacity = allOpaque ? kOpacity_allOpaque : kOpacity_notAllOpaque;
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::transform
+(TransformFunc8 func, WPngImage& dest, unsigned threadsAmount) const
+{
+    transformPixels<Pixel8>(mPixelData, mLayout, func, *dest.mData, threadsAmount);
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::transform
+(TransformFunc16 func, WPngImage& dest, unsigned threadsAmount) const
+{
+    transformPixels<Pixel16>(mPixelData, mLayout, func, *dest.mData, threadsAmount);
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::transform
+(TransformFuncF func, WPngImage& dest, unsigned threadsAmount) const
+{
+    transformPixels<PixelF>(mPixelData, mLayout, func, *dest.mData, threadsAmount);
+}
+
+// These convert a run of pixels the same way as the transform functions above. setPixels()
+// leaves updating the opacity to the caller.
+template<typename PixelData_t>
+template<typename Pixel_t>
+void WPngImage::PngData<PixelData_t>::getPixelsAs
+(std::size_t index, std::size_t amount, Pixel_t* dest) const
+{
+    for(std::size_t i = 0; i < amount;)
+    {
+        const std::size_t runAmount = mLayout.contiguousAmount(index + i, amount - i);
+        const PixelData_t* run = &mPixelData[mLayout.storageIndex(index + i)];
+        for(std::size_t j = 0; j < runAmount; ++j, ++i)
+            assignPixel(dest[i], run[j]);
+    }
+}
+
+template<typename PixelData_t>
+template<typename Pixel_t>
+void WPngImage::PngData<PixelData_t>::setPixelsFrom
+(std::size_t index, std::size_t amount, const Pixel_t* src)
+{
+    for(std::size_t i = 0; i < amount;)
+    {
+        const std::size_t runAmount = mLayout.contiguousAmount(index + i, amount - i);
+        PixelData_t* run = &mPixelData[mLayout.storageIndex(index + i)];
+        for(std::size_t j = 0; j < runAmount; ++j, ++i)
+            assignPixel(run[j], src[i]);
+    }
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, Pixel8* dest) const
+{
+    getPixelsAs(index, amount, dest);
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, Pixel16* dest) const
+{
+    getPixelsAs(index, amount, dest);
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelF* dest) const
+{
+    getPixelsAs(index, amount, dest);
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const Pixel8* src)
+{
+    setPixelsFrom(index, amount, src);
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const Pixel16* src)
+{
+    setPixelsFrom(index, amount, src);
+}
+
+template<typename PixelData_t>
+void WPngImage::PngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelF* src)
+{
+    setPixelsFrom(index, amount, src);
 }
 
 template<typename PixelData_t>
-void WPngImage::PngData<PixelData_t>::transform(TransformFunc8 func)
+void WPngImage::PngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelGA8* dest) const
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        assignPixel(mPixelData[i], func(convertToPixel<Pixel8>(mPixelData[i])));
+    getPixelsAs(index, amount, static_cast<PixelG8*>(dest));
 }
 
 template<typename PixelData_t>
-void WPngImage::PngData<PixelData_t>::transform(TransformFunc16 func)
+void WPngImage::PngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelGA16* dest) const
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        assignPixel(mPixelData[i], func(convertToPixel<Pixel16>(mPixelData[i])));
+    getPixelsAs(index, amount, static_cast<PixelG16*>(dest));
 }
 
 template<typename PixelData_t>
-void WPngImage::PngData<PixelData_t>::transform(TransformFuncF func)
+void WPngImage::PngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelGAF* dest) const
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        assignPixel(mPixelData[i], func(convertToPixel<PixelF>(mPixelData[i])));
+    getPixelsAs(index, amount, static_cast<PixelGF*>(dest));
 }
 
 template<typename PixelData_t>
-void WPngImage::PngData<PixelData_t>::transform(TransformFunc8 func, WPngImage& dest) const
+void WPngImage::PngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelGA8* src)
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        dest.mData->setPixel(i, func(convertToPixel<Pixel8>(mPixelData[i])));
+    setPixelsFrom(index, amount, static_cast<const PixelG8*>(src));
 }
 
 template<typename PixelData_t>
-void WPngImage::PngData<PixelData_t>::transform(TransformFunc16 func, WPngImage& dest) const
+void WPngImage::PngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelGA16* src)
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        dest.mData->setPixel(i, func(convertToPixel<Pixel16>(mPixelData[i])));
+    setPixelsFrom(index, amount, static_cast<const PixelG16*>(src));
 }
 
 template<typename PixelData_t>
-void WPngImage::PngData<PixelData_t>::transform(TransformFuncF func, WPngImage& dest) const
+void WPngImage::PngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelGAF* src)
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        dest.mData->setPixel(i, func(convertToPixel<PixelF>(mPixelData[i])));
+    setPixelsFrom(index, amount, static_cast<const PixelGF*>(src));
 }
 
 
@@ -1650,14 +2795,24 @@ template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::copyPixelTo(std::size_t srcIndex,
                                                   PngDataBase* dest, std::size_t destIndex) const
 {
-    dest->setPixel(destIndex, mPixelData[srcIndex]);
+    dest->setPixel(destIndex, mPixelData[mLayout.storageIndex(srcIndex)]);
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::copyAllPixelsTo(PngDataBase* dest) const
 {
-    for(std::size_t i = 0; i < mPixelData.size(); ++i)
-        dest->setPixel(i, mPixelData[i]);
+    const std::size_t pixelsAmount = mLayout.pixelsAmount(mPixelData.size());
+    for(std::size_t index = 0; index < pixelsAmount;)
+    {
+        const std::size_t amount = mLayout.contiguousAmount(index, pixelsAmount - index);
+        const PixelData_t* run = &mPixelData[mLayout.storageIndex(index)];
+        for(std::size_t i = 0; i < amount; ++i, ++index)
+            dest->setPixel(index, run[i]);
+    }
+
+    // A full alpha stays full in every pixel format.
+    if(mOpacity == kOpacity_allOpaque)
+        dest->mOpacity = kOpacity_allOpaque;
 }
 
 template<typename PixelData_t>
@@ -1667,34 +2822,17 @@ void WPngImage::PngData<PixelData_t>::copyPixelLineTo
 {
     if(useBlending)
     {
-        switch(dest->mPixelFormat)
-        {
-          case kPixelFormat_GA8:
-          case kPixelFormat_RGBA8:
-              for(std::size_t i = 0; i < amount; ++i)
-                  dest->setPixel(destStartIndex + i, dest->getPixel8(destStartIndex + i)
-                                 .blendedPixel(getPixel8(srcStartIndex + i)));
-              break;
-
-          case kPixelFormat_GA16:
-          case kPixelFormat_RGBA16:
-              for(std::size_t i = 0; i < amount; ++i)
-                  dest->setPixel(destStartIndex + i, dest->getPixel16(destStartIndex + i)
-                                 .blendedPixel(getPixel16(srcStartIndex + i)));
-              break;
-
-          case kPixelFormat_GAF:
-          case kPixelFormat_RGBAF:
-              for(std::size_t i = 0; i < amount; ++i)
-                  dest->setPixel(destStartIndex + i, dest->getPixelF(destStartIndex + i)
-                                 .blendedPixel(getPixelF(srcStartIndex + i)));
-              break;
-        }
+        blendPixelLineTo(srcStartIndex, amount, dest, destStartIndex);
     }
     else
     {
-        for(std::size_t i = 0; i < amount; ++i)
-            dest->setPixel(destStartIndex + i, mPixelData[srcStartIndex + i]);
+        for(std::size_t i = 0; i < amount;)
+        {
+            const std::size_t runAmount = mLayout.contiguousAmount(srcStartIndex + i, amount - i);
+            const PixelData_t* run = &mPixelData[mLayout.storageIndex(srcStartIndex + i)];
+            for(std::size_t j = 0; j < runAmount; ++j, ++i)
+                dest->setPixel(destStartIndex + i, run[j]);
+        }
     }
 }
 
@@ -1703,7 +2841,11 @@ void WPngImage::PngData<PixelData_t>::blendLine
 (std::size_t startIndex, std::size_t length, std::size_t step, const PixelData_t& pixel)
 {
     for(std::size_t i = 0; i < length; ++i, startIndex += step)
-        mPixelData[startIndex].blendWith(pixel);
+    {
+        PixelData_t& dest = mPixelData[mLayout.storageIndex(startIndex)];
+        dest.blendWith(pixel);
+        updateOpacity(pixelHasFullAlpha(dest));
+    }
 }
 
 template<typename PixelData_t>
@@ -1711,7 +2853,8 @@ void WPngImage::PngData<PixelData_t>::assignLine
 (std::size_t startIndex, std::size_t length, std::size_t step, const PixelData_t& pixel)
 {
     for(std::size_t i = 0; i < length; ++i, startIndex += step)
-        mPixelData[startIndex] = pixel;
+        mPixelData[mLayout.storageIndex(startIndex)] = pixel;
+    if(length > 0) updateOpacity(pixelHasFullAlpha(pixel));
 }
 
 template<typename PixelData_t>
@@ -1750,196 +2893,68 @@ void WPngImage::PngData<PixelData_t>::addLine
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::premultiplyAlpha()
 {
-    for(typename std::vector<PixelData_t>::iterator iter = mPixelData.begin();
-        iter != mPixelData.end(); ++iter)
+    for(std::size_t rowIndex = 0; rowIndex < mPixelData.size(); rowIndex += mLayout.stride)
     {
-        iter->premultiplyAlpha();
+        PixelData_t* row = &mPixelData[rowIndex];
+        for(std::size_t x = 0; x < mLayout.length; ++x)
+            row[x].premultiplyAlpha();
     }
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::flipHorizontally(int width, int height)
 {
-    const int maxX = width / 2;
-    PixelData_t *data = &mPixelData[0];
-    for(int y = 0; y < height; ++y, data += width)
-        for(int x1 = 0, x2 = width - 1; x1 < maxX; ++x1, --x2)
-            std::swap(data[x1], data[x2]);
+    flipPixelsHorizontally(mPixelData, width, height, mLayout.stride);
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::flipVertically(int width, int height)
 {
-    const int maxY = height / 2;
-    PixelData_t *data1 = &mPixelData[0], *data2 = &mPixelData[width * (height - 1)];
-    for(int y = 0; y < maxY; ++y, data1 += width, data2 -= width)
-        for(int x = 0; x < width; ++x)
-            std::swap(data1[x], data2[x]);
+    flipPixelsVertically(mPixelData, width, height, mLayout.stride);
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::rotate180(int width, int height)
 {
-    const int maxY = height / 2;
-    PixelData_t *data1 = &mPixelData[0], *data2 = &mPixelData[width * (height - 1)];
-    for(int y = 0; y < maxY; ++y, data1 += width, data2 -= width)
-        for(int x1 = 0, x2 = width - 1; x1 < width; ++x1, --x2)
-            std::swap(data1[x1], data2[x2]);
-
-    if(height % 2 == 1)
-    {
-        const int maxX = width / 2;
-        for(int x1 = 0, x2 = width - 1; x1 < maxX; ++x1, --x2)
-            std::swap(data1[x1], data1[x2]);
-    }
+    rotatePixels180(mPixelData, width, height, mLayout.stride);
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::rotate90cwSquare(int width)
 {
-    PixelData_t *startPtr1 = &mPixelData[0];
-    PixelData_t *startPtr2 = &mPixelData[width - 1];
-    PixelData_t *startPtr3 = &mPixelData[width*width - 1];
-    PixelData_t *startPtr4 = &mPixelData[width*(width - 1)];
-
-    for(int length = width - 1; length > 0; length -= 2)
-    {
-        PixelData_t *ptr1 = startPtr1, *ptr2 = startPtr2, *ptr3 = startPtr3, *ptr4 = startPtr4;
-        for(int x = 0; x < length; ++x)
-        {
-            const PixelData_t pixel = *ptr4;
-            *ptr4 = *ptr3;
-            *ptr3 = *ptr2;
-            *ptr2 = *ptr1;
-            *ptr1 = pixel;
-            ++ptr1;
-            ptr2 += width;
-            --ptr3;
-            ptr4 -= width;
-        }
-
-        startPtr1 += width + 1;
-        startPtr2 += width - 1;
-        startPtr3 -= width + 1;
-        startPtr4 -= width - 1;
-    }
+    rotatePixels90cwSquare(mPixelData, width, mLayout.stride);
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::rotate90cwNonsquare(int width, int height)
 {
-    std::vector<PixelData_t> newPixelData;
-    newPixelData.reserve(mPixelData.size());
-
-    PixelData_t *data = &mPixelData[width * (height - 1)];
-    const int ptrOffset = width * height + 1;
-
-    for(int x = 0; x < width; ++x, data += ptrOffset)
-        for(int y = 0; y < height; ++y, data -= width)
-            newPixelData.push_back(*data);
-
-    mPixelData.swap(newPixelData);
+    const std::size_t newStride = getRowStride(std::size_t(height), sizeof(PixelData_t), mPadRows);
+    rotatePixels90cwNonsquare(mPixelData, width, height, mLayout.stride, newStride);
+    mLayout = RowLayout(std::size_t(height), newStride);
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::rotate90ccwSquare(int width)
 {
-    PixelData_t *startPtr1 = &mPixelData[0];
-    PixelData_t *startPtr2 = &mPixelData[width - 1];
-    PixelData_t *startPtr3 = &mPixelData[width*width - 1];
-    PixelData_t *startPtr4 = &mPixelData[width*(width - 1)];
-
-    for(int length = width - 1; length > 0; length -= 2)
-    {
-        PixelData_t *ptr1 = startPtr1, *ptr2 = startPtr2, *ptr3 = startPtr3, *ptr4 = startPtr4;
-        for(int x = 0; x < length; ++x)
-        {
-            const PixelData_t pixel = *ptr1;
-            *ptr1 = *ptr2;
-            *ptr2 = *ptr3;
-            *ptr3 = *ptr4;
-            *ptr4 = pixel;
-            ++ptr1;
-            ptr2 += width;
-            --ptr3;
-            ptr4 -= width;
-        }
-
-        startPtr1 += width + 1;
-        startPtr2 += width - 1;
-        startPtr3 -= width + 1;
-        startPtr4 -= width - 1;
-    }
+    rotatePixels90ccwSquare(mPixelData, width, mLayout.stride);
 }
 
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::rotate90ccwNonsquare(int width, int height)
 {
-    std::vector<PixelData_t> newPixelData;
-    newPixelData.reserve(mPixelData.size());
-
-    PixelData_t *data = &mPixelData[width - 1];
-    const int ptrOffset = width * height + 1;
-
-    for(int x = 0; x < width; ++x, data -= ptrOffset)
-        for(int y = 0; y < height; ++y, data += width)
-            newPixelData.push_back(*data);
-
-    mPixelData.swap(newPixelData);
+    const std::size_t newStride = getRowStride(std::size_t(height), sizeof(PixelData_t), mPadRows);
+    rotatePixels90ccwNonsquare(mPixelData, width, height, mLayout.stride, newStride);
+    mLayout = RowLayout(std::size_t(height), newStride);
 }
 
+// Some pixels are dropped, which may have been the only non-opaque ones.
 template<typename PixelData_t>
 void WPngImage::PngData<PixelData_t>::translate
 (int imageWidth, int imageHeight, int xOffset, int yOffset)
 {
-    if(xOffset == 0 && yOffset == 0)
-        return;
-
-    const int absXOffset = std::abs(xOffset), absYOffset = std::abs(yOffset);
-    if(absXOffset >= imageWidth || absYOffset >= imageHeight)
-        return;
-
-    const int areaWidth = imageWidth - absXOffset, areaHeight = imageHeight - absYOffset;
-
-    if(xOffset <= 0)
-    {
-        if(yOffset <= 0)
-        {
-            PixelData_t *destPtr = &mPixelData[0];
-            const PixelData_t *srcPtr = &mPixelData[absYOffset*imageWidth + absXOffset];
-            for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr += imageWidth, srcPtr += imageWidth)
-                for(int xInd = 0; xInd < areaWidth; ++xInd)
-                    destPtr[xInd] = srcPtr[xInd];
-        }
-        else // yOffset > 0
-        {
-            PixelData_t *destPtr = &mPixelData[mPixelData.size() - imageWidth];
-            const PixelData_t *srcPtr = &mPixelData[(imageHeight-1-absYOffset)*imageWidth + absXOffset];
-            for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr -= imageWidth, srcPtr -= imageWidth)
-                for(int xInd = 0; xInd < areaWidth; ++xInd)
-                    destPtr[xInd] = srcPtr[xInd];
-        }
-    }
-    else // xOffset > 0
-    {
-        if(yOffset <= 0)
-        {
-            PixelData_t *destPtr = &mPixelData[imageWidth-areaWidth];
-            const PixelData_t *srcPtr = &mPixelData[absYOffset*imageWidth + (imageWidth-areaWidth-absXOffset)];
-            for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr += imageWidth, srcPtr += imageWidth)
-                for(int xInd = areaWidth-1; xInd >= 0; --xInd)
-                    destPtr[xInd] = srcPtr[xInd];
-        }
-        else // yOffset > 0
-        {
-            PixelData_t *destPtr = &mPixelData[mPixelData.size() - areaWidth];
-            const PixelData_t *srcPtr = &mPixelData[(imageHeight-1-absYOffset)*imageWidth +
-                                                    (imageWidth-areaWidth-absXOffset)];
-            for(int yInd = 0; yInd < areaHeight; ++yInd, destPtr -= imageWidth, srcPtr -= imageWidth)
-                for(int xInd = areaWidth-1; xInd >= 0; --xInd)
-                    destPtr[xInd] = srcPtr[xInd];
-        }
-    }
+    if(translatePixels(mPixelData, imageWidth, imageHeight, mLayout.stride, xOffset, yOffset) &&
+       mOpacity == kOpacity_notAllOpaque)
+        mOpacity = kOpacity_unknown;
 }
 
 template<typename PixelData_t>
@@ -1949,35 +2964,13 @@ void WPngImage::PngData<PixelData_t>::fillSidesAfterTranslate
     if(xOffset == 0 && yOffset == 0)
         return;
 
-    const int absXOffset = std::abs(xOffset), absYOffset = std::abs(yOffset);
-    if(absXOffset >= imageWidth || absYOffset >= imageHeight)
-    {
-        mPixelData.assign(mPixelData.size(), pixel);
-        return;
-    }
-
-    const int areaHeight = imageHeight - absYOffset;
-    int yBegin, yEnd, xBegin, xEnd;
-
-    if(yOffset >= 0) { yBegin = 0; yEnd = absYOffset; }
-    else { yBegin = imageHeight - absYOffset; yEnd = imageHeight; }
-    if(xOffset >= 0) { xBegin = 0; xEnd = absXOffset; }
-    else { xBegin = imageWidth - absXOffset; xEnd = imageWidth; }
-    const int xDiff = xEnd - xBegin;
-
-    PixelData_t *dest = &mPixelData[yBegin*imageWidth];
-    for(int yInd = yBegin; yInd < yEnd; ++yInd, dest += imageWidth)
-        for(int xInd = 0; xInd < imageWidth; ++xInd)
-            dest[xInd] = pixel;
-
-    if(yOffset >= 0)
-        dest = &mPixelData[yEnd*imageWidth + xBegin];
+    if(std::abs(xOffset) >= imageWidth || std::abs(yOffset) >= imageHeight)
+        mOpacity = pixelHasFullAlpha(pixel) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
     else
-        dest = &mPixelData[xBegin];
+        updateOpacity(pixelHasFullAlpha(pixel));
 
-    for(int yInd = 0; yInd < areaHeight; ++yInd, dest += imageWidth)
-        for(int xInd = 0; xInd < xDiff; ++xInd)
-            dest[xInd] = pixel;
+    ::fillSidesAfterTranslate(mPixelData, imageWidth, imageHeight, mLayout.stride,
+                              xOffset, yOffset, pixel);
 }
 
 template<typename PixelData_t>
@@ -2006,777 +2999,3132 @@ void WPngImage::PngData<PixelData_t>::translate
 
 
 //============================================================================
-// WPngImage constructors, assignment, destructor
+// WPngImage::PlanarPngData
 //============================================================================
-WPngImage::WPngImage(): mData(0), mWidth(0), mHeight(0)
-{}
-
-WPngImage::WPngImage(int width, int height, PixelFormat pixelFormat):
-    mData(0), mWidth(0), mHeight(0)
+// The float pixels are stored with each component in a plane of its own, in the order
+// r, g, b, a or g, a. Operations that handle every component in the same way, like the
+// pixel arithmetic, process the planes as plain arrays of floats.
+namespace
 {
-    newImage(width, height, pixelFormat);
-}
+    inline void getPlanarComponents(const WPngImage::PixelF& pixel, Float* components)
+    {
+        components[0] = pixel.r;
+        components[1] = pixel.g;
+        components[2] = pixel.b;
+        components[3] = pixel.a;
+    }
 
-WPngImage::WPngImage(int width, int height, Pixel8 pixel, PixelFormat pixelFormat):
-    mData(0), mWidth(0), mHeight(0)
-{
-    newImage(width, height, pixel, pixelFormat);
-}
+    inline void getPlanarComponents(const PixelGF& pixel, Float* components)
+    {
+        components[0] = pixel.g;
+        components[1] = pixel.a;
+    }
 
-WPngImage::WPngImage(int width, int height, Pixel16 pixel, PixelFormat pixelFormat):
-    mData(0), mWidth(0), mHeight(0)
-{
-    newImage(width, height, pixel, pixelFormat);
-}
+    inline void setPlanarComponents(WPngImage::PixelF& pixel, const Float* components)
+    {
+        pixel.r = components[0];
+        pixel.g = components[1];
+        pixel.b = components[2];
+        pixel.a = components[3];
+    }
 
-WPngImage::WPngImage(int width, int height, PixelF pixel, PixelFormat pixelFormat):
-    mData(0), mWidth(0), mHeight(0)
-{
-    newImage(width, height, pixel, pixelFormat);
-}
-
-WPngImage::WPngImage(const WPngImage& rhs):
-    mData(rhs.mData ? rhs.mData->createCopy() : 0),
-    mWidth(rhs.mWidth), mHeight(rhs.mHeight)
-{}
-
-WPngImage::~WPngImage()
-{
-    delete mData;
-}
-
-WPngImage& WPngImage::operator=(const WPngImage& rhs)
-{
-    if(this != &rhs)
+    inline void setPlanarComponents(PixelGF& pixel, const Float* components)
     {
-        mWidth = rhs.mWidth;
-        mHeight = rhs.mHeight;
-
-        if(mData && rhs.mData && mData->assignAllDataFrom(rhs.mData))
-            return *this;
-
-        delete mData;
-        mData = rhs.mData ? rhs.mData->createCopy() : 0;
+        pixel.g = components[0];
+        pixel.a = components[1];
     }
-    return *this;
-}
-
-#if !WPNGIMAGE_RESTRICT_TO_CPP98
-WPngImage::WPngImage(WPngImage&& rhs) noexcept:
-    mData(rhs.mData), mWidth(rhs.mWidth), mHeight(rhs.mHeight)
-{
-    rhs.mData = nullptr;
-    rhs.mWidth = rhs.mHeight = 0;
-}
 
-WPngImage& WPngImage::operator=(WPngImage&& rhs) noexcept
-{
-    if(this != &rhs)
+    // Like TransformPixelsToJob, but reads the source pixels through getPixelsAs(), so that
+    // the source and the destination can be the same image data.
+    template<typename Pixel_t, typename Func_t, typename SrcData_t, typename DestData_t>
+    struct TransformPixelRunsJob
     {
-        mData = rhs.mData;
-        mWidth = rhs.mWidth;
-        mHeight = rhs.mHeight;
-        rhs.mData = nullptr;
-        rhs.mWidth = rhs.mHeight = 0;
-    }
-    return *this;
-}
-#endif
-
-void WPngImage::swap(WPngImage& other)
-{
-    std::swap(mData, other.mData);
-    std::swap(mWidth, other.mWidth);
-    std::swap(mHeight, other.mHeight);
-}
+        const SrcData_t* src;
+        std::size_t pixelsAmount, chunkSize;
+        const Func_t* func;
+        DestData_t* dest;
 
-void WPngImage::move(WPngImage& rhs)
-{
-    if(this != &rhs)
-    {
-        mData = rhs.mData;
-        mWidth = rhs.mWidth;
-        mHeight = rhs.mHeight;
-        rhs.mData = 0;
-        rhs.mWidth = rhs.mHeight = 0;
-    }
+        void operator()(std::size_t chunkIndex, unsigned) const
+        {
+            const std::size_t kBufferSize = 256;
+            Pixel_t buffer[kBufferSize];
+            const std::size_t end = std::min((chunkIndex + 1) * chunkSize, pixelsAmount);
+            for(std::size_t index = chunkIndex * chunkSize; index < end; index += kBufferSize)
+            {
+                const std::size_t amount = std::min(kBufferSize, end - index);
+                src->getPixelsAs(index, amount, buffer);
+                for(std::size_t i = 0; i < amount; ++i)
+                    buffer[i] = (*func)(buffer[i]);
+                dest->setPixels(index, amount, buffer);
+            }
+        }
+    };
 }
 
-
-//============================================================================
-// Create a new image
-//============================================================================
-template<typename Pixel_t>
-void WPngImage::newImageWithPixelValue(int width, int height, Pixel_t pixel,
-                                       PixelFormat pixelFormat)
+template<typename PixelData_t>
+struct WPngImage::PlanarPngData: public PngDataBase
 {
-    delete mData;
-    mData = 0;
-    mWidth = mHeight = 0;
-
-    if(width <= 0 || height <= 0)
-        return;
-
-    switch(pixelFormat)
-    {
-      case kPixelFormat_GA8:
-          mData = new PngData<PixelG8>(width, height, pixel, pixelFormat);
-          break;
+    static const unsigned kPlanesAmount = sizeof(PixelData_t) / sizeof(Float);
 
-      case kPixelFormat_GA16:
-          mData = new PngData<PixelG16>(width, height, pixel, pixelFormat);
-          break;
+    typedef std::vector<Float, AlignedAllocator<Float> > PlaneVector;
+    std::vector<PlaneVector, AlignedAllocator<PlaneVector> > mPlanes;
 
-      case kPixelFormat_GAF:
-          mData = new PngData<PixelGF>(width, height, pixel, pixelFormat);
-          break;
+    template<typename Pixel_t>
+    PlanarPngData(int, int, Pixel_t, PixelFormat, bool padRows, MemoryResource*);
 
-      case kPixelFormat_RGBA8:
-          mData = new PngData<Pixel8>(width, height, pixel, pixelFormat);
-          break;
+    std::size_t pixelsAmount() const { return mLayout.pixelsAmount(mPlanes[0].size()); }
+    PixelData_t pixelAt(std::size_t) const;
+    void storePixel(std::size_t, const PixelData_t&);
 
-      case kPixelFormat_RGBA16:
-          mData = new PngData<Pixel16>(width, height, pixel, pixelFormat);
-          break;
+    virtual bool assignAllDataFrom(const PngDataBase*);
+    virtual PngDataBase* createCopy() const;
+    virtual bool hasExternalPixels() const { return false; }
+    virtual bool hasReadOnlyPixels() const { return false; }
 
-      case kPixelFormat_RGBAF:
-          mData = new PngData<PixelF>(width, height, pixel, pixelFormat);
-          break;
-    }
+    virtual Pixel8 getPixel8(std::size_t) const;
+    virtual Pixel16 getPixel16(std::size_t) const;
+    virtual PixelF getPixelF(std::size_t) const;
+    virtual PixelG8 getPixelG8(std::size_t) const;
+    virtual PixelG16 getPixelG16(std::size_t) const;
+    virtual bool scanForFullAlphas() const;
+    template<typename Pixel_t> void setPixelFrom(std::size_t, const Pixel_t&);
+    virtual void setPixel(std::size_t, const Pixel8&);
+    virtual void setPixel(std::size_t, const Pixel16&);
+    virtual void setPixel(std::size_t, const PixelF&);
+    virtual void setPixel(std::size_t, const PixelG8&);
+    virtual void setPixel(std::size_t, const PixelG16&);
+    virtual void setPixel(std::size_t, const PixelGF&);
+    void blendPixel(std::size_t, const PixelData_t&);
+    virtual void drawPixel(std::size_t, const Pixel8&);
+    virtual void drawPixel(std::size_t, const Pixel16&);
+    virtual void drawPixel(std::size_t, const PixelF&);
+    void fillWith(const PixelData_t&);
+    virtual void fill(const Pixel8&);
+    virtual void fill(const Pixel16&);
+    virtual void fill(const PixelF&);
+    template<typename Pixel_t, typename Func_t>
+    void transformTo(const Func_t&, PngDataBase&, unsigned) const;
+    virtual void transform(TransformFunc8, unsigned);
+    virtual void transform(TransformFunc16, unsigned);
+    virtual void transform(TransformFuncF, unsigned);
+    virtual void transform(TransformFunc8, WPngImage& dest, unsigned) const;
+    virtual void transform(TransformFunc16, WPngImage& dest, unsigned) const;
+    virtual void transform(TransformFuncF, WPngImage& dest, unsigned) const;
+    virtual void getPixels(std::size_t, std::size_t, Pixel8*) const;
+    virtual void getPixels(std::size_t, std::size_t, Pixel16*) const;
+    virtual void getPixels(std::size_t, std::size_t, PixelF*) const;
+    virtual void setPixels(std::size_t, std::size_t, const Pixel8*);
+    virtual void setPixels(std::size_t, std::size_t, const Pixel16*);
+    virtual void setPixels(std::size_t, std::size_t, const PixelF*);
+    virtual void getPixels(std::size_t, std::size_t, PixelGA8*) const;
+    virtual void getPixels(std::size_t, std::size_t, PixelGA16*) const;
+    virtual void getPixels(std::size_t, std::size_t, PixelGAF*) const;
+    virtual void setPixels(std::size_t, std::size_t, const PixelGA8*);
+    virtual void setPixels(std::size_t, std::size_t, const PixelGA16*);
+    virtual void setPixels(std::size_t, std::size_t, const PixelGAF*);
+    template<typename Pixel_t> void getPixelsAs(std::size_t, std::size_t, Pixel_t*) const;
+    template<typename Pixel_t> void setPixelsFrom(std::size_t, std::size_t, const Pixel_t*);
+    virtual void copyPixelTo(std::size_t, PngDataBase*, std::size_t) const;
+    virtual void copyAllPixelsTo(PngDataBase*) const;
+    virtual void copyPixelLineTo
+    (std::size_t, std::size_t, PngDataBase*, std::size_t, bool) const;
+    void addLineOf(std::size_t, std::size_t, std::size_t, const PixelData_t&, bool);
+    virtual void addLine(std::size_t, std::size_t, std::size_t, const Pixel8&, bool);
+    virtual void addLine(std::size_t, std::size_t, std::size_t, const Pixel16&, bool);
+    virtual void addLine(std::size_t, std::size_t, std::size_t, const PixelF&, bool);
+    virtual void premultiplyAlpha();
+    virtual void flipHorizontally(int, int);
+    virtual void flipVertically(int, int);
+    virtual void rotate180(int, int);
+    virtual void rotate90cwSquare(int);
+    virtual void rotate90cwNonsquare(int, int);
+    virtual void rotate90ccwSquare(int);
+    virtual void rotate90ccwNonsquare(int, int);
+    virtual void translate(int, int, int, int);
+    virtual void translate(int, int, int, int, Pixel8);
+    virtual void translate(int, int, int, int, Pixel16);
+    virtual void translate(int, int, int, int, PixelF);
+    void fillSidesAfterTranslate(int, int, int, int, const PixelData_t&);
+};
 
-    if(mData)
-    {
-        mWidth = width;
-        mHeight = height;
-    }
+//----------------------------------------------------------------------------
+// Constructor and single pixels
+//----------------------------------------------------------------------------
+template<typename PixelData_t>
+template<typename Pixel_t>
+WPngImage::PlanarPngData<PixelData_t>::PlanarPngData
+(int width, int height, Pixel_t pixel, PixelFormat pixelFormat, bool padRows,
+ MemoryResource* resource):
+    PngDataBase(pixelFormat,
+                RowLayout(std::size_t(width),
+                          getRowStride(std::size_t(width), sizeof(Float), padRows)),
+                padRows, resource),
+    mPlanes(kPlanesAmount, PlaneVector(AlignedAllocator<Float>(resource)),
+            AlignedAllocator<PlaneVector>(resource))
+{
+    const PixelData_t value(pixel);
+    Float components[kPlanesAmount];
+    getPlanarComponents(value, components);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        mPlanes[plane].assign(mLayout.stride * std::size_t(height), components[plane]);
+    mOpacity = pixelHasFullAlpha(value) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
 }
 
-void WPngImage::newImage(int width, int height, PixelFormat pixelFormat)
-{
-    newImageWithPixelValue(width, height, Pixel8(), pixelFormat);
+template<typename PixelData_t>
+PixelData_t WPngImage::PlanarPngData<PixelData_t>::pixelAt(std::size_t index) const
+{
+    index = mLayout.storageIndex(index);
+    Float components[kPlanesAmount];
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        components[plane] = mPlanes[plane][index];
+    PixelData_t pixel(0.0f, 0.0f);
+    setPlanarComponents(pixel, components);
+    return pixel;
 }
 
-void WPngImage::newImage(int width, int height, Pixel8 pixel, PixelFormat pixelFormat)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::storePixel
+(std::size_t index, const PixelData_t& pixel)
 {
-    newImageWithPixelValue(width, height, pixel, pixelFormat);
+    index = mLayout.storageIndex(index);
+    Float components[kPlanesAmount];
+    getPlanarComponents(pixel, components);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        mPlanes[plane][index] = components[plane];
 }
 
-void WPngImage::newImage(int width, int height, Pixel16 pixel, PixelFormat pixelFormat)
+template<typename PixelData_t>
+bool WPngImage::PlanarPngData<PixelData_t>::assignAllDataFrom(const PngDataBase* src)
 {
-    newImageWithPixelValue(width, height, pixel, pixelFormat);
+    const PlanarPngData<PixelData_t>* srcPngData =
+        dynamic_cast<const PlanarPngData<PixelData_t>*>(src);
+    if(!srcPngData) return false;
+    mPixelFormat = srcPngData->mPixelFormat;
+    mPngFileFormat = srcPngData->mPngFileFormat;
+    mOpacity = srcPngData->mPixelDataExposed ? kOpacity_unknown : srcPngData->mOpacity;
+    mPadRows = srcPngData->mPadRows;
+    mLayout = srcPngData->mLayout;
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        mPlanes[plane] = srcPngData->mPlanes[plane];
+    return true;
 }
 
-void WPngImage::newImage(int width, int height, PixelF pixel, PixelFormat pixelFormat)
+template<typename PixelData_t>
+WPngImage::PngDataBase* WPngImage::PlanarPngData<PixelData_t>::createCopy() const
 {
-    newImageWithPixelValue(width, height, pixel, pixelFormat);
+    return new(mMemoryResource) PlanarPngData<PixelData_t>(*this);
 }
 
-
-//============================================================================
-// Image information getters
-//============================================================================
-WPngImage::PixelFormat WPngImage::currentPixelFormat() const
+template<typename PixelData_t>
+WPngImage::Pixel8 WPngImage::PlanarPngData<PixelData_t>::getPixel8(std::size_t index) const
 {
-    return mData ? mData->mPixelFormat : kPixelFormat_RGBA8;
+    return convertToPixel<Pixel8>(pixelAt(index));
 }
 
-WPngImage::PngFileFormat WPngImage::originalFileFormat() const
+template<typename PixelData_t>
+WPngImage::Pixel16 WPngImage::PlanarPngData<PixelData_t>::getPixel16(std::size_t index) const
 {
-    return mData ? mData->mPngFileFormat : kPngFileFormat_none;
+    return convertToPixel<Pixel16>(pixelAt(index));
 }
 
-WPngImage::PngFileFormat WPngImage::getClosestMatchFileFormat(PixelFormat pixelFormat)
+template<typename PixelData_t>
+WPngImage::PixelF WPngImage::PlanarPngData<PixelData_t>::getPixelF(std::size_t index) const
 {
-    switch(pixelFormat)
-    {
-      case WPngImage::kPixelFormat_GA8: return WPngImage::kPngFileFormat_GA8;
-      case WPngImage::kPixelFormat_GA16:
-      case WPngImage::kPixelFormat_GAF: return WPngImage::kPngFileFormat_GA16;
-      case WPngImage::kPixelFormat_RGBA8: return WPngImage::kPngFileFormat_RGBA8;
-      case WPngImage::kPixelFormat_RGBA16:
-      case WPngImage::kPixelFormat_RGBAF: return WPngImage::kPngFileFormat_RGBA16;
-    }
-    return WPngImage::kPngFileFormat_RGBA8;
+    return convertToPixel<PixelF>(pixelAt(index));
 }
 
-WPngImage::PngFileFormat WPngImage::getFileFormat
-(PngWriteConvert conversion, PngFileFormat originalFileFormat, PixelFormat currentPixelFormat)
+template<typename PixelData_t>
+PixelG8 WPngImage::PlanarPngData<PixelData_t>::getPixelG8(std::size_t index) const
 {
-    if(conversion == WPngImage::kPngWriteConvert_closestMatch)
-        return getClosestMatchFileFormat(currentPixelFormat);
-    return originalFileFormat;
+    return convertToPixelG<Byte>(pixelAt(index));
 }
 
-void WPngImage::setFileFormat(PngFileFormat newFormat)
+template<typename PixelData_t>
+PixelG16 WPngImage::PlanarPngData<PixelData_t>::getPixelG16(std::size_t index) const
 {
-    if(mData) mData->mPngFileFormat = newFormat;
+    return convertToPixelG<UInt16>(pixelAt(index));
 }
 
-void WPngImage::setFileFormat(PngWriteConvert conversion)
+// Only the alpha plane needs to be scanned.
+template<typename PixelData_t>
+bool WPngImage::PlanarPngData<PixelData_t>::scanForFullAlphas() const
 {
-    if(mData) mData->mPngFileFormat = getFileFormat(conversion, mData->mPngFileFormat, currentPixelFormat());
+    const PlaneVector& alphas = mPlanes[kPlanesAmount - 1];
+    for(std::size_t index = 0; index < alphas.size(); index += mLayout.stride)
+        if(!::allPixelsHaveFullAlpha(&alphas[index], mLayout.length))
+            return false;
+    return true;
 }
 
-bool WPngImage::isGrayscalePixelFormat() const
+template<typename PixelData_t>
+template<typename Pixel_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixelFrom(std::size_t index, const Pixel_t& src)
 {
-    const PixelFormat pixelFormat = currentPixelFormat();
-    return (pixelFormat == kPixelFormat_GA8 ||
-            pixelFormat == kPixelFormat_GA16 ||
-            pixelFormat == kPixelFormat_GAF);
+    PixelData_t pixel(0.0f, 0.0f);
+    assignPixel(pixel, src);
+    storePixel(index, pixel);
+    updateOpacity(pixelHasFullAlpha(pixel));
 }
 
-bool WPngImage::isRGBAPixelFormat() const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixel(std::size_t index, const Pixel8& pixel)
 {
-    const PixelFormat pixelFormat = currentPixelFormat();
-    return (pixelFormat == kPixelFormat_RGBA8 ||
-            pixelFormat == kPixelFormat_RGBA16 ||
-            pixelFormat == kPixelFormat_RGBAF);
+    setPixelFrom(index, pixel);
 }
 
-bool WPngImage::is8BPCPixelFormat() const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixel(std::size_t index, const Pixel16& pixel)
 {
-    const PixelFormat pixelFormat = currentPixelFormat();
-    return (pixelFormat == kPixelFormat_RGBA8 ||
-            pixelFormat == kPixelFormat_GA8);
+    setPixelFrom(index, pixel);
 }
 
-bool WPngImage::is16BPCPixelFormat() const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixel(std::size_t index, const PixelF& pixel)
 {
-    const PixelFormat pixelFormat = currentPixelFormat();
-    return (pixelFormat == kPixelFormat_RGBA16 ||
-            pixelFormat == kPixelFormat_GA16);
+    setPixelFrom(index, pixel);
 }
 
-bool WPngImage::isFloatPixelFormat() const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixel(std::size_t index, const PixelG8& pixel)
 {
-    const PixelFormat pixelFormat = currentPixelFormat();
-    return (pixelFormat == kPixelFormat_RGBAF ||
-            pixelFormat == kPixelFormat_GAF);
+    setPixelFrom(index, pixel);
 }
 
-bool WPngImage::allPixelsHaveFullAlpha() const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixel(std::size_t index, const PixelG16& pixel)
 {
-    return mData->allPixelsHaveFullAlpha();
+    setPixelFrom(index, pixel);
 }
 
-void WPngImage::convertToPixelFormat(PixelFormat newPixelFormat)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixel(std::size_t index, const PixelGF& pixel)
 {
-    if(mData && newPixelFormat != mData->mPixelFormat)
-    {
-        WPngImage newImage(width(), height(), Pixel8(), newPixelFormat);
-        mData->copyAllPixelsTo(newImage.mData);
-        newImage.mData->mPngFileFormat = mData->mPngFileFormat;
-        this->swap(newImage);
-    }
+    setPixelFrom(index, pixel);
 }
 
-
-//============================================================================
-// Get and set pixels
-//============================================================================
-WPngImage::Pixel8 WPngImage::get8(int x, int y) const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::blendPixel
+(std::size_t index, const PixelData_t& srcPixel)
 {
-    if(x < 0 || x >= mWidth || y < 0 || y >= mHeight || !mData)
-        return Pixel8(0, 0, 0, 0);
-    return mData->getPixel8(std::size_t(y * mWidth + x));
+    PixelData_t pixel = pixelAt(index);
+    pixel.blendWith(srcPixel);
+    storePixel(index, pixel);
+    updateOpacity(pixelHasFullAlpha(pixel));
 }
 
-WPngImage::Pixel16 WPngImage::get16(int x, int y) const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::drawPixel(std::size_t index, const Pixel8& pixel)
 {
-    if(x < 0 || x >= mWidth || y < 0 || y >= mHeight || !mData)
-        return Pixel16(0, 0, 0, 0);
-    return mData->getPixel16(std::size_t(y * mWidth + x));
+    blendPixel(index, PixelData_t(pixel));
 }
 
-WPngImage::PixelF WPngImage::getF(int x, int y) const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::drawPixel(std::size_t index, const Pixel16& pixel)
 {
-    if(x < 0 || x >= mWidth || y < 0 || y >= mHeight || !mData)
-        return PixelF(0, 0, 0, 0);
-    return mData->getPixelF(std::size_t(y * mWidth + x));
+    blendPixel(index, PixelData_t(pixel));
 }
 
-void WPngImage::set(int x, int y, Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::drawPixel(std::size_t index, const PixelF& pixel)
 {
-    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && mData)
-        mData->setPixel(std::size_t(y * mWidth + x), pixel);
+    blendPixel(index, PixelData_t(pixel));
 }
 
-void WPngImage::set(int x, int y, Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::fillWith(const PixelData_t& pixel)
 {
-    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && mData)
-        mData->setPixel(std::size_t(y * mWidth + x), pixel);
+    Float components[kPlanesAmount];
+    getPlanarComponents(pixel, components);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        mPlanes[plane].assign(mPlanes[plane].size(), components[plane]);
+    mOpacity = pixelHasFullAlpha(pixel) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
 }
 
-void WPngImage::set(int x, int y, PixelF pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::fill(const Pixel8& pixel)
 {
-    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && mData)
-        mData->setPixel(std::size_t(y * mWidth + x), pixel);
+    fillWith(PixelData_t(pixel));
 }
 
-void WPngImage::fill(Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::fill(const Pixel16& pixel)
 {
-    if(mData) mData->fill(pixel);
+    fillWith(PixelData_t(pixel));
 }
 
-void WPngImage::fill(Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::fill(const PixelF& pixel)
 {
-    if(mData) mData->fill(pixel);
+    fillWith(PixelData_t(pixel));
 }
 
-void WPngImage::fill(PixelF pixel)
+//----------------------------------------------------------------------------
+// Transforms and runs of pixels
+//----------------------------------------------------------------------------
+template<typename PixelData_t>
+template<typename Pixel_t, typename Func_t>
+void WPngImage::PlanarPngData<PixelData_t>::transformTo
+(const Func_t& func, PngDataBase& dest, unsigned threadsAmount) const
 {
-    if(mData) mData->fill(pixel);
+    if(pixelsAmount() == 0) return;
+
+    threadsAmount = getThreadsAmount(threadsAmount);
+    TransformPixelRunsJob<Pixel_t, Func_t, PlanarPngData, PngDataBase> job;
+    job.src = this;
+    job.pixelsAmount = pixelsAmount();
+    job.chunkSize = getPixelChunkSize(pixelsAmount(), threadsAmount);
+    job.func = &func;
+    job.dest = &dest;
+    runJobs((pixelsAmount() + job.chunkSize - 1) / job.chunkSize, threadsAmount, job);
 }
 
-void WPngImage::transform(TransformFunc8 func)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::transform(TransformFunc8 func, unsigned threadsAmount)
 {
-    if(mData) mData->transform(func);
+    transformTo<Pixel8>(func, *this, threadsAmount);
+    mOpacity = scanForFullAlphas() ? kOpacity_allOpaque : kOpacity_notAllOpaque;
 }
 
-void WPngImage::transform(TransformFunc16 func)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::transform(TransformFunc16 func, unsigned threadsAmount)
 {
-    if(mData) mData->transform(func);
+    transformTo<Pixel16>(func, *this, threadsAmount);
+    mOpacity = scanForFullAlphas() ? kOpacity_allOpaque : kOpacity_notAllOpaque;
 }
 
-void WPngImage::transform(TransformFuncF func)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::transform(TransformFuncF func, unsigned threadsAmount)
 {
-    if(mData) mData->transform(func);
+    transformTo<PixelF>(func, *this, threadsAmount);
+    mOpacity = scanForFullAlphas() ? kOpacity_allOpaque : kOpacity_notAllOpaque;
 }
 
-void WPngImage::transform(TransformFunc8 func, WPngImage& dest) const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::transform
+(TransformFunc8 func, WPngImage& dest, unsigned threadsAmount) const
 {
-    if(mData)
-    {
-        if(dest.width() != width() || dest.height() != height())
-            dest.newImage(width(), height(),
-                          dest.mData ? dest.currentPixelFormat() : currentPixelFormat());
-        mData->transform(func, dest);
-    }
+    transformTo<Pixel8>(func, *dest.mData, threadsAmount);
+    dest.mData->mOpacity = kOpacity_unknown;
 }
 
-void WPngImage::transform(TransformFunc16 func, WPngImage& dest) const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::transform
+(TransformFunc16 func, WPngImage& dest, unsigned threadsAmount) const
 {
-    if(mData)
-    {
-        if(dest.width() != width() || dest.height() != height())
-            dest.newImage(width(), height(),
-                          dest.mData ? dest.currentPixelFormat() : currentPixelFormat());
-        mData->transform(func, dest);
-    }
+    transformTo<Pixel16>(func, *dest.mData, threadsAmount);
+    dest.mData->mOpacity = kOpacity_unknown;
 }
 
-void WPngImage::transform(TransformFuncF func, WPngImage& dest) const
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::transform
+(TransformFuncF func, WPngImage& dest, unsigned threadsAmount) const
 {
-    if(mData)
-    {
-        if(dest.width() != width() || dest.height() != height())
-            dest.newImage(width(), height(),
-                          dest.mData ? dest.currentPixelFormat() : currentPixelFormat());
-        mData->transform(func, dest);
-    }
+    transformTo<PixelF>(func, *dest.mData, threadsAmount);
+    dest.mData->mOpacity = kOpacity_unknown;
 }
 
-// These are called by the loading functions. They assume the index is valid.
-void WPngImage::setPixel(std::size_t index, const Pixel8& p)
+template<typename PixelData_t>
+template<typename Pixel_t>
+void WPngImage::PlanarPngData<PixelData_t>::getPixelsAs
+(std::size_t index, std::size_t amount, Pixel_t* dest) const
 {
-    mData->setPixel(index, p);
+    for(std::size_t i = 0; i < amount; ++i)
+        assignPixel(dest[i], pixelAt(index + i));
 }
 
-void WPngImage::setPixel(std::size_t index, const Pixel16& p)
+template<typename PixelData_t>
+template<typename Pixel_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixelsFrom
+(std::size_t index, std::size_t amount, const Pixel_t* src)
 {
-    mData->setPixel(index, p);
+    PixelData_t pixel(0.0f, 0.0f);
+    for(std::size_t i = 0; i < amount; ++i)
+    {
+        assignPixel(pixel, src[i]);
+        storePixel(index + i, pixel);
+    }
 }
 
-
-//============================================================================
-// Image transformations
-//============================================================================
-void WPngImage::flipHorizontally()
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, Pixel8* dest) const
 {
-    if(mData) mData->flipHorizontally(mWidth, mHeight);
+    getPixelsAs(index, amount, dest);
 }
 
-void WPngImage::flipVertically()
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, Pixel16* dest) const
 {
-    if(mData) mData->flipVertically(mWidth, mHeight);
+    getPixelsAs(index, amount, dest);
 }
 
-void WPngImage::rotate180()
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelF* dest) const
 {
-    if(mData) mData->rotate180(mWidth, mHeight);
+    getPixelsAs(index, amount, dest);
 }
 
-void WPngImage::rotate90cw()
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const Pixel8* src)
 {
-    if(mData)
-    {
-        if(mWidth == mHeight)
-        {
-            mData->rotate90cwSquare(mWidth);
-        }
-        else
-        {
-            mData->rotate90cwNonsquare(mWidth, mHeight);
-            std::swap(mWidth, mHeight);
-        }
-    }
+    setPixelsFrom(index, amount, src);
 }
 
-void WPngImage::rotate90ccw()
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const Pixel16* src)
 {
-    if(mData)
-    {
-        if(mWidth == mHeight)
-        {
-            mData->rotate90ccwSquare(mWidth);
-        }
-        else
-        {
-            mData->rotate90ccwNonsquare(mWidth, mHeight);
-            std::swap(mWidth, mHeight);
-        }
-    }
+    setPixelsFrom(index, amount, src);
 }
 
-void WPngImage::translate(int xOffset, int yOffset)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelF* src)
 {
-    if(mData) mData->translate(mWidth, mHeight, xOffset, yOffset);
+    setPixelsFrom(index, amount, src);
 }
 
-void WPngImage::translate(int xOffset, int yOffset, Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelGA8* dest) const
 {
-    if(mData) mData->translate(mWidth, mHeight, xOffset, yOffset, pixel);
+    getPixelsAs(index, amount, static_cast<PixelG8*>(dest));
 }
 
-void WPngImage::translate(int xOffset, int yOffset, Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelGA16* dest) const
 {
-    if(mData) mData->translate(mWidth, mHeight, xOffset, yOffset, pixel);
+    getPixelsAs(index, amount, static_cast<PixelG16*>(dest));
 }
 
-void WPngImage::translate(int xOffset, int yOffset, PixelF pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::getPixels
+(std::size_t index, std::size_t amount, PixelGAF* dest) const
 {
-    if(mData) mData->translate(mWidth, mHeight, xOffset, yOffset, pixel);
+    getPixelsAs(index, amount, static_cast<PixelGF*>(dest));
 }
 
-
-//============================================================================
-// Drawing functions
-//============================================================================
-void WPngImage::drawPixel(int x, int y, Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelGA8* src)
 {
-    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && mData)
-        mData->drawPixel(std::size_t(y*width() + x), pixel);
+    setPixelsFrom(index, amount, static_cast<const PixelG8*>(src));
 }
 
-void WPngImage::drawPixel(int x, int y, Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelGA16* src)
 {
-    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && mData)
-        mData->drawPixel(std::size_t(y*width() + x), pixel);
+    setPixelsFrom(index, amount, static_cast<const PixelG16*>(src));
 }
 
-void WPngImage::drawPixel(int x, int y, PixelF pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::setPixels
+(std::size_t index, std::size_t amount, const PixelGAF* src)
 {
-    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && mData)
-        mData->drawPixel(std::size_t(y*width() + x), pixel);
+    setPixelsFrom(index, amount, static_cast<const PixelGF*>(src));
 }
 
-void WPngImage::putImage(int destX, int destY, const WPngImage& src,
-                         int srcX, int srcY, int srcWidth, int srcHeight, bool useBlending)
+//----------------------------------------------------------------------------
+// Copying and drawing
+//----------------------------------------------------------------------------
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::copyPixelTo
+(std::size_t srcIndex, PngDataBase* dest, std::size_t destIndex) const
 {
-    if(!mData || !src.mData || srcWidth <= 0 || srcHeight <= 0 ||
-       width() <= 0 || height() <= 0 || src.width() <= 0 || src.height() <= 0 ||
-       srcX >= src.width() || srcY >= src.height() ||
-       srcX + srcWidth <= 0 || srcY + srcHeight <= 0)
-        return;
-
-    if(srcX < 0) { destX -= srcX; srcWidth += srcX; srcX = 0; }
-    if(srcY < 0) { destY -= srcY; srcHeight += srcY; srcY = 0; }
-    if(srcX + srcWidth > src.width()) srcWidth = src.width() - srcX;
-    if(srcY + srcHeight > src.height()) srcHeight = src.height() - srcY;
+    dest->setPixel(destIndex, pixelAt(srcIndex));
+}
 
-    if(destX >= width() || destY >= height() ||
-       destX + srcWidth <= 0 || destY + srcHeight <= 0)
-        return;
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::copyAllPixelsTo(PngDataBase* dest) const
+{
+    for(std::size_t i = 0; i < pixelsAmount(); ++i)
+        dest->setPixel(i, pixelAt(i));
 
-    if(destX < 0) { srcX -= destX; srcWidth += destX; destX = 0; }
-    if(destY < 0) { srcY -= destY; srcHeight += destY; destY = 0; }
-    if(destX + srcWidth > width()) srcWidth = width() - destX;
-    if(destY + srcHeight > height()) srcHeight = height() - destY;
+    if(mOpacity == kOpacity_allOpaque)
+        dest->mOpacity = kOpacity_allOpaque;
+}
 
-    for(int lineInd = 0; lineInd < srcHeight; ++lineInd)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::copyPixelLineTo
+(std::size_t srcStartIndex, std::size_t amount,
+ PngDataBase* dest, std::size_t destStartIndex, bool useBlending) const
+{
+    if(useBlending)
     {
-        const int srcStartInd = (srcY + lineInd) * src.width() + srcX;
-        const int destStartInd = (destY + lineInd) * width() + destX;
-        src.mData->copyPixelLineTo(std::size_t(srcStartInd), srcWidth,
-                                   mData, std::size_t(destStartInd), useBlending);
+        blendPixelLineTo(srcStartIndex, amount, dest, destStartIndex);
+    }
+    else
+    {
+        for(std::size_t i = 0; i < amount; ++i)
+            dest->setPixel(destStartIndex + i, pixelAt(srcStartIndex + i));
     }
 }
 
-void WPngImage::putImage(int destX, int destY, const WPngImage& src)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::addLineOf
+(std::size_t startIndex, std::size_t length, std::size_t step, const PixelData_t& pixel,
+ bool useBlending)
 {
-    putImage(destX, destY, src, 0, 0, src.width(), src.height(), false);
+    if(useBlending)
+    {
+        for(std::size_t i = 0; i < length; ++i, startIndex += step)
+            blendPixel(startIndex, pixel);
+    }
+    else
+    {
+        for(std::size_t i = 0; i < length; ++i, startIndex += step)
+            storePixel(startIndex, pixel);
+        if(length > 0) updateOpacity(pixelHasFullAlpha(pixel));
+    }
 }
 
-void WPngImage::putImage(int destX, int destY, const WPngImage& src,
-                         int srcX, int srcY, int srcWidth, int srcHeight)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::addLine
+(std::size_t startIndex, std::size_t length, std::size_t step, const Pixel8& pixel,
+ bool useBlending)
 {
-    putImage(destX, destY, src, srcX, srcY, srcWidth, srcHeight, false);
+    addLineOf(startIndex, length, step, PixelData_t(pixel), useBlending);
 }
 
-void WPngImage::drawImage(int destX, int destY, const WPngImage& src)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::addLine
+(std::size_t startIndex, std::size_t length, std::size_t step, const Pixel16& pixel,
+ bool useBlending)
 {
-    putImage(destX, destY, src, 0, 0, src.width(), src.height(), true);
+    addLineOf(startIndex, length, step, PixelData_t(pixel), useBlending);
 }
 
-void WPngImage::drawImage(int destX, int destY, const WPngImage& src,
-                          int srcX, int srcY, int srcWidth, int srcHeight)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::addLine
+(std::size_t startIndex, std::size_t length, std::size_t step, const PixelF& pixel,
+ bool useBlending)
 {
-    putImage(destX, destY, src, srcX, srcY, srcWidth, srcHeight, true);
+    addLineOf(startIndex, length, step, PixelData_t(pixel), useBlending);
 }
 
-template<typename Pixel_t>
-void WPngImage::addHorLine(int x, int y, int length, const Pixel_t& pixel, bool useBlending)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::premultiplyAlpha()
 {
-    if(!mData || length == 0 || y < 0 || y >= height()) return;
-    if(length < 0) { length = -length; x = x - length + 1; }
-    if(x >= width()) return;
-    if(x < 0) { length += x; x = 0; }
-    if(length <= 0) return;
-    if(x + length > width()) { length = width() - x; }
-    mData->addLine(std::size_t(y*width() + x), std::size_t(length), 1, pixel, useBlending);
+    const PlaneVector& alphas = mPlanes[kPlanesAmount - 1];
+    for(unsigned plane = 0; plane + 1 < kPlanesAmount; ++plane)
+    {
+        Float* components = alphas.empty() ? 0 : &mPlanes[plane][0];
+        for(std::size_t i = 0; i < alphas.size(); ++i)
+            components[i] = componentMultipliedByAlpha(components[i], alphas[i]);
+    }
 }
 
-template<typename Pixel_t>
-void WPngImage::addVertLine(int x, int y, int length, const Pixel_t& pixel, bool useBlending)
+//----------------------------------------------------------------------------
+// Moving the pixels
+//----------------------------------------------------------------------------
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::flipHorizontally(int width, int height)
 {
-    if(!mData || length == 0 || x < 0 || x >= width()) return;
-    if(length < 0) { length = -length; y = y - length + 1; }
-    if(y >= height()) return;
-    if(y < 0) { length += y; y = 0; }
-    if(length <= 0) return;
-    if(y + length > height()) { length = height() - y; }
-    mData->addLine(std::size_t(y*width() + x), std::size_t(length), std::size_t(width()), pixel,
-                   useBlending);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        flipPixelsHorizontally(mPlanes[plane], width, height, mLayout.stride);
 }
 
-void WPngImage::putHorLine(int x, int y, int length, Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::flipVertically(int width, int height)
 {
-    addHorLine(x, y, length, pixel, false);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        flipPixelsVertically(mPlanes[plane], width, height, mLayout.stride);
 }
 
-void WPngImage::putHorLine(int x, int y, int length, Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::rotate180(int width, int height)
 {
-    addHorLine(x, y, length, pixel, false);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        rotatePixels180(mPlanes[plane], width, height, mLayout.stride);
 }
 
-void WPngImage::putHorLine(int x, int y, int length, PixelF pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::rotate90cwSquare(int width)
 {
-    addHorLine(x, y, length, pixel, false);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        rotatePixels90cwSquare(mPlanes[plane], width, mLayout.stride);
 }
 
-void WPngImage::putVertLine(int x, int y, int length, Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::rotate90cwNonsquare(int width, int height)
 {
-    addVertLine(x, y, length, pixel, false);
+    const std::size_t newStride = getRowStride(std::size_t(height), sizeof(Float), mPadRows);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        rotatePixels90cwNonsquare(mPlanes[plane], width, height, mLayout.stride, newStride);
+    mLayout = RowLayout(std::size_t(height), newStride);
 }
 
-void WPngImage::putVertLine(int x, int y, int length, Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::rotate90ccwSquare(int width)
 {
-    addVertLine(x, y, length, pixel, false);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        rotatePixels90ccwSquare(mPlanes[plane], width, mLayout.stride);
 }
 
-void WPngImage::putVertLine(int x, int y, int length, PixelF pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::rotate90ccwNonsquare(int width, int height)
 {
-    addVertLine(x, y, length, pixel, false);
+    const std::size_t newStride = getRowStride(std::size_t(height), sizeof(Float), mPadRows);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        rotatePixels90ccwNonsquare(mPlanes[plane], width, height, mLayout.stride, newStride);
+    mLayout = RowLayout(std::size_t(height), newStride);
 }
 
-void WPngImage::drawHorLine(int x, int y, int length, Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::translate
+(int imageWidth, int imageHeight, int xOffset, int yOffset)
 {
-    addHorLine(x, y, length, pixel, true);
+    bool pixelsWereMoved = false;
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        pixelsWereMoved = translatePixels(mPlanes[plane], imageWidth, imageHeight,
+                                          mLayout.stride, xOffset, yOffset);
+    if(pixelsWereMoved && mOpacity == kOpacity_notAllOpaque)
+        mOpacity = kOpacity_unknown;
 }
 
-void WPngImage::drawHorLine(int x, int y, int length, Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::fillSidesAfterTranslate
+(int imageWidth, int imageHeight, int xOffset, int yOffset, const PixelData_t& pixel)
 {
-    addHorLine(x, y, length, pixel, true);
+    if(xOffset == 0 && yOffset == 0)
+        return;
+
+    if(std::abs(xOffset) >= imageWidth || std::abs(yOffset) >= imageHeight)
+        mOpacity = pixelHasFullAlpha(pixel) ? kOpacity_allOpaque : kOpacity_notAllOpaque;
+    else
+        updateOpacity(pixelHasFullAlpha(pixel));
+
+    Float components[kPlanesAmount];
+    getPlanarComponents(pixel, components);
+    for(unsigned plane = 0; plane < kPlanesAmount; ++plane)
+        ::fillSidesAfterTranslate(mPlanes[plane], imageWidth, imageHeight, mLayout.stride,
+                                  xOffset, yOffset, components[plane]);
 }
 
-void WPngImage::drawHorLine(int x, int y, int length, PixelF pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::translate
+(int imageWidth, int imageHeight, int xOffset, int yOffset, Pixel8 pixel)
 {
-    addHorLine(x, y, length, pixel, true);
+    translate(imageWidth, imageHeight, xOffset, yOffset);
+    fillSidesAfterTranslate(imageWidth, imageHeight, xOffset, yOffset, PixelData_t(pixel));
 }
 
-void WPngImage::drawVertLine(int x, int y, int length, Pixel8 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::translate
+(int imageWidth, int imageHeight, int xOffset, int yOffset, Pixel16 pixel)
 {
-    addVertLine(x, y, length, pixel, true);
+    translate(imageWidth, imageHeight, xOffset, yOffset);
+    fillSidesAfterTranslate(imageWidth, imageHeight, xOffset, yOffset, PixelData_t(pixel));
 }
 
-void WPngImage::drawVertLine(int x, int y, int length, Pixel16 pixel)
+template<typename PixelData_t>
+void WPngImage::PlanarPngData<PixelData_t>::translate
+(int imageWidth, int imageHeight, int xOffset, int yOffset, PixelF pixel)
 {
-    addVertLine(x, y, length, pixel, true);
+    translate(imageWidth, imageHeight, xOffset, yOffset);
+    fillSidesAfterTranslate(imageWidth, imageHeight, xOffset, yOffset, PixelData_t(pixel));
 }
 
-void WPngImage::drawVertLine(int x, int y, int length, PixelF pixel)
+
+//============================================================================
+// WPngImage constructors, assignment, destructor
+//============================================================================
+WPngImage::WPngImage(): mData(0), mWidth(0), mHeight(0), mPadRows(false), mMemoryResource(0)
+{}
+
+WPngImage::WPngImage(int width, int height, PixelFormat pixelFormat):
+    mData(0), mWidth(0), mHeight(0), mPadRows(false), mMemoryResource(0)
 {
-    addVertLine(x, y, length, pixel, true);
+    newImage(width, height, pixelFormat);
 }
 
-template<typename Pixel_t>
+WPngImage::WPngImage(int width, int height, Pixel8 pixel, PixelFormat pixelFormat):
+    mData(0), mWidth(0), mHeight(0), mPadRows(false), mMemoryResource(0)
+{
+    newImage(width, height, pixel, pixelFormat);
+}
+
+WPngImage::WPngImage(int width, int height, Pixel16 pixel, PixelFormat pixelFormat):
+    mData(0), mWidth(0), mHeight(0), mPadRows(false), mMemoryResource(0)
+{
+    newImage(width, height, pixel, pixelFormat);
+}
+
+WPngImage::WPngImage(int width, int height, PixelF pixel, PixelFormat pixelFormat):
+    mData(0), mWidth(0), mHeight(0), mPadRows(false), mMemoryResource(0)
+{
+    newImage(width, height, pixel, pixelFormat);
+}
+
+WPngImage::WPngImage(const WPngImage& rhs):
+    mData(rhs.sharePixelData()),
+    mWidth(rhs.mWidth), mHeight(rhs.mHeight), mPadRows(rhs.mPadRows),
+    mMemoryResource(rhs.mMemoryResource)
+{}
+
+WPngImage::~WPngImage()
+{
+    releasePixelData();
+}
+
+WPngImage& WPngImage::operator=(const WPngImage& rhs)
+{
+    if(this != &rhs)
+    {
+        mWidth = rhs.mWidth;
+        mHeight = rhs.mHeight;
+        mPadRows = rhs.mPadRows;
+        mMemoryResource = rhs.mMemoryResource;
+
+        // Pixel data which can't be shared is copied over the existing data if possible.
+        if(mData && rhs.mData && rhs.mData->mPixelDataExposed && !mData->isShared() &&
+           mData->mMemoryResource == rhs.mData->mMemoryResource &&
+           mData->assignAllDataFrom(rhs.mData))
+            return *this;
+
+        PngDataBase* data = rhs.sharePixelData();
+        releasePixelData();
+        mData = data;
+    }
+    return *this;
+}
+
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+WPngImage::WPngImage(WPngImage&& rhs) noexcept:
+    mData(rhs.mData), mWidth(rhs.mWidth), mHeight(rhs.mHeight), mPadRows(rhs.mPadRows),
+    mMemoryResource(rhs.mMemoryResource)
+{
+    rhs.mData = nullptr;
+    rhs.mWidth = rhs.mHeight = 0;
+}
+
+WPngImage& WPngImage::operator=(WPngImage&& rhs) noexcept
+{
+    if(this != &rhs)
+    {
+        releasePixelData();
+        mData = rhs.mData;
+        mWidth = rhs.mWidth;
+        mHeight = rhs.mHeight;
+        mPadRows = rhs.mPadRows;
+        mMemoryResource = rhs.mMemoryResource;
+        rhs.mData = nullptr;
+        rhs.mWidth = rhs.mHeight = 0;
+    }
+    return *this;
+}
+#endif
+
+void WPngImage::swap(WPngImage& other)
+{
+    std::swap(mData, other.mData);
+    std::swap(mWidth, other.mWidth);
+    std::swap(mHeight, other.mHeight);
+    std::swap(mPadRows, other.mPadRows);
+    std::swap(mMemoryResource, other.mMemoryResource);
+}
+
+void WPngImage::move(WPngImage& rhs)
+{
+    if(this != &rhs)
+    {
+        releasePixelData();
+        mData = rhs.mData;
+        mWidth = rhs.mWidth;
+        mHeight = rhs.mHeight;
+        mPadRows = rhs.mPadRows;
+        mMemoryResource = rhs.mMemoryResource;
+        rhs.mData = 0;
+        rhs.mWidth = rhs.mHeight = 0;
+    }
+}
+
+// Pixel data whose pointers have been given out can't be shared, since it may be modified
+// through them.
+WPngImage::PngDataBase* WPngImage::sharePixelData() const
+{
+    if(!mData) return 0;
+    if(mData->mPixelDataExposed) return mData->createCopy();
+    ++mData->mReferencesAmount;
+    return mData;
+}
+
+// Called before the pixel data is modified. Returns false if there's no pixel data, or if it
+// refers to a read-only external buffer, in which case it must not be modified.
+bool WPngImage::detachPixelData()
+{
+    if(mData && mData->isShared())
+    {
+        PngDataBase* data = mData->createCopy();
+        releasePixelData();
+        mData = data;
+    }
+    return mData && !mData->hasReadOnlyPixels();
+}
+
+void WPngImage::releasePixelData()
+{
+    if(mData && --mData->mReferencesAmount == 0)
+        delete mData;
+    mData = 0;
+}
+
+
+//============================================================================
+// Create a new image
+//============================================================================
+template<typename Pixel_t>
+void WPngImage::newImageWithPixelValue(int width, int height, Pixel_t pixel,
+                                       PixelFormat pixelFormat)
+{
+    releasePixelData();
+    mWidth = mHeight = 0;
+
+    if(width <= 0 || height <= 0)
+        return;
+
+    MemoryResource* resource = mMemoryResource ? mMemoryResource : defaultMemoryResource();
+    switch(pixelFormat)
+    {
+      case kPixelFormat_GA8:
+          mData = new(resource) PngData<PixelG8>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+
+      case kPixelFormat_GA16:
+          mData = new(resource) PngData<PixelG16>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+
+      case kPixelFormat_GAF:
+          mData = new(resource) PngData<PixelGF>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+
+      case kPixelFormat_RGBA8:
+          mData = new(resource) PngData<Pixel8>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+
+      case kPixelFormat_RGBA16:
+          mData = new(resource) PngData<Pixel16>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+
+      case kPixelFormat_RGBAF:
+          mData = new(resource) PngData<PixelF>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+
+      case kPixelFormat_GAF_Planar:
+          mData = new(resource) PlanarPngData<PixelGF>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+
+      case kPixelFormat_RGBAF_Planar:
+          mData = new(resource) PlanarPngData<PixelF>
+              (width, height, pixel, pixelFormat, mPadRows, resource);
+          break;
+    }
+
+    if(mData)
+    {
+        mWidth = width;
+        mHeight = height;
+    }
+}
+
+void WPngImage::newImage(int width, int height, PixelFormat pixelFormat)
+{
+    newImageWithPixelValue(width, height, Pixel8(), pixelFormat);
+}
+
+void WPngImage::newImage(int width, int height, Pixel8 pixel, PixelFormat pixelFormat)
+{
+    newImageWithPixelValue(width, height, pixel, pixelFormat);
+}
+
+void WPngImage::newImage(int width, int height, Pixel16 pixel, PixelFormat pixelFormat)
+{
+    newImageWithPixelValue(width, height, pixel, pixelFormat);
+}
+
+void WPngImage::newImage(int width, int height, PixelF pixel, PixelFormat pixelFormat)
+{
+    newImageWithPixelValue(width, height, pixel, pixelFormat);
+}
+
+// The image refers to the given pixels instead of a copy of them. The planar pixel formats
+// can't be used, since their components aren't stored as pixels.
+bool WPngImage::adoptExternalBuffer(void* pixels, int width, int height,
+                                    std::size_t rowStride, PixelFormat pixelFormat)
+{
+    return adoptPixelBuffer(pixels, width, height, rowStride, pixelFormat, false);
+}
+
+// The functions which would modify the pixels of a read-only buffer do nothing instead.
+bool WPngImage::adoptExternalBuffer(const void* pixels, int width, int height,
+                                    std::size_t rowStride, PixelFormat pixelFormat)
+{
+    return adoptPixelBuffer(const_cast<void*>(pixels), width, height, rowStride, pixelFormat,
+                            true);
+}
+
+bool WPngImage::adoptPixelBuffer(void* pixels, int width, int height, std::size_t rowStride,
+                                 PixelFormat pixelFormat, bool readOnly)
+{
+    if(!pixels || width <= 0 || height <= 0 || rowStride < std::size_t(width))
+        return false;
+
+    MemoryResource* resource = mMemoryResource ? mMemoryResource : defaultMemoryResource();
+    PngDataBase* data = 0;
+    switch(pixelFormat)
+    {
+      case kPixelFormat_GA8:
+          data = new(resource) PngData<PixelG8>
+              (static_cast<PixelG8*>(pixels), width, height, rowStride, readOnly, pixelFormat,
+               mPadRows, resource);
+          break;
+
+      case kPixelFormat_GA16:
+          data = new(resource) PngData<PixelG16>
+              (static_cast<PixelG16*>(pixels), width, height, rowStride, readOnly, pixelFormat,
+               mPadRows, resource);
+          break;
+
+      case kPixelFormat_GAF:
+          data = new(resource) PngData<PixelGF>
+              (static_cast<PixelGF*>(pixels), width, height, rowStride, readOnly, pixelFormat,
+               mPadRows, resource);
+          break;
+
+      case kPixelFormat_RGBA8:
+          data = new(resource) PngData<Pixel8>
+              (static_cast<Pixel8*>(pixels), width, height, rowStride, readOnly, pixelFormat,
+               mPadRows, resource);
+          break;
+
+      case kPixelFormat_RGBA16:
+          data = new(resource) PngData<Pixel16>
+              (static_cast<Pixel16*>(pixels), width, height, rowStride, readOnly, pixelFormat,
+               mPadRows, resource);
+          break;
+
+      case kPixelFormat_RGBAF:
+          data = new(resource) PngData<PixelF>
+              (static_cast<PixelF*>(pixels), width, height, rowStride, readOnly, pixelFormat,
+               mPadRows, resource);
+          break;
+
+      case kPixelFormat_GAF_Planar:
+      case kPixelFormat_RGBAF_Planar:
+          return false;
+    }
+    if(!data) return false;
+
+    releasePixelData();
+    mData = data;
+    mWidth = width;
+    mHeight = height;
+    return true;
+}
+
+bool WPngImage::hasExternalBuffer() const
+{
+    return mData && mData->hasExternalPixels();
+}
+
+bool WPngImage::isReadOnly() const
+{
+    return mData && mData->hasReadOnlyPixels();
+}
+
+
+//============================================================================
+// Image information getters
+//============================================================================
+WPngImage::PixelFormat WPngImage::currentPixelFormat() const
+{
+    return mData ? mData->mPixelFormat : kPixelFormat_RGBA8;
+}
+
+WPngImage::PngFileFormat WPngImage::originalFileFormat() const
+{
+    return mData ? mData->mPngFileFormat : kPngFileFormat_none;
+}
+
+WPngImage::PngFileFormat WPngImage::getClosestMatchFileFormat(PixelFormat pixelFormat)
+{
+    switch(pixelFormat)
+    {
+      case WPngImage::kPixelFormat_GA8: return WPngImage::kPngFileFormat_GA8;
+      case WPngImage::kPixelFormat_GA16:
+      case WPngImage::kPixelFormat_GAF:
+      case WPngImage::kPixelFormat_GAF_Planar: return WPngImage::kPngFileFormat_GA16;
+      case WPngImage::kPixelFormat_RGBA8: return WPngImage::kPngFileFormat_RGBA8;
+      case WPngImage::kPixelFormat_RGBA16:
+      case WPngImage::kPixelFormat_RGBAF:
+      case WPngImage::kPixelFormat_RGBAF_Planar: return WPngImage::kPngFileFormat_RGBA16;
+    }
+    return WPngImage::kPngFileFormat_RGBA8;
+}
+
+WPngImage::PngFileFormat WPngImage::getFileFormat
+(PngWriteConvert conversion, PngFileFormat originalFileFormat, PixelFormat currentPixelFormat)
+{
+    if(conversion == WPngImage::kPngWriteConvert_closestMatch)
+        return getClosestMatchFileFormat(currentPixelFormat);
+    return originalFileFormat;
+}
+
+void WPngImage::setFileFormat(PngFileFormat newFormat)
+{
+    detachPixelData();
+    if(mData) mData->mPngFileFormat = newFormat;
+}
+
+void WPngImage::setFileFormat(PngWriteConvert conversion)
+{
+    detachPixelData();
+    if(mData) mData->mPngFileFormat = getFileFormat(conversion, mData->mPngFileFormat, currentPixelFormat());
+}
+
+bool WPngImage::isGrayscalePixelFormat() const
+{
+    const PixelFormat pixelFormat = currentPixelFormat();
+    return (pixelFormat == kPixelFormat_GA8 ||
+            pixelFormat == kPixelFormat_GA16 ||
+            pixelFormat == kPixelFormat_GAF ||
+            pixelFormat == kPixelFormat_GAF_Planar);
+}
+
+bool WPngImage::isRGBAPixelFormat() const
+{
+    const PixelFormat pixelFormat = currentPixelFormat();
+    return (pixelFormat == kPixelFormat_RGBA8 ||
+            pixelFormat == kPixelFormat_RGBA16 ||
+            pixelFormat == kPixelFormat_RGBAF ||
+            pixelFormat == kPixelFormat_RGBAF_Planar);
+}
+
+bool WPngImage::is8BPCPixelFormat() const
+{
+    const PixelFormat pixelFormat = currentPixelFormat();
+    return (pixelFormat == kPixelFormat_RGBA8 ||
+            pixelFormat == kPixelFormat_GA8);
+}
+
+bool WPngImage::is16BPCPixelFormat() const
+{
+    const PixelFormat pixelFormat = currentPixelFormat();
+    return (pixelFormat == kPixelFormat_RGBA16 ||
+            pixelFormat == kPixelFormat_GA16);
+}
+
+bool WPngImage::isFloatPixelFormat() const
+{
+    const PixelFormat pixelFormat = currentPixelFormat();
+    return (pixelFormat == kPixelFormat_RGBAF ||
+            pixelFormat == kPixelFormat_GAF ||
+            pixelFormat == kPixelFormat_RGBAF_Planar ||
+            pixelFormat == kPixelFormat_GAF_Planar);
+}
+
+bool WPngImage::isPlanarPixelFormat() const
+{
+    const PixelFormat pixelFormat = currentPixelFormat();
+    return (pixelFormat == kPixelFormat_RGBAF_Planar ||
+            pixelFormat == kPixelFormat_GAF_Planar);
+}
+
+bool WPngImage::allPixelsHaveFullAlpha() const
+{
+    return mData->allPixelsHaveFullAlpha();
+}
+
+// Copies the pixels into new pixel data of the given format, laid out according to the
+// current row padding setting and allocated from the current memory resource.
+void WPngImage::replacePixelData(PixelFormat newPixelFormat)
+{
+    WPngImage newImage;
+    newImage.mPadRows = mPadRows;
+    newImage.mMemoryResource = mMemoryResource;
+    newImage.newImage(width(), height(), Pixel8(), newPixelFormat);
+    mData->copyAllPixelsTo(newImage.mData);
+    newImage.mData->mPngFileFormat = mData->mPngFileFormat;
+    this->swap(newImage);
+}
+
+void WPngImage::convertToPixelFormat(PixelFormat newPixelFormat)
+{
+    if(mData && newPixelFormat != mData->mPixelFormat)
+        replacePixelData(newPixelFormat);
+}
+
+void WPngImage::setPaddedRows(bool padRows)
+{
+    if(padRows == mPadRows) return;
+    mPadRows = padRows;
+    if(mData) replacePixelData(mData->mPixelFormat);
+}
+
+std::size_t WPngImage::rowStride() const
+{
+    return mData ? mData->mLayout.stride : 0;
+}
+
+void WPngImage::setDefaultMemoryResource(MemoryResource* resource)
+{
+    gDefaultMemoryResource = resource;
+}
+
+WPngImage::MemoryResource* WPngImage::defaultMemoryResource()
+{
+    return gDefaultMemoryResource;
+}
+
+// Existing pixel data is moved to the new resource.
+void WPngImage::setMemoryResource(MemoryResource* resource)
+{
+    mMemoryResource = resource;
+    if(mData && mData->mMemoryResource !=
+       (resource ? resource : defaultMemoryResource()))
+        replacePixelData(mData->mPixelFormat);
+}
+
+
+//============================================================================
+// Get and set pixels
+//============================================================================
+WPngImage::Pixel8 WPngImage::get8(int x, int y) const
+{
+    if(x < 0 || x >= mWidth || y < 0 || y >= mHeight || !mData)
+        return Pixel8(0, 0, 0, 0);
+    return mData->getPixel8(std::size_t(y * mWidth + x));
+}
+
+WPngImage::Pixel16 WPngImage::get16(int x, int y) const
+{
+    if(x < 0 || x >= mWidth || y < 0 || y >= mHeight || !mData)
+        return Pixel16(0, 0, 0, 0);
+    return mData->getPixel16(std::size_t(y * mWidth + x));
+}
+
+WPngImage::PixelF WPngImage::getF(int x, int y) const
+{
+    if(x < 0 || x >= mWidth || y < 0 || y >= mHeight || !mData)
+        return PixelF(0, 0, 0, 0);
+    return mData->getPixelF(std::size_t(y * mWidth + x));
+}
+
+void WPngImage::set(int x, int y, Pixel8 pixel)
+{
+    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && detachPixelData())
+        mData->setPixel(std::size_t(y * mWidth + x), pixel);
+}
+
+void WPngImage::set(int x, int y, Pixel16 pixel)
+{
+    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && detachPixelData())
+        mData->setPixel(std::size_t(y * mWidth + x), pixel);
+}
+
+void WPngImage::set(int x, int y, PixelF pixel)
+{
+    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && detachPixelData())
+        mData->setPixel(std::size_t(y * mWidth + x), pixel);
+}
+
+void WPngImage::fill(Pixel8 pixel)
+{
+    if(detachPixelData()) mData->fill(pixel);
+}
+
+void WPngImage::fill(Pixel16 pixel)
+{
+    if(detachPixelData()) mData->fill(pixel);
+}
+
+void WPngImage::fill(PixelF pixel)
+{
+    if(detachPixelData()) mData->fill(pixel);
+}
+
+void WPngImage::transform(TransformFunc8 func)
+{
+    transform(func, 1U);
+}
+
+void WPngImage::transform(TransformFunc8 func, unsigned threadsAmount)
+{
+    if(detachPixelData()) mData->transform(func, threadsAmount);
+}
+
+void WPngImage::transform(TransformFunc16 func)
+{
+    transform(func, 1U);
+}
+
+void WPngImage::transform(TransformFunc16 func, unsigned threadsAmount)
+{
+    if(detachPixelData()) mData->transform(func, threadsAmount);
+}
+
+void WPngImage::transform(TransformFuncF func)
+{
+    transform(func, 1U);
+}
+
+void WPngImage::transform(TransformFuncF func, unsigned threadsAmount)
+{
+    if(detachPixelData()) mData->transform(func, threadsAmount);
+}
+
+void WPngImage::transform(TransformFunc8 func, WPngImage& dest) const
+{
+    transform(func, dest, 1U);
+}
+
+void WPngImage::transform(TransformFunc8 func, WPngImage& dest, unsigned threadsAmount) const
+{
+    if(mData)
+    {
+        if(dest.width() != width() || dest.height() != height())
+            dest.newImage(width(), height(),
+                          dest.mData ? dest.currentPixelFormat() : currentPixelFormat());
+        if(dest.detachPixelData())
+            mData->transform(func, dest, threadsAmount);
+    }
+}
+
+void WPngImage::transform(TransformFunc16 func, WPngImage& dest) const
+{
+    transform(func, dest, 1U);
+}
+
+void WPngImage::transform(TransformFunc16 func, WPngImage& dest, unsigned threadsAmount) const
+{
+    if(mData)
+    {
+        if(dest.width() != width() || dest.height() != height())
+            dest.newImage(width(), height(),
+                          dest.mData ? dest.currentPixelFormat() : currentPixelFormat());
+        if(dest.detachPixelData())
+            mData->transform(func, dest, threadsAmount);
+    }
+}
+
+void WPngImage::transform(TransformFuncF func, WPngImage& dest) const
+{
+    transform(func, dest, 1U);
+}
+
+void WPngImage::transform(TransformFuncF func, WPngImage& dest, unsigned threadsAmount) const
+{
+    if(mData)
+    {
+        if(dest.width() != width() || dest.height() != height())
+            dest.newImage(width(), height(),
+                          dest.mData ? dest.currentPixelFormat() : currentPixelFormat());
+        if(dest.detachPixelData())
+            mData->transform(func, dest, threadsAmount);
+    }
+}
+
+// Used by the transform and forEachPixel templates for the pixel formats whose pixels
+// aren't stored as the requested type. The row must be valid.
+void WPngImage::readPixelRow(int y, Pixel8* dest) const
+{
+    mData->getPixels(std::size_t(y) * mWidth, std::size_t(mWidth), dest);
+}
+
+void WPngImage::readPixelRow(int y, Pixel16* dest) const
+{
+    mData->getPixels(std::size_t(y) * mWidth, std::size_t(mWidth), dest);
+}
+
+void WPngImage::readPixelRow(int y, PixelF* dest) const
+{
+    mData->getPixels(std::size_t(y) * mWidth, std::size_t(mWidth), dest);
+}
+
+void WPngImage::writePixelRow(int y, const Pixel8* src)
+{
+    mData->setPixels(std::size_t(y) * mWidth, std::size_t(mWidth), src);
+}
+
+void WPngImage::writePixelRow(int y, const Pixel16* src)
+{
+    mData->setPixels(std::size_t(y) * mWidth, std::size_t(mWidth), src);
+}
+
+void WPngImage::writePixelRow(int y, const PixelF* src)
+{
+    mData->setPixels(std::size_t(y) * mWidth, std::size_t(mWidth), src);
+}
+
+void WPngImage::readPixelRow(int y, PixelGA8* dest) const
+{
+    mData->getPixels(std::size_t(y) * mWidth, std::size_t(mWidth), dest);
+}
+
+void WPngImage::readPixelRow(int y, PixelGA16* dest) const
+{
+    mData->getPixels(std::size_t(y) * mWidth, std::size_t(mWidth), dest);
+}
+
+void WPngImage::readPixelRow(int y, PixelGAF* dest) const
+{
+    mData->getPixels(std::size_t(y) * mWidth, std::size_t(mWidth), dest);
+}
+
+void WPngImage::writePixelRow(int y, const PixelGA8* src)
+{
+    mData->setPixels(std::size_t(y) * mWidth, std::size_t(mWidth), src);
+}
+
+void WPngImage::writePixelRow(int y, const PixelGA16* src)
+{
+    mData->setPixels(std::size_t(y) * mWidth, std::size_t(mWidth), src);
+}
+
+void WPngImage::writePixelRow(int y, const PixelGAF* src)
+{
+    mData->setPixels(std::size_t(y) * mWidth, std::size_t(mWidth), src);
+}
+
+void WPngImage::pixelsWereModified()
+{
+    mData->mOpacity = PngDataBase::kOpacity_unknown;
+}
+
+struct WPngImage::RowsJobRunner
+{
+    RowsJob* rowsJob;
+    int height, rowsPerJob;
+
+    void operator()(std::size_t jobIndex, unsigned) const
+    {
+        const int beginY = int(jobIndex) * rowsPerJob;
+        rowsJob->transformRows(beginY, std::min(beginY + rowsPerJob, height));
+    }
+};
+
+// The rows are split into bands of about the same amount of pixels as the chunks used by
+// the transform functions.
+void WPngImage::runRowsJob(RowsJob& rowsJob, unsigned threadsAmount)
+{
+    threadsAmount = getThreadsAmount(threadsAmount);
+    if(threadsAmount == 1)
+    {
+        rowsJob.transformRows(0, mHeight);
+        return;
+    }
+
+    const std::size_t chunkSize =
+        getPixelChunkSize(std::size_t(mWidth) * std::size_t(mHeight), threadsAmount);
+    RowsJobRunner job;
+    job.rowsJob = &rowsJob;
+    job.height = mHeight;
+    job.rowsPerJob = int(std::min(std::size_t(mHeight), (chunkSize + mWidth - 1) / mWidth));
+    runJobs(std::size_t((mHeight + job.rowsPerJob - 1) / job.rowsPerJob), threadsAmount, job);
+}
+
+// These are called by the loading functions. They assume the index is valid.
+void WPngImage::setPixel(std::size_t index, const Pixel8& p)
+{
+    mData->setPixel(index, p);
+}
+
+void WPngImage::setPixel(std::size_t index, const Pixel16& p)
+{
+    mData->setPixel(index, p);
+}
+
+
+//============================================================================
+// Image transformations
+//============================================================================
+void WPngImage::flipHorizontally()
+{
+    if(detachPixelData()) mData->flipHorizontally(mWidth, mHeight);
+}
+
+void WPngImage::flipVertically()
+{
+    if(detachPixelData()) mData->flipVertically(mWidth, mHeight);
+}
+
+void WPngImage::rotate180()
+{
+    if(detachPixelData()) mData->rotate180(mWidth, mHeight);
+}
+
+void WPngImage::rotate90cw()
+{
+    if(detachPixelData())
+    {
+        if(mWidth == mHeight)
+        {
+            mData->rotate90cwSquare(mWidth);
+        }
+        else
+        {
+            mData->rotate90cwNonsquare(mWidth, mHeight);
+            std::swap(mWidth, mHeight);
+        }
+    }
+}
+
+void WPngImage::rotate90ccw()
+{
+    if(detachPixelData())
+    {
+        if(mWidth == mHeight)
+        {
+            mData->rotate90ccwSquare(mWidth);
+        }
+        else
+        {
+            mData->rotate90ccwNonsquare(mWidth, mHeight);
+            std::swap(mWidth, mHeight);
+        }
+    }
+}
+
+void WPngImage::translate(int xOffset, int yOffset)
+{
+    if(detachPixelData()) mData->translate(mWidth, mHeight, xOffset, yOffset);
+}
+
+void WPngImage::translate(int xOffset, int yOffset, Pixel8 pixel)
+{
+    if(detachPixelData()) mData->translate(mWidth, mHeight, xOffset, yOffset, pixel);
+}
+
+void WPngImage::translate(int xOffset, int yOffset, Pixel16 pixel)
+{
+    if(detachPixelData()) mData->translate(mWidth, mHeight, xOffset, yOffset, pixel);
+}
+
+void WPngImage::translate(int xOffset, int yOffset, PixelF pixel)
+{
+    if(detachPixelData()) mData->translate(mWidth, mHeight, xOffset, yOffset, pixel);
+}
+
+
+//============================================================================
+// Drawing functions
+//============================================================================
+void WPngImage::drawPixel(int x, int y, Pixel8 pixel)
+{
+    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && detachPixelData())
+        mData->drawPixel(std::size_t(y*width() + x), pixel);
+}
+
+void WPngImage::drawPixel(int x, int y, Pixel16 pixel)
+{
+    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && detachPixelData())
+        mData->drawPixel(std::size_t(y*width() + x), pixel);
+}
+
+void WPngImage::drawPixel(int x, int y, PixelF pixel)
+{
+    if(x >= 0 && x < mWidth && y >= 0 && y < mHeight && detachPixelData())
+        mData->drawPixel(std::size_t(y*width() + x), pixel);
+}
+
+void WPngImage::putImage(int destX, int destY, const WPngImage& src,
+                         int srcX, int srcY, int srcWidth, int srcHeight, bool useBlending)
+{
+    if(!mData || !src.mData || srcWidth <= 0 || srcHeight <= 0 ||
+       width() <= 0 || height() <= 0 || src.width() <= 0 || src.height() <= 0 ||
+       srcX >= src.width() || srcY >= src.height() ||
+       srcX + srcWidth <= 0 || srcY + srcHeight <= 0)
+        return;
+
+    if(srcX < 0) { destX -= srcX; srcWidth += srcX; srcX = 0; }
+    if(srcY < 0) { destY -= srcY; srcHeight += srcY; srcY = 0; }
+    if(srcX + srcWidth > src.width()) srcWidth = src.width() - srcX;
+    if(srcY + srcHeight > src.height()) srcHeight = src.height() - srcY;
+
+    if(destX >= width() || destY >= height() ||
+       destX + srcWidth <= 0 || destY + srcHeight <= 0)
+        return;
+
+    if(destX < 0) { srcX -= destX; srcWidth += destX; destX = 0; }
+    if(destY < 0) { srcY -= destY; srcHeight += destY; destY = 0; }
+    if(destX + srcWidth > width()) srcWidth = width() - destX;
+    if(destY + srcHeight > height()) srcHeight = height() - destY;
+
+    if(!detachPixelData()) return;
+    for(int lineInd = 0; lineInd < srcHeight; ++lineInd)
+    {
+        const int srcStartInd = (srcY + lineInd) * src.width() + srcX;
+        const int destStartInd = (destY + lineInd) * width() + destX;
+        src.mData->copyPixelLineTo(std::size_t(srcStartInd), srcWidth,
+                                   mData, std::size_t(destStartInd), useBlending);
+    }
+}
+
+void WPngImage::putImage(int destX, int destY, const WPngImage& src)
+{
+    putImage(destX, destY, src, 0, 0, src.width(), src.height(), false);
+}
+
+void WPngImage::putImage(int destX, int destY, const WPngImage& src,
+                         int srcX, int srcY, int srcWidth, int srcHeight)
+{
+    putImage(destX, destY, src, srcX, srcY, srcWidth, srcHeight, false);
+}
+
+void WPngImage::drawImage(int destX, int destY, const WPngImage& src)
+{
+    putImage(destX, destY, src, 0, 0, src.width(), src.height(), true);
+}
+
+void WPngImage::drawImage(int destX, int destY, const WPngImage& src,
+                          int srcX, int srcY, int srcWidth, int srcHeight)
+{
+    putImage(destX, destY, src, srcX, srcY, srcWidth, srcHeight, true);
+}
+
+template<typename Pixel_t>
+void WPngImage::addHorLine(int x, int y, int length, const Pixel_t& pixel, bool useBlending)
+{
+    if(!mData || length == 0 || y < 0 || y >= height()) return;
+    if(length < 0) { length = -length; x = x - length + 1; }
+    if(x >= width()) return;
+    if(x < 0) { length += x; x = 0; }
+    if(length <= 0) return;
+    if(x + length > width()) { length = width() - x; }
+    if(!detachPixelData()) return;
+    mData->addLine(std::size_t(y*width() + x), std::size_t(length), 1, pixel, useBlending);
+}
+
+template<typename Pixel_t>
+void WPngImage::addVertLine(int x, int y, int length, const Pixel_t& pixel, bool useBlending)
+{
+    if(!mData || length == 0 || x < 0 || x >= width()) return;
+    if(length < 0) { length = -length; y = y - length + 1; }
+    if(y >= height()) return;
+    if(y < 0) { length += y; y = 0; }
+    if(length <= 0) return;
+    if(y + length > height()) { length = height() - y; }
+    if(!detachPixelData()) return;
+    mData->addLine(std::size_t(y*width() + x), std::size_t(length), std::size_t(width()), pixel,
+                   useBlending);
+}
+
+void WPngImage::putHorLine(int x, int y, int length, Pixel8 pixel)
+{
+    addHorLine(x, y, length, pixel, false);
+}
+
+void WPngImage::putHorLine(int x, int y, int length, Pixel16 pixel)
+{
+    addHorLine(x, y, length, pixel, false);
+}
+
+void WPngImage::putHorLine(int x, int y, int length, PixelF pixel)
+{
+    addHorLine(x, y, length, pixel, false);
+}
+
+void WPngImage::putVertLine(int x, int y, int length, Pixel8 pixel)
+{
+    addVertLine(x, y, length, pixel, false);
+}
+
+void WPngImage::putVertLine(int x, int y, int length, Pixel16 pixel)
+{
+    addVertLine(x, y, length, pixel, false);
+}
+
+void WPngImage::putVertLine(int x, int y, int length, PixelF pixel)
+{
+    addVertLine(x, y, length, pixel, false);
+}
+
+void WPngImage::drawHorLine(int x, int y, int length, Pixel8 pixel)
+{
+    addHorLine(x, y, length, pixel, true);
+}
+
+void WPngImage::drawHorLine(int x, int y, int length, Pixel16 pixel)
+{
+    addHorLine(x, y, length, pixel, true);
+}
+
+void WPngImage::drawHorLine(int x, int y, int length, PixelF pixel)
+{
+    addHorLine(x, y, length, pixel, true);
+}
+
+void WPngImage::drawVertLine(int x, int y, int length, Pixel8 pixel)
+{
+    addVertLine(x, y, length, pixel, true);
+}
+
+void WPngImage::drawVertLine(int x, int y, int length, Pixel16 pixel)
+{
+    addVertLine(x, y, length, pixel, true);
+}
+
+void WPngImage::drawVertLine(int x, int y, int length, PixelF pixel)
+{
+    addVertLine(x, y, length, pixel, true);
+}
+
+template<typename Pixel_t>
 void WPngImage::addRect(int x, int y, int rectWidth, int rectHeight, const Pixel_t& pixel,
                         bool filled, bool useBlending)
 {
-    if(!mData || rectWidth == 0 || rectHeight == 0) return;
-    if(rectWidth < 0) { rectWidth = -rectWidth; x = x - rectWidth + 1; }
-    if(rectHeight < 0) { rectHeight = -rectHeight; y = y - rectHeight + 1; }
-    if(rectWidth == 1) return addVertLine(x, y, rectHeight, pixel, useBlending);
-    if(rectHeight == 1) return addHorLine(x, y, rectWidth, pixel, useBlending);
+    if(!mData || rectWidth == 0 || rectHeight == 0) return;
+    if(rectWidth < 0) { rectWidth = -rectWidth; x = x - rectWidth + 1; }
+    if(rectHeight < 0) { rectHeight = -rectHeight; y = y - rectHeight + 1; }
+    if(rectWidth == 1) return addVertLine(x, y, rectHeight, pixel, useBlending);
+    if(rectHeight == 1) return addHorLine(x, y, rectWidth, pixel, useBlending);
+
+    if(!filled)
+    {
+        addHorLine(x, y, rectWidth, pixel, useBlending);
+        addHorLine(x, y + rectHeight - 1, rectWidth, pixel, useBlending);
+        addVertLine(x, y + 1, rectHeight - 2, pixel, useBlending);
+        addVertLine(x + rectWidth - 1, y + 1, rectHeight - 2, pixel, useBlending);
+    }
+    else
+    {
+        if(x >= width() || y >= height()) return;
+        if(x < 0) { rectWidth += x; x = 0; }
+        if(y < 0) { rectHeight += y; y = 0; }
+        if(rectWidth <= 0 || rectHeight <= 0) return;
+        if(x + rectWidth > width()) { rectWidth = width() - x; }
+        if(y + rectHeight > height()) { rectHeight = height() - y; }
+
+        if(!detachPixelData()) return;
+        const std::size_t indexBegin = std::size_t(y * width() + x);
+        const std::size_t step = std::size_t(width());
+
+        if(rectWidth == 1)
+        {
+            mData->addLine(indexBegin, std::size_t(rectHeight), step, pixel, useBlending);
+        }
+        else
+        {
+            const std::size_t indexEnd = indexBegin + step * std::size_t(rectHeight);
+            const std::size_t length = std::size_t(rectWidth);
+
+            for(std::size_t index = indexBegin; index < indexEnd; index += step)
+                mData->addLine(index, length, 1, pixel, useBlending);
+        }
+    }
+}
+
+void WPngImage::putRect(int x, int y, int width, int height, Pixel8 pixel, bool filled)
+{
+    addRect(x, y, width, height, pixel, filled, false);
+}
+
+void WPngImage::putRect(int x, int y, int width, int height, Pixel16 pixel, bool filled)
+{
+    addRect(x, y, width, height, pixel, filled, false);
+}
+
+void WPngImage::putRect(int x, int y, int width, int height, PixelF pixel, bool filled)
+{
+    addRect(x, y, width, height, pixel, filled, false);
+}
+
+void WPngImage::drawRect(int x, int y, int width, int height, Pixel8 pixel, bool filled)
+{
+    addRect(x, y, width, height, pixel, filled, true);
+}
+
+void WPngImage::drawRect(int x, int y, int width, int height, Pixel16 pixel, bool filled)
+{
+    addRect(x, y, width, height, pixel, filled, true);
+}
+
+void WPngImage::drawRect(int x, int y, int width, int height, PixelF pixel, bool filled)
+{
+    addRect(x, y, width, height, pixel, filled, true);
+}
+
+void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight)
+{
+    resizeCanvas(newOriginX, newOriginY, newWidth, newHeight, Pixel8(0, 0, 0, 0));
+}
+
+void WPngImage::manageCanvasResize(WPngImage& newImage, int newOriginX, int newOriginY)
+{
+    newImage.putImage(-newOriginX, -newOriginY, *this);
+    newImage.mData->mPngFileFormat = mData->mPngFileFormat;
+    this->swap(newImage);
+}
+
+void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight,
+                             Pixel8 pixel)
+{
+    if(mData && (newOriginX != 0 || newOriginY != 0 ||
+                 newWidth != width() || newHeight != height()))
+    {
+        WPngImage newImage;
+        newImage.mPadRows = mPadRows;
+        newImage.mMemoryResource = mMemoryResource;
+        newImage.newImage(newWidth, newHeight, pixel, currentPixelFormat());
+        manageCanvasResize(newImage, newOriginX, newOriginY);
+    }
+}
+
+void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight,
+                             Pixel16 pixel)
+{
+    if(mData && (newOriginX != 0 || newOriginY != 0 ||
+                 newWidth != width() || newHeight != height()))
+    {
+        WPngImage newImage;
+        newImage.mPadRows = mPadRows;
+        newImage.mMemoryResource = mMemoryResource;
+        newImage.newImage(newWidth, newHeight, pixel, currentPixelFormat());
+        manageCanvasResize(newImage, newOriginX, newOriginY);
+    }
+}
+
+void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight,
+                             PixelF pixel)
+{
+    if(mData && (newOriginX != 0 || newOriginY != 0 ||
+                 newWidth != width() || newHeight != height()))
+    {
+        WPngImage newImage;
+        newImage.mPadRows = mPadRows;
+        newImage.mMemoryResource = mMemoryResource;
+        newImage.newImage(newWidth, newHeight, pixel, currentPixelFormat());
+        manageCanvasResize(newImage, newOriginX, newOriginY);
+    }
+}
+
+void WPngImage::premultiplyAlpha()
+{
+    if(detachPixelData()) mData->premultiplyAlpha();
+}
+
+const WPngImage::Pixel8* WPngImage::getRawPixelData8() const
+{
+    return mData && mData->mPixelFormat == kPixelFormat_RGBA8 ?
+        &(static_cast<const PngData<Pixel8>*>(mData)->mPixelData[0]) : 0;
+}
+
+WPngImage::Pixel8* WPngImage::getRawPixelData8()
+{
+    if(!mData || mData->mPixelFormat != kPixelFormat_RGBA8) return 0;
+    if(!detachPixelData()) return 0;
+    mData->mPixelDataExposed = true;
+    return &(static_cast<PngData<Pixel8>*>(mData)->mPixelData[0]);
+}
+
+const WPngImage::Pixel16* WPngImage::getRawPixelData16() const
+{
+    return mData && mData->mPixelFormat == kPixelFormat_RGBA16 ?
+        &(static_cast<const PngData<Pixel16>*>(mData)->mPixelData[0]) : 0;
+}
+
+WPngImage::Pixel16* WPngImage::getRawPixelData16()
+{
+    if(!mData || mData->mPixelFormat != kPixelFormat_RGBA16) return 0;
+    if(!detachPixelData()) return 0;
+    mData->mPixelDataExposed = true;
+    return &(static_cast<PngData<Pixel16>*>(mData)->mPixelData[0]);
+}
+
+const WPngImage::PixelF* WPngImage::getRawPixelDataF() const
+{
+    return mData && mData->mPixelFormat == kPixelFormat_RGBAF ?
+        &(static_cast<const PngData<PixelF>*>(mData)->mPixelData[0]) : 0;
+}
+
+WPngImage::PixelF* WPngImage::getRawPixelDataF()
+{
+    if(!mData || mData->mPixelFormat != kPixelFormat_RGBAF) return 0;
+    if(!detachPixelData()) return 0;
+    mData->mPixelDataExposed = true;
+    return &(static_cast<PngData<PixelF>*>(mData)->mPixelData[0]);
+}
+
+// The channels are r, g, b, a for kPixelFormat_RGBAF_Planar and g, a for
+// kPixelFormat_GAF_Planar.
+const WPngImage::Float* WPngImage::getRawPlaneData(unsigned channel) const
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return 0;
+
+    switch(mData->mPixelFormat)
+    {
+      case kPixelFormat_GAF_Planar:
+          return channel < 2 ?
+              &static_cast<const PlanarPngData<PixelGF>*>(mData)->mPlanes[channel][0] : 0;
+      case kPixelFormat_RGBAF_Planar:
+          return channel < 4 ?
+              &static_cast<const PlanarPngData<PixelF>*>(mData)->mPlanes[channel][0] : 0;
+      default:
+          return 0;
+    }
+}
+
+WPngImage::Float* WPngImage::getRawPlaneData(unsigned channel)
+{
+    if(!static_cast<const WPngImage*>(this)->getRawPlaneData(channel)) return 0;
+    if(!detachPixelData()) return 0;
+    mData->mPixelDataExposed = true;
+    return const_cast<Float*>(static_cast<const WPngImage*>(this)->getRawPlaneData(channel));
+}
+
+// Used by rows() and rowSpan(). The gray pixel data is given as the public gray pixel types,
+// which are the base classes of the ones used internally.
+const void* WPngImage::rawPixelData(PixelFormat pixelFormat) const
+{
+    if(!mData || mData->mPixelFormat != pixelFormat || mWidth == 0 || mHeight == 0) return 0;
+
+    switch(pixelFormat)
+    {
+      case kPixelFormat_GA8:
+          return static_cast<const PixelGA8*>
+              (&static_cast<const PngData<PixelG8>*>(mData)->mPixelData[0]);
+      case kPixelFormat_GA16:
+          return static_cast<const PixelGA16*>
+              (&static_cast<const PngData<PixelG16>*>(mData)->mPixelData[0]);
+      case kPixelFormat_GAF:
+          return static_cast<const PixelGAF*>
+              (&static_cast<const PngData<PixelGF>*>(mData)->mPixelData[0]);
+      case kPixelFormat_RGBA8:
+          return &static_cast<const PngData<Pixel8>*>(mData)->mPixelData[0];
+      case kPixelFormat_RGBA16:
+          return &static_cast<const PngData<Pixel16>*>(mData)->mPixelData[0];
+      case kPixelFormat_RGBAF:
+          return &static_cast<const PngData<PixelF>*>(mData)->mPixelData[0];
+      case kPixelFormat_GAF_Planar:
+      case kPixelFormat_RGBAF_Planar:
+          return 0;
+    }
+    return 0;
+}
+
+void* WPngImage::rawPixelData(PixelFormat pixelFormat)
+{
+    if(!static_cast<const WPngImage*>(this)->rawPixelData(pixelFormat)) return 0;
+    if(!detachPixelData()) return 0;
+    mData->mPixelDataExposed = true;
+    return const_cast<void*>(static_cast<const WPngImage*>(this)->rawPixelData(pixelFormat));
+}
+
+
+//============================================================================
+// Pixel arithmetic
+//============================================================================
+namespace
+{
+    // The components are changed to c * mul + add, limited to [low, high]. The parameters
+    // are in the units of the component type. Integer results are rounded.
+    struct AffineParams { Float mul, add, low, high; };
+
+    const Float kNoLimit = std::numeric_limits<Float>::infinity();
+
+    inline Float componentMaxValue(Byte) { return 255.0f; }
+    inline Float componentMaxValue(UInt16) { return 65535.0f; }
+    inline Float componentMaxValue(Float) { return 1.0f; }
+
+    // The parameters are given in the range of PixelF. Float components are limited only as
+    // requested, while integer components are always kept in their range.
+    template<typename CT>
+    AffineParams getAffineParams(Float mul, Float add, Float low, Float high)
+    {
+        const Float maxValue = componentMaxValue(CT());
+        const bool isInteger = std::numeric_limits<CT>::is_integer;
+        AffineParams params;
+        params.mul = mul;
+        params.add = add * maxValue;
+        params.low = isInteger && low < 0.0f ? 0.0f : low * maxValue;
+        params.high = isInteger && high > 1.0f ? maxValue : high * maxValue;
+        return params;
+    }
+
+    template<typename CT>
+    inline CT applyAffine(CT c, const AffineParams& params)
+    {
+        Float value = Float(c) * params.mul + params.add;
+        value = value < params.low ? params.low : value;
+        value = value > params.high ? params.high : value;
+        return CT(value + 0.5f);
+    }
+
+    template<>
+    inline Float applyAffine(Float c, const AffineParams& params)
+    {
+        Float value = c * params.mul + params.add;
+        value = value < params.low ? params.low : value;
+        return value > params.high ? params.high : value;
+    }
+
+    // The alpha components are those at alphaIndex in each pixel. In the interleaved pixel
+    // formats it's the last component. A plane has one component per pixel, which is either
+    // always alpha (an alphaIndex of 0) or never (an alphaIndex of 1).
+    inline bool isAlphaComponent(std::size_t index, unsigned componentsPerPixel,
+                                 unsigned alphaIndex)
+    {
+        return index % componentsPerPixel == alphaIndex;
+    }
+
+#if WPNGIMAGE_SSE2
+    // Selects the alpha components of the pixels in a 16-byte block.
+    template<typename CT>
+    __m128i getAlphaComponentsMask(unsigned componentsPerPixel, unsigned alphaIndex)
+    {
+        Byte mask[16];
+        for(unsigned i = 0; i < 16; ++i)
+            mask[i] = isAlphaComponent(i / sizeof(CT), componentsPerPixel, alphaIndex) ? 255 : 0;
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask));
+    }
+
+    struct AffineVectors
+    {
+        __m128 mul, add, low, high;
+
+        explicit AffineVectors(const AffineParams& params):
+            mul(_mm_set1_ps(params.mul)), add(_mm_set1_ps(params.add)),
+            low(_mm_set1_ps(params.low)), high(_mm_set1_ps(params.high)) {}
+
+        __m128 apply(__m128 value) const
+        {
+            value = _mm_add_ps(_mm_mul_ps(value, mul), add);
+            return _mm_min_ps(_mm_max_ps(value, low), high);
+        }
+
+        __m128i applyRounded(__m128i value) const
+        {
+            return _mm_cvttps_epi32
+                (_mm_add_ps(apply(_mm_cvtepi32_ps(value)), _mm_set1_ps(0.5f)));
+        }
+    };
+
+    inline __m128i applyAffine(__m128i block, const AffineVectors& vectors, Byte)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i low = _mm_unpacklo_epi8(block, zero), high = _mm_unpackhi_epi8(block, zero);
+        return _mm_packus_epi16
+            (_mm_packs_epi32(vectors.applyRounded(_mm_unpacklo_epi16(low, zero)),
+                             vectors.applyRounded(_mm_unpackhi_epi16(low, zero))),
+             _mm_packs_epi32(vectors.applyRounded(_mm_unpacklo_epi16(high, zero)),
+                             vectors.applyRounded(_mm_unpackhi_epi16(high, zero))));
+    }
+
+    // There's no unsigned 32-to-16-bit pack in SSE2, so the values are offset to the signed
+    // range for packing.
+    inline __m128i applyAffine(__m128i block, const AffineVectors& vectors, UInt16)
+    {
+        const __m128i zero = _mm_setzero_si128(), offset = _mm_set1_epi32(32768);
+        return _mm_xor_si128
+            (_mm_packs_epi32
+             (_mm_sub_epi32(vectors.applyRounded(_mm_unpacklo_epi16(block, zero)), offset),
+              _mm_sub_epi32(vectors.applyRounded(_mm_unpackhi_epi16(block, zero)), offset)),
+             _mm_set1_epi16(-32768));
+    }
+
+    inline __m128i applyAffine(__m128i block, const AffineVectors& vectors, Float)
+    {
+        return _mm_castps_si128(vectors.apply(_mm_castsi128_ps(block)));
+    }
+#endif
+
+    // Applies the parameters either to the color or to the alpha components.
+    template<typename CT>
+    void applyAffine(CT* components, std::size_t amount, unsigned componentsPerPixel,
+                     unsigned alphaIndex, bool toAlpha, const AffineParams& params)
+    {
+        std::size_t i = 0;
+#if WPNGIMAGE_SSE2
+        const std::size_t kBlockSize = 16 / sizeof(CT);
+        const AffineVectors vectors(params);
+        const __m128i alphaMask = getAlphaComponentsMask<CT>(componentsPerPixel, alphaIndex);
+        for(; i + kBlockSize <= amount; i += kBlockSize)
+        {
+            __m128i* block = reinterpret_cast<__m128i*>(components + i);
+            const __m128i value = _mm_loadu_si128(block);
+            const __m128i result = applyAffine(value, vectors, CT());
+            _mm_storeu_si128
+                (block, toAlpha ?
+                 _mm_or_si128(_mm_and_si128(alphaMask, result),
+                              _mm_andnot_si128(alphaMask, value)) :
+                 _mm_or_si128(_mm_andnot_si128(alphaMask, result),
+                              _mm_and_si128(alphaMask, value)));
+        }
+#endif
+        for(; i < amount; ++i)
+            if(isAlphaComponent(i, componentsPerPixel, alphaIndex) == toAlpha)
+                components[i] = applyAffine(components[i], params);
+    }
+
+    // The operations are the same as those of the Pixel operators taking another pixel:
+    // the color components are combined with saturation and the alpha components are
+    // averaged.
+    template<typename CT>
+    inline CT combineComponents(CT c1, CT c2, char operation)
+    {
+        switch(operation)
+        {
+          case '+': return addComponents(c1, c2);
+          case '-': return subComponents(c1, c2);
+          case '*': return mulComponents(c1, c2);
+          default: return divComponents(c1, c2);
+        }
+    }
+
+#if WPNGIMAGE_SSE2
+    inline __m128i addBlocks(__m128i b1, __m128i b2, Byte) { return _mm_adds_epu8(b1, b2); }
+    inline __m128i addBlocks(__m128i b1, __m128i b2, UInt16) { return _mm_adds_epu16(b1, b2); }
+    inline __m128i subBlocks(__m128i b1, __m128i b2, Byte) { return _mm_subs_epu8(b1, b2); }
+    inline __m128i subBlocks(__m128i b1, __m128i b2, UInt16) { return _mm_subs_epu16(b1, b2); }
+
+    inline __m128i addBlocks(__m128i b1, __m128i b2, Float)
+    { return _mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(b1), _mm_castsi128_ps(b2))); }
+
+    inline __m128i subBlocks(__m128i b1, __m128i b2, Float)
+    { return _mm_castps_si128(_mm_sub_ps(_mm_castsi128_ps(b1), _mm_castsi128_ps(b2))); }
+
+    // The products of 8-bit components fit in 16 bits, and the ones above 255 are saturated
+    // before packing.
+    inline __m128i mulWords(__m128i w1, __m128i w2)
+    {
+        const __m128i product = _mm_mullo_epi16(w1, w2);
+        const __m128i fits = _mm_cmpeq_epi16(_mm_srli_epi16(product, 8), _mm_setzero_si128());
+        return _mm_or_si128(_mm_and_si128(fits, product),
+                            _mm_andnot_si128(fits, _mm_set1_epi16(255)));
+    }
+
+    inline __m128i mulBlocks(__m128i b1, __m128i b2, Byte)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        return _mm_packus_epi16
+            (mulWords(_mm_unpacklo_epi8(b1, zero), _mm_unpacklo_epi8(b2, zero)),
+             mulWords(_mm_unpackhi_epi8(b1, zero), _mm_unpackhi_epi8(b2, zero)));
+    }
+
+    // A product with non-zero high 16 bits is saturated to 65535.
+    inline __m128i mulBlocks(__m128i b1, __m128i b2, UInt16)
+    {
+        const __m128i high = _mm_mulhi_epu16(b1, b2);
+        return _mm_or_si128(_mm_mullo_epi16(b1, b2),
+                            _mm_andnot_si128(_mm_cmpeq_epi16(high, _mm_setzero_si128()),
+                                             _mm_set1_epi16(-1)));
+    }
+
+    inline __m128i mulBlocks(__m128i b1, __m128i b2, Float)
+    { return _mm_castps_si128(_mm_mul_ps(_mm_castsi128_ps(b1), _mm_castsi128_ps(b2))); }
+
+    // There's no integer division in SSE2. The dividends and divisors are below 2^17, so the
+    // truncated float quotient equals the integer one. Division by zero gives maxValue.
+    inline __m128i divDwords(__m128i v1, __m128i v2, __m128i maxValue)
+    {
+        const __m128i byZero = _mm_cmpeq_epi32(v2, _mm_setzero_si128());
+        const __m128i quotient = _mm_cvttps_epi32
+            (_mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(v1, _mm_srli_epi32(v2, 1))),
+                        _mm_cvtepi32_ps(_mm_sub_epi32(v2, byZero))));
+        return _mm_or_si128(_mm_andnot_si128(byZero, quotient), _mm_and_si128(byZero, maxValue));
+    }
+
+    inline __m128i divWords(__m128i w1, __m128i w2, __m128i maxValue)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        return _mm_packs_epi32
+            (divDwords(_mm_unpacklo_epi16(w1, zero), _mm_unpacklo_epi16(w2, zero), maxValue),
+             divDwords(_mm_unpackhi_epi16(w1, zero), _mm_unpackhi_epi16(w2, zero), maxValue));
+    }
+
+    inline __m128i divBlocks(__m128i b1, __m128i b2, Byte)
+    {
+        const __m128i zero = _mm_setzero_si128(), maxValue = _mm_set1_epi32(255);
+        return _mm_packus_epi16
+            (divWords(_mm_unpacklo_epi8(b1, zero), _mm_unpacklo_epi8(b2, zero), maxValue),
+             divWords(_mm_unpackhi_epi8(b1, zero), _mm_unpackhi_epi8(b2, zero), maxValue));
+    }
+
+    // The quotients are offset to the signed range for packing, as in applyAffine().
+    inline __m128i divBlocks(__m128i b1, __m128i b2, UInt16)
+    {
+        const __m128i zero = _mm_setzero_si128(), offset = _mm_set1_epi32(32768);
+        const __m128i maxValue = _mm_set1_epi32(65535);
+        return _mm_xor_si128
+            (_mm_packs_epi32
+             (_mm_sub_epi32(divDwords(_mm_unpacklo_epi16(b1, zero),
+                                      _mm_unpacklo_epi16(b2, zero), maxValue), offset),
+              _mm_sub_epi32(divDwords(_mm_unpackhi_epi16(b1, zero),
+                                      _mm_unpackhi_epi16(b2, zero), maxValue), offset)),
+             _mm_set1_epi16(-32768));
+    }
+
+    inline __m128i divBlocks(__m128i b1, __m128i b2, Float)
+    {
+        const __m128 divisor = _mm_castsi128_ps(b2);
+        const __m128 byZero = _mm_cmpeq_ps(divisor, _mm_setzero_ps());
+        return _mm_castps_si128
+            (_mm_or_ps(_mm_andnot_ps(byZero, _mm_div_ps(_mm_castsi128_ps(b1), divisor)),
+                       _mm_and_ps(byZero, _mm_set1_ps(std::numeric_limits<Float>::max()))));
+    }
+
+    template<typename CT>
+    inline __m128i combineBlocks(__m128i b1, __m128i b2, char operation)
+    {
+        switch(operation)
+        {
+          case '+': return addBlocks(b1, b2, CT());
+          case '-': return subBlocks(b1, b2, CT());
+          case '*': return mulBlocks(b1, b2, CT());
+          default: return divBlocks(b1, b2, CT());
+        }
+    }
+
+    // The SSE2 average rounds up, while average() rounds down.
+    inline __m128i averageBlocks(__m128i b1, __m128i b2, Byte)
+    {
+        return _mm_sub_epi8(_mm_avg_epu8(b1, b2),
+                            _mm_and_si128(_mm_xor_si128(b1, b2), _mm_set1_epi8(1)));
+    }
+
+    inline __m128i averageBlocks(__m128i b1, __m128i b2, UInt16)
+    {
+        return _mm_sub_epi16(_mm_avg_epu16(b1, b2),
+                             _mm_and_si128(_mm_xor_si128(b1, b2), _mm_set1_epi16(1)));
+    }
+
+    inline __m128i averageBlocks(__m128i b1, __m128i b2, Float)
+    {
+        return _mm_castps_si128
+            (_mm_mul_ps(_mm_add_ps(_mm_castsi128_ps(b1), _mm_castsi128_ps(b2)),
+                        _mm_set1_ps(0.5f)));
+    }
+#endif
+
+    template<typename CT>
+    void combineComponents(CT* dest, const CT* src, std::size_t amount,
+                           unsigned componentsPerPixel, unsigned alphaIndex, char operation)
+    {
+        std::size_t i = 0;
+#if WPNGIMAGE_SSE2
+        const std::size_t kBlockSize = 16 / sizeof(CT);
+        const __m128i alphaMask = getAlphaComponentsMask<CT>(componentsPerPixel, alphaIndex);
+        for(; i + kBlockSize <= amount; i += kBlockSize)
+        {
+            __m128i* destBlock = reinterpret_cast<__m128i*>(dest + i);
+            const __m128i b1 = _mm_loadu_si128(destBlock);
+            const __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            const __m128i colors = combineBlocks<CT>(b1, b2, operation);
+            _mm_storeu_si128
+                (destBlock, _mm_or_si128(_mm_andnot_si128(alphaMask, colors),
+                                         _mm_and_si128(alphaMask, averageBlocks(b1, b2, CT()))));
+        }
+#endif
+        for(; i < amount; ++i)
+            dest[i] = isAlphaComponent(i, componentsPerPixel, alphaIndex) ?
+                average(dest[i], src[i]) : combineComponents(dest[i], src[i], operation);
+    }
+}
+
+// The add, low and high values are given in the range of PixelF, and are scaled to the
+// range of the pixel format.
+void WPngImage::applyToComponents(Float mul, Float add, Float low, Float high, bool toAlpha)
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return;
+    if(!detachPixelData()) return;
 
-    if(!filled)
+    // The padding at the ends of the rows is processed along with the pixels, except with
+    // external pixel data, whose rows are processed one at a time.
+    const unsigned componentsPerPixel = isGrayscalePixelFormat() ? 2 : 4;
+    const std::size_t pixelsAmount = mData->mLayout.stride * std::size_t(mHeight);
+    const bool byRows = mData->hasExternalPixels();
+    const std::size_t runsAmount = byRows ? std::size_t(mHeight) : 1;
+    const std::size_t amount = (byRows ? std::size_t(mWidth) : pixelsAmount) * componentsPerPixel;
+    const std::size_t runStep = mData->mLayout.stride * componentsPerPixel;
+    const unsigned alphaIndex = componentsPerPixel - 1;
+    void* data = const_cast<void*>
+        (static_cast<const WPngImage*>(this)->rawPixelData(mData->mPixelFormat));
+
+    switch(mData->mPixelFormat)
     {
-        addHorLine(x, y, rectWidth, pixel, useBlending);
-        addHorLine(x, y + rectHeight - 1, rectWidth, pixel, useBlending);
-        addVertLine(x, y + 1, rectHeight - 2, pixel, useBlending);
-        addVertLine(x + rectWidth - 1, y + 1, rectHeight - 2, pixel, useBlending);
+      case kPixelFormat_GA8:
+      case kPixelFormat_RGBA8:
+          for(std::size_t run = 0; run < runsAmount; ++run)
+              applyAffine(static_cast<Byte*>(data) + run * runStep, amount, componentsPerPixel,
+                          alphaIndex, toAlpha, getAffineParams<Byte>(mul, add, low, high));
+          break;
+      case kPixelFormat_GA16:
+      case kPixelFormat_RGBA16:
+          for(std::size_t run = 0; run < runsAmount; ++run)
+              applyAffine(static_cast<UInt16*>(data) + run * runStep, amount, componentsPerPixel,
+                          alphaIndex, toAlpha, getAffineParams<UInt16>(mul, add, low, high));
+          break;
+      case kPixelFormat_GAF:
+      case kPixelFormat_RGBAF:
+          for(std::size_t run = 0; run < runsAmount; ++run)
+              applyAffine(static_cast<Float*>(data) + run * runStep, amount, componentsPerPixel,
+                          alphaIndex, toAlpha, getAffineParams<Float>(mul, add, low, high));
+          break;
+      case kPixelFormat_GAF_Planar:
+      case kPixelFormat_RGBAF_Planar:
+          for(unsigned plane = 0; plane < componentsPerPixel; ++plane)
+          {
+              const bool isAlphaPlane = plane == alphaIndex;
+              if(isAlphaPlane != toAlpha) continue;
+              Float* components = const_cast<Float*>
+                  (static_cast<const WPngImage*>(this)->getRawPlaneData(plane));
+              applyAffine(components, pixelsAmount, 1, isAlphaPlane ? 0 : 1, toAlpha,
+                          getAffineParams<Float>(mul, add, low, high));
+          }
+          break;
     }
-    else
+
+    if(toAlpha) pixelsWereModified();
+}
+
+// The other image is converted to the pixel format of this one if needed. Only the area
+// where the images overlap is changed.
+void WPngImage::combineWithImage(const WPngImage& image, char operation)
+{
+    if(!mData || !image.mData) return;
+
+    if(image.currentPixelFormat() != currentPixelFormat())
     {
-        if(x >= width() || y >= height()) return;
-        if(x < 0) { rectWidth += x; x = 0; }
-        if(y < 0) { rectHeight += y; y = 0; }
-        if(rectWidth <= 0 || rectHeight <= 0) return;
-        if(x + rectWidth > width()) { rectWidth = width() - x; }
-        if(y + rectHeight > height()) { rectHeight = height() - y; }
+        WPngImage converted(image);
+        converted.convertToPixelFormat(currentPixelFormat());
+        combineWithImage(converted, operation);
+        return;
+    }
 
-        const std::size_t indexBegin = std::size_t(y * width() + x);
-        const std::size_t step = std::size_t(width());
+    const int width = std::min(mWidth, image.mWidth);
+    const int height = std::min(mHeight, image.mHeight);
+    if(width == 0 || height == 0) return;
+    if(!detachPixelData()) return;
 
-        if(rectWidth == 1)
+    const unsigned componentsPerPixel = isGrayscalePixelFormat() ? 2 : 4;
+    const unsigned alphaIndex = componentsPerPixel - 1;
+
+    if(isPlanarPixelFormat())
+    {
+        for(unsigned plane = 0; plane < componentsPerPixel; ++plane)
         {
-            mData->addLine(indexBegin, std::size_t(rectHeight), step, pixel, useBlending);
+            Float* dest = const_cast<Float*>
+                (static_cast<const WPngImage*>(this)->getRawPlaneData(plane));
+            const Float* src = image.getRawPlaneData(plane);
+            for(int y = 0; y < height; ++y)
+                combineComponents(dest + std::size_t(y) * mData->mLayout.stride,
+                                  src + std::size_t(y) * image.mData->mLayout.stride,
+                                  std::size_t(width), 1, plane == alphaIndex ? 0 : 1,
+                                  operation);
         }
-        else
-        {
-            const std::size_t indexEnd = indexBegin + step * std::size_t(rectHeight);
-            const std::size_t length = std::size_t(rectWidth);
+        pixelsWereModified();
+        return;
+    }
 
-            for(std::size_t index = indexBegin; index < indexEnd; index += step)
-                mData->addLine(index, length, 1, pixel, useBlending);
+    const PixelFormat pixelFormat = currentPixelFormat();
+    const std::size_t rowAmount = std::size_t(width) * componentsPerPixel;
+    char* dest = static_cast<char*>
+        (const_cast<void*>(static_cast<const WPngImage*>(this)->rawPixelData(pixelFormat)));
+    const char* src = static_cast<const char*>(image.rawPixelData(pixelFormat));
+    const std::size_t pixelSize =
+        (pixelFormat == kPixelFormat_GA8 || pixelFormat == kPixelFormat_RGBA8 ? sizeof(Byte) :
+         pixelFormat == kPixelFormat_GA16 || pixelFormat == kPixelFormat_RGBA16 ?
+         sizeof(UInt16) : sizeof(Float)) * componentsPerPixel;
+
+    for(int y = 0; y < height; ++y)
+    {
+        void* destRow = dest + std::size_t(y) * mData->mLayout.stride * pixelSize;
+        const void* srcRow = src + std::size_t(y) * image.mData->mLayout.stride * pixelSize;
+        switch(pixelFormat)
+        {
+          case kPixelFormat_GA8:
+          case kPixelFormat_RGBA8:
+              combineComponents(static_cast<Byte*>(destRow), static_cast<const Byte*>(srcRow),
+                                rowAmount, componentsPerPixel, alphaIndex, operation);
+              break;
+          case kPixelFormat_GA16:
+          case kPixelFormat_RGBA16:
+              combineComponents(static_cast<UInt16*>(destRow),
+                                static_cast<const UInt16*>(srcRow),
+                                rowAmount, componentsPerPixel, alphaIndex, operation);
+              break;
+          case kPixelFormat_GAF:
+          case kPixelFormat_RGBAF:
+              combineComponents(static_cast<Float*>(destRow), static_cast<const Float*>(srcRow),
+                                rowAmount, componentsPerPixel, alphaIndex, operation);
+              break;
+          case kPixelFormat_GAF_Planar:
+          case kPixelFormat_RGBAF_Planar:
+              break;
         }
     }
+
+    pixelsWereModified();
 }
 
-void WPngImage::putRect(int x, int y, int width, int height, Pixel8 pixel, bool filled)
+void WPngImage::invert()
 {
-    addRect(x, y, width, height, pixel, filled, false);
+    applyToComponents(-1.0f, 1.0f, -kNoLimit, kNoLimit, false);
 }
 
-void WPngImage::putRect(int x, int y, int width, int height, Pixel16 pixel, bool filled)
+void WPngImage::add(Float value)
 {
-    addRect(x, y, width, height, pixel, filled, false);
+    applyToComponents(1.0f, value, -kNoLimit, kNoLimit, false);
 }
 
-void WPngImage::putRect(int x, int y, int width, int height, PixelF pixel, bool filled)
+void WPngImage::subtract(Float value)
 {
-    addRect(x, y, width, height, pixel, filled, false);
+    applyToComponents(1.0f, -value, -kNoLimit, kNoLimit, false);
 }
 
-void WPngImage::drawRect(int x, int y, int width, int height, Pixel8 pixel, bool filled)
+void WPngImage::multiply(Float factor)
 {
-    addRect(x, y, width, height, pixel, filled, true);
+    applyToComponents(factor, 0.0f, -kNoLimit, kNoLimit, false);
 }
 
-void WPngImage::drawRect(int x, int y, int width, int height, Pixel16 pixel, bool filled)
+void WPngImage::divide(Float divisor)
 {
-    addRect(x, y, width, height, pixel, filled, true);
+    if(divisor == 0.0f) applyToComponents(0.0f, 1.0f, -kNoLimit, kNoLimit, false);
+    else applyToComponents(1.0f / divisor, 0.0f, -kNoLimit, kNoLimit, false);
 }
 
-void WPngImage::drawRect(int x, int y, int width, int height, PixelF pixel, bool filled)
+void WPngImage::add(const WPngImage& image)
 {
-    addRect(x, y, width, height, pixel, filled, true);
+    combineWithImage(image, '+');
 }
 
-void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight)
+void WPngImage::subtract(const WPngImage& image)
 {
-    resizeCanvas(newOriginX, newOriginY, newWidth, newHeight, Pixel8(0, 0, 0, 0));
+    combineWithImage(image, '-');
 }
 
-void WPngImage::manageCanvasResize(WPngImage& newImage, int newOriginX, int newOriginY)
+void WPngImage::multiply(const WPngImage& image)
 {
-    newImage.putImage(-newOriginX, -newOriginY, *this);
-    newImage.mData->mPngFileFormat = mData->mPngFileFormat;
-    this->swap(newImage);
+    combineWithImage(image, '*');
+}
+
+void WPngImage::divide(const WPngImage& image)
+{
+    combineWithImage(image, '/');
+}
+
+// Only the float pixel formats can have components outside the range 0-1.
+void WPngImage::clamp()
+{
+    if(isFloatPixelFormat())
+    {
+        applyToComponents(1.0f, 0.0f, 0.0f, 1.0f, false);
+        applyToComponents(1.0f, 0.0f, 0.0f, 1.0f, true);
+    }
+}
+
+void WPngImage::clampColors(Float minValue, Float maxValue)
+{
+    applyToComponents(1.0f, 0.0f, minValue, maxValue, false);
+}
+
+// The contrast is adjusted around the middle value 0.5.
+void WPngImage::adjustBrightnessContrast(Float brightness, Float contrast)
+{
+    applyToComponents(contrast, 0.5f - 0.5f * contrast + brightness, -kNoLimit, kNoLimit, false);
+}
+
+void WPngImage::multiplyAlpha(Float factor)
+{
+    applyToComponents(factor, 0.0f, -kNoLimit, kNoLimit, true);
+}
+
+
+//----------------------------------------------------------------------------
+// Lookup tables
+//----------------------------------------------------------------------------
+// The tables are built by giving each possible value to the function as all the
+// components of a pixel, so the function must handle the components independently.
+WPngImage::LUT8::LUT8()
+{
+    for(unsigned value = 0; value < 256; ++value)
+        r[value] = g[value] = b[value] = a[value] = Byte(value);
+}
+
+WPngImage::LUT8::LUT8(TransformFunc8 func)
+{
+    for(unsigned value = 0; value < 256; ++value)
+    {
+        const Byte c = Byte(value);
+        const Pixel8 pixel = func(Pixel8(c, c, c, c));
+        r[value] = pixel.r;
+        g[value] = pixel.g;
+        b[value] = pixel.b;
+        a[value] = pixel.a;
+    }
+}
+
+WPngImage::LUT16::LUT16(): r(65536), g(65536), b(65536), a(65536)
+{
+    for(unsigned value = 0; value < 65536; ++value)
+        r[value] = g[value] = b[value] = a[value] = UInt16(value);
+}
+
+WPngImage::LUT16::LUT16(TransformFunc16 func): r(65536), g(65536), b(65536), a(65536)
+{
+    for(unsigned value = 0; value < 65536; ++value)
+    {
+        const UInt16 c = UInt16(value);
+        const Pixel16 pixel = func(Pixel16(c, c, c, c));
+        r[value] = pixel.r;
+        g[value] = pixel.g;
+        b[value] = pixel.b;
+        a[value] = pixel.a;
+    }
+}
+
+namespace
+{
+    template<typename Pixel_t, typename CT>
+    void applyLUT(Pixel_t* pixels, std::size_t amount,
+                  const CT* r, const CT* g, const CT* b, const CT* a)
+    {
+        for(std::size_t i = 0; i < amount; ++i)
+        {
+            Pixel_t& pixel = pixels[i];
+            pixel.r = r[pixel.r];
+            pixel.g = g[pixel.g];
+            pixel.b = b[pixel.b];
+            pixel.a = a[pixel.a];
+        }
+    }
+
+#if WPNGIMAGE_X86_DISPATCH
+    // AVX2 is detected once during static initialization. It needs both the CPU support
+    // and the operating system saving the ymm registers.
+    bool detectAVX2()
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        if(info[0] < 7) return false;
+        __cpuid(info, 1);
+        if(!(unsigned(info[2]) & (1U << 27))) return false;
+        if((_xgetbv(0) & 6) != 6) return false;
+        __cpuidex(info, 7, 0);
+        return (unsigned(info[1]) & (1U << 5)) != 0;
+#else
+        unsigned eax, ebx, ecx, edx;
+        if(__get_cpuid_max(0, 0) < 7) return false;
+        if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1U << 27))) return false;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        if((eax & 6) != 6) return false;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & (1U << 5)) != 0;
+#endif
+    }
+
+    const bool gCpuHasAVX2 = detectAVX2();
+
+    // Looks up eight pixels at a time with gathers from a table of 1024 32-bit entries,
+    // where entry c * 256 + v holds the table value of component c for v already shifted
+    // to the position of the component in the pixel. Returns the amount of pixels done.
+    WPNGIMAGE_TARGET("avx2")
+    std::size_t applyLUTAVX2(WPngImage::Pixel8* pixels, std::size_t amount,
+                             const int* table)
+    {
+        const __m256i byteMask = _mm256_set1_epi32(0xFF);
+        std::size_t i = 0;
+        for(; i + 8 <= amount; i += 8)
+        {
+            __m256i* ptr = reinterpret_cast<__m256i*>(pixels + i);
+            const __m256i values = _mm256_loadu_si256(ptr);
+            const __m256i r = _mm256_i32gather_epi32
+                (table, _mm256_and_si256(values, byteMask), 4);
+            const __m256i g = _mm256_i32gather_epi32
+                (table + 256, _mm256_and_si256(_mm256_srli_epi32(values, 8), byteMask), 4);
+            const __m256i b = _mm256_i32gather_epi32
+                (table + 512, _mm256_and_si256(_mm256_srli_epi32(values, 16), byteMask), 4);
+            const __m256i a = _mm256_i32gather_epi32
+                (table + 768, _mm256_srli_epi32(values, 24), 4);
+            _mm256_storeu_si256(ptr, _mm256_or_si256(_mm256_or_si256(r, g),
+                                                     _mm256_or_si256(b, a)));
+        }
+        return i;
+    }
+#endif
+
+    // Applies a LUT8 to RGBA8 pixels, with AVX2 gathers if the CPU supports them. (Byte
+    // shuffles can only look up one 16-entry table per instruction, which doesn't suit
+    // four interleaved 256-entry tables.)
+    class RGBA8LUT
+    {
+     public:
+        explicit RGBA8LUT(const WPngImage::LUT8& lut): mLUT(lut)
+        {
+#if WPNGIMAGE_X86_DISPATCH
+            if(gCpuHasAVX2)
+                for(unsigned value = 0; value < 256; ++value)
+                {
+                    mGatherTable[value] = int(lut.r[value]);
+                    mGatherTable[256 + value] = int(unsigned(lut.g[value]) << 8);
+                    mGatherTable[512 + value] = int(unsigned(lut.b[value]) << 16);
+                    mGatherTable[768 + value] = int(unsigned(lut.a[value]) << 24);
+                }
+#endif
+        }
+
+        void apply(WPngImage::Pixel8* pixels, std::size_t amount) const
+        {
+            std::size_t done = 0;
+#if WPNGIMAGE_X86_DISPATCH
+            if(gCpuHasAVX2) done = applyLUTAVX2(pixels, amount, mGatherTable);
+#endif
+            applyLUT(pixels + done, amount - done, mLUT.r, mLUT.g, mLUT.b, mLUT.a);
+        }
+
+     private:
+        const WPngImage::LUT8& mLUT;
+#if WPNGIMAGE_X86_DISPATCH
+        int mGatherTable[1024];
+#endif
+    };
+
+    // The gray value of a gray pixel is mapped to what it would become when converted to
+    // RGBA, looked up and converted back to gray.
+    template<typename CT, typename Pixel_t>
+    void applyGrayLUT(PixelG<CT>* pixels, std::size_t amount,
+                      const CT* r, const CT* g, const CT* b, const CT* a)
+    {
+        const std::size_t kTableSize = std::size_t(std::numeric_limits<CT>::max()) + 1;
+        std::vector<CT> gray(kTableSize);
+        for(std::size_t value = 0; value < kTableSize; ++value)
+            gray[value] = PixelG<CT>(Pixel_t(r[value], g[value], b[value], a[value])).g;
+
+        for(std::size_t i = 0; i < amount; ++i)
+        {
+            pixels[i].g = gray[pixels[i].g];
+            pixels[i].a = a[pixels[i].a];
+        }
+    }
+
+    template<typename CT>
+    bool isIdentityLUT(const CT* table, std::size_t size)
+    {
+        for(std::size_t value = 0; value < size; ++value)
+            if(table[value] != value)
+                return false;
+        return true;
+    }
+
+    template<typename Pixel_t, typename Table_t>
+    struct LUTFunc
+    {
+        const Table_t* table;
+
+        explicit LUTFunc(const Table_t& t): table(&t) {}
+
+        Pixel_t operator()(const Pixel_t& pixel) const
+        {
+            return Pixel_t(table->r[pixel.r], table->g[pixel.g], table->b[pixel.b],
+                           table->a[pixel.a]);
+        }
+    };
+}
+
+// Images with a different bit depth than the table are converted to it and back, like
+// transform() does.
+void WPngImage::applyLUT(const LUT8& table)
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return;
+    if(!detachPixelData()) return;
+
+    // The padding at the ends of the rows is processed along with the pixels, except with
+    // external pixel data, whose rows are processed one at a time.
+    const std::size_t stride = mData->mLayout.stride;
+    const bool byRows = mData->hasExternalPixels();
+    const std::size_t runsAmount = byRows ? std::size_t(mHeight) : 1;
+    const std::size_t amount = byRows ? std::size_t(mWidth) : stride * std::size_t(mHeight);
+    void* data = const_cast<void*>
+        (static_cast<const WPngImage*>(this)->rawPixelData(mData->mPixelFormat));
+
+    switch(mData->mPixelFormat)
+    {
+      case kPixelFormat_RGBA8:
+      {
+          const RGBA8LUT lut(table);
+          for(std::size_t run = 0; run < runsAmount; ++run)
+              lut.apply(static_cast<Pixel8*>(data) + run * stride, amount);
+          break;
+      }
+      case kPixelFormat_GA8:
+          for(std::size_t run = 0; run < runsAmount; ++run)
+              applyGrayLUT<Byte, Pixel8>
+                  (static_cast<PixelG8*>(static_cast<PixelGA8*>(data)) + run * stride,
+                   amount, table.r, table.g, table.b, table.a);
+          break;
+      default:
+          transformT<Pixel8>(LUTFunc<Pixel8, LUT8>(table));
+          return;
+    }
+
+    if(!isIdentityLUT(table.a, 256)) pixelsWereModified();
+}
+
+void WPngImage::applyLUT(const LUT16& table)
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return;
+    if(!detachPixelData()) return;
+
+    // The padding at the ends of the rows is processed along with the pixels, except with
+    // external pixel data, whose rows are processed one at a time.
+    const std::size_t stride = mData->mLayout.stride;
+    const bool byRows = mData->hasExternalPixels();
+    const std::size_t runsAmount = byRows ? std::size_t(mHeight) : 1;
+    const std::size_t amount = byRows ? std::size_t(mWidth) : stride * std::size_t(mHeight);
+    void* data = const_cast<void*>
+        (static_cast<const WPngImage*>(this)->rawPixelData(mData->mPixelFormat));
+
+    switch(mData->mPixelFormat)
+    {
+      case kPixelFormat_RGBA16:
+          for(std::size_t run = 0; run < runsAmount; ++run)
+              ::applyLUT(static_cast<Pixel16*>(data) + run * stride, amount,
+                         &table.r[0], &table.g[0], &table.b[0], &table.a[0]);
+          break;
+      case kPixelFormat_GA16:
+          for(std::size_t run = 0; run < runsAmount; ++run)
+              applyGrayLUT<UInt16, Pixel16>
+                  (static_cast<PixelG16*>(static_cast<PixelGA16*>(data)) + run * stride,
+                   amount, &table.r[0], &table.g[0], &table.b[0], &table.a[0]);
+          break;
+      default:
+          transformT<Pixel16>(LUTFunc<Pixel16, LUT16>(table));
+          return;
+    }
+
+    if(!isIdentityLUT(&table.a[0], 65536)) pixelsWereModified();
 }
 
-void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight,
-                             Pixel8 pixel)
-{
-    if(mData && (newOriginX != 0 || newOriginY != 0 ||
-                 newWidth != width() || newHeight != height()))
+//============================================================================
+// Palette quantization
+//============================================================================
+namespace
+{
+    // Colors are handled as 8-bit RGBA values packed into one integer. All fully
+    // transparent colors are treated as the same color.
+    inline UInt32 getQuantizerKey(Byte r, Byte g, Byte b, Byte a)
+    {
+        if(a == 0) return 0;
+        return (UInt32(r) << 24) | (UInt32(g) << 16) | (UInt32(b) << 8) | UInt32(a);
+    }
+
+    inline unsigned getQuantizerHash(UInt32 key, unsigned bits)
+    {
+        return unsigned(((key * 2654435761U) & 0xFFFFFFFFU) >> (32 - bits));
+    }
+
+    inline void addPaletteColor(std::vector<Byte>& palette, UInt32 key)
+    {
+        palette.push_back(Byte(key >> 24));
+        palette.push_back(Byte((key >> 16) & 0xFF));
+        palette.push_back(Byte((key >> 8) & 0xFF));
+        palette.push_back(Byte(key & 0xFF));
+    }
+
+    // Returns false if the pixels have more than maxColors distinct colors (maxColors is
+    // at most 256).
+    bool getExactPalette(const Byte* rgba, std::size_t pixelsAmount, unsigned maxColors,
+                         std::vector<Byte>& palette)
+    {
+        enum { kTableBits = 10, kTableSize = 1 << kTableBits };
+        UInt32 keys[kTableSize];
+        bool slotIsUsed[kTableSize] = {};
+
+        palette.clear();
+        UInt32 previousKey = 0;
+        for(std::size_t i = 0; i < pixelsAmount; ++i, rgba += 4)
+        {
+            const UInt32 key = getQuantizerKey(rgba[0], rgba[1], rgba[2], rgba[3]);
+            if(i > 0 && key == previousKey) continue;
+            previousKey = key;
+
+            unsigned slot = getQuantizerHash(key, kTableBits);
+            while(slotIsUsed[slot] && keys[slot] != key)
+                slot = (slot + 1) & (kTableSize - 1);
+            if(slotIsUsed[slot]) continue;
+            if(palette.size() == maxColors * 4) return false;
+            slotIsUsed[slot] = true;
+            keys[slot] = key;
+            addPaletteColor(palette, key);
+        }
+        return true;
+    }
+
+    struct QuantizerSample { Byte c[4]; };
+
+    struct CompareSampleComponents
+    {
+        unsigned component;
+        explicit CompareSampleComponents(unsigned c): component(c) {}
+        bool operator()(const QuantizerSample& lhs, const QuantizerSample& rhs) const
+        {
+            return lhs.c[component] < rhs.c[component];
+        }
+    };
+
+    // A box of the median cut covers the samples in [begin, end). It's split along the
+    // component with the largest range.
+    struct QuantizerBox
+    {
+        std::size_t begin, end;
+        unsigned splitComponent, range;
+
+        QuantizerBox(const std::vector<QuantizerSample>& samples,
+                     std::size_t beginIndex, std::size_t endIndex):
+            begin(beginIndex), end(endIndex), splitComponent(0), range(0)
+        {
+            for(unsigned c = 0; c < 4; ++c)
+            {
+                unsigned minValue = 255, maxValue = 0;
+                for(std::size_t i = begin; i < end; ++i)
+                {
+                    minValue = std::min(minValue, unsigned(samples[i].c[c]));
+                    maxValue = std::max(maxValue, unsigned(samples[i].c[c]));
+                }
+                if(maxValue >= minValue && maxValue - minValue > range)
+                {
+                    range = maxValue - minValue;
+                    splitComponent = c;
+                }
+            }
+        }
+    };
+
+    // Takes at most kMaxSamples pixels spread evenly over the image, each at a
+    // pseudo-random position within its stretch so that regular patterns aren't missed.
+    void getQuantizerSamples(const Byte* rgba, std::size_t pixelsAmount,
+                             std::vector<QuantizerSample>& samples)
+    {
+        const std::size_t kMaxSamples = 1 << 15;
+        const std::size_t step = (pixelsAmount + kMaxSamples - 1) / kMaxSamples;
+        UInt32 random = 1;
+
+        samples.clear();
+        samples.reserve(pixelsAmount / step + 1);
+        for(std::size_t start = 0; start < pixelsAmount; start += step)
+        {
+            random = (random * 1103515245U + 12345U) & 0xFFFFFFFFU;
+            const std::size_t index =
+                std::min(start + std::size_t(random >> 8) % step, pixelsAmount - 1);
+            const Byte* color = rgba + index * 4;
+            QuantizerSample sample;
+            for(unsigned c = 0; c < 4; ++c) sample.c[c] = color[3] == 0 ? 0 : color[c];
+            samples.push_back(sample);
+        }
+    }
+
+    void getMedianCutPalette(std::vector<QuantizerSample>& samples, unsigned maxColors,
+                             std::vector<Byte>& palette)
+    {
+        std::vector<QuantizerBox> boxes(1, QuantizerBox(samples, 0, samples.size()));
+        while(boxes.size() < maxColors)
+        {
+            std::size_t boxIndex = boxes.size();
+            double largestScore = 0;
+            for(std::size_t i = 0; i < boxes.size(); ++i)
+            {
+                const double score = double(boxes[i].range) * double(boxes[i].end - boxes[i].begin);
+                if(score > largestScore) { largestScore = score; boxIndex = i; }
+            }
+            if(boxIndex == boxes.size()) break;
+
+            const QuantizerBox box = boxes[boxIndex];
+            const std::size_t middle = box.begin + (box.end - box.begin) / 2;
+            std::nth_element(samples.begin() + box.begin, samples.begin() + middle,
+                             samples.begin() + box.end,
+                             CompareSampleComponents(box.splitComponent));
+            boxes[boxIndex] = QuantizerBox(samples, box.begin, middle);
+            boxes.push_back(QuantizerBox(samples, middle, box.end));
+        }
+
+        palette.clear();
+        for(std::size_t i = 0; i < boxes.size(); ++i)
+        {
+            const std::size_t amount = boxes[i].end - boxes[i].begin;
+            for(unsigned c = 0; c < 4; ++c)
+            {
+                std::size_t sum = amount / 2;
+                for(std::size_t s = boxes[i].begin; s < boxes[i].end; ++s)
+                    sum += samples[s].c[c];
+                palette.push_back(Byte(sum / amount));
+            }
+        }
+    }
+
+    // Finds the palette color closest to a given color. The palette is sorted by the green
+    // component, so the search can start from colors with the same green and stop once
+    // the difference in green alone is larger than the best distance found.
+    class PaletteSearch
+    {
+     public:
+        explicit PaletteSearch(std::vector<Byte>& palette):
+            mPalette(palette), mColorsAmount(unsigned(palette.size() / 4))
+        {
+            std::vector<UInt32> keys(mColorsAmount);
+            for(unsigned i = 0; i < mColorsAmount; ++i)
+            {
+                const Byte* color = &palette[i * 4];
+                keys[i] = (UInt32(color[1]) << 24) | (UInt32(color[0]) << 16) |
+                    (UInt32(color[2]) << 8) | UInt32(color[3]);
+            }
+            std::sort(keys.begin(), keys.end());
+            for(unsigned i = 0; i < mColorsAmount; ++i)
+            {
+                Byte* color = &palette[i * 4];
+                color[0] = Byte((keys[i] >> 16) & 0xFF);
+                color[1] = Byte(keys[i] >> 24);
+                color[2] = Byte((keys[i] >> 8) & 0xFF);
+                color[3] = Byte(keys[i] & 0xFF);
+            }
+
+            for(unsigned g = 0, index = 0; g < 256; ++g)
+            {
+                while(index < mColorsAmount && palette[index * 4 + 1] < g) ++index;
+                mGreenStart[g] = index;
+            }
+        }
+
+        unsigned closest(const int* color) const
+        {
+            unsigned bestIndex = 0;
+            int bestDistance = std::numeric_limits<int>::max();
+            const unsigned start = mGreenStart[color[1]];
+
+            for(unsigned i = start; i < mColorsAmount; ++i)
+            {
+                const int dg = int(mPalette[i * 4 + 1]) - color[1];
+                if(dg * dg >= bestDistance) break;
+                const int distance = getDistance(i, color);
+                if(distance < bestDistance) { bestDistance = distance; bestIndex = i; }
+            }
+            for(unsigned i = start; i-- > 0;)
+            {
+                const int dg = color[1] - int(mPalette[i * 4 + 1]);
+                if(dg * dg >= bestDistance) break;
+                const int distance = getDistance(i, color);
+                if(distance < bestDistance) { bestDistance = distance; bestIndex = i; }
+            }
+            return bestIndex;
+        }
+
+        const Byte* color(unsigned index) const { return &mPalette[index * 4]; }
+
+     private:
+        const std::vector<Byte>& mPalette;
+        unsigned mColorsAmount;
+        unsigned mGreenStart[256];
+
+        int getDistance(unsigned index, const int* color) const
+        {
+            const Byte* paletteColor = &mPalette[index * 4];
+            int distance = 0;
+            for(unsigned c = 0; c < 4; ++c)
+            {
+                const int d = int(paletteColor[c]) - color[c];
+                distance += d * d;
+            }
+            return distance;
+        }
+    };
+
+    // Moves each palette color to the average of the samples closest to it.
+    void refinePalette(const std::vector<QuantizerSample>& samples, std::vector<Byte>& palette,
+                       unsigned iterations)
     {
-        WPngImage newImage(newWidth, newHeight, pixel, currentPixelFormat());
-        manageCanvasResize(newImage, newOriginX, newOriginY);
+        const std::size_t colorsAmount = palette.size() / 4;
+        std::vector<std::size_t> sums(colorsAmount * 5);
+        for(unsigned iteration = 0; iteration < iterations; ++iteration)
+        {
+            std::fill(sums.begin(), sums.end(), std::size_t(0));
+            {
+                const PaletteSearch search(palette);
+                for(std::size_t i = 0; i < samples.size(); ++i)
+                {
+                    const int color[4] = { samples[i].c[0], samples[i].c[1],
+                                           samples[i].c[2], samples[i].c[3] };
+                    std::size_t* sum = &sums[search.closest(color) * 5];
+                    for(unsigned c = 0; c < 4; ++c) sum[c] += samples[i].c[c];
+                    ++sum[4];
+                }
+            }
+            for(std::size_t i = 0; i < colorsAmount; ++i)
+            {
+                const std::size_t* sum = &sums[i * 5];
+                if(sum[4] > 0)
+                    for(unsigned c = 0; c < 4; ++c)
+                        palette[i * 4 + c] = Byte((sum[c] + sum[4] / 2) / sum[4]);
+            }
+        }
     }
-}
 
-void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight,
-                             Pixel16 pixel)
-{
-    if(mData && (newOriginX != 0 || newOriginY != 0 ||
-                 newWidth != width() || newHeight != height()))
+    // Maps the pixels of a band of rows to palette indices. The dithering is Floyd-Steinberg
+    // error diffusion in serpentine order. The error doesn't cross from one band to the
+    // next, so that the bands can be processed in parallel, and the result doesn't depend
+    // on the amount of threads. The closest palette colors are cached.
+    struct PaletteMappingJob
     {
-        WPngImage newImage(newWidth, newHeight, pixel, currentPixelFormat());
-        manageCanvasResize(newImage, newOriginX, newOriginY);
-    }
-}
+        enum { kRowsPerJob = 64, kCacheBits = 12, kCacheSize = 1 << kCacheBits };
 
-void WPngImage::resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight,
-                             PixelF pixel)
-{
-    if(mData && (newOriginX != 0 || newOriginY != 0 ||
-                 newWidth != width() || newHeight != height()))
-    {
-        WPngImage newImage(newWidth, newHeight, pixel, currentPixelFormat());
-        manageCanvasResize(newImage, newOriginX, newOriginY);
-    }
-}
+        const Byte* rgba;
+        int width, height;
+        const PaletteSearch* search;
+        bool dither;
+        Byte* indices;
 
-void WPngImage::premultiplyAlpha()
-{
-    if(mData) mData->premultiplyAlpha();
-}
+        void operator()(std::size_t jobIndex, unsigned) const
+        {
+            std::vector<UInt32> cacheKeys(kCacheSize);
+            std::vector<int> cachedIndices(kCacheSize, -1);
+            std::vector<int> errors(dither ? (width + 2) * 8 : 0);
+            int* currentErrors = dither ? &errors[0] : 0;
+            int* nextErrors = dither ? &errors[(width + 2) * 4] : 0;
+
+            const int startY = int(jobIndex) * kRowsPerJob;
+            const int endY = std::min(startY + int(kRowsPerJob), height);
+            for(int y = startY; y < endY; ++y)
+            {
+                const bool leftToRight = ((y - startY) & 1) == 0;
+                const int step = leftToRight ? 1 : -1;
+                for(int i = 0, x = leftToRight ? 0 : width - 1; i < width; ++i, x += step)
+                {
+                    const std::size_t pixelIndex = std::size_t(y) * width + x;
+                    const Byte* pixel = rgba + pixelIndex * 4;
+                    int color[4] = { pixel[0], pixel[1], pixel[2], pixel[3] };
+                    if(pixel[3] == 0)
+                        color[0] = color[1] = color[2] = 0;
+                    else if(dither)
+                        for(unsigned c = 0; c < 4; ++c)
+                            color[c] = std::max(0, std::min(255, color[c] +
+                                                            currentErrors[(x + 1) * 4 + c] / 16));
+
+                    const UInt32 key = getQuantizerKey(Byte(color[0]), Byte(color[1]),
+                                                       Byte(color[2]), Byte(color[3]));
+                    const unsigned slot = getQuantizerHash(key, kCacheBits);
+                    if(cachedIndices[slot] < 0 || cacheKeys[slot] != key)
+                    {
+                        if(color[3] == 0) color[0] = color[1] = color[2] = 0;
+                        cacheKeys[slot] = key;
+                        cachedIndices[slot] = int(search->closest(color));
+                    }
+                    const unsigned index = unsigned(cachedIndices[slot]);
+                    indices[pixelIndex] = Byte(index);
+
+                    if(dither && pixel[3] != 0)
+                    {
+                        const Byte* paletteColor = search->color(index);
+                        for(unsigned c = 0; c < 4; ++c)
+                        {
+                            const int error = color[c] - int(paletteColor[c]);
+                            currentErrors[(x + 1 + step) * 4 + c] += error * 7;
+                            nextErrors[(x + 1 - step) * 4 + c] += error * 3;
+                            nextErrors[(x + 1) * 4 + c] += error * 5;
+                            nextErrors[(x + 1 + step) * 4 + c] += error;
+                        }
+                    }
+                }
+
+                if(dither)
+                {
+                    std::swap(currentErrors, nextErrors);
+                    std::fill(nextErrors, nextErrors + (width + 2) * 4, 0);
+                }
+            }
+        }
+    };
 
-const WPngImage::Pixel8* WPngImage::getRawPixelData8() const
-{
-    return mData && mData->mPixelFormat == kPixelFormat_RGBA8 ?
-        &(static_cast<const PngData<Pixel8>*>(mData)->mPixelData[0]) : 0;
-}
+    // Chooses a palette of at most maxColors colors (in [1, 256]) for the 8-bit RGBA
+    // pixels and maps each pixel to an index in the palette. If the pixels have no more
+    // distinct colors than that, they are used as they are. Otherwise the palette is made
+    // with median cut from a sample of the pixels, and refined with k-means.
+    void quantizeRGBA8(const Byte* rgba, int width, int height, unsigned maxColors,
+                       bool dither, unsigned threadsAmount,
+                       std::vector<Byte>& palette, std::vector<Byte>& indices)
+    {
+        const std::size_t pixelsAmount = std::size_t(width) * std::size_t(height);
+        palette.clear();
+        indices.resize(pixelsAmount);
+        if(pixelsAmount == 0) return;
 
-WPngImage::Pixel8* WPngImage::getRawPixelData8()
-{
-    return mData && mData->mPixelFormat == kPixelFormat_RGBA8 ?
-        &(static_cast<PngData<Pixel8>*>(mData)->mPixelData[0]) : 0;
-}
+        if(getExactPalette(rgba, pixelsAmount, maxColors, palette))
+        {
+            dither = false;
+        }
+        else
+        {
+            std::vector<QuantizerSample> samples;
+            getQuantizerSamples(rgba, pixelsAmount, samples);
+            getMedianCutPalette(samples, maxColors, palette);
+            refinePalette(samples, palette, 3);
+        }
 
-const WPngImage::Pixel16* WPngImage::getRawPixelData16() const
-{
-    return mData && mData->mPixelFormat == kPixelFormat_RGBA16 ?
-        &(static_cast<const PngData<Pixel16>*>(mData)->mPixelData[0]) : 0;
+        const PaletteSearch search(palette);
+        PaletteMappingJob job;
+        job.rgba = rgba;
+        job.width = width;
+        job.height = height;
+        job.search = &search;
+        job.dither = dither;
+        job.indices = &indices[0];
+        runJobs((std::size_t(height) + PaletteMappingJob::kRowsPerJob - 1) /
+                PaletteMappingJob::kRowsPerJob, threadsAmount, job);
+    }
 }
 
-WPngImage::Pixel16* WPngImage::getRawPixelData16()
+// Each pixel is replaced with its palette color. Grayscale images stay grayscale, since
+// the palette of gray pixels only has grays.
+void WPngImage::quantizeToPalette(unsigned maxColors, bool dither, unsigned threadsAmount)
 {
-    return mData && mData->mPixelFormat == kPixelFormat_RGBA16 ?
-        &(static_cast<PngData<Pixel16>*>(mData)->mPixelData[0]) : 0;
-}
+    if(!mData) return;
+    if(!detachPixelData()) return;
 
-const WPngImage::PixelF* WPngImage::getRawPixelDataF() const
-{
-    return mData && mData->mPixelFormat == kPixelFormat_RGBAF ?
-        &(static_cast<const PngData<PixelF>*>(mData)->mPixelData[0]) : 0;
-}
+    const std::size_t pixelsAmount = std::size_t(mWidth) * std::size_t(mHeight);
+    const bool isGray = isGrayscalePixelFormat();
+    std::vector<Byte> rgba(pixelsAmount * 4), palette, indices;
+    for(std::size_t i = 0; i < pixelsAmount; ++i)
+    {
+        Byte* color = &rgba[i * 4];
+        if(isGray)
+        {
+            const PixelG8 pixel = mData->getPixelG8(i);
+            color[0] = color[1] = color[2] = pixel.g;
+            color[3] = pixel.a;
+        }
+        else
+        {
+            const Pixel8 pixel = mData->getPixel8(i);
+            color[0] = pixel.r; color[1] = pixel.g; color[2] = pixel.b; color[3] = pixel.a;
+        }
+    }
 
-WPngImage::PixelF* WPngImage::getRawPixelDataF()
-{
-    return mData && mData->mPixelFormat == kPixelFormat_RGBAF ?
-        &(static_cast<PngData<PixelF>*>(mData)->mPixelData[0]) : 0;
+    quantizeRGBA8(&rgba[0], mWidth, mHeight, std::max(1U, std::min(maxColors, 256U)), dither,
+                  getThreadsAmount(threadsAmount), palette, indices);
+
+    for(std::size_t i = 0; i < pixelsAmount; ++i)
+    {
+        const Byte* color = &palette[indices[i] * 4];
+        if(isGray)
+        {
+            PixelG8 pixel = mData->getPixelG8(i);
+            pixel.g = color[1];
+            pixel.a = color[3];
+            mData->setPixel(i, pixel);
+        }
+        else
+            mData->setPixel(i, Pixel8(color[0], color[1], color[2], color[3]));
+    }
 }
 
 
@@ -2854,121 +6202,813 @@ WPngImage::PixelFormat WPngImage::getPixelFormat(WPngImage::PngReadConvert conve
           }
           break;
     }
-    return WPngImage::kPixelFormat_RGBA8;
+    return WPngImage::kPixelFormat_RGBA8;
+}
+
+
+#if !WPNGIMAGE_DISABLE_PNG_FILE_IO_SUPPORT
+//----------------------------------------------------------------------------
+// Load PNG image from file
+//----------------------------------------------------------------------------
+// A memory resource given to a load function becomes the memory resource of the image.
+WPngImage::IOStatus WPngImage::loadImage(const char* fileName, PngReadConvert conversion,
+                                         CompressionBackend* backend,
+                                         MemoryResource* memoryResource)
+{
+    if(memoryResource) mMemoryResource = memoryResource;
+    IOStatus status = performLoadImage(fileName, true, conversion, kPixelFormat_RGBA8, backend);
+    if(status != kIOStatus_Ok) status.fileName = fileName;
+    return status;
+}
+
+WPngImage::IOStatus WPngImage::loadImage(const char* fileName, PixelFormat pixelFormat,
+                                         CompressionBackend* backend,
+                                         MemoryResource* memoryResource)
+{
+    if(memoryResource) mMemoryResource = memoryResource;
+    IOStatus status = performLoadImage(fileName, false, kPngReadConvert_closestMatch, pixelFormat,
+                                       backend);
+    if(status != kIOStatus_Ok) status.fileName = fileName;
+    return status;
+}
+
+WPngImage::IOStatus WPngImage::loadImage(const std::string& fileName, PngReadConvert conversion,
+                                         CompressionBackend* backend,
+                                         MemoryResource* memoryResource)
+{
+    return loadImage(fileName.c_str(), conversion, backend, memoryResource);
+}
+
+WPngImage::IOStatus WPngImage::loadImage(const std::string& fileName, PixelFormat pixelFormat,
+                                         CompressionBackend* backend,
+                                         MemoryResource* memoryResource)
+{
+    return loadImage(fileName.c_str(), pixelFormat, backend, memoryResource);
+}
+
+
+//----------------------------------------------------------------------------
+// Read PNG data from RAM
+//----------------------------------------------------------------------------
+WPngImage::IOStatus WPngImage::loadImageFromRAM(const void* pngData, std::size_t pngDataSize,
+                                                PngReadConvert conversion,
+                                                CompressionBackend* backend,
+                                                MemoryResource* memoryResource)
+{
+    if(memoryResource) mMemoryResource = memoryResource;
+    return performLoadImageFromRAM
+        (pngData, pngDataSize, true, conversion, kPixelFormat_RGBA8, backend);
+}
+
+WPngImage::IOStatus WPngImage::loadImageFromRAM(const void* pngData, std::size_t pngDataSize,
+                                                PixelFormat pixelFormat,
+                                                CompressionBackend* backend,
+                                                MemoryResource* memoryResource)
+{
+    if(memoryResource) mMemoryResource = memoryResource;
+    return performLoadImageFromRAM
+        (pngData, pngDataSize, false, kPngReadConvert_closestMatch, pixelFormat, backend);
+}
+
+
+//----------------------------------------------------------------------------
+// Compression backend
+//----------------------------------------------------------------------------
+namespace
+{
+    WPngImage::CompressionBackend* gDefaultCompressionBackend = 0;
+}
+
+void WPngImage::setDefaultCompressionBackend(CompressionBackend* backend)
+{
+    gDefaultCompressionBackend = backend;
+}
+
+WPngImage::CompressionBackend* WPngImage::defaultCompressionBackend()
+{
+    return gDefaultCompressionBackend;
+}
+
+
+//============================================================================
+// Write PNG data
+//============================================================================
+template<typename CT>
+static void setColorComponentsG(CT* dest, int colorComponents, const PixelG<CT>& pixel)
+{
+    dest[0] = pixel.g;
+    if(colorComponents > 1) dest[1] = pixel.a;
+}
+
+template<typename CT, typename Pixel_t>
+static void setColorComponents(CT* dest, int colorComponents, const Pixel_t& pixel)
+{
+    dest[0] = pixel.r;
+    dest[1] = pixel.g;
+    dest[2] = pixel.b;
+    if(colorComponents > 3) dest[3] = pixel.a;
+}
+
+void WPngImage::setPixelRow
+(PngFileFormat fileFormat, int startX, int y, int rowWidth, Byte* dest,
+ int colorComponents) const
+{
+    const std::size_t indexStart = std::size_t(y) * width() + startX;
+
+    switch(fileFormat)
+    {
+      case kPngFileFormat_GA8:
+          for(int x = 0; x < rowWidth; ++x)
+              setColorComponentsG(dest + (x * colorComponents), colorComponents,
+                                  mData->getPixelG8(indexStart + x));
+          break;
+
+      case kPngFileFormat_RGBA8:
+          for(int x = 0; x < rowWidth; ++x)
+              setColorComponents(dest + (x * colorComponents), colorComponents,
+                                 mData->getPixel8(indexStart + x));
+          break;
+
+      default: break;
+    }
+}
+
+void WPngImage::setPixelRow
+(PngFileFormat fileFormat, int startX, int y, int rowWidth, UInt16* dest,
+ int colorComponents) const
+{
+    const std::size_t indexStart = std::size_t(y) * width() + startX;
+
+    switch(fileFormat)
+    {
+      case kPngFileFormat_GA16:
+          for(int x = 0; x < rowWidth; ++x)
+              setColorComponentsG(dest + (x * colorComponents), colorComponents,
+                                  mData->getPixelG16(indexStart + x));
+          break;
+
+      case kPngFileFormat_RGBA16:
+          for(int x = 0; x < rowWidth; ++x)
+              setColorComponents(dest + (x * colorComponents), colorComponents,
+                                 mData->getPixel16(indexStart + x));
+          break;
+
+      default: break;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Choose the PNG color type and bit depth
+//----------------------------------------------------------------------------
+namespace
+{
+    // Maps the distinct colors of an image (as 8-bit RGBA values) to palette indices
+    // using a small open addressing hash table. Adding fails once there would be more
+    // colors than fit in a PNG palette.
+    class PngPalette
+    {
+     public:
+        PngPalette(): mColorsAmount(0) { clearTable(); }
+
+        void clear() { mColorsAmount = 0; clearTable(); }
+
+        unsigned colorsAmount() const { return mColorsAmount; }
+        const Byte* color(unsigned index) const { return mColors[index]; }
+
+        bool add(Byte r, Byte g, Byte b, Byte a)
+        {
+            const UInt32 key = getKey(r, g, b, a);
+            const unsigned slot = findSlot(key);
+            if(mIndices[slot] != kEmptySlot) return true;
+            if(mColorsAmount == kMaxColors) return false;
+            mKeys[slot] = key;
+            mIndices[slot] = mColorsAmount;
+            Byte* color = mColors[mColorsAmount++];
+            color[0] = r; color[1] = g; color[2] = b; color[3] = a;
+            return true;
+        }
+
+        // The color must have been added.
+        Byte index(Byte r, Byte g, Byte b, Byte a) const
+        {
+            return Byte(mIndices[findSlot(getKey(r, g, b, a))]);
+        }
+
+        // Moves the colors that are not fully opaque to the beginning of the palette, so
+        // that the tRNS chunk only needs to cover those. Returns their amount.
+        unsigned putTranslucentColorsFirst()
+        {
+            Byte colors[kMaxColors][4];
+            unsigned translucentAmount = 0, index = 0;
+            for(unsigned i = 0; i < mColorsAmount; ++i)
+                if(mColors[i][3] != 255)
+                    std::memcpy(colors[translucentAmount++], mColors[i], 4);
+            index = translucentAmount;
+            for(unsigned i = 0; i < mColorsAmount; ++i)
+                if(mColors[i][3] == 255)
+                    std::memcpy(colors[index++], mColors[i], 4);
+
+            const unsigned colorsAmount = mColorsAmount;
+            mColorsAmount = 0;
+            clearTable();
+            for(unsigned i = 0; i < colorsAmount; ++i)
+                add(colors[i][0], colors[i][1], colors[i][2], colors[i][3]);
+            return translucentAmount;
+        }
+
+     private:
+        enum { kMaxColors = 256, kTableSize = 1024, kEmptySlot = 0xFFFF };
+
+        UInt32 mKeys[kTableSize];
+        UInt16 mIndices[kTableSize];
+        Byte mColors[kMaxColors][4];
+        unsigned mColorsAmount;
+
+        void clearTable()
+        {
+            for(unsigned i = 0; i < kTableSize; ++i) mIndices[i] = kEmptySlot;
+        }
+
+        static UInt32 getKey(Byte r, Byte g, Byte b, Byte a)
+        {
+            return (UInt32(r) << 24) | (UInt32(g) << 16) | (UInt32(b) << 8) | UInt32(a);
+        }
+
+        unsigned findSlot(UInt32 key) const
+        {
+            unsigned slot = unsigned(((key * 2654435761U) & 0xFFFFFFFFU) >> 22);
+            while(mIndices[slot] != kEmptySlot && mKeys[slot] != key)
+                slot = (slot + 1) & (kTableSize - 1);
+            return slot;
+        }
+    };
+
+    // The color key is the color of the fully transparent pixels, if all the other pixels
+    // are fully opaque.
+    struct PngColorAnalysis
+    {
+        bool isGray, fitsIn8Bits, fitsInPalette, fitsInColorKey, colorKeyFound;
+        UInt16 colorKey[3];
+    };
+
+    inline Byte componentTo8Bits(Byte c) { return c; }
+    inline Byte componentTo8Bits(UInt16 c) { return Byte(c >> 8); }
+    inline bool componentFitsIn8Bits(Byte) { return true; }
+    inline bool componentFitsIn8Bits(UInt16 c) { return (c >> 8) == (c & 0xFF); }
+
+    // The row has 1 or 2 (gray) or 3 or 4 (RGB) components per pixel. Returns false once
+    // the rest of the image cannot change the outcome.
+    template<typename CT>
+    bool analyzePngRow(const CT* src, int width, int components, CT maxValue,
+                       PngColorAnalysis& analysis, PngPalette& palette)
+    {
+        const bool hasColor = components >= 3;
+        const bool hasAlpha = components == 2 || components == 4;
+
+        for(int x = 0; x < width; ++x, src += components)
+        {
+            const CT r = src[0], g = hasColor ? src[1] : r, b = hasColor ? src[2] : r;
+            const CT a = hasAlpha ? src[components - 1] : maxValue;
+
+            if(r != g || r != b)
+                analysis.isGray = false;
+
+            if(!(componentFitsIn8Bits(r) && componentFitsIn8Bits(g) &&
+                 componentFitsIn8Bits(b) && componentFitsIn8Bits(a)))
+                analysis.fitsIn8Bits = analysis.fitsInPalette = false;
+
+            if(analysis.fitsInPalette &&
+               !palette.add(componentTo8Bits(r), componentTo8Bits(g),
+                            componentTo8Bits(b), componentTo8Bits(a)))
+                analysis.fitsInPalette = false;
+
+            if(analysis.fitsInColorKey)
+            {
+                if(a == 0)
+                {
+                    if(!analysis.colorKeyFound)
+                    {
+                        analysis.colorKey[0] = r;
+                        analysis.colorKey[1] = g;
+                        analysis.colorKey[2] = b;
+                        analysis.colorKeyFound = true;
+                    }
+                    else if(r != analysis.colorKey[0] || g != analysis.colorKey[1] ||
+                            b != analysis.colorKey[2])
+                        analysis.fitsInColorKey = false;
+                }
+                else if(a != maxValue)
+                    analysis.fitsInColorKey = false;
+            }
+
+            if((!hasColor || !analysis.isGray) && !analysis.fitsInPalette &&
+               !analysis.fitsInColorKey && (sizeof(CT) == 1 || !analysis.fitsIn8Bits))
+                return false;
+        }
+        return true;
+    }
+
+    // Whether none of the pixels which aren't fully transparent has the color of the key.
+    template<typename CT>
+    bool colorKeyIsUnused(const CT* src, int width, int components, const UInt16* colorKey)
+    {
+        const bool hasColor = components >= 3;
+        for(int x = 0; x < width; ++x, src += components)
+            if(src[components - 1] != 0 && src[0] == colorKey[0] &&
+               (!hasColor || (src[1] == colorKey[1] && src[2] == colorKey[2])))
+                return false;
+        return true;
+    }
+
+    // The smallest bit depth which can represent all the (8-bit) gray values in the palette.
+    // A value can be written with fewer bits if its high bits repeat in the rest of the byte,
+    // as PNG decoders scale the values to 8 bits by bit replication.
+    unsigned getGrayBitDepth(const PngPalette& palette)
+    {
+        for(unsigned bitDepth = 1; bitDepth < 8; bitDepth *= 2)
+        {
+            const unsigned step = 255 / ((1U << bitDepth) - 1);
+            bool fits = true;
+            for(unsigned i = 0; i < palette.colorsAmount() && fits; ++i)
+                fits = palette.color(i)[0] % step == 0;
+            if(fits) return bitDepth;
+        }
+        return 8;
+    }
+
+    inline unsigned getPaletteBitDepth(unsigned colorsAmount)
+    {
+        return (colorsAmount <= 2 ? 1 : colorsAmount <= 4 ? 2 : colorsAmount <= 16 ? 4 : 8);
+    }
+
+    void packPaletteIndices(const Byte* indices, int width, unsigned bitDepth,
+                            unsigned char* dest)
+    {
+        unsigned packedIndices = 0, packedBits = 0;
+        for(int x = 0; x < width; ++x)
+        {
+            packedIndices = (packedIndices << bitDepth) | indices[x];
+            packedBits += bitDepth;
+            if(packedBits == 8)
+            {
+                *dest++ = (unsigned char)packedIndices;
+                packedIndices = packedBits = 0;
+            }
+        }
+        if(packedBits > 0)
+            *dest = (unsigned char)(packedIndices << (8 - packedBits));
+    }
+
+    inline void packPngComponent16(UInt16 value, unsigned char* dest)
+    {
+        dest[0] = (unsigned char)(value >> 8);
+        dest[1] = (unsigned char)(value & 0xFF);
+    }
+
+    template<typename CT>
+    void convertPngRow(const CT* src, int width, int srcComponents, unsigned colorType,
+                       unsigned bitDepth, const PngPalette& palette, unsigned char* dest)
+    {
+        const bool srcHasColor = srcComponents >= 3;
+        const bool srcHasAlpha = srcComponents == 2 || srcComponents == 4;
+
+        // Palette indices, and gray values of less than 8 bits, are packed into bytes.
+        if(colorType == 3 || bitDepth < 8)
+        {
+            unsigned packedIndices = 0, packedBits = 0;
+            for(int x = 0; x < width; ++x, src += srcComponents)
+            {
+                const Byte r = componentTo8Bits(src[0]);
+                const Byte g = srcHasColor ? componentTo8Bits(src[1]) : r;
+                const Byte b = srcHasColor ? componentTo8Bits(src[2]) : r;
+                const Byte a = srcHasAlpha ? componentTo8Bits(src[srcComponents - 1]) : 255;
+                packedIndices = (packedIndices << bitDepth) |
+                    (colorType == 3 ? palette.index(r, g, b, a) : unsigned(r >> (8 - bitDepth)));
+                packedBits += bitDepth;
+                if(packedBits == 8)
+                {
+                    *dest++ = (unsigned char)packedIndices;
+                    packedIndices = packedBits = 0;
+                }
+            }
+            if(packedBits > 0)
+                *dest = (unsigned char)(packedIndices << (8 - packedBits));
+            return;
+        }
+
+        const bool writeColor = colorType == 2 || colorType == 6;
+        const bool writeAlpha = colorType == 4 || colorType == 6;
+
+        for(int x = 0; x < width; ++x, src += srcComponents)
+        {
+            CT values[4];
+            int valuesAmount = 0;
+            values[valuesAmount++] = src[0];
+            if(writeColor)
+            {
+                values[valuesAmount++] = src[1];
+                values[valuesAmount++] = src[2];
+            }
+            if(writeAlpha) values[valuesAmount++] = src[srcComponents - 1];
+
+            for(int i = 0; i < valuesAmount; ++i)
+            {
+                if(bitDepth == 16)
+                {
+                    packPngComponent16(UInt16(values[i]), dest);
+                    dest += 2;
+                }
+                else
+                    *dest++ = componentTo8Bits(values[i]);
+            }
+        }
+    }
 }
 
-
-#if !WPNGIMAGE_DISABLE_PNG_FILE_IO_SUPPORT
 //----------------------------------------------------------------------------
-// Load PNG image from file
+// Write 16-bit pixel data as big-endian bytes
 //----------------------------------------------------------------------------
-WPngImage::IOStatus WPngImage::loadImage(const char* fileName, PngReadConvert conversion)
+namespace
 {
-    IOStatus status = performLoadImage(fileName, true, conversion, kPixelFormat_RGBA8);
-    if(status != kIOStatus_Ok) status.fileName = fileName;
-    return status;
+#if WPNGIMAGE_SSE2
+    inline __m128i swapBytes16(__m128i values)
+    {
+        return _mm_or_si128(_mm_slli_epi16(values, 8), _mm_srli_epi16(values, 8));
+    }
+#endif
+
+    // Writes the pixels of src, which have srcComponents (2 or 4) components each, as the
+    // big-endian 16-bit components of a PNG row, leaving out the last (alpha) component if
+    // destComponents is one less than srcComponents.
+    void packPngRow16(const UInt16* src, int width, int srcComponents, int destComponents,
+                      unsigned char* dest)
+    {
+        int x = 0;
+#if WPNGIMAGE_SSE2
+        if(destComponents == srcComponents)
+        {
+            for(const int end = (width * srcComponents) & ~7; x < end; x += 8)
+            {
+                const __m128i values = _mm_loadu_si128((const __m128i*)(src + x));
+                _mm_storeu_si128((__m128i*)(dest + x * 2), swapBytes16(values));
+            }
+            x /= srcComponents;
+        }
+        else if(srcComponents == 4)
+        {
+            // Each pixel is stored with its alpha, which the next pixel then overwrites,
+            // so there must always be a pixel left for the loop after this one.
+            for(; x + 2 < width; x += 2)
+            {
+                const __m128i values =
+                    swapBytes16(_mm_loadu_si128((const __m128i*)(src + x * 4)));
+                _mm_storel_epi64((__m128i*)(dest + x * 6), values);
+                _mm_storel_epi64((__m128i*)(dest + x * 6 + 6), _mm_srli_si128(values, 8));
+            }
+        }
+        else
+        {
+            // The gray components are the low halves of the 32-bit lanes, which are
+            // sign-extended so that packing them with signed saturation keeps them intact.
+            for(; x + 8 <= width; x += 8)
+            {
+                const __m128i values1 = _mm_loadu_si128((const __m128i*)(src + x * 2));
+                const __m128i values2 = _mm_loadu_si128((const __m128i*)(src + x * 2 + 8));
+                const __m128i grays = _mm_packs_epi32
+                    (_mm_srai_epi32(_mm_slli_epi32(values1, 16), 16),
+                     _mm_srai_epi32(_mm_slli_epi32(values2, 16), 16));
+                _mm_storeu_si128((__m128i*)(dest + x * 2), swapBytes16(grays));
+            }
+        }
+#endif
+        src += x * srcComponents;
+        dest += x * destComponents * 2;
+        for(; x < width; ++x, src += srcComponents, dest += destComponents * 2)
+            for(int i = 0; i < destComponents; ++i)
+                packPngComponent16(src[i], dest + i * 2);
+    }
 }
 
-WPngImage::IOStatus WPngImage::loadImage(const char* fileName, PixelFormat pixelFormat)
+struct WPngImage::PngWriteInfo
 {
-    IOStatus status = performLoadImage(fileName, false, kPngReadConvert_closestMatch, pixelFormat);
-    if(status != kIOStatus_Ok) status.fileName = fileName;
-    return status;
+    // These are the values used in the PNG format itself (and thus by lodepng and libpng).
+    enum ColorType
+    {
+        kColorType_gray = 0, kColorType_RGB = 2, kColorType_palette = 3,
+        kColorType_grayAlpha = 4, kColorType_RGBA = 6
+    };
+
+    PngFileFormat fileFormat;
+    int srcX, srcY, width, height;
+    int srcComponents;
+    unsigned colorType, bitDepth, translucentColorsAmount;
+    bool hasColorKey;
+    UInt16 colorKey[3];
+    PngPalette palette;
+    std::vector<Byte> srcRow8;
+    std::vector<UInt16> srcRow16;
+    std::vector<Byte> paletteIndices;
+
+    unsigned componentsPerPixel() const
+    {
+        switch(colorType)
+        {
+          case kColorType_grayAlpha: return 2;
+          case kColorType_RGB: return 3;
+          case kColorType_RGBA: return 4;
+          default: return 1;
+        }
+    }
+
+    std::size_t rowBytes(int width, unsigned rowBitDepth) const
+    {
+        return (std::size_t(width) * componentsPerPixel() * rowBitDepth + 7) / 8;
+    }
+};
+
+// Clips the region to the image. The ends of the region are compared with subtraction, so
+// that a region reaching past INT_MAX doesn't overflow. Returns false if nothing remains of
+// the region.
+bool WPngImage::clipSaveRegion(const SaveRegion& region, int& x, int& y,
+                               int& width, int& height) const
+{
+    if(region.width <= 0 || region.height <= 0) return false;
+    x = std::max(region.x, 0);
+    y = std::max(region.y, 0);
+    const int endX = (region.x > mWidth - region.width ? mWidth : region.x + region.width);
+    const int endY = (region.y > mHeight - region.height ? mHeight : region.y + region.height);
+    if(endX <= x || endY <= y) return false;
+    width = endX - x;
+    height = endY - y;
+    return true;
 }
 
-WPngImage::IOStatus WPngImage::loadImage(const std::string& fileName, PngReadConvert conversion)
+bool WPngImage::isValidSaveRegion(const SaveRegion& region) const
 {
-    return loadImage(fileName.c_str(), conversion);
+    int x, y, width, height;
+    return clipSaveRegion(region, x, y, width, height);
 }
 
-WPngImage::IOStatus WPngImage::loadImage(const std::string& fileName, PixelFormat pixelFormat)
+// Chooses the smallest PNG color type and bit depth that can represent the pixels
+// written with the given file format losslessly: grayscale if all the pixels are gray
+// (with 1, 2 or 4 bits if the values allow it), 8 bits if the low byte of every 16-bit
+// component equals the high byte, a palette if there are at most 256 distinct colors, and
+// a color key instead of the alpha channel if the only non-opaque pixels are fully
+// transparent ones of the same color. Only the given region of the image (clipped
+// to the image) is written. If options.paletteColors is set and the pixels don't fit in a
+// palette of that size as they are, they are quantized to it, and the palette indices of
+// the whole region are stored in info.paletteIndices.
+void WPngImage::getPngWriteInfo(PngWriteInfo& info, PngFileFormat fileFormat,
+                                const SaveOptions& options, const SaveRegion& region) const
 {
-    return loadImage(fileName.c_str(), pixelFormat);
-}
+    if(fileFormat == kPngFileFormat_none)
+        fileFormat = getClosestMatchFileFormat(currentPixelFormat());
 
+    if(!clipSaveRegion(region, info.srcX, info.srcY, info.width, info.height))
+        info.srcX = info.srcY = info.width = info.height = 0;
+
+    const bool srcIsGray = (fileFormat == kPngFileFormat_GA8 ||
+                            fileFormat == kPngFileFormat_GA16);
+    const bool srcIs16Bit = (fileFormat == kPngFileFormat_GA16 ||
+                             fileFormat == kPngFileFormat_RGBA16);
+    const int imageWidth = info.width, imageHeight = info.height;
+
+    info.fileFormat = fileFormat;
+    info.translucentColorsAmount = 0;
+    info.hasColorKey = false;
+    info.palette.clear();
+    info.srcRow8.clear();
+    info.srcRow16.clear();
+    info.paletteIndices.clear();
+
+    // The region can be fully opaque even if the rest of the image isn't.
+    bool writeAlphas = !allPixelsHaveFullAlpha();
+    if(writeAlphas && (imageWidth != width() || imageHeight != height()))
+    {
+        const int components = srcIsGray ? 2 : 4;
+        unsigned alphas = ~0U;
+        for(int y = 0; y < imageHeight; ++y)
+        {
+            if(srcIs16Bit)
+            {
+                info.srcRow16.resize(imageWidth * components);
+                setPixelRow(fileFormat, info.srcX, info.srcY + y, imageWidth,
+                            &info.srcRow16[0], components);
+                for(int x = components - 1; x < imageWidth * components; x += components)
+                    alphas &= info.srcRow16[x];
+            }
+            else
+            {
+                info.srcRow8.resize(imageWidth * components);
+                setPixelRow(fileFormat, info.srcX, info.srcY + y, imageWidth,
+                            &info.srcRow8[0], components);
+                for(int x = components - 1; x < imageWidth * components; x += components)
+                    alphas &= info.srcRow8[x];
+            }
+        }
+        const unsigned maxAlpha = srcIs16Bit ? 0xFFFFU : 0xFFU;
+        writeAlphas = (alphas & maxAlpha) != maxAlpha;
+        info.srcRow8.clear();
+        info.srcRow16.clear();
+    }
 
-//----------------------------------------------------------------------------
-// Read PNG data from RAM
-//----------------------------------------------------------------------------
-WPngImage::IOStatus WPngImage::loadImageFromRAM(const void* pngData, std::size_t pngDataSize,
-                                                PngReadConvert conversion)
-{
-    return performLoadImageFromRAM
-        (pngData, pngDataSize, true, conversion, kPixelFormat_RGBA8);
-}
+    info.srcComponents = (srcIsGray ? 1 : 3) + (writeAlphas ? 1 : 0);
+    if(srcIs16Bit) info.srcRow16.resize(imageWidth * info.srcComponents);
+    else info.srcRow8.resize(imageWidth * info.srcComponents);
 
-WPngImage::IOStatus WPngImage::loadImageFromRAM(const void* pngData, std::size_t pngDataSize,
-                                                PixelFormat pixelFormat)
-{
-    return performLoadImageFromRAM
-        (pngData, pngDataSize, false, kPngReadConvert_closestMatch, pixelFormat);
-}
+    PngColorAnalysis analysis = { srcIsGray, !srcIs16Bit, false, false, false, { 0, 0, 0 } };
+    bool fitsInRequestedPalette = false;
+    unsigned grayBitDepth = 8;
 
+    if(options.reduceColors)
+    {
+        analysis.isGray = analysis.fitsIn8Bits = analysis.fitsInPalette = true;
+        analysis.fitsInColorKey = writeAlphas;
+        for(int y = 0; y < imageHeight; ++y)
+        {
+            bool continueAnalysis;
+            if(srcIs16Bit)
+            {
+                setPixelRow(fileFormat, info.srcX, info.srcY + y, imageWidth,
+                            &info.srcRow16[0], info.srcComponents);
+                continueAnalysis = analyzePngRow(&info.srcRow16[0], imageWidth,
+                                                 info.srcComponents, UInt16(65535),
+                                                 analysis, info.palette);
+            }
+            else
+            {
+                setPixelRow(fileFormat, info.srcX, info.srcY + y, imageWidth,
+                            &info.srcRow8[0], info.srcComponents);
+                continueAnalysis = analyzePngRow(&info.srcRow8[0], imageWidth,
+                                                 info.srcComponents, Byte(255),
+                                                 analysis, info.palette);
+            }
+            if(!continueAnalysis) break;
+        }
 
-//============================================================================
-// Write PNG data
-//============================================================================
-template<typename CT>
-static void setColorComponentsG(CT* dest, int colorComponents, const PixelG<CT>& pixel)
-{
-    dest[0] = pixel.g;
-    if(colorComponents > 1) dest[1] = pixel.a;
-}
+        // The palette has all the gray values if they fit in it.
+        if(analysis.isGray && analysis.fitsInPalette && !writeAlphas)
+            grayBitDepth = getGrayBitDepth(info.palette);
+
+        // A palette takes space of its own, so it's only used if it makes the pixel data
+        // smaller than a grayscale image would be, and the image isn't tiny.
+        const unsigned colorsAmount = info.palette.colorsAmount();
+        fitsInRequestedPalette = analysis.fitsInPalette && colorsAmount <= options.paletteColors;
+        analysis.fitsInPalette = analysis.fitsInPalette &&
+            std::size_t(imageWidth) * std::size_t(imageHeight) >= colorsAmount * 2 &&
+            (writeAlphas || !analysis.isGray ||
+             (colorsAmount <= 16 && grayBitDepth > getPaletteBitDepth(colorsAmount)));
+    }
 
-template<typename CT, typename Pixel_t>
-static void setColorComponents(CT* dest, int colorComponents, const Pixel_t& pixel)
-{
-    dest[0] = pixel.r;
-    dest[1] = pixel.g;
-    dest[2] = pixel.b;
-    if(colorComponents > 3) dest[3] = pixel.a;
-}
+    std::vector<Byte> quantizedColors;
+    if(options.paletteColors > 0 && !fitsInRequestedPalette && imageWidth > 0 && imageHeight > 0)
+    {
+        std::vector<Byte> rgba(std::size_t(imageWidth) * std::size_t(imageHeight) * 4);
+        for(int y = 0; y < imageHeight; ++y)
+        {
+            Byte* row = &rgba[std::size_t(y) * imageWidth * 4];
+            setPixelRow(srcIsGray ? kPngFileFormat_GA8 : kPngFileFormat_RGBA8,
+                        info.srcX, info.srcY + y, imageWidth, row, 4);
+            if(srcIsGray)
+                for(Byte* color = row; color < row + imageWidth * 4; color += 4)
+                {
+                    color[3] = color[1];
+                    color[1] = color[2] = color[0];
+                }
+        }
 
-void WPngImage::setPixelRow
-(PngFileFormat fileFormat, int y, Byte* dest, int colorComponents) const
-{
-    const int imageWidth = width();
-    const std::size_t indexStart = y * imageWidth;
+        quantizeRGBA8(&rgba[0], imageWidth, imageHeight, std::min(options.paletteColors, 256U),
+                      options.ditherPalette, getThreadsAmount(options.threadsAmount),
+                      quantizedColors, info.paletteIndices);
+        info.palette.clear();
+        for(std::size_t i = 0; i < quantizedColors.size(); i += 4)
+            info.palette.add(quantizedColors[i], quantizedColors[i + 1],
+                             quantizedColors[i + 2], quantizedColors[i + 3]);
+        analysis.fitsInPalette = true;
+    }
 
-    switch(fileFormat)
+    if(analysis.fitsInPalette)
     {
-      case kPngFileFormat_GA8:
-          for(int x = 0; x < imageWidth; ++x)
-              setColorComponentsG(dest + (x * colorComponents), colorComponents,
-                                  mData->getPixelG8(indexStart + x));
-          break;
+        const unsigned colorsAmount = info.palette.colorsAmount();
+        info.colorType = PngWriteInfo::kColorType_palette;
+        info.bitDepth = getPaletteBitDepth(colorsAmount);
+        info.translucentColorsAmount = info.palette.putTranslucentColorsFirst();
+    }
+    else
+    {
+        // The color key can't be used if some opaque pixel has the same color.
+        if(analysis.fitsInColorKey && analysis.colorKeyFound)
+        {
+            for(int y = 0; y < imageHeight && analysis.fitsInColorKey; ++y)
+            {
+                if(srcIs16Bit)
+                {
+                    setPixelRow(fileFormat, info.srcX, info.srcY + y, imageWidth,
+                                &info.srcRow16[0], info.srcComponents);
+                    analysis.fitsInColorKey = colorKeyIsUnused
+                        (&info.srcRow16[0], imageWidth, info.srcComponents, analysis.colorKey);
+                }
+                else
+                {
+                    setPixelRow(fileFormat, info.srcX, info.srcY + y, imageWidth,
+                                &info.srcRow8[0], info.srcComponents);
+                    analysis.fitsInColorKey = colorKeyIsUnused
+                        (&info.srcRow8[0], imageWidth, info.srcComponents, analysis.colorKey);
+                }
+            }
+            info.hasColorKey = analysis.fitsInColorKey;
+        }
 
-      case kPngFileFormat_RGBA8:
-          for(int x = 0; x < imageWidth; ++x)
-              setColorComponents(dest + (x * colorComponents), colorComponents,
-                                 mData->getPixel8(indexStart + x));
-          break;
+        const bool writeAlphaChannel = writeAlphas && !info.hasColorKey;
+        if(analysis.isGray)
+            info.colorType = (writeAlphaChannel ? PngWriteInfo::kColorType_grayAlpha :
+                              PngWriteInfo::kColorType_gray);
+        else
+            info.colorType = (writeAlphaChannel ? PngWriteInfo::kColorType_RGBA :
+                              PngWriteInfo::kColorType_RGB);
+        info.bitDepth = analysis.fitsIn8Bits ? grayBitDepth : 16;
 
-      default: break;
+        for(unsigned i = 0; i < 3; ++i)
+            info.colorKey[i] = (srcIs16Bit && info.bitDepth == 8 ?
+                                UInt16(analysis.colorKey[i] >> 8) : analysis.colorKey[i]);
+    }
+
+    // The quantized colors were reordered in the palette, and the same color may appear
+    // in it only once.
+    if(!quantizedColors.empty())
+    {
+        Byte newIndices[256];
+        for(std::size_t i = 0; i < quantizedColors.size(); i += 4)
+            newIndices[i / 4] = info.palette.index(quantizedColors[i], quantizedColors[i + 1],
+                                                   quantizedColors[i + 2],
+                                                   quantizedColors[i + 3]);
+        for(std::size_t i = 0; i < info.paletteIndices.size(); ++i)
+            info.paletteIndices[i] = newIndices[info.paletteIndices[i]];
     }
 }
 
-void WPngImage::setPixelRow
-(PngFileFormat fileFormat, int y, UInt16* dest, int colorComponents) const
+// Writes the row in the chosen PNG format. rowBitDepth can be larger than the bit depth
+// of a palette image, in which case each index takes a whole byte.
+// y is relative to the saved region.
+void WPngImage::setPngRow(PngWriteInfo& info, int y, unsigned char* dest,
+                          unsigned rowBitDepth) const
 {
-    const int imageWidth = width();
-    const std::size_t indexStart = y * imageWidth;
+    const int imageWidth = info.width;
+    if(imageWidth == 0) return;
 
-    switch(fileFormat)
+    if(!info.paletteIndices.empty())
     {
-      case kPngFileFormat_GA16:
-          for(int x = 0; x < imageWidth; ++x)
-              setColorComponentsG(dest + (x * colorComponents), colorComponents,
-                                  mData->getPixelG16(indexStart + x));
-          break;
+        packPaletteIndices(&info.paletteIndices[std::size_t(y) * imageWidth], imageWidth,
+                           rowBitDepth, dest);
+        return;
+    }
 
-      case kPngFileFormat_RGBA16:
-          for(int x = 0; x < imageWidth; ++x)
-              setColorComponents(dest + (x * colorComponents), colorComponents,
-                                 mData->getPixel16(indexStart + x));
-          break;
+    if(info.srcRow16.empty())
+    {
+        if(rowBitDepth == 8 && info.componentsPerPixel() == unsigned(info.srcComponents) &&
+           info.colorType != PngWriteInfo::kColorType_palette)
+        {
+            setPixelRow(info.fileFormat, info.srcX, info.srcY + y, imageWidth,
+                        dest, info.srcComponents);
+            return;
+        }
 
-      default: break;
+        setPixelRow(info.fileFormat, info.srcX, info.srcY + y, imageWidth,
+                    &info.srcRow8[0], info.srcComponents);
+        convertPngRow(&info.srcRow8[0], imageWidth, info.srcComponents, info.colorType,
+                      rowBitDepth, info.palette, dest);
+    }
+    else
+    {
+        // Images stored with 16-bit components are written directly from the pixel data
+        // if the PNG has the same components (possibly without the alpha).
+        const std::size_t pixelIndex =
+            mData->mLayout.storageIndex(std::size_t(info.srcY + y) * width() + info.srcX);
+        const int writeComponents = int(info.componentsPerPixel());
+        if(rowBitDepth == 16 && info.colorType != PngWriteInfo::kColorType_palette)
+        {
+            if(mData->mPixelFormat == kPixelFormat_RGBA16 &&
+               info.fileFormat == kPngFileFormat_RGBA16 && writeComponents >= 3)
+            {
+                const Pixel16* pixels =
+                    &static_cast<const PngData<Pixel16>*>(mData)->mPixelData[pixelIndex];
+                packPngRow16(&pixels->r, imageWidth, 4, writeComponents, dest);
+                return;
+            }
+            if(mData->mPixelFormat == kPixelFormat_GA16 &&
+               info.fileFormat == kPngFileFormat_GA16)
+            {
+                const PixelG16* pixels =
+                    &static_cast<const PngData<PixelG16>*>(mData)->mPixelData[pixelIndex];
+                packPngRow16(&pixels->g, imageWidth, 2, writeComponents, dest);
+                return;
+            }
+        }
+
+        setPixelRow(info.fileFormat, info.srcX, info.srcY + y, imageWidth,
+                    &info.srcRow16[0], info.srcComponents);
+        convertPngRow(&info.srcRow16[0], imageWidth, info.srcComponents, info.colorType,
+                      rowBitDepth, info.palette, dest);
     }
 }
 
@@ -2977,20 +7017,46 @@ void WPngImage::setPixelRow
 //----------------------------------------------------------------------------
 WPngImage::IOStatus WPngImage::saveImage(const char* fileName, PngFileFormat fileFormat) const
 {
-    IOStatus status = performSaveImage(fileName, fileFormat);
-    if(status != kIOStatus_Ok) status.fileName = fileName;
-    return status;
+    return saveImage(fileName, SaveOptions(), fileFormat);
 }
 
 WPngImage::IOStatus WPngImage::saveImage
 (const char* fileName, PngWriteConvert conversion) const
 {
-    IOStatus status = performSaveImage
-        (fileName, getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+    return saveImage(fileName, SaveOptions(), conversion);
+}
+
+WPngImage::IOStatus WPngImage::saveImage
+(const char* fileName, const SaveOptions& options, PngFileFormat fileFormat) const
+{
+    return saveImage(fileName, 0, 0, mWidth, mHeight, options, fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::saveImage
+(const char* fileName, const SaveOptions& options, PngWriteConvert conversion) const
+{
+    return saveImage(fileName, options,
+                     getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::saveImage
+(const char* fileName, int x, int y, int width, int height, const SaveOptions& options,
+ PngFileFormat fileFormat) const
+{
+    const SaveRegion region = { x, y, width, height };
+    IOStatus status = performSaveImage(fileName, fileFormat, options, region, 0);
     if(status != kIOStatus_Ok) status.fileName = fileName;
     return status;
 }
 
+WPngImage::IOStatus WPngImage::saveImage
+(const char* fileName, int x, int y, int width, int height, const SaveOptions& options,
+ PngWriteConvert conversion) const
+{
+    return saveImage(fileName, x, y, width, height, options,
+                     getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+}
+
 WPngImage::IOStatus WPngImage::saveImage
 (const std::string& fileName, PngWriteConvert conversion) const
 {
@@ -3003,6 +7069,32 @@ WPngImage::IOStatus WPngImage::saveImage
     return saveImage(fileName.c_str(), fileFormat);
 }
 
+WPngImage::IOStatus WPngImage::saveImage
+(const std::string& fileName, const SaveOptions& options, PngWriteConvert conversion) const
+{
+    return saveImage(fileName.c_str(), options, conversion);
+}
+
+WPngImage::IOStatus WPngImage::saveImage
+(const std::string& fileName, const SaveOptions& options, PngFileFormat fileFormat) const
+{
+    return saveImage(fileName.c_str(), options, fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::saveImage
+(const std::string& fileName, int x, int y, int width, int height, const SaveOptions& options,
+ PngWriteConvert conversion) const
+{
+    return saveImage(fileName.c_str(), x, y, width, height, options, conversion);
+}
+
+WPngImage::IOStatus WPngImage::saveImage
+(const std::string& fileName, int x, int y, int width, int height, const SaveOptions& options,
+ PngFileFormat fileFormat) const
+{
+    return saveImage(fileName.c_str(), x, y, width, height, options, fileFormat);
+}
+
 
 //----------------------------------------------------------------------------
 // Write PNG data to RAM
@@ -3010,7 +7102,7 @@ WPngImage::IOStatus WPngImage::saveImage
 WPngImage::IOStatus WPngImage::saveImageToRAM(std::vector<unsigned char>& dest,
                                               PngFileFormat fileFormat) const
 {
-    return performSaveImageToRAM(&dest, 0, fileFormat);
+    return performSaveImageToRAM(&dest, 0, fileFormat, SaveOptions(), wholeImageRegion(), 0);
 }
 
 WPngImage::IOStatus WPngImage::saveImageToRAM(std::vector<unsigned char>& dest,
@@ -3020,10 +7112,44 @@ WPngImage::IOStatus WPngImage::saveImageToRAM(std::vector<unsigned char>& dest,
         (dest, getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
 }
 
+WPngImage::IOStatus WPngImage::saveImageToRAM(std::vector<unsigned char>& dest,
+                                              const SaveOptions& options,
+                                              PngFileFormat fileFormat) const
+{
+    return performSaveImageToRAM(&dest, 0, fileFormat, options, wholeImageRegion(), 0);
+}
+
+WPngImage::IOStatus WPngImage::saveImageToRAM(std::vector<unsigned char>& dest,
+                                              const SaveOptions& options,
+                                              PngWriteConvert conversion) const
+{
+    return saveImageToRAM
+        (dest, options, getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::saveImageToRAM(std::vector<unsigned char>& dest,
+                                              int x, int y, int width, int height,
+                                              const SaveOptions& options,
+                                              PngFileFormat fileFormat) const
+{
+    const SaveRegion region = { x, y, width, height };
+    return performSaveImageToRAM(&dest, 0, fileFormat, options, region, 0);
+}
+
+WPngImage::IOStatus WPngImage::saveImageToRAM(std::vector<unsigned char>& dest,
+                                              int x, int y, int width, int height,
+                                              const SaveOptions& options,
+                                              PngWriteConvert conversion) const
+{
+    return saveImageToRAM
+        (dest, x, y, width, height, options,
+         getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+}
+
 WPngImage::IOStatus WPngImage::saveImageToRAM(ByteStreamOutputFunc destFunc,
                                               PngFileFormat fileFormat) const
 {
-    return performSaveImageToRAM(0, destFunc, fileFormat);
+    return performSaveImageToRAM(0, destFunc, fileFormat, SaveOptions(), wholeImageRegion(), 0);
 }
 
 WPngImage::IOStatus WPngImage::saveImageToRAM(ByteStreamOutputFunc destFunc,
@@ -3033,6 +7159,41 @@ WPngImage::IOStatus WPngImage::saveImageToRAM(ByteStreamOutputFunc destFunc,
         (destFunc, getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
 }
 
+WPngImage::IOStatus WPngImage::saveImageToRAM(ByteStreamOutputFunc destFunc,
+                                              const SaveOptions& options,
+                                              PngFileFormat fileFormat) const
+{
+    return performSaveImageToRAM(0, destFunc, fileFormat, options, wholeImageRegion(), 0);
+}
+
+WPngImage::IOStatus WPngImage::saveImageToRAM(ByteStreamOutputFunc destFunc,
+                                              const SaveOptions& options,
+                                              PngWriteConvert conversion) const
+{
+    return saveImageToRAM
+        (destFunc, options,
+         getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::saveImageToRAM(ByteStreamOutputFunc destFunc,
+                                              int x, int y, int width, int height,
+                                              const SaveOptions& options,
+                                              PngFileFormat fileFormat) const
+{
+    const SaveRegion region = { x, y, width, height };
+    return performSaveImageToRAM(0, destFunc, fileFormat, options, region, 0);
+}
+
+WPngImage::IOStatus WPngImage::saveImageToRAM(ByteStreamOutputFunc destFunc,
+                                              int x, int y, int width, int height,
+                                              const SaveOptions& options,
+                                              PngWriteConvert conversion) const
+{
+    return saveImageToRAM
+        (destFunc, x, y, width, height, options,
+         getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+}
+
 
 //============================================================================
 // WPngImage::IOStatus implementations
@@ -3061,6 +7222,13 @@ bool WPngImage::IOStatus::printErrorMsg(std::ostream& os) const
               os << ": " << pngLibErrorMsg;
           os << "\n";
           return true;
+
+      case WPngImage::kIOStatus_Error_InvalidRegion:
+          os << "Error writing ";
+          if(fileName.empty()) os << "PNG data";
+          else os << fileName;
+          os << ": The region to save is outside the image.\n";
+          return true;
     }
     return false;
 }
@@ -3112,11 +7280,48 @@ namespace
                 WPngImage::UInt16(rawImageData[index + 1]));
     }
 
-    inline void setPNGComponent16
-    (std::vector<unsigned char>& rawImageData, std::size_t index, WPngImage::UInt16 value)
+    // lodepng's custom_deflate and custom_inflate hooks, which call a CompressionBackend.
+    struct CompressionBackendContext
+    {
+        WPngImage::CompressionBackend* backend;
+        WPngImage::PngCompression compression;
+    };
+
+    // lodepng frees and reallocates its buffers with its own allocation functions, which
+    // may be custom ones.
+    unsigned appendToLodepngBuffer(unsigned char** out, std::size_t* outsize,
+                                   const std::vector<unsigned char>& data)
+    {
+        if(data.empty()) return 0;
+        unsigned char* newBuffer =
+            static_cast<unsigned char*>(lodepng_realloc(*out, *outsize + data.size()));
+        if(!newBuffer) return 83;
+        std::memcpy(newBuffer + *outsize, &data[0], data.size());
+        *out = newBuffer;
+        *outsize += data.size();
+        return 0;
+    }
+
+    unsigned backendDeflate(unsigned char** out, std::size_t* outsize,
+                            const unsigned char* in, std::size_t insize,
+                            const LodePNGCompressSettings* settings)
     {
-        rawImageData[index] = (unsigned char)(value >> 8);
-        rawImageData[index + 1] = (unsigned char)value;
+        const CompressionBackendContext* context =
+            static_cast<const CompressionBackendContext*>(settings->custom_context);
+        std::vector<unsigned char> data;
+        if(!context->backend->deflate(data, in, insize, context->compression)) return 1;
+        return appendToLodepngBuffer(out, outsize, data);
+    }
+
+    unsigned backendInflate(unsigned char** out, std::size_t* outsize,
+                            const unsigned char* in, std::size_t insize,
+                            const LodePNGDecompressSettings* settings)
+    {
+        const CompressionBackendContext* context =
+            static_cast<const CompressionBackendContext*>(settings->custom_context);
+        std::vector<unsigned char> data;
+        if(!context->backend->inflate(data, in, insize)) return 1;
+        return appendToLodepngBuffer(out, outsize, data);
     }
 }
 
@@ -3124,7 +7329,8 @@ namespace
 // Load PNG image from file
 //----------------------------------------------------------------------------
 WPngImage::IOStatus WPngImage::performLoadImage
-(const char* fileName, bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat)
+(const char* fileName, bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat,
+ CompressionBackend* backend)
 {
     FilePtr iFile;
     iFile.fp = std::fopen(fileName, "rb");
@@ -3134,10 +7340,13 @@ WPngImage::IOStatus WPngImage::performLoadImage
     const std::size_t fileSize = std::size_t(std::ftell(iFile.fp));
     std::fseek(iFile.fp, 0, SEEK_SET);
 
-    std::vector<unsigned char> buffer(fileSize);
+    std::vector<unsigned char, AlignedAllocator<unsigned char> > buffer
+        (fileSize, 0, AlignedAllocator<unsigned char>
+         (mMemoryResource ? mMemoryResource : defaultMemoryResource()));
     std::fread(&buffer[0], 1, fileSize, iFile.fp);
 
-    return performLoadImageFromRAM(&buffer[0], fileSize, useConversion, conversion, pixelFormat);
+    return performLoadImageFromRAM(&buffer[0], fileSize, useConversion, conversion, pixelFormat,
+                                   backend);
 }
 
 //----------------------------------------------------------------------------
@@ -3145,7 +7354,8 @@ WPngImage::IOStatus WPngImage::performLoadImage
 //----------------------------------------------------------------------------
 WPngImage::IOStatus WPngImage::performLoadImageFromRAM
 (const void* pngData, std::size_t pngDataSize,
- bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat)
+ bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat,
+ CompressionBackend* backend)
 {
     unsigned imageWidth = 0, imageHeight = 0;
 
@@ -3160,10 +7370,20 @@ WPngImage::IOStatus WPngImage::performLoadImageFromRAM
     const unsigned colorType = state.info_png.color.colortype;
     const PngFileFormat fileFormat = ::getFileFormat(bitDepth, colorType);
 
+    CompressionBackendContext backendContext;
+    backendContext.backend = backend ? backend : gDefaultCompressionBackend;
+    backendContext.compression = kPngCompression_default;
+    if(backendContext.backend)
+    {
+        state.decoder.zlibsettings.custom_inflate = &backendInflate;
+        state.decoder.zlibsettings.custom_context = &backendContext;
+    }
+
     std::vector<unsigned char> rawImageData;
-    errorCode = lodepng::decode(rawImageData, imageWidth, imageHeight,
-                                reinterpret_cast<const unsigned char*>(pngData), pngDataSize,
-                                LCT_RGBA, bitDepth);
+    state.info_raw.colortype = LCT_RGBA;
+    state.info_raw.bitdepth = bitDepth;
+    errorCode = lodepng::decode(rawImageData, imageWidth, imageHeight, state,
+                                reinterpret_cast<const unsigned char*>(pngData), pngDataSize);
 
     if(errorCode != 0)
         return IOStatus(kIOStatus_Error_PNGLibraryError, lodepng_error_text(errorCode));
@@ -3174,46 +7394,91 @@ WPngImage::IOStatus WPngImage::performLoadImageFromRAM
 
     setFileFormat(fileFormat);
 
+    unsigned alphas = 0xFFFF;
+
     if(bitDepth == 16)
     {
         assert(rawImageData.size() == imageWidth * imageHeight * 8);
         for(std::size_t srcIndex = 0, destIndex = 0;
             srcIndex < rawImageData.size();
             srcIndex += 8, ++destIndex)
+        {
+            const UInt16 alpha = getPNGComponent16(rawImageData, srcIndex + 6);
+            alphas &= alpha;
             setPixel(destIndex,
                      Pixel16(getPNGComponent16(rawImageData, srcIndex),
                              getPNGComponent16(rawImageData, srcIndex + 2),
-                             getPNGComponent16(rawImageData, srcIndex + 4),
-                             getPNGComponent16(rawImageData, srcIndex + 6)));
+                             getPNGComponent16(rawImageData, srcIndex + 4), alpha));
+        }
     }
     else
     {
         assert(rawImageData.size() == imageWidth * imageHeight * 4);
+        alphas = 0xFF;
         for(std::size_t srcIndex = 0, destIndex = 0;
             srcIndex < rawImageData.size();
             srcIndex += 4, ++destIndex)
+        {
+            alphas &= rawImageData[srcIndex + 3];
             setPixel(destIndex,
                      Pixel8(rawImageData[srcIndex], rawImageData[srcIndex + 1],
                             rawImageData[srcIndex + 2], rawImageData[srcIndex + 3]));
+        }
     }
 
+    if(alphas == (bitDepth == 16 ? 0xFFFFU : 0xFFU))
+        mData->mOpacity = PngDataBase::kOpacity_allOpaque;
+
     return kIOStatus_Ok;
 }
 
+//----------------------------------------------------------------------------
+// Buffers kept by WPngImage::Encoder between images
+//----------------------------------------------------------------------------
+// The raw image data comes from the memory resource of the image when saving without an
+// Encoder, and from the default memory resource at the time of its creation otherwise.
+struct WPngImage::Encoder::Buffers
+{
+    PngWriteInfo info;
+    std::vector<unsigned char, AlignedAllocator<unsigned char> > rawImageData;
+    std::vector<unsigned char> pngData;
+    LodePNGDeflateCache* deflateCache;
+    LodePNGEncoderBuffers* lodepngBuffers;
+    const Deadline* deadline; // if set, encoding fails when it passes
+
+    explicit Buffers(MemoryResource* resource = defaultMemoryResource()):
+        rawImageData(AlignedAllocator<unsigned char>(resource)), deflateCache(0),
+        lodepngBuffers(0), deadline(0) {}
+    ~Buffers()
+    {
+        lodepng_deflate_cache_delete(deflateCache);
+        lodepng_encoder_buffers_delete(lodepngBuffers);
+    }
+
+ private:
+    Buffers(const Buffers&);
+    Buffers& operator=(const Buffers&);
+};
+
 //----------------------------------------------------------------------------
 // Save PNG image to file
 //----------------------------------------------------------------------------
-WPngImage::IOStatus
-WPngImage::performSaveImage(const char* fileName, PngFileFormat fileFormat) const
+WPngImage::IOStatus WPngImage::performSaveImage
+(const char* fileName, PngFileFormat fileFormat, const SaveOptions& options,
+ const SaveRegion& region, Encoder::Buffers* encoderBuffers) const
 {
     if(!mData) return kIOStatus_Ok;
+    if(!isValidSaveRegion(region)) return kIOStatus_Error_InvalidRegion;
 
     FilePtr oFile;
     oFile.fp = std::fopen(fileName, "wb");
     if(!oFile.fp) return IOStatus(kIOStatus_Error_CantOpenFile, errno);
 
-    std::vector<unsigned char> buffer;
-    const IOStatus status = performSaveImageToRAM(&buffer, 0, fileFormat);
+    std::vector<unsigned char> localBuffer;
+    std::vector<unsigned char>& buffer = encoderBuffers ? encoderBuffers->pngData : localBuffer;
+    buffer.clear();
+    const IOStatus status = performSaveImageToRAM(&buffer, 0, fileFormat, options, region,
+                                                  encoderBuffers);
     if(status != kIOStatus_Ok) return status;
 
     std::fwrite(&buffer[0], 1, buffer.size(), oFile.fp);
@@ -3223,74 +7488,260 @@ WPngImage::performSaveImage(const char* fileName, PngFileFormat fileFormat) cons
 //----------------------------------------------------------------------------
 // Write PNG data to RAM
 //----------------------------------------------------------------------------
-WPngImage::IOStatus WPngImage::performSaveImageToRAM
-(std::vector<unsigned char>* destVector, ByteStreamOutputFunc destFunc,
- PngFileFormat fileFormat) const
+namespace
 {
-    if(!mData) return kIOStatus_Ok;
+    LodePNGFilterStrategy getLodepngFilterStrategy(WPngImage::PngFilterStrategy strategy)
+    {
+        switch(strategy)
+        {
+          case WPngImage::kPngFilterStrategy_none: return LFS_ZERO;
+          case WPngImage::kPngFilterStrategy_sub: return LFS_ONE;
+          case WPngImage::kPngFilterStrategy_up: return LFS_TWO;
+          case WPngImage::kPngFilterStrategy_average: return LFS_THREE;
+          case WPngImage::kPngFilterStrategy_paeth: return LFS_FOUR;
+          case WPngImage::kPngFilterStrategy_minSum: return LFS_MINSUM;
+          case WPngImage::kPngFilterStrategy_entropy: return LFS_ENTROPY;
+          case WPngImage::kPngFilterStrategy_bruteForce: return LFS_BRUTE_FORCE;
+        }
+        return LFS_MINSUM;
+    }
 
-    if(fileFormat == kPngFileFormat_none)
-        fileFormat = getClosestMatchFileFormat(currentPixelFormat());
+    void setLodepngCompression(LodePNGCompressSettings& settings,
+                               WPngImage::PngCompression compression)
+    {
+        switch(compression)
+        {
+          case WPngImage::kPngCompression_huffmanOnly: settings.use_lz77 = 0; break;
+          case WPngImage::kPngCompression_rle: settings.use_rle = 1; break;
+          case WPngImage::kPngCompression_fastest:
+              settings.greedy_chainlength = 1;
+              settings.windowsize = 32768;
+              break;
+          case WPngImage::kPngCompression_fast:
+              settings.greedy_chainlength = 8;
+              settings.nicematch = 32;
+              settings.windowsize = 32768;
+              break;
+          case WPngImage::kPngCompression_default: break;
+          case WPngImage::kPngCompression_maximum: settings.squeeze_iterations = 15; break;
+        }
+    }
+
+    // For the maximum compression each adaptive filter strategy is tried with the default
+    // compression, which predicts well enough which one compresses best, and the best one
+    // is used for the actual (much slower) compression.
+    unsigned selectMaximumCompressionFilters(lodepng::State& state,
+                                             const unsigned char* rawImageData,
+                                             unsigned width, unsigned height)
+    {
+        static const LodePNGFilterStrategy kStrategies[] =
+            { LFS_MINSUM, LFS_ENTROPY, LFS_BRUTE_FORCE };
+        const unsigned squeezeIterations = state.encoder.zlibsettings.squeeze_iterations;
+        state.encoder.zlibsettings.squeeze_iterations = 0;
+
+        std::vector<unsigned char> pngData;
+        std::size_t smallestSize = 0;
+        LodePNGFilterStrategy bestStrategy = kStrategies[0];
+        unsigned errorCode = 0;
+        for(std::size_t i = 0; i < sizeof(kStrategies) / sizeof(*kStrategies); ++i)
+        {
+            pngData.clear();
+            state.encoder.filter_strategy = kStrategies[i];
+            errorCode = lodepng::encode(pngData, rawImageData, width, height, state);
+            if(errorCode != 0) break;
+            if(i == 0 || pngData.size() < smallestSize)
+            {
+                smallestSize = pngData.size();
+                bestStrategy = kStrategies[i];
+            }
+        }
 
-    unsigned bitDepth = 8, bytesPerComponent = 1;
-    LodePNGColorType colorType = LCT_RGBA;
-    int colorComponents = 4;
-    const bool writeAlphas = !allPixelsHaveFullAlpha();
+        state.encoder.filter_strategy = bestStrategy;
+        state.encoder.zlibsettings.squeeze_iterations = squeezeIterations;
+        return errorCode;
+    }
 
-    switch(fileFormat)
+    // Returned by the jobs when the deadline has passed. (It's not a lodepng error code.)
+    const unsigned kDeadlinePassedErrorCode = 10000;
+
+    struct ParallelFilterContext
     {
-      case kPngFileFormat_GA16:
-          bitDepth = 16;
-          bytesPerComponent = 2;
-          colorType = writeAlphas ? LCT_GREY_ALPHA : LCT_GREY;
-          colorComponents = writeAlphas ? 2 : 1;
-          break;
+        unsigned threadsAmount, minRowsPerJob;
+        const Deadline* deadline;
+    };
 
-      case kPngFileFormat_GA8:
-          colorType = writeAlphas ? LCT_GREY_ALPHA : LCT_GREY;
-          colorComponents = writeAlphas ? 2 : 1;
-          break;
+    struct ParallelFilterJob
+    {
+        unsigned (*run)(void*, unsigned, unsigned);
+        void* data;
+        unsigned rowsAmount, rowsPerJob;
+        const Deadline* deadline;
+        std::vector<unsigned> errors;
 
-      case kPngFileFormat_RGBA16:
-          bitDepth = 16;
-          bytesPerComponent = 2;
-          colorType = writeAlphas ? LCT_RGBA : LCT_RGB;
-          colorComponents = writeAlphas ? 4 : 3;
-          break;
+        void operator()(std::size_t jobIndex, unsigned)
+        {
+            const unsigned begin = unsigned(jobIndex) * rowsPerJob;
+            const unsigned end = std::min(begin + rowsPerJob, rowsAmount);
+            errors[jobIndex] = (deadline && deadline->passed() ?
+                                kDeadlinePassedErrorCode : run(data, begin, end));
+        }
+    };
 
-      case kPngFileFormat_none:
-      case kPngFileFormat_RGBA8:
-          colorType = writeAlphas ? LCT_RGBA : LCT_RGB;
-          colorComponents = writeAlphas ? 4 : 3;
-          break;
+    // Called by lodepng to filter the scanlines of the image. The scanlines are split into
+    // a few jobs per thread (so that uneven rows even out), but each job is kept large
+    // enough that the threading overhead stays negligible.
+    unsigned runParallelFilter(unsigned (*run)(void*, unsigned, unsigned),
+                               void* data, unsigned rowsAmount, const void* context)
+    {
+        const ParallelFilterContext& filterContext =
+            *static_cast<const ParallelFilterContext*>(context);
+
+        ParallelFilterJob job;
+        job.run = run;
+        job.data = data;
+        job.rowsAmount = rowsAmount;
+        job.deadline = filterContext.deadline;
+        job.rowsPerJob = std::max((rowsAmount + filterContext.threadsAmount * 4 - 1) /
+                                  (filterContext.threadsAmount * 4),
+                                  filterContext.minRowsPerJob);
+        const unsigned jobsAmount = (rowsAmount + job.rowsPerJob - 1) / job.rowsPerJob;
+        job.errors.resize(jobsAmount, 0);
+
+        runJobs(jobsAmount, filterContext.threadsAmount, job);
+
+        for(unsigned i = 0; i < jobsAmount; ++i)
+            if(job.errors[i]) return job.errors[i];
+        return 0;
     }
+}
 
-    const unsigned imageWidth = unsigned(width()), imageHeight = unsigned(height());
-    const unsigned rowSize = imageWidth * colorComponents * bytesPerComponent;
-    std::vector<unsigned char> rawImageData(imageHeight * rowSize);
-
-    if(bytesPerComponent == 1)
+WPngImage::IOStatus WPngImage::performSaveImageToRAM
+(std::vector<unsigned char>* destVector, ByteStreamOutputFunc destFunc,
+ PngFileFormat fileFormat, const SaveOptions& options, const SaveRegion& region,
+ Encoder::Buffers* encoderBuffers) const
+{
+    if(!mData) return kIOStatus_Ok;
+    if(!isValidSaveRegion(region)) return kIOStatus_Error_InvalidRegion;
+
+    Encoder::Buffers localBuffers(mData->mMemoryResource);
+    Encoder::Buffers& buffers = encoderBuffers ? *encoderBuffers : localBuffers;
+    if(encoderBuffers && !buffers.deflateCache)
+        buffers.deflateCache = lodepng_deflate_cache_new();
+    if(encoderBuffers && !buffers.lodepngBuffers)
+        buffers.lodepngBuffers = lodepng_encoder_buffers_new();
+
+    PngWriteInfo& info = buffers.info;
+    getPngWriteInfo(info, fileFormat, options, region);
+
+    // Palette indices are given to lodepng one per byte, and it packs them itself.
+    const unsigned imageWidth = unsigned(info.width), imageHeight = unsigned(info.height);
+    const unsigned rawBitDepth = std::max(info.bitDepth, 8U);
+    const std::size_t rowSize = info.rowBytes(int(imageWidth), rawBitDepth);
+    std::vector<unsigned char, AlignedAllocator<unsigned char> >& rawImageData =
+        buffers.rawImageData;
+    const unsigned char* rawData = 0;
+
+    // Whole rows of 8-bit RGBA pixels, written as such, are given to lodepng directly if
+    // they are contiguous.
+    if(info.colorType == PngWriteInfo::kColorType_RGBA && info.bitDepth == 8 &&
+       mData->mPixelFormat == kPixelFormat_RGBA8 && info.srcX == 0 && info.width == mWidth &&
+       info.height > 0 && (mData->mLayout.stride == mData->mLayout.length || info.height == 1))
     {
-        for(unsigned y = 0, index = 0; y < imageHeight; ++y, index += rowSize)
-            setPixelRow(fileFormat, y, &rawImageData[index], colorComponents);
+        const Pixel8* pixels = &static_cast<const PngData<Pixel8>*>(mData)->mPixelData
+            [mData->mLayout.storageIndex(std::size_t(info.srcY) * mWidth)];
+        rawData = &pixels->r;
     }
     else
     {
-        std::vector<UInt16> rowBuffer(imageWidth * colorComponents);
-        for(unsigned y = 0, rowIndex = 0; y < imageHeight; ++y, rowIndex += rowSize)
+        rawImageData.resize(imageHeight * rowSize);
+        for(unsigned y = 0; y < imageHeight; ++y)
+            setPngRow(info, int(y), &rawImageData[y * rowSize], rawBitDepth);
+        if(!rawImageData.empty()) rawData = &rawImageData[0];
+    }
+
+    lodepng::State state;
+    const LodePNGColorType colorType = LodePNGColorType(info.colorType);
+    state.info_raw.colortype = colorType;
+    state.info_raw.bitdepth = rawBitDepth;
+    state.info_png.color.colortype = colorType;
+    state.info_png.color.bitdepth = info.bitDepth;
+    if(info.hasColorKey)
+    {
+        // A gray key is in key_r, but the other components are compared too.
+        const unsigned keyR = info.colorKey[0];
+        const unsigned keyG = colorType == LCT_GREY ? keyR : info.colorKey[1];
+        const unsigned keyB = colorType == LCT_GREY ? keyR : info.colorKey[2];
+        LodePNGColorMode* modes[] = { &state.info_raw, &state.info_png.color };
+        for(unsigned i = 0; i < 2; ++i)
         {
-            setPixelRow(fileFormat, y, &rowBuffer[0], colorComponents);
+            modes[i]->key_defined = 1;
+            modes[i]->key_r = keyR;
+            modes[i]->key_g = keyG;
+            modes[i]->key_b = keyB;
+        }
+    }
+    state.encoder.auto_convert = 0;
+    state.encoder.filter_strategy = getLodepngFilterStrategy(options.filterStrategy);
+    state.encoder.zlibsettings.cache = buffers.deflateCache;
+    state.encoder.buffers = buffers.lodepngBuffers;
+    setLodepngCompression(state.encoder.zlibsettings, options.compression);
+
+    CompressionBackendContext backendContext;
+    backendContext.backend =
+        options.compressionBackend ? options.compressionBackend : gDefaultCompressionBackend;
+    backendContext.compression = options.compression;
+    if(backendContext.backend)
+    {
+        state.encoder.zlibsettings.custom_deflate = &backendDeflate;
+        state.encoder.zlibsettings.custom_context = &backendContext;
+    }
 
-            for(unsigned colIndex = 0; colIndex < rowBuffer.size(); ++colIndex)
-                setPNGComponent16(rawImageData, rowIndex + colIndex * 2, rowBuffer[colIndex]);
+    unsigned errorCode = 0;
+    if(info.colorType == PngWriteInfo::kColorType_palette)
+    {
+        for(unsigned i = 0; i < info.palette.colorsAmount() && errorCode == 0; ++i)
+        {
+            const Byte* color = info.palette.color(i);
+            errorCode = lodepng_palette_add(&state.info_raw, color[0], color[1],
+                                            color[2], color[3]);
+            if(errorCode == 0)
+                errorCode = lodepng_palette_add(&state.info_png.color, color[0], color[1],
+                                                color[2], color[3]);
         }
     }
 
-    std::vector<unsigned char> buffer;
-    if(!destVector) destVector = &buffer;
+    ParallelFilterContext filterContext;
+    filterContext.threadsAmount = getThreadsAmount(options.threadsAmount);
+    filterContext.minRowsPerJob = 65536 / (rowSize + 1) + 1;
+    filterContext.deadline = buffers.deadline;
+    // Each deflate block is squeezed as its own job.
+    ParallelFilterContext squeezeContext;
+    squeezeContext.threadsAmount = filterContext.threadsAmount;
+    squeezeContext.minRowsPerJob = 1;
+    squeezeContext.deadline = buffers.deadline;
+    // The deadline is checked by the jobs, so they are used even with one thread.
+    if(filterContext.threadsAmount > 1 || buffers.deadline)
+    {
+        state.encoder.filter_parallel = &runParallelFilter;
+        state.encoder.filter_parallel_context = &filterContext;
+        state.encoder.zlibsettings.squeeze_parallel = &runParallelFilter;
+        state.encoder.zlibsettings.squeeze_parallel_context = &squeezeContext;
+    }
+
+    if(!destVector)
+    {
+        destVector = &buffers.pngData;
+        destVector->clear();
+    }
 
-    unsigned errorCode = lodepng::encode(*destVector, rawImageData, imageWidth, imageHeight,
-                                         colorType, bitDepth);
+    if(errorCode == 0 && options.compression == kPngCompression_maximum &&
+       !backendContext.backend && (options.filterStrategy == kPngFilterStrategy_minSum ||
+                                   options.filterStrategy == kPngFilterStrategy_entropy ||
+                                   options.filterStrategy == kPngFilterStrategy_bruteForce))
+        errorCode = selectMaximumCompressionFilters(state, rawData, imageWidth, imageHeight);
+
+    if(errorCode == 0)
+        errorCode = lodepng::encode(*destVector, rawData, imageWidth, imageHeight, state);
 
     if(errorCode != 0)
         return IOStatus(kIOStatus_Error_PNGLibraryError, lodepng_error_text(errorCode));
@@ -3309,6 +7760,7 @@ WPngImage::IOStatus WPngImage::performSaveImageToRAM
 #include <cerrno>
 #include <cassert>
 #include <png.h>
+#include <zlib.h>
 
 #if !WPNGIMAGE_RESTRICT_TO_CPP98
 #define WPNGIMAGE_DELETED = delete
@@ -3345,22 +7797,31 @@ struct WPngImage::PngStructs
     bool mReading;
     std::string mPngLibErrorMsg;
 
-    PngStructs(bool);
+    PngStructs(bool, MemoryResource*);
     ~PngStructs();
     PngStructs(const PngStructs&) WPNGIMAGE_DELETED;
     PngStructs& operator=(const PngStructs&) WPNGIMAGE_DELETED;
 
     static void handlePngError(png_structp, png_const_charp);
     static void handlePngWarning(png_structp, png_const_charp);
+    static png_voidp allocatePngMemory(png_structp, png_alloc_size_t);
+    static void freePngMemory(png_structp, png_voidp);
 };
 
-WPngImage::PngStructs::PngStructs(bool forReading):
+// With a memory resource, all of libpng's allocations are made from it.
+WPngImage::PngStructs::PngStructs(bool forReading, MemoryResource* resource):
     mPngStructPtr(0), mPngInfoPtr(0), mReading(forReading), mPngLibErrorMsg()
 {
     if(forReading)
-        mPngStructPtr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+        mPngStructPtr = resource ?
+            png_create_read_struct_2(PNG_LIBPNG_VER_STRING, 0, 0, 0,
+                                     resource, &allocatePngMemory, &freePngMemory) :
+            png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
     else
-        mPngStructPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+        mPngStructPtr = resource ?
+            png_create_write_struct_2(PNG_LIBPNG_VER_STRING, 0, 0, 0,
+                                      resource, &allocatePngMemory, &freePngMemory) :
+            png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
 
     if(mPngStructPtr) mPngInfoPtr = png_create_info_struct(mPngStructPtr);
 
@@ -3392,6 +7853,41 @@ void WPngImage::PngStructs::handlePngError(png_structp png_ptr, png_const_charp
 void WPngImage::PngStructs::handlePngWarning(png_structp, png_const_charp)
 {}
 
+namespace
+{
+    // libpng doesn't give the size of the block to the free function, so it's stored in
+    // a header before the block.
+    const std::size_t kPngMemoryHeaderSize = 16;
+}
+
+png_voidp WPngImage::PngStructs::allocatePngMemory(png_structp png_ptr, png_alloc_size_t size)
+{
+    MemoryResource* resource = static_cast<MemoryResource*>(png_get_mem_ptr(png_ptr));
+    const std::size_t bytes = std::size_t(size) + kPngMemoryHeaderSize;
+    if(bytes < kPngMemoryHeaderSize) return 0;
+    char* block;
+    try
+    {
+        block = static_cast<char*>(resource->allocate(bytes, kPngMemoryHeaderSize));
+    }
+    catch(...)
+    {
+        return 0; // libpng reports the failure itself
+    }
+    std::memcpy(block, &bytes, sizeof(bytes));
+    return block + kPngMemoryHeaderSize;
+}
+
+void WPngImage::PngStructs::freePngMemory(png_structp png_ptr, png_voidp ptr)
+{
+    if(!ptr) return;
+    MemoryResource* resource = static_cast<MemoryResource*>(png_get_mem_ptr(png_ptr));
+    char* block = static_cast<char*>(ptr) - kPngMemoryHeaderSize;
+    std::size_t bytes;
+    std::memcpy(&bytes, block, sizeof(bytes));
+    resource->deallocate(block, bytes, kPngMemoryHeaderSize);
+}
+
 namespace
 {
     struct FilePtr
@@ -3412,13 +7908,6 @@ namespace
         return ((WPngImage::UInt16(rawImageData[index]) << 8) |
                 WPngImage::UInt16(rawImageData[index + 1]));
     }
-
-    inline void setPNGComponent16
-    (std::vector<unsigned char>& rawImageData, std::size_t index, WPngImage::UInt16 value)
-    {
-        rawImageData[index] = (unsigned char)(value >> 8);
-        rawImageData[index + 1] = (unsigned char)value;
-    }
 }
 
 
@@ -3449,6 +7938,8 @@ WPngImage::IOStatus WPngImage::readPngData
 
     setFileFormat(fileFormat);
 
+    unsigned alphas = 0xFFFF;
+
     if(bitDepth == 16)
     {
         assert(rowBytes <= 4*2*unsigned(imageWidth));
@@ -3458,27 +7949,37 @@ WPngImage::IOStatus WPngImage::readPngData
         {
             png_read_row(structs.mPngStructPtr, (png_bytep) &dataRow[0], 0);
             for(int x = 0; x < imageWidth*8; x += 8, ++destIndex)
+            {
+                const UInt16 alpha = getPNGComponent16(dataRow, x + 6);
+                alphas &= alpha;
                 setPixel(std::size_t(destIndex),
                          Pixel16(getPNGComponent16(dataRow, x),
                                  getPNGComponent16(dataRow, x + 2),
-                                 getPNGComponent16(dataRow, x + 4),
-                                 getPNGComponent16(dataRow, x + 6)));
+                                 getPNGComponent16(dataRow, x + 4), alpha));
+            }
         }
     }
     else
     {
         assert(rowBytes <= 4*unsigned(imageWidth));
         std::vector<Byte> dataRow(imageWidth * 4);
+        alphas = 0xFF;
 
         for(int y = 0, destIndex = 0; y < imageHeight; ++y)
         {
             png_read_row(structs.mPngStructPtr, (png_bytep) &dataRow[0], 0);
             for(int x = 0; x < imageWidth*4; x += 4, ++destIndex)
+            {
+                alphas &= dataRow[x+3];
                 setPixel(std::size_t(destIndex),
                          Pixel8(dataRow[x], dataRow[x+1], dataRow[x+2], dataRow[x+3]));
+            }
         }
     }
 
+    if(alphas == (bitDepth == 16 ? 0xFFFFU : 0xFFU))
+        mData->mOpacity = PngDataBase::kOpacity_allOpaque;
+
     png_read_end(structs.mPngStructPtr, structs.mPngInfoPtr);
     return kIOStatus_Ok;
 }
@@ -3488,7 +7989,8 @@ WPngImage::IOStatus WPngImage::readPngData
 // Load PNG image from file
 //----------------------------------------------------------------------------
 WPngImage::IOStatus WPngImage::performLoadImage
-(const char* fileName, bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat)
+(const char* fileName, bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat,
+ CompressionBackend*)
 {
     FilePtr iFile;
     iFile.fp = std::fopen(fileName, "rb");
@@ -3499,7 +8001,7 @@ WPngImage::IOStatus WPngImage::performLoadImage
     if(png_sig_cmp(header, 0, 8)) return kIOStatus_Error_NotPNG;
     std::fseek(iFile.fp, 0, SEEK_SET);
 
-    PngStructs structs(true);
+    PngStructs structs(true, mMemoryResource ? mMemoryResource : defaultMemoryResource());
     if(!structs.mPngInfoPtr) return kIOStatus_Error_PNGLibraryError;
 
     if(setjmp(png_jmpbuf(structs.mPngStructPtr)))
@@ -3537,7 +8039,8 @@ static void pngDataReader(png_structp png_ptr, png_bytep data, png_size_t length
 
 WPngImage::IOStatus WPngImage::performLoadImageFromRAM
 (const void* pngData, std::size_t pngDataSize,
- bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat)
+ bool useConversion, PngReadConvert conversion, PixelFormat pixelFormat,
+ CompressionBackend*)
 {
     RAMPngData ramPngData;
     ramPngData.mData = (png_const_charp)pngData;
@@ -3546,7 +8049,7 @@ WPngImage::IOStatus WPngImage::performLoadImageFromRAM
 
     if(png_sig_cmp((png_bytep)ramPngData.mData, 0, 8)) return kIOStatus_Error_NotPNG;
 
-    PngStructs structs(true);
+    PngStructs structs(true, mMemoryResource ? mMemoryResource : defaultMemoryResource());
     if(!structs.mPngInfoPtr) return kIOStatus_Error_PNGLibraryError;
 
     if(setjmp(png_jmpbuf(structs.mPngStructPtr)))
@@ -3560,77 +8063,123 @@ WPngImage::IOStatus WPngImage::performLoadImageFromRAM
 //----------------------------------------------------------------------------
 // Write PNG data
 //----------------------------------------------------------------------------
-void WPngImage::performWritePngData
-(PngStructs& structs, PngFileFormat fileFormat,
- int bitDepth, int colorType, int colorComponents) const
+//----------------------------------------------------------------------------
+// Buffers kept by WPngImage::Encoder between images
+//----------------------------------------------------------------------------
+// libpng's own allocations come from the memory resource of the image being saved. The row
+// data does too when saving without an Encoder, and comes from the default memory resource
+// at the time of its creation otherwise.
+struct WPngImage::Encoder::Buffers
+{
+    PngWriteInfo info;
+    std::vector<unsigned char, AlignedAllocator<unsigned char> > rowData;
+
+    explicit Buffers(MemoryResource* resource = defaultMemoryResource()):
+        rowData(AlignedAllocator<unsigned char>(resource)) {}
+};
+
+void WPngImage::performWritePngData(PngStructs& structs, Encoder::Buffers& buffers) const
 {
-    const int imageWidth = width(), imageHeight = height();
+    PngWriteInfo& info = buffers.info;
+    const int imageWidth = info.width, imageHeight = info.height;
 
     png_set_IHDR(structs.mPngStructPtr, structs.mPngInfoPtr, imageWidth, imageHeight,
-                 bitDepth, colorType, PNG_INTERLACE_NONE,
+                 info.bitDepth, info.colorType, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(structs.mPngStructPtr, structs.mPngInfoPtr);
 
-    if(bitDepth == 16)
+    if(info.colorType == PngWriteInfo::kColorType_palette)
     {
-        std::vector<UInt16> rowData(imageWidth * colorComponents);
-        std::vector<unsigned char> rowDataBytes(rowData.size() * 2);
-        for(int y = 0; y < imageHeight; ++y)
+        const unsigned colorsAmount = info.palette.colorsAmount();
+        std::vector<png_color> paletteColors(colorsAmount);
+        std::vector<png_byte> paletteAlphas(colorsAmount);
+        for(unsigned i = 0; i < colorsAmount; ++i)
         {
-            setPixelRow(fileFormat, y, &rowData[0], colorComponents);
-            for(std::size_t i = 0; i < rowData.size(); ++i)
-                setPNGComponent16(rowDataBytes, i * 2, rowData[i]);
-            png_write_row(structs.mPngStructPtr, (png_bytep)(&rowDataBytes[0]));
+            const Byte* color = info.palette.color(i);
+            paletteColors[i].red = color[0];
+            paletteColors[i].green = color[1];
+            paletteColors[i].blue = color[2];
+            paletteAlphas[i] = color[3];
         }
+
+        png_set_PLTE(structs.mPngStructPtr, structs.mPngInfoPtr,
+                     &paletteColors[0], int(colorsAmount));
+        if(info.translucentColorsAmount > 0)
+            png_set_tRNS(structs.mPngStructPtr, structs.mPngInfoPtr,
+                         &paletteAlphas[0], int(info.translucentColorsAmount), 0);
     }
-    else
+    else if(info.hasColorKey)
     {
-        std::vector<Byte> rowData(imageWidth * colorComponents);
-        for(int y = 0; y < imageHeight; ++y)
-        {
-            setPixelRow(fileFormat, y, &rowData[0], colorComponents);
-            png_write_row(structs.mPngStructPtr, (png_bytep)(&rowData[0]));
-        }
+        png_color_16 colorKey;
+        colorKey.index = 0;
+        colorKey.red = info.colorKey[0];
+        colorKey.green = info.colorKey[1];
+        colorKey.blue = info.colorKey[2];
+        colorKey.gray = info.colorKey[0];
+        png_set_tRNS(structs.mPngStructPtr, structs.mPngInfoPtr, 0, 0, &colorKey);
+    }
+
+    png_write_info(structs.mPngStructPtr, structs.mPngInfoPtr);
+
+    std::vector<unsigned char, AlignedAllocator<unsigned char> >& rowData = buffers.rowData;
+    rowData.resize(info.rowBytes(imageWidth, info.bitDepth));
+    for(int y = 0; y < imageHeight; ++y)
+    {
+        setPngRow(info, y, &rowData[0], info.bitDepth);
+        png_write_row(structs.mPngStructPtr, (png_bytep)(&rowData[0]));
     }
 
     png_write_end(structs.mPngStructPtr, structs.mPngInfoPtr);
 }
 
-WPngImage::IOStatus WPngImage::writePngData(PngStructs& structs, PngFileFormat fileFormat) const
+static int getLibpngFilters(WPngImage::PngFilterStrategy strategy)
 {
-    const bool writeAlphas = !allPixelsHaveFullAlpha();
-
-    switch(fileFormat)
+    switch(strategy)
     {
-      case kPngFileFormat_GA8:
-          performWritePngData
-              (structs, fileFormat, 8,
-               writeAlphas ? PNG_COLOR_TYPE_GRAY_ALPHA : PNG_COLOR_TYPE_GRAY,
-               writeAlphas ? 2 : 1);
-          break;
+      case WPngImage::kPngFilterStrategy_none: return PNG_FILTER_NONE;
+      case WPngImage::kPngFilterStrategy_sub: return PNG_FILTER_SUB;
+      case WPngImage::kPngFilterStrategy_up: return PNG_FILTER_UP;
+      case WPngImage::kPngFilterStrategy_average: return PNG_FILTER_AVG;
+      case WPngImage::kPngFilterStrategy_paeth: return PNG_FILTER_PAETH;
+      case WPngImage::kPngFilterStrategy_minSum:
+      case WPngImage::kPngFilterStrategy_entropy:
+      case WPngImage::kPngFilterStrategy_bruteForce: break;
+    }
+    return PNG_ALL_FILTERS;
+}
 
-      case kPngFileFormat_GA16:
-          performWritePngData
-              (structs, fileFormat, 16,
-               writeAlphas ? PNG_COLOR_TYPE_GRAY_ALPHA : PNG_COLOR_TYPE_GRAY,
-               writeAlphas ? 2 : 1);
-          break;
+static int getZlibStrategy(WPngImage::PngCompression compression)
+{
+    switch(compression)
+    {
+      case WPngImage::kPngCompression_huffmanOnly: return Z_HUFFMAN_ONLY;
+      case WPngImage::kPngCompression_rle: return Z_RLE;
+      case WPngImage::kPngCompression_fastest:
+      case WPngImage::kPngCompression_fast:
+      case WPngImage::kPngCompression_default:
+      case WPngImage::kPngCompression_maximum: break;
+    }
+    return Z_DEFAULT_STRATEGY;
+}
 
-      case kPngFileFormat_none:
-      case kPngFileFormat_RGBA8:
-          performWritePngData
-              (structs, fileFormat, 8,
-               writeAlphas ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
-               writeAlphas ? 4 : 3);
-          break;
+WPngImage::IOStatus WPngImage::writePngData
+(PngStructs& structs, PngFileFormat fileFormat, const SaveOptions& options,
+ const SaveRegion& region, Encoder::Buffers& buffers) const
+{
+    png_set_filter(structs.mPngStructPtr, PNG_FILTER_TYPE_BASE,
+                   getLibpngFilters(options.filterStrategy));
+    // Without an explicit strategy libpng chooses one itself based on the filters.
+    if(options.compression == kPngCompression_fastest)
+        png_set_compression_level(structs.mPngStructPtr, 1);
+    else if(options.compression == kPngCompression_fast)
+        png_set_compression_level(structs.mPngStructPtr, 2);
+    else if(options.compression == kPngCompression_maximum)
+        png_set_compression_level(structs.mPngStructPtr, 9);
+    else if(options.compression != kPngCompression_default)
+        png_set_compression_strategy(structs.mPngStructPtr,
+                                     getZlibStrategy(options.compression));
 
-      case kPngFileFormat_RGBA16:
-          performWritePngData
-              (structs, fileFormat, 16,
-               writeAlphas ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
-               writeAlphas ? 4 : 3);
-          break;
-    }
+    getPngWriteInfo(buffers.info, fileFormat, options, region);
+    performWritePngData(structs, buffers);
 
     return kIOStatus_Ok;
 }
@@ -3639,16 +8188,19 @@ WPngImage::IOStatus WPngImage::writePngData(PngStructs& structs, PngFileFormat f
 //----------------------------------------------------------------------------
 // Save PNG image to file
 //----------------------------------------------------------------------------
-WPngImage::IOStatus
-WPngImage::performSaveImage(const char* fileName, PngFileFormat fileFormat) const
+WPngImage::IOStatus WPngImage::performSaveImage
+(const char* fileName, PngFileFormat fileFormat, const SaveOptions& options,
+ const SaveRegion& region, Encoder::Buffers* encoderBuffers) const
 {
     if(!mData) return kIOStatus_Ok;
+    if(!isValidSaveRegion(region)) return kIOStatus_Error_InvalidRegion;
 
     FilePtr oFile;
     oFile.fp = std::fopen(fileName, "wb");
     if(!oFile.fp) return IOStatus(kIOStatus_Error_CantOpenFile, errno);
 
-    PngStructs structs(false);
+    PngStructs structs(false, mData->mMemoryResource ?
+                       mData->mMemoryResource : defaultMemoryResource());
     if(!structs.mPngInfoPtr) return kIOStatus_Error_PNGLibraryError;
 
     if(setjmp(png_jmpbuf(structs.mPngStructPtr)))
@@ -3656,8 +8208,10 @@ WPngImage::performSaveImage(const char* fileName, PngFileFormat fileFormat) cons
 
     png_init_io(structs.mPngStructPtr, oFile.fp);
 
+    Encoder::Buffers localBuffers(mData->mMemoryResource);
     return writePngData(structs, fileFormat == kPngFileFormat_none ?
-                        getClosestMatchFileFormat(currentPixelFormat()) : fileFormat);
+                        getClosestMatchFileFormat(currentPixelFormat()) : fileFormat, options,
+                        region, encoderBuffers ? *encoderBuffers : localBuffers);
 }
 
 
@@ -3688,11 +8242,14 @@ static void pngDataFlush(png_structp)
 
 WPngImage::IOStatus WPngImage::performSaveImageToRAM
 (std::vector<unsigned char>* destVector, ByteStreamOutputFunc destFunc,
- PngFileFormat fileFormat) const
+ PngFileFormat fileFormat, const SaveOptions& options, const SaveRegion& region,
+ Encoder::Buffers* encoderBuffers) const
 {
     if(!mData) return kIOStatus_Ok;
+    if(!isValidSaveRegion(region)) return kIOStatus_Error_InvalidRegion;
 
-    PngStructs structs(false);
+    PngStructs structs(false, mData->mMemoryResource ?
+                       mData->mMemoryResource : defaultMemoryResource());
     if(!structs.mPngInfoPtr) return kIOStatus_Error_PNGLibraryError;
 
     if(setjmp(png_jmpbuf(structs.mPngStructPtr)))
@@ -3704,8 +8261,416 @@ WPngImage::IOStatus WPngImage::performSaveImageToRAM
 
     png_set_write_fn(structs.mPngStructPtr, &destData, &pngDataWriter, &pngDataFlush);
 
+    Encoder::Buffers localBuffers(mData->mMemoryResource);
     return writePngData(structs, fileFormat == kPngFileFormat_none ?
-                        getClosestMatchFileFormat(currentPixelFormat()) : fileFormat);
+                        getClosestMatchFileFormat(currentPixelFormat()) : fileFormat, options,
+                        region, encoderBuffers ? *encoderBuffers : localBuffers);
 }
 #endif // !WPNGIMAGE_USE_LIBPNG
+
+
+//============================================================================
+// WPngImage::Encoder implementations
+//============================================================================
+WPngImage::Encoder::Encoder():
+    mBuffers(new Buffers)
+{}
+
+WPngImage::Encoder::Encoder(const SaveOptions& options):
+    mOptions(options), mBuffers(new Buffers)
+{}
+
+WPngImage::Encoder::~Encoder()
+{
+    delete mBuffers;
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const char* fileName, PngFileFormat fileFormat)
+{
+    return saveImage(image, fileName, 0, 0, image.width(), image.height(), fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const char* fileName, PngWriteConvert conversion)
+{
+    return saveImage(image, fileName,
+                     getFileFormat(conversion, image.originalFileFormat(),
+                                   image.currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const std::string& fileName, PngFileFormat fileFormat)
+{
+    return saveImage(image, fileName.c_str(), fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const std::string& fileName, PngWriteConvert conversion)
+{
+    return saveImage(image, fileName.c_str(), conversion);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const char* fileName, int x, int y, int width, int height,
+ PngFileFormat fileFormat)
+{
+    const SaveRegion region = { x, y, width, height };
+    IOStatus status = image.performSaveImage(fileName, fileFormat, mOptions, region, mBuffers);
+    if(status != kIOStatus_Ok) status.fileName = fileName;
+    return status;
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const char* fileName, int x, int y, int width, int height,
+ PngWriteConvert conversion)
+{
+    return saveImage(image, fileName, x, y, width, height,
+                     getFileFormat(conversion, image.originalFileFormat(),
+                                   image.currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const std::string& fileName, int x, int y, int width, int height,
+ PngFileFormat fileFormat)
+{
+    return saveImage(image, fileName.c_str(), x, y, width, height, fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImage
+(const WPngImage& image, const std::string& fileName, int x, int y, int width, int height,
+ PngWriteConvert conversion)
+{
+    return saveImage(image, fileName.c_str(), x, y, width, height, conversion);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, std::vector<unsigned char>& dest, PngFileFormat fileFormat)
+{
+    return saveImageToRAM(image, dest, 0, 0, image.width(), image.height(), fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, std::vector<unsigned char>& dest, PngWriteConvert conversion)
+{
+    return saveImageToRAM(image, dest,
+                          getFileFormat(conversion, image.originalFileFormat(),
+                                        image.currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, ByteStreamOutputFunc destFunc, PngFileFormat fileFormat)
+{
+    return saveImageToRAM(image, destFunc, 0, 0, image.width(), image.height(), fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, ByteStreamOutputFunc destFunc, PngWriteConvert conversion)
+{
+    return saveImageToRAM(image, destFunc,
+                          getFileFormat(conversion, image.originalFileFormat(),
+                                        image.currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, std::vector<unsigned char>& dest,
+ int x, int y, int width, int height, PngFileFormat fileFormat)
+{
+    const SaveRegion region = { x, y, width, height };
+    return image.performSaveImageToRAM(&dest, 0, fileFormat, mOptions, region, mBuffers);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, std::vector<unsigned char>& dest,
+ int x, int y, int width, int height, PngWriteConvert conversion)
+{
+    return saveImageToRAM(image, dest, x, y, width, height,
+                          getFileFormat(conversion, image.originalFileFormat(),
+                                        image.currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, ByteStreamOutputFunc destFunc,
+ int x, int y, int width, int height, PngFileFormat fileFormat)
+{
+    const SaveRegion region = { x, y, width, height };
+    return image.performSaveImageToRAM(0, destFunc, fileFormat, mOptions, region, mBuffers);
+}
+
+WPngImage::IOStatus WPngImage::Encoder::saveImageToRAM
+(const WPngImage& image, ByteStreamOutputFunc destFunc,
+ int x, int y, int width, int height, PngWriteConvert conversion)
+{
+    return saveImageToRAM(image, destFunc, x, y, width, height,
+                          getFileFormat(conversion, image.originalFileFormat(),
+                                        image.currentPixelFormat()));
+}
+
+
+//============================================================================
+// Saving many images in parallel
+//============================================================================
+namespace
+{
+    bool isLargerSaveItem(const WPngImage::BatchSaveItem* item1,
+                          const WPngImage::BatchSaveItem* item2)
+    {
+        return (std::size_t(item1->image->width()) * std::size_t(item1->image->height()) >
+                std::size_t(item2->image->width()) * std::size_t(item2->image->height()));
+    }
+
+    struct BatchSaveJob
+    {
+        std::vector<const WPngImage::BatchSaveItem*> items;
+        const WPngImage::BatchSaveItem* firstItem;
+        const WPngImage::SaveOptions* options;
+        std::vector<WPngImage::IOStatus>* statuses;
+        std::vector<WPngImage::Encoder*> encoders;
+        std::size_t maxBufferedBytes, bufferedBytes;
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+        std::mutex bufferedBytesMutex;
+        std::condition_variable bufferedBytesReleased;
+#endif
+
+        // The memory needed for encoding an image is estimated from its uncompressed size.
+        static std::size_t getEncodingBytes(const WPngImage& image)
+        {
+            return (std::size_t(image.width()) * std::size_t(image.height()) *
+                    (image.is8BPCPixelFormat() ? 4 : 8));
+        }
+
+        // Waits until the image fits within maxBufferedBytes together with the images
+        // currently being encoded. An image larger than the limit is encoded alone.
+        void acquireBufferedBytes(std::size_t bytes)
+        {
+            if(maxBufferedBytes == 0) return;
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+            std::unique_lock<std::mutex> lock(bufferedBytesMutex);
+            while(bufferedBytes > 0 && bufferedBytes + bytes > maxBufferedBytes)
+                bufferedBytesReleased.wait(lock);
+#endif
+            bufferedBytes += bytes;
+        }
+
+        void releaseBufferedBytes(std::size_t bytes)
+        {
+            if(maxBufferedBytes == 0) return;
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+            std::lock_guard<std::mutex> lock(bufferedBytesMutex);
+#endif
+            bufferedBytes -= bytes;
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+            bufferedBytesReleased.notify_all();
+#endif
+        }
+
+        void operator()(std::size_t jobIndex, unsigned workerIndex)
+        {
+            const WPngImage::BatchSaveItem& item = *items[jobIndex];
+            WPngImage::IOStatus& status = (*statuses)[&item - firstItem];
+
+            if(!encoders[workerIndex])
+                encoders[workerIndex] = new WPngImage::Encoder(*options);
+            WPngImage::Encoder& encoder = *encoders[workerIndex];
+
+            const std::size_t bytes = getEncodingBytes(*item.image);
+            acquireBufferedBytes(bytes);
+
+            if(item.dest)
+                status = (item.fileFormat == WPngImage::kPngFileFormat_none ?
+                          encoder.saveImageToRAM(*item.image, *item.dest, item.conversion) :
+                          encoder.saveImageToRAM(*item.image, *item.dest, item.fileFormat));
+            else
+                status = (item.fileFormat == WPngImage::kPngFileFormat_none ?
+                          encoder.saveImage(*item.image, item.fileName, item.conversion) :
+                          encoder.saveImage(*item.image, item.fileName, item.fileFormat));
+
+            releaseBufferedBytes(bytes);
+        }
+    };
+}
+
+// The images are saved from the largest to the smallest, so that the threads don't end
+// up waiting for one large image started last. Each thread uses its own Encoder.
+std::vector<WPngImage::IOStatus> WPngImage::saveImages
+(const std::vector<BatchSaveItem>& items, const SaveOptions& options,
+ unsigned threadsAmount, std::size_t maxBufferedBytes)
+{
+    std::vector<IOStatus> statuses(items.size(), IOStatus(kIOStatus_Ok));
+    if(items.empty()) return statuses;
+
+    threadsAmount = std::min(getThreadsAmount(threadsAmount), unsigned(items.size()));
+
+    BatchSaveJob job;
+    job.items.resize(items.size());
+    for(std::size_t i = 0; i < items.size(); ++i)
+        job.items[i] = &items[i];
+    std::stable_sort(job.items.begin(), job.items.end(), isLargerSaveItem);
+    job.firstItem = &items[0];
+    job.options = &options;
+    job.statuses = &statuses;
+    job.encoders.resize(threadsAmount, 0);
+    job.maxBufferedBytes = maxBufferedBytes;
+    job.bufferedBytes = 0;
+
+    runJobs(items.size(), threadsAmount, job);
+
+    for(std::size_t i = 0; i < job.encoders.size(); ++i)
+        delete job.encoders[i];
+    return statuses;
+}
+
+
+//============================================================================
+// Saving with the options which compress best
+//============================================================================
+namespace
+{
+    // The candidate options, roughly from the fastest to the slowest, so that the slowest
+    // ones are the ones left out if the time runs out. The first one, which is always tried
+    // to completion, is the default.
+    std::vector<WPngImage::SaveOptions> getOptimizeCandidates
+    (const WPngImage::OptimizeOptions& optimizeOptions)
+    {
+        const WPngImage::PngFilterStrategy kStrategies[] =
+        {
+            WPngImage::kPngFilterStrategy_minSum, WPngImage::kPngFilterStrategy_none,
+            WPngImage::kPngFilterStrategy_entropy, WPngImage::kPngFilterStrategy_bruteForce
+        };
+
+        std::vector<WPngImage::SaveOptions> candidates;
+        WPngImage::SaveOptions options;
+        for(unsigned i = 0; i < 2; ++i)
+        {
+            options.reduceColors = (i == 0);
+            for(std::size_t j = 0; j < sizeof(kStrategies) / sizeof(*kStrategies); ++j)
+            {
+                options.filterStrategy = kStrategies[j];
+                candidates.push_back(options);
+            }
+        }
+
+        // With the maximum compression minSum stands for all the adaptive filter strategies,
+        // as it tries them all.
+        if(optimizeOptions.tryMaximumCompression)
+        {
+            options.compression = WPngImage::kPngCompression_maximum;
+            for(unsigned i = 0; i < 2; ++i)
+            {
+                options.reduceColors = (i == 0);
+                options.filterStrategy = WPngImage::kPngFilterStrategy_minSum;
+                candidates.push_back(options);
+                options.filterStrategy = WPngImage::kPngFilterStrategy_none;
+                candidates.push_back(options);
+            }
+        }
+        return candidates;
+    }
+
+}
+
+struct WPngImage::OptimizeJob
+{
+    const WPngImage* image;
+    PngFileFormat fileFormat;
+    const std::vector<SaveOptions>* candidates;
+    const Deadline* deadline;
+    std::vector<std::vector<unsigned char> > results;
+    std::vector<IOStatus> statuses;
+
+    // A candidate which hasn't been started when the deadline passes is skipped, and
+    // one which is still being encoded is stopped and counts as failed.
+    void operator()(std::size_t jobIndex, unsigned)
+    {
+        const bool useDeadline = jobIndex > 0 && deadline;
+        if(useDeadline && deadline->passed())
+        {
+            statuses[jobIndex] = kIOStatus_Error_PNGLibraryError;
+            return;
+        }
+
+        Encoder encoder((*candidates)[jobIndex]);
+#if !WPNGIMAGE_USE_LIBPNG
+        encoder.mBuffers->deadline = useDeadline ? deadline : 0;
+#endif
+        statuses[jobIndex] = encoder.saveImageToRAM(*image, results[jobIndex], fileFormat);
+    }
+};
+
+// Each candidate is encoded with one thread, and the candidates are run in parallel.
+WPngImage::IOStatus WPngImage::optimizeToRAM
+(std::vector<unsigned char>& dest, const OptimizeOptions& options, PngFileFormat fileFormat) const
+{
+    if(!mData) return kIOStatus_Ok;
+
+    const std::vector<SaveOptions> candidates = getOptimizeCandidates(options);
+    const Deadline deadline(options.timeBudget);
+
+    OptimizeJob job;
+    job.image = this;
+    job.fileFormat = fileFormat;
+    job.candidates = &candidates;
+    job.deadline = options.timeBudget > 0 ? &deadline : 0;
+    job.results.resize(candidates.size());
+    job.statuses.resize(candidates.size(), IOStatus(kIOStatus_Ok));
+
+    runJobs(candidates.size(), getThreadsAmount(options.threadsAmount), job);
+
+    if(job.statuses[0] != kIOStatus_Ok) return job.statuses[0];
+
+    std::size_t bestIndex = 0;
+    for(std::size_t i = 1; i < candidates.size(); ++i)
+        if(job.statuses[i] == kIOStatus_Ok &&
+           job.results[i].size() < job.results[bestIndex].size())
+            bestIndex = i;
+
+    dest.insert(dest.end(), job.results[bestIndex].begin(), job.results[bestIndex].end());
+    return kIOStatus_Ok;
+}
+
+WPngImage::IOStatus WPngImage::optimizeToRAM
+(std::vector<unsigned char>& dest, const OptimizeOptions& options,
+ PngWriteConvert conversion) const
+{
+    return optimizeToRAM(dest, options,
+                         getFileFormat(conversion, originalFileFormat(), currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::saveImageOptimized
+(const char* fileName, const OptimizeOptions& options, PngFileFormat fileFormat) const
+{
+    if(!mData) return kIOStatus_Ok;
+
+    std::vector<unsigned char> pngData;
+    IOStatus status = optimizeToRAM(pngData, options, fileFormat);
+    if(status == kIOStatus_Ok)
+    {
+        FilePtr oFile;
+        oFile.fp = std::fopen(fileName, "wb");
+        if(!oFile.fp) status = IOStatus(kIOStatus_Error_CantOpenFile, errno);
+        else std::fwrite(&pngData[0], 1, pngData.size(), oFile.fp);
+    }
+    if(status != kIOStatus_Ok) status.fileName = fileName;
+    return status;
+}
+
+WPngImage::IOStatus WPngImage::saveImageOptimized
+(const char* fileName, const OptimizeOptions& options, PngWriteConvert conversion) const
+{
+    return saveImageOptimized(fileName, options,
+                              getFileFormat(conversion, originalFileFormat(),
+                                            currentPixelFormat()));
+}
+
+WPngImage::IOStatus WPngImage::saveImageOptimized
+(const std::string& fileName, const OptimizeOptions& options, PngFileFormat fileFormat) const
+{
+    return saveImageOptimized(fileName.c_str(), options, fileFormat);
+}
+
+WPngImage::IOStatus WPngImage::saveImageOptimized
+(const std::string& fileName, const OptimizeOptions& options, PngWriteConvert conversion) const
+{
+    return saveImageOptimized(fileName.c_str(), options, conversion);
+}
 #endif // !WPNGIMAGE_DISABLE_PNG_FILE_IO_SUPPORT
@@ -29,6 +29,13 @@
 #if !WPNGIMAGE_RESTRICT_TO_CPP98
 #include <cstdint>
 #include <functional>
+// MSVC reports the language version in __cplusplus only with /Zc:__cplusplus.
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <memory_resource>
+#define WPNGIMAGE_PMR_SUPPORT 1
+#else
+#define WPNGIMAGE_PMR_SUPPORT 0
+#endif
 #define WPNGIMAGE_CONSTEXPR constexpr
 #else
 #include <climits>
@@ -36,6 +43,7 @@
 #error "WPngImage requires 8-bit bytes"
 #endif
 #define WPNGIMAGE_CONSTEXPR
+#define WPNGIMAGE_PMR_SUPPORT 0
 #endif
 
 #define WPNGIMAGE_VERSION 0x010500
@@ -78,6 +86,14 @@ class WPngImage
     struct Pixel16;
     struct PixelF;
 
+    // The storage of the grayscale pixel formats.
+    struct PixelGA8 { Byte g, a; };
+    struct PixelGA16 { UInt16 g, a; };
+    struct PixelGAF { Float g, a; };
+
+    template<typename Pixel_t> class PixelSpan;
+    template<typename Pixel_t> class PixelRows;
+
     struct HSV { Float h, s, v, a; };
     struct HSL { Float h, s, l, a; };
     struct XYZ { Float x, y, z, a; };
@@ -105,7 +121,9 @@ class WPngImage
         kPixelFormat_GAF,
         kPixelFormat_RGBA8,
         kPixelFormat_RGBA16,
-        kPixelFormat_RGBAF
+        kPixelFormat_RGBAF,
+        kPixelFormat_GAF_Planar,
+        kPixelFormat_RGBAF_Planar
     };
 
     enum PngReadConvert
@@ -124,6 +142,28 @@ class WPngImage
         kPngWriteConvert_closestMatch
     };
 
+    enum PngFilterStrategy
+    {
+        kPngFilterStrategy_none,
+        kPngFilterStrategy_sub,
+        kPngFilterStrategy_up,
+        kPngFilterStrategy_average,
+        kPngFilterStrategy_paeth,
+        kPngFilterStrategy_minSum,
+        kPngFilterStrategy_entropy,
+        kPngFilterStrategy_bruteForce
+    };
+
+    enum PngCompression
+    {
+        kPngCompression_huffmanOnly,
+        kPngCompression_rle,
+        kPngCompression_fastest,
+        kPngCompression_fast,
+        kPngCompression_default,
+        kPngCompression_maximum
+    };
+
 
     //------------------------------------------------------------------------
     // Constructors, assignment, destructor
@@ -149,6 +189,42 @@ class WPngImage
     static const bool isUsingLibpng;
 
 
+    //------------------------------------------------------------------------
+    // Memory resources
+    //------------------------------------------------------------------------
+    class MemoryResource
+    {
+     public:
+        virtual ~MemoryResource() {}
+
+        virtual void* allocate(std::size_t bytes, std::size_t alignment) = 0;
+        virtual void deallocate(void* ptr, std::size_t bytes, std::size_t alignment) = 0;
+    };
+
+#if WPNGIMAGE_PMR_SUPPORT
+    class PmrMemoryResource: public MemoryResource
+    {
+     public:
+        explicit PmrMemoryResource(std::pmr::memory_resource* resource):
+            mResource(resource) {}
+
+        virtual void* allocate(std::size_t bytes, std::size_t alignment)
+        { return mResource->allocate(bytes, alignment); }
+        virtual void deallocate(void* ptr, std::size_t bytes, std::size_t alignment)
+        { mResource->deallocate(ptr, bytes, alignment); }
+
+     private:
+        std::pmr::memory_resource* mResource;
+    };
+#endif
+
+    static void setDefaultMemoryResource(MemoryResource*);
+    static MemoryResource* defaultMemoryResource();
+
+    void setMemoryResource(MemoryResource*);
+    MemoryResource* memoryResource() const { return mMemoryResource; }
+
+
     //------------------------------------------------------------------------
     // Image loading and creation
     //------------------------------------------------------------------------
@@ -158,7 +234,8 @@ class WPngImage
         kIOStatus_Ok,
         kIOStatus_Error_CantOpenFile,
         kIOStatus_Error_NotPNG,
-        kIOStatus_Error_PNGLibraryError
+        kIOStatus_Error_PNGLibraryError,
+        kIOStatus_Error_InvalidRegion
     };
 
     struct IOStatus
@@ -177,16 +254,37 @@ class WPngImage
         bool printErrorMsg(std::ostream& = std::cerr) const;
     };
 
-    IOStatus loadImage(const char* fileName, PngReadConvert = kPngReadConvert_closestMatch);
-    IOStatus loadImage(const char* fileName, PixelFormat);
+    class CompressionBackend
+    {
+     public:
+        virtual ~CompressionBackend() {}
+
+        virtual bool deflate(std::vector<unsigned char>& dest,
+                             const unsigned char* data, std::size_t dataSize,
+                             PngCompression) = 0;
+        virtual bool inflate(std::vector<unsigned char>& dest,
+                             const unsigned char* data, std::size_t dataSize) = 0;
+    };
+
+    static void setDefaultCompressionBackend(CompressionBackend*);
+    static CompressionBackend* defaultCompressionBackend();
+
+    IOStatus loadImage(const char* fileName, PngReadConvert = kPngReadConvert_closestMatch,
+                       CompressionBackend* = 0, MemoryResource* = 0);
+    IOStatus loadImage(const char* fileName, PixelFormat, CompressionBackend* = 0,
+                       MemoryResource* = 0);
 
     IOStatus loadImage(const std::string& fileName,
-                       PngReadConvert = kPngReadConvert_closestMatch);
-    IOStatus loadImage(const std::string& fileName, PixelFormat);
+                       PngReadConvert = kPngReadConvert_closestMatch,
+                       CompressionBackend* = 0, MemoryResource* = 0);
+    IOStatus loadImage(const std::string& fileName, PixelFormat, CompressionBackend* = 0,
+                       MemoryResource* = 0);
 
     IOStatus loadImageFromRAM(const void* pngData, std::size_t pngDataSize,
-                              PngReadConvert = kPngReadConvert_closestMatch);
-    IOStatus loadImageFromRAM(const void* pngData, std::size_t pngDataSize, PixelFormat);
+                              PngReadConvert = kPngReadConvert_closestMatch,
+                              CompressionBackend* = 0, MemoryResource* = 0);
+    IOStatus loadImageFromRAM(const void* pngData, std::size_t pngDataSize, PixelFormat,
+                              CompressionBackend* = 0, MemoryResource* = 0);
 #endif
 
     void newImage(int width, int height, PixelFormat = kPixelFormat_RGBA8);
@@ -194,22 +292,69 @@ class WPngImage
     void newImage(int width, int height, Pixel16, PixelFormat = kPixelFormat_RGBA16);
     void newImage(int width, int height, PixelF, PixelFormat = kPixelFormat_RGBAF);
 
+    bool adoptExternalBuffer(void* pixels, int width, int height, std::size_t rowStride,
+                             PixelFormat = kPixelFormat_RGBA8);
+    bool adoptExternalBuffer(const void* pixels, int width, int height, std::size_t rowStride,
+                             PixelFormat = kPixelFormat_RGBA8);
+    bool hasExternalBuffer() const;
+    bool isReadOnly() const;
+
 
     //------------------------------------------------------------------------
     // Image writing
     //------------------------------------------------------------------------
 #if !WPNGIMAGE_DISABLE_PNG_FILE_IO_SUPPORT
+    struct SaveOptions
+    {
+        PngFilterStrategy filterStrategy;
+        PngCompression compression;
+        unsigned threadsAmount;
+        bool reduceColors;
+        CompressionBackend* compressionBackend;
+        unsigned paletteColors;
+        bool ditherPalette;
+
+        SaveOptions():
+            filterStrategy(kPngFilterStrategy_minSum), compression(kPngCompression_default),
+            threadsAmount(1), reduceColors(true), compressionBackend(0), paletteColors(0),
+            ditherPalette(true) {}
+    };
+
     IOStatus saveImage(const char* fileName,
                        PngWriteConvert = kPngWriteConvert_closestMatch) const;
     IOStatus saveImage(const char* fileName, PngFileFormat) const;
+    IOStatus saveImage(const char* fileName, const SaveOptions&,
+                       PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImage(const char* fileName, const SaveOptions&, PngFileFormat) const;
+    IOStatus saveImage(const char* fileName, int x, int y, int width, int height,
+                       const SaveOptions&, PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImage(const char* fileName, int x, int y, int width, int height,
+                       const SaveOptions&, PngFileFormat) const;
 
     IOStatus saveImage(const std::string& fileName,
                        PngWriteConvert = kPngWriteConvert_closestMatch) const;
     IOStatus saveImage(const std::string& fileName, PngFileFormat) const;
+    IOStatus saveImage(const std::string& fileName, const SaveOptions&,
+                       PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImage(const std::string& fileName, const SaveOptions&, PngFileFormat) const;
+    IOStatus saveImage(const std::string& fileName, int x, int y, int width, int height,
+                       const SaveOptions&, PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImage(const std::string& fileName, int x, int y, int width, int height,
+                       const SaveOptions&, PngFileFormat) const;
 
     IOStatus saveImageToRAM(std::vector<unsigned char>& dest,
                             PngWriteConvert = kPngWriteConvert_closestMatch) const;
     IOStatus saveImageToRAM(std::vector<unsigned char>& dest, PngFileFormat) const;
+    IOStatus saveImageToRAM(std::vector<unsigned char>& dest, const SaveOptions&,
+                            PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImageToRAM(std::vector<unsigned char>& dest, const SaveOptions&,
+                            PngFileFormat) const;
+    IOStatus saveImageToRAM(std::vector<unsigned char>& dest,
+                            int x, int y, int width, int height, const SaveOptions&,
+                            PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImageToRAM(std::vector<unsigned char>& dest,
+                            int x, int y, int width, int height, const SaveOptions&,
+                            PngFileFormat) const;
 
 #if WPNGIMAGE_RESTRICT_TO_CPP98
     typedef void(*ByteStreamOutputFunc)(const unsigned char*, std::size_t);
@@ -219,6 +364,125 @@ class WPngImage
     IOStatus saveImageToRAM(ByteStreamOutputFunc,
                             PngWriteConvert = kPngWriteConvert_closestMatch) const;
     IOStatus saveImageToRAM(ByteStreamOutputFunc, PngFileFormat) const;
+    IOStatus saveImageToRAM(ByteStreamOutputFunc, const SaveOptions&,
+                            PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImageToRAM(ByteStreamOutputFunc, const SaveOptions&, PngFileFormat) const;
+    IOStatus saveImageToRAM(ByteStreamOutputFunc, int x, int y, int width, int height,
+                            const SaveOptions&,
+                            PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImageToRAM(ByteStreamOutputFunc, int x, int y, int width, int height,
+                            const SaveOptions&, PngFileFormat) const;
+
+    class Encoder
+    {
+     public:
+        Encoder();
+        explicit Encoder(const SaveOptions&);
+        ~Encoder();
+
+        void setOptions(const SaveOptions& options) { mOptions = options; }
+        const SaveOptions& options() const { return mOptions; }
+
+        IOStatus saveImage(const WPngImage&, const char* fileName,
+                           PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImage(const WPngImage&, const char* fileName, PngFileFormat);
+        IOStatus saveImage(const WPngImage&, const std::string& fileName,
+                           PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImage(const WPngImage&, const std::string& fileName, PngFileFormat);
+
+        IOStatus saveImageToRAM(const WPngImage&, std::vector<unsigned char>& dest,
+                                PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImageToRAM(const WPngImage&, std::vector<unsigned char>& dest,
+                                PngFileFormat);
+        IOStatus saveImageToRAM(const WPngImage&, ByteStreamOutputFunc,
+                                PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImageToRAM(const WPngImage&, ByteStreamOutputFunc, PngFileFormat);
+
+        IOStatus saveImage(const WPngImage&, const char* fileName,
+                           int x, int y, int width, int height,
+                           PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImage(const WPngImage&, const char* fileName,
+                           int x, int y, int width, int height, PngFileFormat);
+        IOStatus saveImage(const WPngImage&, const std::string& fileName,
+                           int x, int y, int width, int height,
+                           PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImage(const WPngImage&, const std::string& fileName,
+                           int x, int y, int width, int height, PngFileFormat);
+
+        IOStatus saveImageToRAM(const WPngImage&, std::vector<unsigned char>& dest,
+                                int x, int y, int width, int height,
+                                PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImageToRAM(const WPngImage&, std::vector<unsigned char>& dest,
+                                int x, int y, int width, int height, PngFileFormat);
+        IOStatus saveImageToRAM(const WPngImage&, ByteStreamOutputFunc,
+                                int x, int y, int width, int height,
+                                PngWriteConvert = kPngWriteConvert_closestMatch);
+        IOStatus saveImageToRAM(const WPngImage&, ByteStreamOutputFunc,
+                                int x, int y, int width, int height, PngFileFormat);
+
+     private:
+        friend class WPngImage;
+        struct Buffers;
+
+        SaveOptions mOptions;
+        Buffers* mBuffers;
+
+        Encoder(const Encoder&);
+        Encoder& operator=(const Encoder&);
+    };
+
+    struct BatchSaveItem
+    {
+        const WPngImage* image;
+        std::string fileName;
+        std::vector<unsigned char>* dest;
+        PngWriteConvert conversion;
+        PngFileFormat fileFormat;
+
+        BatchSaveItem(const WPngImage& img, const std::string& name,
+                      PngWriteConvert conv = kPngWriteConvert_closestMatch):
+            image(&img), fileName(name), dest(0), conversion(conv),
+            fileFormat(kPngFileFormat_none) {}
+        BatchSaveItem(const WPngImage& img, const std::string& name, PngFileFormat format):
+            image(&img), fileName(name), dest(0), conversion(kPngWriteConvert_closestMatch),
+            fileFormat(format) {}
+        BatchSaveItem(const WPngImage& img, std::vector<unsigned char>& destVector,
+                      PngWriteConvert conv = kPngWriteConvert_closestMatch):
+            image(&img), dest(&destVector), conversion(conv), fileFormat(kPngFileFormat_none) {}
+        BatchSaveItem(const WPngImage& img, std::vector<unsigned char>& destVector,
+                      PngFileFormat format):
+            image(&img), dest(&destVector), conversion(kPngWriteConvert_closestMatch),
+            fileFormat(format) {}
+    };
+
+    static std::vector<IOStatus> saveImages(const std::vector<BatchSaveItem>&,
+                                            const SaveOptions& = SaveOptions(),
+                                            unsigned threadsAmount = 0,
+                                            std::size_t maxBufferedBytes = 0);
+
+    struct OptimizeOptions
+    {
+        unsigned threadsAmount;
+        double timeBudget;
+        bool tryMaximumCompression;
+
+        OptimizeOptions(): threadsAmount(0), timeBudget(0), tryMaximumCompression(true) {}
+    };
+
+    IOStatus saveImageOptimized(const char* fileName, const OptimizeOptions& = OptimizeOptions(),
+                                PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImageOptimized(const char* fileName, const OptimizeOptions&,
+                                PngFileFormat) const;
+    IOStatus saveImageOptimized(const std::string& fileName,
+                                const OptimizeOptions& = OptimizeOptions(),
+                                PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus saveImageOptimized(const std::string& fileName, const OptimizeOptions&,
+                                PngFileFormat) const;
+    IOStatus optimizeToRAM(std::vector<unsigned char>& dest,
+                           const OptimizeOptions& = OptimizeOptions(),
+                           PngWriteConvert = kPngWriteConvert_closestMatch) const;
+    IOStatus optimizeToRAM(std::vector<unsigned char>& dest, const OptimizeOptions&,
+                           PngFileFormat) const;
 #endif
 
 
@@ -238,6 +502,7 @@ class WPngImage
     bool is8BPCPixelFormat() const;
     bool is16BPCPixelFormat() const;
     bool isFloatPixelFormat() const;
+    bool isPlanarPixelFormat() const;
 
     bool allPixelsHaveFullAlpha() const;
     void convertToPixelFormat(PixelFormat);
@@ -273,6 +538,12 @@ class WPngImage
     void transform(TransformFunc8, WPngImage& dest) const;
     void transform(TransformFunc16, WPngImage& dest) const;
     void transform(TransformFuncF, WPngImage& dest) const;
+    void transform(TransformFunc8, unsigned threadsAmount);
+    void transform(TransformFunc16, unsigned threadsAmount);
+    void transform(TransformFuncF, unsigned threadsAmount);
+    void transform(TransformFunc8, WPngImage& dest, unsigned threadsAmount) const;
+    void transform(TransformFunc16, WPngImage& dest, unsigned threadsAmount) const;
+    void transform(TransformFuncF, WPngImage& dest, unsigned threadsAmount) const;
 
     void transform8(TransformFunc8 f) { transform(f); }
     void transform16(TransformFunc16 f) { transform(f); }
@@ -281,6 +552,13 @@ class WPngImage
     void transform16(TransformFunc16 f, WPngImage& dest) const { transform(f, dest); }
     void transformF(TransformFuncF f, WPngImage& dest) const { transform(f, dest); }
 
+    template<typename Pixel_t, typename Func_t> void transformT(Func_t);
+    template<typename Pixel_t, typename Func_t> void transformXYT(Func_t);
+    template<typename Pixel_t, typename Func_t> void transformT(Func_t, unsigned threadsAmount);
+    template<typename Pixel_t, typename Func_t> void transformXYT(Func_t, unsigned threadsAmount);
+    template<typename Pixel_t, typename Func_t> void forEachPixel(Func_t) const;
+    template<typename Pixel_t, typename Func_t> void forEachPixelXY(Func_t) const;
+
 
     //------------------------------------------------------------------------
     // Image transformations
@@ -338,17 +616,69 @@ class WPngImage
     void resizeCanvas(int newOriginX, int newOriginY, int newWidth, int newHeight, PixelF);
 
     void premultiplyAlpha();
+    void quantizeToPalette(unsigned maxColors = 256, bool dither = true,
+                           unsigned threadsAmount = 1);
+
+
+    //------------------------------------------------------------------------
+    // Pixel arithmetic
+    //------------------------------------------------------------------------
+    void invert();
+    void add(Float value);
+    void subtract(Float value);
+    void multiply(Float factor);
+    void divide(Float divisor);
+    void add(const WPngImage&);
+    void subtract(const WPngImage&);
+    void multiply(const WPngImage&);
+    void divide(const WPngImage&);
+    void clamp();
+    void clampColors(Float minValue, Float maxValue);
+    void adjustBrightnessContrast(Float brightness, Float contrast);
+    void multiplyAlpha(Float factor);
+
+    struct LUT8
+    {
+        Byte r[256], g[256], b[256], a[256];
+
+        LUT8();
+        explicit LUT8(TransformFunc8);
+    };
+
+    struct LUT16
+    {
+        std::vector<UInt16> r, g, b, a;
+
+        LUT16();
+        explicit LUT16(TransformFunc16);
+    };
+
+    void applyLUT(const LUT8&);
+    void applyLUT(const LUT16&);
 
 
     //------------------------------------------------------------------------
     // Raw data
     //------------------------------------------------------------------------
+    // The pixel data seen through the const versions may be shared with copies of the image,
+    // so any modification of the image invalidates the pointers they have returned.
     const Pixel8* getRawPixelData8() const;
     Pixel8* getRawPixelData8();
     const Pixel16* getRawPixelData16() const;
     Pixel16* getRawPixelData16();
     const PixelF* getRawPixelDataF() const;
     PixelF* getRawPixelDataF();
+    const Float* getRawPlaneData(unsigned channel) const;
+    Float* getRawPlaneData(unsigned channel);
+
+    void setPaddedRows(bool);
+    bool hasPaddedRows() const { return mPadRows; }
+    std::size_t rowStride() const;
+
+    template<typename Pixel_t> PixelRows<Pixel_t> rows();
+    template<typename Pixel_t> PixelRows<const Pixel_t> rows() const;
+    template<typename Pixel_t> PixelSpan<Pixel_t> rowSpan(int y);
+    template<typename Pixel_t> PixelSpan<const Pixel_t> rowSpan(int y) const;
 
 
 
@@ -359,12 +689,47 @@ class WPngImage
     template<typename, typename> struct IPixel;
     struct PngDataBase;
     template<typename> struct PngData;
+    template<typename> struct PlanarPngData;
 
     PngDataBase* mData;
     int mWidth, mHeight;
+    bool mPadRows;
+    MemoryResource* mMemoryResource;
 
     template<typename Pixel_t>
     void newImageWithPixelValue(int, int, Pixel_t, PixelFormat);
+    bool adoptPixelBuffer(void*, int, int, std::size_t, PixelFormat, bool readOnly);
+    void replacePixelData(PixelFormat);
+    PngDataBase* sharePixelData() const;
+    bool detachPixelData();
+    void releasePixelData();
+
+    template<typename> struct NativePixelFormat;
+    const void* rawPixelData(PixelFormat) const;
+    void* rawPixelData(PixelFormat);
+    template<typename Pixel_t> PixelRows<Pixel_t> storageRows() const;
+    void readPixelRow(int, Pixel8*) const;
+    void readPixelRow(int, Pixel16*) const;
+    void readPixelRow(int, PixelF*) const;
+    void readPixelRow(int, PixelGA8*) const;
+    void readPixelRow(int, PixelGA16*) const;
+    void readPixelRow(int, PixelGAF*) const;
+    void writePixelRow(int, const Pixel8*);
+    void writePixelRow(int, const Pixel16*);
+    void writePixelRow(int, const PixelF*);
+    void writePixelRow(int, const PixelGA8*);
+    void writePixelRow(int, const PixelGA16*);
+    void writePixelRow(int, const PixelGAF*);
+    void pixelsWereModified();
+    void applyToComponents(Float, Float, Float, Float, bool);
+    void combineWithImage(const WPngImage&, char);
+
+    struct RowsJob { virtual ~RowsJob() {} virtual void transformRows(int, int) = 0; };
+    struct PixelFuncCall;
+    struct PixelFuncCallXY;
+    template<typename, typename, typename> struct TransformRowsJob;
+    struct RowsJobRunner;
+    void runRowsJob(RowsJob&, unsigned);
 
     void putImage(int, int, const WPngImage&, int, int, int, int, bool);
     void manageCanvasResize(WPngImage&, int, int);
@@ -379,18 +744,34 @@ class WPngImage
     void setPixel(std::size_t, const Pixel16&);
 
 #if !WPNGIMAGE_DISABLE_PNG_FILE_IO_SUPPORT
-    void setPixelRow(PngFileFormat, int, Byte*, int) const;
-    void setPixelRow(PngFileFormat, int, UInt16*, int) const;
+    void setPixelRow(PngFileFormat, int, int, int, Byte*, int) const;
+    void setPixelRow(PngFileFormat, int, int, int, UInt16*, int) const;
+
+    struct SaveRegion { int x, y, width, height; };
+    SaveRegion wholeImageRegion() const { SaveRegion r = { 0, 0, mWidth, mHeight }; return r; }
+    bool clipSaveRegion(const SaveRegion&, int& x, int& y, int& width, int& height) const;
+    bool isValidSaveRegion(const SaveRegion&) const;
+
+    struct PngWriteInfo;
+    void getPngWriteInfo(PngWriteInfo&, PngFileFormat, const SaveOptions&,
+                         const SaveRegion&) const;
+    void setPngRow(PngWriteInfo&, int, unsigned char*, unsigned) const;
 
     struct PngStructs;
     IOStatus readPngData(PngStructs&, bool, PngReadConvert, PixelFormat);
-    IOStatus performLoadImage(const char*, bool, PngReadConvert, PixelFormat);
-    IOStatus performLoadImageFromRAM(const void*, std::size_t, bool, PngReadConvert, PixelFormat);
-    IOStatus writePngData(PngStructs&, PngFileFormat) const;
-    void performWritePngData(PngStructs&, PngFileFormat, int, int, int) const;
-    IOStatus performSaveImage(const char*, PngFileFormat) const;
+    IOStatus performLoadImage(const char*, bool, PngReadConvert, PixelFormat,
+                              CompressionBackend*);
+    IOStatus performLoadImageFromRAM(const void*, std::size_t, bool, PngReadConvert, PixelFormat,
+                                     CompressionBackend*);
+    IOStatus writePngData(PngStructs&, PngFileFormat, const SaveOptions&, const SaveRegion&,
+                          Encoder::Buffers&) const;
+    void performWritePngData(PngStructs&, Encoder::Buffers&) const;
+    IOStatus performSaveImage(const char*, PngFileFormat, const SaveOptions&, const SaveRegion&,
+                              Encoder::Buffers*) const;
     IOStatus performSaveImageToRAM
-    (std::vector<unsigned char>*, ByteStreamOutputFunc, PngFileFormat) const;
+    (std::vector<unsigned char>*, ByteStreamOutputFunc, PngFileFormat, const SaveOptions&,
+     const SaveRegion&, Encoder::Buffers*) const;
+    struct OptimizeJob;
 #endif
 };
 
@@ -651,6 +1032,252 @@ inline WPngImage::PixelF operator*(WPngImage::Float value, const WPngImage::Pixe
 WPngImage::PixelF operator/(WPngImage::Float, const WPngImage::PixelF&);
 
 
+//============================================================================
+// Pixel spans
+//============================================================================
+// The pixels of one row.
+template<typename Pixel_t>
+class WPngImage::PixelSpan
+{
+ public:
+    typedef Pixel_t value_type;
+    typedef Pixel_t* iterator;
+
+    PixelSpan(): mData(0), mSize(0) {}
+    PixelSpan(Pixel_t* data, std::size_t size): mData(data), mSize(size) {}
+
+    Pixel_t* data() const { return mData; }
+    std::size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    Pixel_t* begin() const { return mData; }
+    Pixel_t* end() const { return mData + mSize; }
+    Pixel_t& operator[](std::size_t index) const { return mData[index]; }
+
+ private:
+    Pixel_t* mData;
+    std::size_t mSize;
+};
+
+// All the rows of an image. Each row starts stride() pixels after the previous one.
+template<typename Pixel_t>
+class WPngImage::PixelRows
+{
+ public:
+    PixelRows(): mData(0), mWidth(0), mHeight(0), mStride(0) {}
+    PixelRows(Pixel_t* data, int width, int height, std::size_t stride):
+        mData(data), mWidth(width), mHeight(height), mStride(stride) {}
+
+    Pixel_t* data() const { return mData; }
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+    std::size_t stride() const { return mStride; }
+    bool empty() const { return mData == 0; }
+
+    PixelSpan<Pixel_t> operator[](int y) const
+    { return PixelSpan<Pixel_t>(mData + std::size_t(y) * mStride, std::size_t(mWidth)); }
+
+ private:
+    Pixel_t* mData;
+    int mWidth, mHeight;
+    std::size_t mStride;
+};
+
+template<> struct WPngImage::NativePixelFormat<WPngImage::PixelGA8>
+{ static const PixelFormat kValue = kPixelFormat_GA8; };
+template<> struct WPngImage::NativePixelFormat<WPngImage::PixelGA16>
+{ static const PixelFormat kValue = kPixelFormat_GA16; };
+template<> struct WPngImage::NativePixelFormat<WPngImage::PixelGAF>
+{ static const PixelFormat kValue = kPixelFormat_GAF; };
+template<> struct WPngImage::NativePixelFormat<WPngImage::Pixel8>
+{ static const PixelFormat kValue = kPixelFormat_RGBA8; };
+template<> struct WPngImage::NativePixelFormat<WPngImage::Pixel16>
+{ static const PixelFormat kValue = kPixelFormat_RGBA16; };
+template<> struct WPngImage::NativePixelFormat<WPngImage::PixelF>
+{ static const PixelFormat kValue = kPixelFormat_RGBAF; };
+
+template<typename Pixel_t>
+WPngImage::PixelRows<Pixel_t> WPngImage::rows()
+{
+    Pixel_t* data = static_cast<Pixel_t*>(rawPixelData(NativePixelFormat<Pixel_t>::kValue));
+    return data ? PixelRows<Pixel_t>(data, mWidth, mHeight, rowStride()) :
+        PixelRows<Pixel_t>();
+}
+
+template<typename Pixel_t>
+WPngImage::PixelRows<const Pixel_t> WPngImage::rows() const
+{
+    const Pixel_t* data =
+        static_cast<const Pixel_t*>(rawPixelData(NativePixelFormat<Pixel_t>::kValue));
+    return data ? PixelRows<const Pixel_t>(data, mWidth, mHeight, rowStride()) :
+        PixelRows<const Pixel_t>();
+}
+
+template<typename Pixel_t>
+WPngImage::PixelSpan<Pixel_t> WPngImage::rowSpan(int y)
+{
+    if(y < 0 || y >= mHeight) return PixelSpan<Pixel_t>();
+    return rows<Pixel_t>()[y];
+}
+
+template<typename Pixel_t>
+WPngImage::PixelSpan<const Pixel_t> WPngImage::rowSpan(int y) const
+{
+    if(y < 0 || y >= mHeight) return PixelSpan<const Pixel_t>();
+    return rows<Pixel_t>()[y];
+}
+
+// Unlike rows(), this doesn't mark the pixel data as exposed. Used by the transform
+// templates, which take care of the opacity tracking themselves.
+template<typename Pixel_t>
+WPngImage::PixelRows<Pixel_t> WPngImage::storageRows() const
+{
+    Pixel_t* data = static_cast<Pixel_t*>
+        (const_cast<void*>(rawPixelData(NativePixelFormat<Pixel_t>::kValue)));
+    return data ? PixelRows<Pixel_t>(data, mWidth, mHeight, rowStride()) :
+        PixelRows<Pixel_t>();
+}
+
+
+//============================================================================
+// Pixel transform templates
+//============================================================================
+// Calls the function of transformT() and transformXYT(), respectively.
+struct WPngImage::PixelFuncCall
+{
+    template<typename Pixel_t, typename Func_t>
+    static Pixel_t call(Func_t& func, const Pixel_t& pixel, int, int) { return func(pixel); }
+};
+
+struct WPngImage::PixelFuncCallXY
+{
+    template<typename Pixel_t, typename Func_t>
+    static Pixel_t call(Func_t& func, const Pixel_t& pixel, int x, int y)
+    { return func(pixel, x, y); }
+};
+
+// If the pixels are stored as Pixel_t, the function is called directly on the pixel data,
+// so it can be inlined into the loop. Otherwise each row is converted to Pixel_t and back.
+template<typename Pixel_t, typename Func_t, typename Call_t>
+struct WPngImage::TransformRowsJob: public WPngImage::RowsJob
+{
+    WPngImage& mImage;
+    Func_t& mFunc;
+
+    TransformRowsJob(WPngImage& image, Func_t& func): mImage(image), mFunc(func) {}
+
+    virtual void transformRows(int beginY, int endY)
+    {
+        const int width = mImage.mWidth;
+        const PixelRows<Pixel_t> pixelRows = mImage.storageRows<Pixel_t>();
+        if(!pixelRows.empty())
+        {
+            for(int y = beginY; y < endY; ++y)
+            {
+                Pixel_t* row = pixelRows[y].data();
+                for(int x = 0; x < width; ++x)
+                    row[x] = Call_t::call(mFunc, row[x], x, y);
+            }
+        }
+        else
+        {
+            std::vector<Pixel_t> row(width);
+            for(int y = beginY; y < endY; ++y)
+            {
+                mImage.readPixelRow(y, &row[0]);
+                for(int x = 0; x < width; ++x)
+                    row[x] = Call_t::call(mFunc, row[x], x, y);
+                mImage.writePixelRow(y, &row[0]);
+            }
+        }
+    }
+};
+
+template<typename Pixel_t, typename Func_t>
+void WPngImage::transformT(Func_t func)
+{
+    transformT<Pixel_t>(func, 1U);
+}
+
+template<typename Pixel_t, typename Func_t>
+void WPngImage::transformXYT(Func_t func)
+{
+    transformXYT<Pixel_t>(func, 1U);
+}
+
+// With more than one thread the function is called concurrently from all of them.
+template<typename Pixel_t, typename Func_t>
+void WPngImage::transformT(Func_t func, unsigned threadsAmount)
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return;
+    if(!detachPixelData()) return;
+    TransformRowsJob<Pixel_t, Func_t, PixelFuncCall> job(*this, func);
+    runRowsJob(job, threadsAmount);
+    pixelsWereModified();
+}
+
+template<typename Pixel_t, typename Func_t>
+void WPngImage::transformXYT(Func_t func, unsigned threadsAmount)
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return;
+    if(!detachPixelData()) return;
+    TransformRowsJob<Pixel_t, Func_t, PixelFuncCallXY> job(*this, func);
+    runRowsJob(job, threadsAmount);
+    pixelsWereModified();
+}
+
+template<typename Pixel_t, typename Func_t>
+void WPngImage::forEachPixel(Func_t func) const
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return;
+    const PixelRows<const Pixel_t> pixelRows = rows<Pixel_t>();
+    if(!pixelRows.empty())
+    {
+        for(int y = 0; y < mHeight; ++y)
+        {
+            const Pixel_t* row = pixelRows[y].data();
+            for(int x = 0; x < mWidth; ++x)
+                func(row[x]);
+        }
+    }
+    else
+    {
+        std::vector<Pixel_t> row(mWidth);
+        for(int y = 0; y < mHeight; ++y)
+        {
+            readPixelRow(y, &row[0]);
+            for(int x = 0; x < mWidth; ++x)
+                func(static_cast<const Pixel_t&>(row[x]));
+        }
+    }
+}
+
+template<typename Pixel_t, typename Func_t>
+void WPngImage::forEachPixelXY(Func_t func) const
+{
+    if(!mData || mWidth == 0 || mHeight == 0) return;
+    const PixelRows<const Pixel_t> pixelRows = rows<Pixel_t>();
+    if(!pixelRows.empty())
+    {
+        for(int y = 0; y < mHeight; ++y)
+        {
+            const Pixel_t* row = pixelRows[y].data();
+            for(int x = 0; x < mWidth; ++x)
+                func(row[x], x, y);
+        }
+    }
+    else
+    {
+        std::vector<Pixel_t> row(mWidth);
+        for(int y = 0; y < mHeight; ++y)
+        {
+            readPixelRow(y, &row[0]);
+            for(int x = 0; x < mWidth; ++x)
+                func(static_cast<const Pixel_t&>(row[x]), x, y);
+        }
+    }
+}
+
+
 //============================================================================
 // Pixel base class inline function implementations
 //============================================================================
@@ -67,11 +67,10 @@ platform if needed. Everything else in the code calls these. Pass
 -DLODEPNG_NO_COMPILE_ALLOCATORS to the compiler, or comment out
 #define LODEPNG_COMPILE_ALLOCATORS in the header, to disable the ones here and
 define them in your own project's source files without needing to change
-lodepng source code. Don't forget to remove "static" if you copypaste them
-from here.*/
+lodepng source code. They are declared in the header.*/
 
 #ifdef LODEPNG_COMPILE_ALLOCATORS
-static void* lodepng_malloc(size_t size) {
+void* lodepng_malloc(size_t size) {
 #ifdef LODEPNG_MAX_ALLOC
   if(size > LODEPNG_MAX_ALLOC) return 0;
 #endif
@@ -79,21 +78,16 @@ static void* lodepng_malloc(size_t size) {
 }
 
 /* NOTE: when realloc returns NULL, it leaves the original memory untouched */
-static void* lodepng_realloc(void* ptr, size_t new_size) {
+void* lodepng_realloc(void* ptr, size_t new_size) {
 #ifdef LODEPNG_MAX_ALLOC
   if(new_size > LODEPNG_MAX_ALLOC) return 0;
 #endif
   return realloc(ptr, new_size);
 }
 
-static void lodepng_free(void* ptr) {
+void lodepng_free(void* ptr) {
   free(ptr);
 }
-#else /*LODEPNG_COMPILE_ALLOCATORS*/
-/* TODO: support giving additional void* payload to the custom allocators */
-void* lodepng_malloc(size_t size);
-void* lodepng_realloc(void* ptr, size_t new_size);
-void lodepng_free(void* ptr);
 #endif /*LODEPNG_COMPILE_ALLOCATORS*/
 
 /* convince the compiler to inline a function, for use when this measurably improves performance */
@@ -113,6 +107,44 @@ void lodepng_free(void* ptr);
 #define LODEPNG_RESTRICT /* not available */
 #endif
 
+/* SIMD code paths for x86-64, chosen at runtime depending on what the CPU supports.
+Pass -DLODEPNG_NO_COMPILE_SIMD to the compiler to only use the portable code. The
+features are detected once during static initialization; a value of zero (which is
+also what is seen before that) selects the portable code. */
+#if !defined(LODEPNG_NO_COMPILE_SIMD) && defined(__cplusplus) && \
+    (defined(__x86_64__) || defined(_M_X64)) && \
+    (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define LODEPNG_X86_SIMD
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define LODEPNG_TARGET(features) /* not needed */
+#else
+#include <cpuid.h>
+#define LODEPNG_TARGET(features) __attribute__((target(features)))
+#endif
+#include <immintrin.h>
+
+#define LODEPNG_CPU_SSSE3 1u
+#define LODEPNG_CPU_PCLMUL 2u
+
+static unsigned lodepng_detect_cpu_features(void) {
+  unsigned features = 0, ecx;
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 1);
+  ecx = (unsigned)info[2];
+#else
+  unsigned eax, ebx, edx;
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+#endif
+  if(ecx & (1u << 9u)) features |= LODEPNG_CPU_SSSE3;
+  if(ecx & (1u << 1u)) features |= LODEPNG_CPU_PCLMUL;
+  return features;
+}
+
+static const unsigned lodepng_cpu_features = lodepng_detect_cpu_features();
+#endif /* LODEPNG_X86_SIMD */
+
 /* Replacements for C library functions such as memcpy and strlen, to support platforms
 where a full C library is not available. The compiler can recognize them and compile
 to something as fast. */
@@ -1530,6 +1562,64 @@ static void hash_cleanup(Hash* hash) {
   lodepng_free(hash->chainz);
 }
 
+struct LodePNGDeflateCache {
+  Hash hash;
+  unsigned windowsize; /*window size the hash was allocated for, 0 if it is not allocated*/
+  unsigned usedsize; /*amount of window positions touched since the hash was last initialized*/
+  uivector lz77_encoded; /*buffer for the lz77 output of deflateDynamic and deflateFixed*/
+};
+
+LodePNGDeflateCache* lodepng_deflate_cache_new(void) {
+  LodePNGDeflateCache* cache = (LodePNGDeflateCache*)lodepng_malloc(sizeof(LodePNGDeflateCache));
+  if(cache) {
+    cache->windowsize = 0;
+    cache->usedsize = 0;
+    uivector_init(&cache->lz77_encoded);
+  }
+  return cache;
+}
+
+void lodepng_deflate_cache_delete(LodePNGDeflateCache* cache) {
+  if(!cache) return;
+  if(cache->windowsize) hash_cleanup(&cache->hash);
+  uivector_cleanup(&cache->lz77_encoded);
+  lodepng_free(cache);
+}
+
+/*Brings the hash of the cache into the same state as hash_init would. The tables are only
+allocated when the window size changes, and otherwise only the window positions used by the
+previous call are reset, which for small images is much less than the whole tables.*/
+static unsigned hash_init_cached(LodePNGDeflateCache* cache, unsigned windowsize, size_t insize) {
+  Hash* hash = &cache->hash;
+  unsigned i;
+  if(cache->windowsize != windowsize) {
+    unsigned error;
+    if(cache->windowsize) hash_cleanup(hash);
+    cache->windowsize = 0;
+    error = hash_init(hash, windowsize);
+    if(error) {
+      hash_cleanup(hash);
+      return error;
+    }
+    cache->windowsize = windowsize;
+  } else {
+    if(cache->usedsize == windowsize) {
+      /*the positions may have gone around the window, so val does not know every used head*/
+      for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+    } else {
+      for(i = 0; i != cache->usedsize; ++i) {
+        if(hash->val[i] != -1) hash->head[hash->val[i]] = -1;
+      }
+    }
+    for(i = 0; i != cache->usedsize; ++i) hash->val[i] = -1;
+    for(i = 0; i != cache->usedsize; ++i) hash->chain[i] = i;
+    for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+    for(i = 0; i != cache->usedsize; ++i) hash->chainz[i] = i;
+  }
+  cache->usedsize = insize < windowsize ? (unsigned)insize : windowsize;
+  return 0;
+}
+
 
 
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos) {
@@ -1730,6 +1820,129 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*Hash of the 4 bytes at data, used by encodeLZ77Greedy*/
+static unsigned getHash4(const unsigned char* data) {
+  unsigned value = (unsigned)data[0] | ((unsigned)data[1] << 8u) |
+                   ((unsigned)data[2] << 16u) | ((unsigned)data[3] << 24u);
+  return (((value * 2654435761u) & 0xffffffffu) >> 16u) & HASH_BIT_MASK;
+}
+
+/*
+LZ77-encode the data greedily, for speed: the longest match found at a position is always
+taken, without lazy matching. Only matches of at least 4 bytes are searched for, using a hash
+of 4 bytes, and at most maxchainlength earlier positions with the same hash are tried. With a
+maxchainlength of 1 the hash chains are not maintained at all, only the latest position of
+each hash. The tables are the same as those of encodeLZ77 and are reset the same way, but
+since the entries are not kept consistent with the window, every candidate is checked.
+*/
+static unsigned encodeLZ77Greedy(uivector* out, Hash* hash,
+                                 const unsigned char* in, size_t inpos, size_t insize,
+                                 unsigned windowsize, unsigned maxchainlength, unsigned nicematch) {
+  /*the positions inside longer matches than this are not added to the hash, as a speedup*/
+  unsigned maxinsertlength = maxchainlength > 1 ? 32 : 8;
+  size_t pos = inpos;
+
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+
+  if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+
+  while(pos < insize) {
+    size_t length = 0;
+    unsigned offset = 0;
+
+    if(pos + 4 <= insize) {
+      size_t wpos = pos & (windowsize - 1);
+      size_t maxlength = insize - pos;
+      unsigned hashval = getHash4(&in[pos]);
+      int hashpos = hash->head[hashval];
+      unsigned chainlength = 0, prev_offset = 0;
+      if(maxlength > MAX_SUPPORTED_DEFLATE_LENGTH) maxlength = MAX_SUPPORTED_DEFLATE_LENGTH;
+
+      while(hashpos != -1 && chainlength++ < maxchainlength) {
+        unsigned current_offset = (unsigned)((wpos - (size_t)hashpos) & (windowsize - 1));
+        const unsigned char* foreptr = &in[pos];
+        const unsigned char* backptr;
+        /*stop at outdated entries, and when went completely around the circular buffer*/
+        if(current_offset == 0 || current_offset > pos || current_offset < prev_offset) break;
+        prev_offset = current_offset;
+        backptr = foreptr - current_offset;
+
+        /*only a candidate that continues past the longest match so far can be better*/
+        if(backptr[length] == foreptr[length]) {
+          size_t current_length = 0;
+          while(current_length != maxlength && backptr[current_length] == foreptr[current_length]) {
+            ++current_length;
+          }
+          if(current_length > length) {
+            length = current_length;
+            offset = current_offset;
+            if(length >= nicematch || length == maxlength) break;
+          }
+        }
+
+        if(hash->chain[hashpos] == hashpos) break;
+        hashpos = hash->chain[hashpos];
+        if(hash->val[hashpos] != (int)hashval) break;
+      }
+
+      hash->val[wpos] = (int)hashval;
+      if(maxchainlength > 1) {
+        hash->chain[wpos] = (unsigned short)(hash->head[hashval] != -1 ? hash->head[hashval] : (int)wpos);
+      }
+      hash->head[hashval] = (int)wpos;
+    }
+
+    if(length < 4) {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    } else {
+      size_t end = pos + length;
+      addLengthDistance(out, length, offset);
+      if(length <= maxinsertlength) {
+        for(++pos; pos != end && pos + 4 <= insize; ++pos) {
+          size_t wpos = pos & (windowsize - 1);
+          unsigned hashval = getHash4(&in[pos]);
+          hash->val[wpos] = (int)hashval;
+          if(maxchainlength > 1) {
+            hash->chain[wpos] = (unsigned short)(hash->head[hashval] != -1 ? hash->head[hashval] : (int)wpos);
+          }
+          hash->head[hashval] = (int)wpos;
+        }
+      }
+      pos = end;
+    }
+  }
+  return 0;
+}
+
+/*
+LZ77-encode the data using only matches at distance 1, that is runs of the same byte, like
+zlib's Z_RLE strategy. No hash tables are needed and every byte is only looked at once, and
+since filtered PNG data is dominated by runs of zeros, it still compresses reasonably well.
+*/
+static unsigned encodeRLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize) {
+  size_t pos = inpos;
+  while(pos < insize) {
+    size_t length = 0;
+    if(pos > 0) {
+      unsigned char previous = in[pos - 1];
+      size_t maxlength = insize - pos;
+      if(maxlength > MAX_SUPPORTED_DEFLATE_LENGTH) maxlength = MAX_SUPPORTED_DEFLATE_LENGTH;
+      while(length != maxlength && in[pos + length] == previous) ++length;
+    }
+
+    if(length >= 3) {
+      addLengthDistance(out, length, 1);
+      pos += length;
+    } else {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      ++pos;
+    }
+  }
+  return 0;
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
 static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
@@ -1794,10 +2007,12 @@ static void writeLZ77data(LodePNGBitWriter* writer, const uivector* lz77_encoded
   }
 }
 
-/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
+/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees.
+If symbols is not null, it is the already LZ77 encoded block, and the data is not used.*/
 static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
                                const unsigned char* data, size_t datapos, size_t dataend,
-                               const LodePNGCompressSettings* settings, unsigned final) {
+                               const LodePNGCompressSettings* settings, unsigned final,
+                               const uivector* symbols) {
   unsigned error = 0;
 
   /*
@@ -1812,7 +2027,8 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   */
 
   /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
+  uivector lz77_local;
+  uivector* lz77_encoded = settings->cache ? &settings->cache->lz77_encoded : &lz77_local;
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
@@ -1837,7 +2053,8 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   size_t numcodes_ll, numcodes_d, numcodes_lld, numcodes_lld_e, numcodes_cl;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
+  uivector_init(&lz77_local);
+  lz77_encoded->size = 0;
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
@@ -1855,21 +2072,31 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     lodepng_memset(frequencies_d, 0, 30 * sizeof(*frequencies_d));
     lodepng_memset(frequencies_cl, 0, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
-    if(settings->use_lz77) {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+    if(symbols) {
+      /*already encoded*/
+    } else if(settings->use_lz77 && settings->use_rle) {
+      error = encodeRLE(lz77_encoded, data, datapos, dataend);
+      if(error) break;
+    } else if(settings->use_lz77 && settings->greedy_chainlength) {
+      error = encodeLZ77Greedy(lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                               settings->greedy_chainlength, settings->nicematch);
+      if(error) break;
+    } else if(settings->use_lz77) {
+      error = encodeLZ77(lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
       if(error) break;
     } else {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; ++i) lz77_encoded.data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
+      if(!uivector_resize(lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
+      for(i = datapos; i < dataend; ++i) lz77_encoded->data[i - datapos] = data[i]; /*no LZ77, but still will be Huffman compressed*/
     }
+    if(!symbols) symbols = lz77_encoded;
 
     /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i != lz77_encoded.size; ++i) {
-      unsigned symbol = lz77_encoded.data[i];
+    for(i = 0; i != symbols->size; ++i) {
+      unsigned symbol = symbols->data[i];
       ++frequencies_ll[symbol];
       if(symbol > 256) {
-        unsigned dist = lz77_encoded.data[i + 2];
+        unsigned dist = symbols->data[i + 2];
         ++frequencies_d[dist];
         i += 3;
       }
@@ -1993,7 +2220,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
+    writeLZ77data(writer, symbols, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(tree_ll.lengths[256] == 0) ERROR_BREAK(64);
 
@@ -2004,7 +2231,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   }
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
+  uivector_cleanup(&lz77_local);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
@@ -2040,12 +2267,21 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
     writeBits(writer, 0, 1); /*second bit of BTYPE*/
 
     if(settings->use_lz77) /*LZ77 encoded*/ {
-      uivector lz77_encoded;
-      uivector_init(&lz77_encoded);
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
-      if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
-      uivector_cleanup(&lz77_encoded);
+      uivector lz77_local;
+      uivector* lz77_encoded = settings->cache ? &settings->cache->lz77_encoded : &lz77_local;
+      uivector_init(&lz77_local);
+      lz77_encoded->size = 0;
+      if(settings->use_rle) {
+        error = encodeRLE(lz77_encoded, data, datapos, dataend);
+      } else if(settings->greedy_chainlength) {
+        error = encodeLZ77Greedy(lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                                 settings->greedy_chainlength, settings->nicematch);
+      } else {
+        error = encodeLZ77(lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                           settings->minmatch, settings->nicematch, settings->lazymatching);
+      }
+      if(!error) writeLZ77data(writer, lz77_encoded, &tree_ll, &tree_d);
+      uivector_cleanup(&lz77_local);
     } else /*no LZ77, but still will be Huffman compressed*/ {
       for(i = datapos; i < dataend; ++i) {
         writeBitsReversed(writer, tree_ll.codes[data[i]], tree_ll.lengths[data[i]]);
@@ -2062,11 +2298,499 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Squeeze: deflate with optimal parsing                                  / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*
+The squeeze compresses as much as possible regardless of the time it takes, similarly to Zopfli.
+All matches of a block are found once. Then the block is parsed repeatedly with a shortest path
+search, where the cost of each literal and length/distance pair comes from the huffman code lengths
+of the previous parse (the first parse uses the fixed tree), and the smallest parse is kept. Then
+the block is split into smaller deflate blocks, each with its own huffman trees, wherever that makes
+the result smaller, and those are parsed again with their own costs. The blocks only depend on the
+input data, so they can be squeezed concurrently.
+*/
+
+#define SQUEEZE_WINDOW_SIZE 32768u
+#define SQUEEZE_MAX_CHAIN_LENGTH 4096u
+/*the amount of blocks squeezed at the same time, which limits the memory used for their results*/
+#define SQUEEZE_BATCH_SIZE 16u
+/*ranges with less LZ77 items than this are not split further*/
+#define SQUEEZE_MIN_SPLIT_ITEMS 512u
+#define SQUEEZE_SPLIT_POINTS 9u
+#define SQUEEZE_SPLIT_ROUNDS 4u
+
+typedef struct SqueezeBlock {
+  size_t start, end; /*the positions of the block in the input*/
+  /*the matches of each position, as length << 16 | distance in order of increasing length and
+  distance: each length up to that of a pair, and longer than that of the previous pair, has its
+  shortest distance in the pair. Those of position i are pairs[first[i]] to pairs[first[i + 1]].*/
+  size_t* first;
+  uivector pairs;
+  unsigned short* runs; /*the amount of equal bytes starting at each position, at most 65535*/
+  /*for the shortest path search, per position*/
+  unsigned* cost;
+  unsigned short* step_length; /*1 for a literal*/
+  unsigned short* step_distance;
+  uivector path;
+  /*result: the LZ77 symbols, and the symbol index at which each deflate block ends*/
+  uivector symbols;
+  uivector splits;
+} SqueezeBlock;
+
+typedef struct SqueezeCosts {
+  unsigned ll[NUM_DEFLATE_CODE_SYMBOLS]; /*bits of each literal/length symbol*/
+  unsigned d[NUM_DISTANCE_SYMBOLS]; /*bits of each distance symbol*/
+} SqueezeCosts;
+
+typedef struct SqueezeData {
+  const unsigned char* in;
+  SqueezeBlock* blocks;
+  const LodePNGCompressSettings* settings;
+} SqueezeData;
+
+/*3 bytes, which is the shortest match, hashed into 16 bits*/
+static unsigned getHash3(const unsigned char* data) {
+  unsigned value = (unsigned)data[0] | ((unsigned)data[1] << 8u) | ((unsigned)data[2] << 16u);
+  return (((value * 2654435761u) & 0xffffffffu) >> 16u) & HASH_BIT_MASK;
+}
+
+static unsigned squeezeFindMatches(SqueezeBlock* block, const unsigned char* in) {
+  size_t start = block->start, end = block->end;
+  size_t base = start > SQUEEZE_WINDOW_SIZE ? start - SQUEEZE_WINDOW_SIZE : 0;
+  int* head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
+  int* prev = (int*)lodepng_malloc(sizeof(int) * SQUEEZE_WINDOW_SIZE);
+  unsigned error = 0;
+  size_t pos, i;
+
+  if(!head || !prev) error = 83; /*alloc fail*/
+
+  if(!error) {
+    for(pos = end - start; pos-- > 0;) {
+      unsigned run = pos + 1 < end - start && in[start + pos] == in[start + pos + 1] ? block->runs[pos + 1] : 0;
+      block->runs[pos] = (unsigned short)(run < 65535 ? run + 1 : run);
+    }
+
+    for(i = 0; i != HASH_NUM_VALUES; ++i) head[i] = -1;
+    /*the positions in the window before the block are only added to the hash chains*/
+    for(pos = base; pos < end; ++pos) {
+      unsigned hashval = pos + 3 <= end ? getHash3(&in[pos]) : 0;
+      if(pos >= start) {
+        block->first[pos - start] = block->pairs.size;
+        if(pos + 3 <= end) {
+          size_t maxlength = LODEPNG_MIN(end - pos, MAX_SUPPORTED_DEFLATE_LENGTH);
+          size_t best = 2;
+          int candidate = head[hashval];
+          unsigned chainlength = 0;
+          if(pos > 0 && in[pos - 1] == in[pos] && block->runs[pos - start] >= maxlength) {
+            /*inside a long run of the same byte, distance 1 is the shortest for all lengths*/
+            if(!uivector_push_back(&block->pairs, (unsigned)((maxlength << 16u) | 1u))) ERROR_BREAK(83);
+            candidate = -1;
+          }
+          /*the chain goes from the nearest position to the farthest, so the first match found
+          with each length has the shortest distance*/
+          while(candidate >= 0 && chainlength++ < SQUEEZE_MAX_CHAIN_LENGTH) {
+            const unsigned char* backptr = &in[base + (size_t)candidate];
+            size_t distance = pos - (base + (size_t)candidate);
+            if(distance > SQUEEZE_WINDOW_SIZE) break;
+            if(backptr[best] == in[pos + best]) {
+              size_t length = 0;
+              while(length != maxlength && backptr[length] == in[pos + length]) ++length;
+              if(length > best) {
+                best = length;
+                if(!uivector_push_back(&block->pairs, (unsigned)((length << 16u) | distance))) {
+                  ERROR_BREAK(83); /*alloc fail*/
+                }
+                if(best == maxlength) break;
+              }
+            }
+            candidate = prev[(size_t)candidate & (SQUEEZE_WINDOW_SIZE - 1u)];
+          }
+          if(error) break;
+        }
+      }
+      if(pos + 3 <= end) {
+        prev[(pos - base) & (SQUEEZE_WINDOW_SIZE - 1u)] = head[hashval];
+        head[hashval] = (int)(pos - base);
+      }
+    }
+    block->first[end - start] = block->pairs.size;
+  }
+
+  lodepng_free(head);
+  lodepng_free(prev);
+  return error;
+}
+
+static void squeezeFixedCosts(SqueezeCosts* costs) {
+  unsigned i;
+  for(i = 0; i != NUM_DEFLATE_CODE_SYMBOLS; ++i) {
+    costs->ll[i] = i <= 143 ? 8 : i <= 255 ? 9 : i <= 279 ? 7 : 8;
+  }
+  for(i = 0; i != NUM_DISTANCE_SYMBOLS; ++i) costs->d[i] = 5;
+}
+
+/*The costs from the code lengths for the symbols [begin, end). Every symbol gets a code, so that the
+next parse can also choose symbols which were not used by this one.*/
+static unsigned squeezeSymbolCosts(SqueezeCosts* costs, const uivector* symbols, size_t begin, size_t end) {
+  unsigned frequencies_ll[286];
+  unsigned frequencies_d[30];
+  unsigned error;
+  size_t i;
+  for(i = 0; i != 286; ++i) frequencies_ll[i] = 1;
+  for(i = 0; i != 30; ++i) frequencies_d[i] = 1;
+  for(i = begin; i < end; ++i) {
+    unsigned symbol = symbols->data[i];
+    ++frequencies_ll[symbol];
+    if(symbol > 256) {
+      ++frequencies_d[symbols->data[i + 2]];
+      i += 3;
+    }
+  }
+  error = lodepng_huffman_code_lengths(costs->ll, frequencies_ll, 286, 15);
+  if(!error) error = lodepng_huffman_code_lengths(costs->d, frequencies_d, 30, 15);
+  costs->ll[286] = costs->ll[287] = costs->d[30] = costs->d[31] = 15; /*not used*/
+  return error;
+}
+
+/*Appends the parse of the positions [from, to) of the block with the smallest cost to symbols.*/
+static unsigned squeezeParse(uivector* symbols, SqueezeBlock* block, const unsigned char* in,
+                             size_t from, size_t to, const SqueezeCosts* costs) {
+  unsigned length_costs[MAX_SUPPORTED_DEFLATE_LENGTH + 1];
+  unsigned* cost = block->cost;
+  size_t size = to - from, i;
+  unsigned length;
+
+  for(length = 3; length <= MAX_SUPPORTED_DEFLATE_LENGTH; ++length) {
+    unsigned code = (unsigned)searchCodeIndex(LENGTHBASE, 29, length);
+    length_costs[length] = costs->ll[code + FIRST_LENGTH_CODE_INDEX] + LENGTHEXTRA[code];
+  }
+
+  cost[0] = 0;
+  for(i = 1; i <= size; ++i) cost[i] = (unsigned)(-1);
+
+  for(i = 0; i != size; ++i) {
+    size_t pos = from + i;
+    size_t pair = block->first[pos], lastpair = block->first[pos + 1];
+    size_t maxlength = size - i;
+    unsigned literal_cost = cost[i] + costs->ll[in[block->start + pos]];
+    if(literal_cost < cost[i + 1]) {
+      cost[i + 1] = literal_cost;
+      block->step_length[i + 1] = 1;
+    }
+    if(pair == lastpair) continue;
+
+    if(block->runs[pos] > 2 * MAX_SUPPORTED_DEFLATE_LENGTH) {
+      /*inside a long run of the same byte, only the longest match is worth trying*/
+      unsigned distance = block->pairs.data[lastpair - 1] & 0xffffu;
+      unsigned code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, distance);
+      unsigned match_cost;
+      length = block->pairs.data[lastpair - 1] >> 16u;
+      if(length > maxlength) length = (unsigned)maxlength;
+      if(length < 3) continue;
+      match_cost = cost[i] + costs->d[code] + DISTANCEEXTRA[code] + length_costs[length];
+      if(match_cost < cost[i + length]) {
+        cost[i + length] = match_cost;
+        block->step_length[i + length] = (unsigned short)length;
+        block->step_distance[i + length] = (unsigned short)distance;
+      }
+      continue;
+    }
+
+    for(length = 3; pair != lastpair && length <= maxlength; ++pair) {
+      unsigned pairlength = block->pairs.data[pair] >> 16u;
+      unsigned distance = block->pairs.data[pair] & 0xffffu;
+      unsigned code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, distance);
+      unsigned distance_cost = cost[i] + costs->d[code] + DISTANCEEXTRA[code];
+      if(pairlength > maxlength) pairlength = (unsigned)maxlength;
+      for(; length <= pairlength; ++length) {
+        unsigned match_cost = distance_cost + length_costs[length];
+        if(match_cost < cost[i + length]) {
+          cost[i + length] = match_cost;
+          block->step_length[i + length] = (unsigned short)length;
+          block->step_distance[i + length] = (unsigned short)distance;
+        }
+      }
+    }
+  }
+
+  /*the steps can only be followed backwards from the end*/
+  block->path.size = 0;
+  for(i = size; i != 0; i -= block->step_length[i]) {
+    unsigned step = ((unsigned)block->step_length[i] << 16u) | block->step_distance[i];
+    if(!uivector_push_back(&block->path, step)) return 83; /*alloc fail*/
+  }
+  for(i = from; block->path.size != 0; --block->path.size) {
+    unsigned step = block->path.data[block->path.size - 1];
+    length = step >> 16u;
+    if(length == 1) {
+      if(!uivector_push_back(symbols, in[block->start + i])) return 83; /*alloc fail*/
+    } else {
+      addLengthDistance(symbols, length, step & 0xffffu);
+    }
+    i += length;
+  }
+  return 0;
+}
+
+/*the exact size in bits of the symbols [begin, end) written as one dynamic block*/
+static unsigned squeezeBits(size_t* bits, const uivector* symbols, size_t begin, size_t end,
+                            const LodePNGCompressSettings* settings) {
+  uivector view; /*does not own the data*/
+  ucvector scratch = ucvector_init(NULL, 0);
+  LodePNGBitWriter writer;
+  unsigned error;
+  view.data = symbols->data + begin;
+  view.size = end - begin;
+  view.allocsize = 0;
+  LodePNGBitWriter_init(&writer, &scratch);
+  error = deflateDynamic(&writer, 0, 0, 0, 0, settings, 0, &view);
+  *bits = scratch.size * 8u - ((8u - (writer.bp & 7u)) & 7u);
+  lodepng_free(scratch.data);
+  return error;
+}
+
+/*Parses the positions [from, to) of the block again and again, each time with the costs from the
+previous parse, starting from the given costs, and appends the smallest parse to the symbols.*/
+static unsigned squeezeRange(SqueezeBlock* block, const unsigned char* in, size_t from, size_t to,
+                             SqueezeCosts* costs, const LodePNGCompressSettings* settings) {
+  uivector current, best;
+  size_t bits, bestbits = 0, previousbits = 0;
+  unsigned iteration, error = 0;
+
+  uivector_init(&current);
+  uivector_init(&best);
+  for(iteration = 0; iteration != settings->squeeze_iterations && !error; ++iteration) {
+    current.size = 0;
+    error = squeezeParse(&current, block, in, from, to, costs);
+    if(!error) error = squeezeBits(&bits, &current, 0, current.size, settings);
+    /*the costs for the next iteration*/
+    if(!error) error = squeezeSymbolCosts(costs, &current, 0, current.size);
+    if(error) break;
+    if(iteration == 0 || bits < bestbits) {
+      uivector temp = best;
+      best = current;
+      current = temp;
+      bestbits = bits;
+    }
+    if(iteration != 0 && bits == previousbits) break; /*the costs don't change anymore*/
+    previousbits = bits;
+  }
+  if(!error) {
+    size_t i, size = block->symbols.size;
+    if(!uivector_resize(&block->symbols, size + best.size)) error = 83; /*alloc fail*/
+    else for(i = 0; i != best.size; ++i) block->symbols.data[size + i] = best.data[i];
+  }
+  uivector_cleanup(&current);
+  uivector_cleanup(&best);
+  return error;
+}
+
+/*Splits the LZ77 items [begin, end) of the block, which take the given amount of bits as one
+deflate block, where that makes them smaller, and adds the split items to splits in order. The
+split point is searched at evenly spaced items, then again around the best one, a few times.*/
+static unsigned squeezeSplit(SqueezeBlock* block, const size_t* items, size_t begin, size_t end,
+                             size_t bits, uivector* splits, const LodePNGCompressSettings* settings) {
+  size_t low = begin, high = end, best = 0, bestbits = bits, bestleft = 0, bestright = 0;
+  unsigned round, point, error = 0;
+
+  if(end - begin < SQUEEZE_MIN_SPLIT_ITEMS) return 0;
+  for(round = 0; round != SQUEEZE_SPLIT_ROUNDS && high - low > SQUEEZE_SPLIT_POINTS && !error; ++round) {
+    size_t step = (high - low) / (SQUEEZE_SPLIT_POINTS + 1u), roundbest = 0, roundbits = 0;
+    for(point = 1; point <= SQUEEZE_SPLIT_POINTS; ++point) {
+      size_t item = low + point * step, left, right;
+      if(item <= begin || item >= end) continue;
+      error = squeezeBits(&left, &block->symbols, items[begin], items[item], settings);
+      if(!error) error = squeezeBits(&right, &block->symbols, items[item], items[end], settings);
+      if(error) break;
+      if(roundbest == 0 || left + right < roundbits) {
+        roundbest = item;
+        roundbits = left + right;
+        if(roundbits < bestbits) {
+          best = item;
+          bestbits = roundbits;
+          bestleft = left;
+          bestright = right;
+        }
+      }
+    }
+    if(roundbest == 0) break;
+    low = roundbest - step;
+    high = roundbest + step;
+  }
+
+  if(!error && best) {
+    error = squeezeSplit(block, items, begin, best, bestleft, splits, settings);
+    if(!error && !uivector_push_back(splits, (unsigned)best)) error = 83; /*alloc fail*/
+    if(!error) error = squeezeSplit(block, items, best, end, bestright, splits, settings);
+  }
+  return error;
+}
+
+static unsigned squeezeBlock(SqueezeBlock* block, const unsigned char* in,
+                             const LodePNGCompressSettings* settings) {
+  size_t size = block->end - block->start;
+  size_t* items = 0; /*the symbol index of each LZ77 item, and the symbol count at the end*/
+  size_t* positions = 0; /*the position of each LZ77 item, and the block size at the end*/
+  size_t numitems = 0, bits, i;
+  uivector splits, symbols;
+  SqueezeCosts costs;
+  unsigned error = 0;
+
+  uivector_init(&splits);
+  uivector_init(&symbols);
+  block->first = (size_t*)lodepng_malloc(sizeof(size_t) * (size + 1));
+  block->runs = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * (size + 1));
+  block->cost = (unsigned*)lodepng_malloc(sizeof(unsigned) * (size + 1));
+  block->step_length = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * (size + 1));
+  block->step_distance = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * (size + 1));
+  if(!block->first || !block->runs || !block->cost || !block->step_length || !block->step_distance) {
+    error = 83; /*alloc fail*/
+  }
+
+  if(!error) error = squeezeFindMatches(block, in);
+  if(!error) {
+    squeezeFixedCosts(&costs);
+    error = squeezeRange(block, in, 0, size, &costs, settings);
+  }
+
+  if(!error) {
+    items = (size_t*)lodepng_malloc(sizeof(size_t) * (block->symbols.size + 1));
+    positions = (size_t*)lodepng_malloc(sizeof(size_t) * (block->symbols.size + 1));
+    if(!items || !positions) error = 83; /*alloc fail*/
+  }
+  if(!error) {
+    size_t pos = 0;
+    for(i = 0; i != block->symbols.size; ++i, ++numitems) {
+      items[numitems] = i;
+      positions[numitems] = pos;
+      if(block->symbols.data[i] > 256) {
+        pos += LENGTHBASE[block->symbols.data[i] - FIRST_LENGTH_CODE_INDEX] + block->symbols.data[i + 1];
+        i += 3;
+      } else {
+        ++pos;
+      }
+    }
+    items[numitems] = block->symbols.size;
+    positions[numitems] = size;
+    error = squeezeBits(&bits, &block->symbols, 0, block->symbols.size, settings);
+  }
+  if(!error) error = squeezeSplit(block, items, 0, numitems, bits, &splits, settings);
+  if(!error && !uivector_push_back(&splits, (unsigned)numitems)) error = 83; /*alloc fail*/
+
+  if(!error) {
+    /*parse each split block again with its own costs, keeping the smaller result*/
+    uivector split_symbols = block->symbols;
+    block->symbols = symbols;
+    for(i = 0; i != splits.size && !error; ++i) {
+      size_t begin = i == 0 ? 0 : splits.data[i - 1], end = splits.data[i];
+      size_t oldsize = block->symbols.size, oldbits, newbits;
+      if(splits.size > 1) {
+        error = squeezeSymbolCosts(&costs, &split_symbols, items[begin], items[end]);
+        if(!error) error = squeezeRange(block, in, positions[begin], positions[end], &costs, settings);
+        if(!error) error = squeezeBits(&newbits, &block->symbols, oldsize, block->symbols.size, settings);
+        if(!error) error = squeezeBits(&oldbits, &split_symbols, items[begin], items[end], settings);
+        if(error) break;
+        if(newbits < oldbits) {
+          if(!uivector_push_back(&block->splits, (unsigned)block->symbols.size)) error = 83; /*alloc fail*/
+          continue;
+        }
+      }
+      /*keep the symbols from the parse of the whole block*/
+      if(!uivector_resize(&block->symbols, oldsize + items[end] - items[begin])) ERROR_BREAK(83);
+      if(items[end] != items[begin]) {
+        lodepng_memcpy(&block->symbols.data[oldsize], &split_symbols.data[items[begin]],
+                       (items[end] - items[begin]) * sizeof(unsigned));
+      }
+      if(!uivector_push_back(&block->splits, (unsigned)block->symbols.size)) error = 83; /*alloc fail*/
+    }
+    symbols = split_symbols;
+  }
+
+  lodepng_free(block->first);
+  uivector_cleanup(&block->pairs);
+  lodepng_free(block->runs);
+  lodepng_free(block->cost);
+  lodepng_free(block->step_length);
+  lodepng_free(block->step_distance);
+  uivector_cleanup(&block->path);
+  lodepng_free(items);
+  lodepng_free(positions);
+  uivector_cleanup(&splits);
+  uivector_cleanup(&symbols);
+  return error;
+}
+
+static unsigned squeezeBlockRange(void* data, unsigned begin, unsigned end) {
+  SqueezeData* squeeze = (SqueezeData*)data;
+  unsigned i, error = 0;
+  for(i = begin; i != end && !error; ++i) {
+    error = squeezeBlock(&squeeze->blocks[i], squeeze->in, squeeze->settings);
+  }
+  return error;
+}
+
+static unsigned deflateSqueeze(LodePNGBitWriter* writer, const unsigned char* in, size_t insize,
+                               size_t blocksize, const LodePNGCompressSettings* settings) {
+  SqueezeBlock blocks[SQUEEZE_BATCH_SIZE];
+  SqueezeData data;
+  LodePNGCompressSettings local_settings;
+  size_t numblocks = insize == 0 ? 1 : (insize + blocksize - 1) / blocksize, batch;
+  unsigned error = 0;
+
+  /*the cache would be shared by the blocks squeezed concurrently*/
+  lodepng_memcpy(&local_settings, settings, sizeof(LodePNGCompressSettings));
+  local_settings.cache = 0;
+  data.in = in;
+  data.blocks = blocks;
+  data.settings = &local_settings;
+
+  for(batch = 0; batch < numblocks && !error; batch += SQUEEZE_BATCH_SIZE) {
+    unsigned amount = (unsigned)LODEPNG_MIN(numblocks - batch, SQUEEZE_BATCH_SIZE), i;
+    size_t j;
+    for(i = 0; i != amount; ++i) {
+      SqueezeBlock* block = &blocks[i];
+      block->start = (batch + i) * blocksize;
+      block->end = LODEPNG_MIN(block->start + blocksize, insize);
+      uivector_init(&block->pairs);
+      uivector_init(&block->path);
+      uivector_init(&block->symbols);
+      uivector_init(&block->splits);
+    }
+
+    if(settings->squeeze_parallel && amount > 1) {
+      error = settings->squeeze_parallel(&squeezeBlockRange, &data, amount, settings->squeeze_parallel_context);
+    } else {
+      error = squeezeBlockRange(&data, 0, amount);
+    }
+
+    for(i = 0; i != amount; ++i) {
+      SqueezeBlock* block = &blocks[i];
+      for(j = 0; j != block->splits.size && !error; ++j) {
+        uivector view; /*does not own the data*/
+        size_t begin = j == 0 ? 0 : block->splits.data[j - 1];
+        unsigned final = batch + i == numblocks - 1 && j == block->splits.size - 1;
+        view.data = block->symbols.data + begin;
+        view.size = block->splits.data[j] - begin;
+        view.allocsize = 0;
+        error = deflateDynamic(writer, 0, 0, 0, 0, &local_settings, final, &view);
+      }
+      uivector_cleanup(&block->symbols);
+      uivector_cleanup(&block->splits);
+    }
+  }
+  return error;
+}
+
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
                                  const LodePNGCompressSettings* settings) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  Hash hash;
+  Hash local_hash;
+  Hash* hash = &local_hash;
+  /*the hash chains are only searched by encodeLZ77*/
+  unsigned usehash = settings->use_lz77 && !settings->use_rle;
   LodePNGBitWriter writer;
 
   LodePNGBitWriter_init(&writer, out);
@@ -2081,10 +2805,21 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
     if(blocksize > 262144) blocksize = 262144;
   }
 
+  if(settings->btype == 2 && settings->use_lz77 && settings->squeeze_iterations) {
+    return deflateSqueeze(&writer, in, insize, blocksize, settings);
+  }
+
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  if(!usehash) {
+    hash = 0;
+  } else if(settings->cache) {
+    hash = &settings->cache->hash;
+    error = hash_init_cached(settings->cache, settings->windowsize, insize);
+  } else {
+    error = hash_init(hash, settings->windowsize);
+  }
 
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
@@ -2093,12 +2828,12 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
       size_t end = start + blocksize;
       if(end > insize) end = insize;
 
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+      if(settings->btype == 1) error = deflateFixed(&writer, hash, in, start, end, settings, final);
+      else if(settings->btype == 2) error = deflateDynamic(&writer, hash, in, start, end, settings, final, 0);
     }
   }
 
-  hash_cleanup(&hash);
+  if(usehash && !settings->cache) hash_cleanup(hash);
 
   return error;
 }
@@ -2131,10 +2866,70 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+#ifdef LODEPNG_X86_SIMD
+/*Processes blocks of 32 bytes: the byte sums for s1 are computed with _mm_sad_epu8
+and the sums weighted by position (32, 31, ..., 1) for s2 with _mm_maddubs_epi16.
+The contribution of s1 to s2 over n blocks is accumulated separately and multiplied
+by the block size at the end.*/
+LODEPNG_TARGET("ssse3")
+static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data, unsigned blocks) {
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
   unsigned s1 = adler & 0xffffu;
   unsigned s2 = (adler >> 16u) & 0xffffu;
 
+  while(blocks != 0u) {
+    /*at most 5552 bytes can be summed before s2 must be reduced*/
+    unsigned n = blocks > 5552u / 32u ? 5552u / 32u : blocks;
+    __m128i v_ps = _mm_setr_epi32((int)(s1 * n), 0, 0, 0);
+    __m128i v_s2 = _mm_setr_epi32((int)s2, 0, 0, 0);
+    __m128i v_s1 = zero;
+    blocks -= n;
+
+    do {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+    } while(--n);
+
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    /*horizontal sums; v_s1 only has values in its two 64-bit halves*/
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += (unsigned)_mm_cvtsi128_si32(v_s1);
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+
+    s1 %= 65521u;
+    s2 %= 65521u;
+  }
+
+  return (s2 << 16u) | s1;
+}
+#endif /* LODEPNG_X86_SIMD */
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1, s2;
+
+#ifdef LODEPNG_X86_SIMD
+  if(len >= 32u && (lodepng_cpu_features & LODEPNG_CPU_SSSE3)) {
+    unsigned blocks = len / 32u;
+    adler = update_adler32_ssse3(adler, data, blocks);
+    data += blocks * 32u;
+    len -= blocks * 32u;
+  }
+#endif /* LODEPNG_X86_SIMD */
+
+  s1 = adler & 0xffffu;
+  s2 = (adler >> 16u) & 0xffffu;
   while(len != 0u) {
     unsigned i;
     /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
@@ -2243,40 +3038,58 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                               size_t insize, const LodePNGCompressSettings* settings) {
-  size_t i;
+/*appends the zlib data to out. The built in deflate writes straight into out.*/
+static unsigned lodepng_zlib_compressv(ucvector* out, const unsigned char* in, size_t insize,
+                                       const LodePNGCompressSettings* settings) {
   unsigned error;
-  unsigned char* deflatedata = 0;
-  size_t deflatesize = 0;
-
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  size_t pos = out->size;
+  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  if(!ucvector_resize(out, pos + 2)) return 83; /*alloc fail*/
+  out->data[pos + 0] = (unsigned char)(CMFFLG >> 8);
+  out->data[pos + 1] = (unsigned char)(CMFFLG & 255);
 
-  *out = NULL;
-  *outsize = 0;
-  if(!error) {
-    *outsize = deflatesize + 6;
-    *out = (unsigned char*)lodepng_malloc(*outsize);
-    if(!*out) error = 83; /*alloc fail*/
+  if(settings->custom_deflate) {
+    unsigned char* deflatedata = 0;
+    size_t deflatesize = 0;
+    error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+    if(!error) {
+      pos = out->size;
+      if(!ucvector_resize(out, pos + deflatesize)) error = 83; /*alloc fail*/
+      else if(deflatesize) lodepng_memcpy(out->data + pos, deflatedata, deflatesize);
+    }
+    lodepng_free(deflatedata);
+  } else {
+    error = lodepng_deflatev(out, in, insize, settings);
   }
 
   if(!error) {
     unsigned ADLER32 = adler32(in, (unsigned)insize);
-    /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-    unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-    unsigned FLEVEL = 0;
-    unsigned FDICT = 0;
-    unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-    unsigned FCHECK = 31 - CMFFLG % 31;
-    CMFFLG += FCHECK;
-
-    (*out)[0] = (unsigned char)(CMFFLG >> 8);
-    (*out)[1] = (unsigned char)(CMFFLG & 255);
-    for(i = 0; i != deflatesize; ++i) (*out)[i + 2] = deflatedata[i];
-    lodepng_set32bitInt(&(*out)[*outsize - 4], ADLER32);
+    pos = out->size;
+    if(!ucvector_resize(out, pos + 4)) return 83; /*alloc fail*/
+    lodepng_set32bitInt(&out->data[pos], ADLER32);
   }
+  return error;
+}
 
-  lodepng_free(deflatedata);
+unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGCompressSettings* settings) {
+  ucvector v = ucvector_init(NULL, 0);
+  unsigned error = lodepng_zlib_compressv(&v, in, insize, settings);
+  if(error) {
+    lodepng_free(v.data);
+    *out = NULL;
+    *outsize = 0;
+  } else {
+    *out = v.data;
+    *outsize = v.size;
+  }
   return error;
 }
 
@@ -2329,13 +3142,19 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->use_rle = 0;
+  settings->greedy_chainlength = 0;
+  settings->squeeze_iterations = 0;
+  settings->squeeze_parallel = 0;
+  settings->squeeze_parallel_context = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+  settings->cache = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2370,48 +3189,390 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 
 
 #ifndef LODEPNG_NO_COMPILE_CRC
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/* CRC polynomial: 0xedb88320. Table 0 is the classic byte-at-a-time table,
+table k gives the CRC of a byte followed by k zero bytes (for slicing-by-8)*/
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
+#ifdef LODEPNG_X86_SIMD
+/*Folds blocks of 16 bytes with carry-less multiplication, as described in Intel's
+"Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction". Takes
+and returns the internal (not inverted) CRC state. length must be a multiple of 16,
+and at least 64.*/
+LODEPNG_TARGET("sse2,pclmul")
+static unsigned lodepng_crc32_pclmul(unsigned crc, const unsigned char* data, size_t length) {
+  /*The bit-reflected fold constants x^(4*128+32), x^(4*128-32), x^(128+32),
+  x^(128-32) and x^64 mod P(x), and the Barrett reduction constants. Each is a
+  33-bit value, stored as two 32-bit halves.*/
+  const __m128i k1k2 = _mm_setr_epi32((int)0x54442bd4u, 1, (int)0xc6e41596u, 1);
+  const __m128i k3k4 = _mm_setr_epi32((int)0x751997d0u, 1, (int)0xccaa009eu, 0);
+  const __m128i k5k0 = _mm_setr_epi32((int)0x63cd6124u, 1, 0, 0);
+  const __m128i poly = _mm_setr_epi32((int)0xdb710641u, 1, (int)0xf7011641u, 1);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(data + 0));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  data += 64;
+  length -= 64;
+
+  /*fold four blocks in parallel*/
+  while(length >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 48)));
+    data += 64;
+    length -= 64;
+  }
+
+  /*fold the four blocks into one*/
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  /*fold the remaining blocks one at a time*/
+  while(length >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  /*fold 128 bits to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /*Barrett reduction to 32 bits*/
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /* LODEPNG_X86_SIMD */
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* data, size_t length) {
   unsigned r = 0xffffffffu;
-  size_t i;
-  for(i = 0; i < length; ++i) {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xffu] ^ (r >> 8u);
+#ifdef LODEPNG_X86_SIMD
+  if(length >= 64 && (lodepng_cpu_features & LODEPNG_CPU_PCLMUL)) {
+    size_t blocks = length & ~(size_t)15;
+    r = lodepng_crc32_pclmul(r, data, blocks);
+    data += blocks;
+    length -= blocks;
+  }
+#endif /* LODEPNG_X86_SIMD */
+  /*slicing-by-8: process 8 bytes per step with independent table lookups*/
+  while(length >= 8) {
+    r = lodepng_crc32_table[7][(data[0] ^ r) & 0xffu] ^
+        lodepng_crc32_table[6][(data[1] ^ (r >> 8u)) & 0xffu] ^
+        lodepng_crc32_table[5][(data[2] ^ (r >> 16u)) & 0xffu] ^
+        lodepng_crc32_table[4][(data[3] ^ (r >> 24u)) & 0xffu] ^
+        lodepng_crc32_table[3][data[4]] ^
+        lodepng_crc32_table[2][data[5]] ^
+        lodepng_crc32_table[1][data[6]] ^
+        lodepng_crc32_table[0][data[7]];
+    data += 8;
+    length -= 8;
+  }
+  while(length--) {
+    r = lodepng_crc32_table[0][(r ^ *data++) & 0xffu] ^ (r >> 8u);
   }
   return r ^ 0xffffffffu;
 }
@@ -5199,6 +6360,23 @@ static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t d
   unsigned char* zlib = 0;
   size_t zlibsize = 0;
 
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(!zlibsettings->custom_zlib) {
+    /*compress straight into the chunk, so that the zlib data needs no buffer of its own*/
+    size_t chunkpos = out->size, length;
+    if(!ucvector_resize(out, chunkpos + 8)) return 83; /*alloc fail*/
+    lodepng_memcpy(out->data + chunkpos + 4, "IDAT", 4);
+    error = lodepng_zlib_compressv(out, data, datasize, zlibsettings);
+    if(error) return error;
+    length = out->size - chunkpos - 8;
+    if(length > 2147483647) return 77; /*chunk too large*/
+    lodepng_set32bitInt(out->data + chunkpos, (unsigned)length);
+    if(!ucvector_resize(out, out->size + 4)) return 83; /*alloc fail*/
+    lodepng_chunk_generate_crc(out->data + chunkpos);
+    return 0;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
   error = zlib_compress(&zlib, &zlibsize, data, datasize, zlibsettings);
   if(!error) {
     error = lodepng_chunk_createv(out, zlibsize, "IDAT", zlib);
@@ -5465,46 +6643,36 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (1u << l)) << 1u);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
-  the scanlines with 1 extra byte per scanline
-  */
-
-  unsigned bpp = lodepng_get_bpp(color);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+/*the state shared by all the scanline ranges of one filter() call*/
+typedef struct FilterRangeData {
+  unsigned char* out;
+  const unsigned char* in;
+  size_t linebytes;
+  size_t bytewidth;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+} FilterRangeData;
 
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7u) / 8u;
-  const unsigned char* prevline = 0;
+/*
+Filters the scanlines [ybegin, yend) of the image. The filter choice of a scanline only depends on
+that scanline and the unfiltered scanline above it, so disjoint ranges can be processed independently
+(and concurrently) and still give exactly the same result as filtering all scanlines in one go.
+*/
+static unsigned filterRange(void* rangedata, unsigned ybegin, unsigned yend) {
+  const FilterRangeData* data = (const FilterRangeData*)rangedata;
+  unsigned char* out = data->out;
+  const unsigned char* in = data->in;
+  size_t linebytes = data->linebytes;
+  size_t bytewidth = data->bytewidth;
+  LodePNGFilterStrategy strategy = data->strategy;
+  const LodePNGEncoderSettings* settings = data->settings;
+  const unsigned char* prevline = ybegin ? &in[(ybegin - 1) * linebytes] : 0;
   unsigned x, y;
   unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
-
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (color->colortype == LCT_PALETTE || color->bitdepth < 8)) strategy = LFS_ZERO;
-
-  if(bpp == 0) return 31; /*error: invalid color type*/
 
   if(strategy >= LFS_ZERO && strategy <= LFS_FOUR) {
     unsigned char type = (unsigned char)strategy;
-    for(y = 0; y != h; ++y) {
+    for(y = ybegin; y != yend; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       out[outindex] = type; /*filter type byte*/
@@ -5523,7 +6691,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = ybegin; y != yend; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
           size_t sum = 0;
@@ -5570,7 +6738,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = ybegin; y != yend; ++y) {
         /*try the 5 filter types*/
         for(type = 0; type != 5; ++type) {
           size_t sum = 0;
@@ -5598,7 +6766,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
     for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   } else if(strategy == LFS_PREDEFINED) {
-    for(y = 0; y != h; ++y) {
+    for(y = ybegin; y != yend; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       unsigned char type = settings->predefined_filters[y];
@@ -5631,7 +6799,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
     if(!error) {
-      for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
+      for(y = ybegin; y != yend; ++y) /*try the 5 filter types*/ {
         for(type = 0; type != 5; ++type) {
           unsigned testsize = (unsigned)linebytes;
           /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
@@ -5659,6 +6827,58 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   return error;
 }
 
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(color);
+  FilterRangeData data;
+  LodePNGFilterStrategy strategy = settings->filter_strategy;
+
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (color->colortype == LCT_PALETTE || color->bitdepth < 8)) strategy = LFS_ZERO;
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+  if(strategy > LFS_PREDEFINED) return 88; /* unknown filter strategy */
+
+  data.out = out;
+  data.in = in;
+  /*the width of a scanline in bytes, not including the filter type*/
+  data.linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  data.bytewidth = (bpp + 7u) / 8u;
+  data.strategy = strategy;
+  data.settings = settings;
+
+  if(settings->filter_parallel && h > 1) {
+    /*the ranges may be filtered concurrently, and the deflate cache (used by the brute force
+    strategy) can't be shared between threads*/
+    LodePNGEncoderSettings parallel_settings;
+    lodepng_memcpy(&parallel_settings, settings, sizeof(LodePNGEncoderSettings));
+    parallel_settings.zlibsettings.cache = 0;
+    data.settings = &parallel_settings;
+    return settings->filter_parallel(&filterRange, &data, h, settings->filter_parallel_context);
+  }
+  return filterRange(&data, 0, h);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h) {
   /*The opposite of the removePaddingBits function
@@ -5730,7 +6950,7 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
 
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
 return value is error**/
-static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
+static unsigned preProcessScanlines(ucvector* out, const unsigned char* in,
                                     unsigned w, unsigned h,
                                     const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings) {
   /*
@@ -5742,9 +6962,8 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   unsigned error = 0;
 
   if(info_png->interlace_method == 0) {
-    *outsize = h + (h * ((w * bpp + 7u) / 8u)); /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
-    if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
+    /*image size plus an extra byte per scanline + possible padding bits*/
+    if(!ucvector_resize(out, h + (h * ((w * bpp + 7u) / 8u)))) error = 83; /*alloc fail*/
 
     if(!error) {
       /*non multiple of 8 bits per scanline, padding bits needed per scanline*/
@@ -5753,12 +6972,12 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!padded) error = 83; /*alloc fail*/
         if(!error) {
           addPaddingBits(padded, in, ((w * bpp + 7u) / 8u) * 8u, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          error = filter(out->data, padded, w, h, &info_png->color, settings);
         }
         lodepng_free(padded);
       } else {
         /*we can immediately filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filter(out->data, in, w, h, &info_png->color, settings);
       }
     }
   } else /*interlace_method is 1 (Adam7)*/ {
@@ -5768,9 +6987,8 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
 
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
-    *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
-    if(!(*out)) error = 83; /*alloc fail*/
+    /*image size plus an extra byte per scanline + possible padding bits*/
+    if(!ucvector_resize(out, filter_passstart[7])) error = 83; /*alloc fail*/
 
     adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
     if(!adam7 && passstart[7]) error = 83; /*alloc fail*/
@@ -5785,11 +7003,11 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           if(!padded) ERROR_BREAK(83); /*alloc fail*/
           addPaddingBits(padded, &adam7[passstart[i]],
                          ((passw[i] * bpp + 7u) / 8u) * 8u, passw[i] * bpp, passh[i]);
-          error = filter(&(*out)[filter_passstart[i]], padded,
+          error = filter(&out->data[filter_passstart[i]], padded,
                          passw[i], passh[i], &info_png->color, settings);
           lodepng_free(padded);
         } else {
-          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
+          error = filter(&out->data[filter_passstart[i]], &adam7[padded_passstart[i]],
                          passw[i], passh[i], &info_png->color, settings);
         }
 
@@ -5835,20 +7053,41 @@ static unsigned isRGBICCProfile(const unsigned char* profile, unsigned size) {
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state) {
-  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
-  size_t datasize = 0;
-  ucvector outv = ucvector_init(NULL, 0);
+struct LodePNGEncoderBuffers {
+  ucvector filtered; /*the uncompressed IDAT chunk data*/
+  ucvector png; /*the PNG data, used by the C++ encode functions*/
+};
+
+LodePNGEncoderBuffers* lodepng_encoder_buffers_new(void) {
+  LodePNGEncoderBuffers* buffers = (LodePNGEncoderBuffers*)lodepng_malloc(sizeof(LodePNGEncoderBuffers));
+  if(buffers) {
+    buffers->filtered = ucvector_init(NULL, 0);
+    buffers->png = ucvector_init(NULL, 0);
+  }
+  return buffers;
+}
+
+void lodepng_encoder_buffers_delete(LodePNGEncoderBuffers* buffers) {
+  if(!buffers) return;
+  lodepng_free(buffers->filtered.data);
+  lodepng_free(buffers->png.data);
+  lodepng_free(buffers);
+}
+
+/*appends the PNG data to outv*/
+static unsigned lodepng_encodev(ucvector* outv,
+                                const unsigned char* image, unsigned w, unsigned h,
+                                LodePNGState* state) {
+  ucvector data = ucvector_init(NULL, 0); /*uncompressed version of the IDAT chunk data*/
   LodePNGInfo info;
   const LodePNGInfo* info_png = &state->info_png;
 
+  if(state->encoder.buffers) {
+    data = state->encoder.buffers->filtered;
+    data.size = 0;
+  }
   lodepng_info_init(&info);
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-  *outsize = 0;
   state->error = 0;
 
   /*check input values validity*/
@@ -5940,12 +7179,12 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
     }
     if(!state->error) {
-      state->error = preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+      state->error = preProcessScanlines(&data, converted, w, h, &info, &state->encoder);
     }
     lodepng_free(converted);
     if(state->error) goto cleanup;
   } else {
-    state->error = preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+    state->error = preProcessScanlines(&data, image, w, h, &info, &state->encoder);
     if(state->error) goto cleanup;
   }
 
@@ -5954,73 +7193,73 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     size_t i;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*write signature and chunks*/
-    state->error = writeSignature(&outv);
+    state->error = writeSignature(outv);
     if(state->error) goto cleanup;
     /*IHDR*/
-    state->error = addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
+    state->error = addChunk_IHDR(outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
     if(state->error) goto cleanup;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*unknown chunks between IHDR and PLTE*/
     if(info.unknown_chunks_data[0]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
+      state->error = addUnknownChunks(outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
       if(state->error) goto cleanup;
     }
     /*color profile chunks must come before PLTE */
     if(info.iccp_defined) {
-      state->error = addChunk_iCCP(&outv, &info, &state->encoder.zlibsettings);
+      state->error = addChunk_iCCP(outv, &info, &state->encoder.zlibsettings);
       if(state->error) goto cleanup;
     }
     if(info.srgb_defined) {
-      state->error = addChunk_sRGB(&outv, &info);
+      state->error = addChunk_sRGB(outv, &info);
       if(state->error) goto cleanup;
     }
     if(info.gama_defined) {
-      state->error = addChunk_gAMA(&outv, &info);
+      state->error = addChunk_gAMA(outv, &info);
       if(state->error) goto cleanup;
     }
     if(info.chrm_defined) {
-      state->error = addChunk_cHRM(&outv, &info);
+      state->error = addChunk_cHRM(outv, &info);
       if(state->error) goto cleanup;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*PLTE*/
     if(info.color.colortype == LCT_PALETTE) {
-      state->error = addChunk_PLTE(&outv, &info.color);
+      state->error = addChunk_PLTE(outv, &info.color);
       if(state->error) goto cleanup;
     }
     if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA)) {
       /*force_palette means: write suggested palette for truecolor in PLTE chunk*/
-      state->error = addChunk_PLTE(&outv, &info.color);
+      state->error = addChunk_PLTE(outv, &info.color);
       if(state->error) goto cleanup;
     }
     /*tRNS (this will only add if when necessary) */
-    state->error = addChunk_tRNS(&outv, &info.color);
+    state->error = addChunk_tRNS(outv, &info.color);
     if(state->error) goto cleanup;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*bKGD (must come between PLTE and the IDAt chunks*/
     if(info.background_defined) {
-      state->error = addChunk_bKGD(&outv, &info);
+      state->error = addChunk_bKGD(outv, &info);
       if(state->error) goto cleanup;
     }
     /*pHYs (must come before the IDAT chunks)*/
     if(info.phys_defined) {
-      state->error = addChunk_pHYs(&outv, &info);
+      state->error = addChunk_pHYs(outv, &info);
       if(state->error) goto cleanup;
     }
 
     /*unknown chunks between PLTE and IDAT*/
     if(info.unknown_chunks_data[1]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
+      state->error = addUnknownChunks(outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
       if(state->error) goto cleanup;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunk_IDAT(outv, data.data, data.size, &state->encoder.zlibsettings);
     if(state->error) goto cleanup;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
     if(info.time_defined) {
-      state->error = addChunk_tIME(&outv, &info.time);
+      state->error = addChunk_tIME(outv, &info.time);
       if(state->error) goto cleanup;
     }
     /*tEXt and/or zTXt*/
@@ -6034,10 +7273,10 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
         goto cleanup;
       }
       if(state->encoder.text_compression) {
-        state->error = addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
+        state->error = addChunk_zTXt(outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
         if(state->error) goto cleanup;
       } else {
-        state->error = addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
+        state->error = addChunk_tEXt(outv, info.text_keys[i], info.text_strings[i]);
         if(state->error) goto cleanup;
       }
     }
@@ -6054,7 +7293,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
         }
       }
       if(already_added_id_text == 0) {
-        state->error = addChunk_tEXt(&outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+        state->error = addChunk_tEXt(outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
         if(state->error) goto cleanup;
       }
     }
@@ -6069,7 +7308,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
         goto cleanup;
       }
       state->error = addChunk_iTXt(
-          &outv, state->encoder.text_compression,
+          outv, state->encoder.text_compression,
           info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
           &state->encoder.zlibsettings);
       if(state->error) goto cleanup;
@@ -6077,17 +7316,27 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 
     /*unknown chunks between IDAT and IEND*/
     if(info.unknown_chunks_data[2]) {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
+      state->error = addUnknownChunks(outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
       if(state->error) goto cleanup;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    state->error = addChunk_IEND(&outv);
+    state->error = addChunk_IEND(outv);
     if(state->error) goto cleanup;
   }
 
 cleanup:
   lodepng_info_cleanup(&info);
-  lodepng_free(data);
+  if(state->encoder.buffers) state->encoder.buffers->filtered = data;
+  else lodepng_free(data.data);
+
+  return state->error;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state) {
+  ucvector outv = ucvector_init(NULL, 0);
+  lodepng_encodev(&outv, image, w, h, state);
 
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
@@ -6146,6 +7395,9 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings) {
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->filter_parallel = 0;
+  settings->filter_parallel_context = 0;
+  settings->buffers = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -6450,7 +7702,16 @@ unsigned encode(std::vector<unsigned char>& out,
                 State& state) {
   unsigned char* buffer;
   size_t buffersize;
-  unsigned error = lodepng_encode(&buffer, &buffersize, in, w, h, &state);
+  unsigned error;
+  if(state.encoder.buffers) {
+    /*the PNG data is only copied, and its buffer is kept for the next call*/
+    ucvector* png = &state.encoder.buffers->png;
+    png->size = 0;
+    error = lodepng_encodev(png, in, w, h, &state);
+    if(png->size) out.insert(out.end(), &png->data[0], &png->data[png->size]);
+    return error;
+  }
+  error = lodepng_encode(&buffer, &buffersize, in, w, h, &state);
   if(buffer) {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
     lodepng_free(buffer);
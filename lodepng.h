@@ -38,6 +38,8 @@ compiler command to disable them without modifying this header, e.g.
 -DLODEPNG_NO_COMPILE_ZLIB for gcc.
 In addition to those below, you can also define LODEPNG_NO_COMPILE_CRC to
 allow implementing a custom lodepng_crc32.
+Define LODEPNG_NO_COMPILE_SIMD to disable the x86-64 SIMD code paths, which are
+otherwise used when the CPU running the code supports them.
 */
 /*deflate & zlib. If disabled, you must specify alternative zlib functions in
 the custom_zlib field of the compress and decompress settings*/
@@ -94,6 +96,13 @@ source files with custom allocators.*/
 #include <string>
 #endif /*LODEPNG_COMPILE_CPP*/
 
+/*The allocation functions lodepng uses for every buffer it allocates or frees, either the default
+ones above or your own. Buffers given to lodepng for it to grow or free, such as the output of
+custom_zlib, custom_deflate and custom_inflate, must be allocated with these.*/
+void* lodepng_malloc(size_t size);
+void* lodepng_realloc(void* ptr, size_t new_size);
+void lodepng_free(void* ptr);
+
 #ifdef LODEPNG_COMPILE_PNG
 /*The PNG color types (also used for raw image).*/
 typedef enum LodePNGColorType {
@@ -326,6 +335,17 @@ Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
 */
 typedef struct LodePNGCompressSettings LodePNGCompressSettings;
+
+/*
+Allocations of the built in deflate encoder (the LZ77 hash tables and the lz77
+output buffer) that can be kept between calls when compressing many images.
+A cache must not be used by more than one deflate call at a time.
+*/
+typedef struct LodePNGDeflateCache LodePNGDeflateCache;
+/*returns null if allocation failed*/
+LodePNGDeflateCache* lodepng_deflate_cache_new(void);
+void lodepng_deflate_cache_delete(LodePNGDeflateCache* cache);
+
 struct LodePNGCompressSettings /*deflate = compress*/ {
   /*LZ77 related settings*/
   unsigned btype; /*the block type for LZ (0, 1, 2 or 3, see zlib standard). Should be 2 for proper compression.*/
@@ -334,6 +354,26 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned minmatch; /*minimum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*use only LZ77 matches at distance 1 (runs of the same byte), like zlib's Z_RLE strategy. Much
+  faster since no hash chains are searched, but compresses less. Ignored if use_lz77 is 0. Default: false*/
+  unsigned use_rle;
+  /*if not 0, use a greedy match finder which takes the longest match found at each position and
+  tries at most this many earlier positions with the same hash. With 1 only the latest such
+  position is tried and no hash chains are maintained at all. Like zlib's fastest levels, this
+  is several times faster than the default match finder but compresses less. minmatch and
+  lazymatching are not used, and it is ignored if use_lz77 is 0 or use_rle is 1. Default: 0*/
+  unsigned greedy_chainlength;
+  /*if not 0, compress as much as possible with optimal LZ77 parsing and splitting into deflate blocks,
+  similarly to Zopfli: each block is parsed this many times, with the costs of the symbols from the
+  previous parse. This is many times slower than the default. It is used only if btype is 2 and
+  use_lz77 is 1, and the other LZ77 settings are then not used. 15 is a good value. Default: 0*/
+  unsigned squeeze_iterations;
+  /*optional hook to squeeze deflate blocks concurrently (default: null), with the same contract as
+  filter_parallel in LodePNGEncoderSettings, where amount is the amount of blocks. The result is
+  identical to squeezing all blocks serially.*/
+  unsigned (*squeeze_parallel)(unsigned (*run)(void* data, unsigned begin, unsigned end),
+                               void* data, unsigned amount, const void* context);
+  const void* squeeze_parallel_context; /*passed as the context parameter to squeeze_parallel*/
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -347,6 +387,9 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*optional allocations reused by the built in deflate encoder between calls (default: null)*/
+  LodePNGDeflateCache* cache;
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
@@ -749,6 +792,16 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
                                      const unsigned char* image, unsigned w, unsigned h,
                                      const LodePNGColorMode* mode_in);
 
+/*
+Buffers of the PNG encoder (the filtered scanlines and the encoded PNG data) that can be kept
+between calls when encoding many images. Like LodePNGDeflateCache, they must not be used by more
+than one encode call at a time.
+*/
+typedef struct LodePNGEncoderBuffers LodePNGEncoderBuffers;
+/*returns null if allocation failed*/
+LodePNGEncoderBuffers* lodepng_encoder_buffers_new(void);
+void lodepng_encoder_buffers_delete(LodePNGEncoderBuffers* buffers);
+
 /*Settings for the encoder.*/
 typedef struct LodePNGEncoderSettings {
   LodePNGCompressSettings zlibsettings; /*settings for the zlib encoder, such as window size, ...*/
@@ -769,6 +822,19 @@ typedef struct LodePNGEncoderSettings {
   must be set to 0 to ensure this is also used on palette or low bitdepth images.*/
   const unsigned char* predefined_filters;
 
+  /*optional hook to filter ranges of scanlines concurrently (default: null).
+  If set, it must call run(data, begin, end) for consecutive, non-overlapping ranges that together
+  cover the scanlines [0, amount) exactly once. The calls may be made from any threads, in any
+  order, but filter_parallel must only return after all of them have finished. It returns the first
+  nonzero value returned by run, or 0. The result is identical to filtering all scanlines serially.*/
+  unsigned (*filter_parallel)(unsigned (*run)(void* data, unsigned begin, unsigned end),
+                              void* data, unsigned amount, const void* context);
+  const void* filter_parallel_context; /*passed as the context parameter to filter_parallel*/
+
+  /*optional buffers reused between calls (default: null). The C++ encode functions then also
+  keep the allocation of the PNG data in them, and only copy the data to the output vector.*/
+  LodePNGEncoderBuffers* buffers;
+
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
   unsigned force_palette;
@@ -1817,7 +1883,11 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.use_rle: only use LZ77 matches at distance 1, for speed
+state.encoder.zlibsettings.greedy_chainlength: use a faster greedy LZ77 match finder
+state.encoder.zlibsettings.squeeze_iterations: compress as much as possible, very slowly
 state.encoder.zlibsettings.custom_...: use custom deflate function
+state.encoder.zlibsettings.cache: keep the deflate allocations between calls
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
 state.encoder.filter_strategy: PNG filter strategy to encode with
@@ -15,6 +15,8 @@
 #include <cstdio>
 #include <cstring>
 #include <cerrno>
+#include <climits>
+#include <algorithm>
 
 typedef WPngImage::Byte Byte;
 typedef WPngImage::UInt16 UInt16;
@@ -2620,6 +2622,1162 @@ static bool testSavingAndLoading()
 }
 
 
+//============================================================================
+// Test saving with options
+//============================================================================
+static bool testSaveOptions(const WPngImage& image, WPngImage::PngFilterStrategy strategy)
+{
+    WPngImage::SaveOptions options;
+    options.filterStrategy = strategy;
+
+    std::vector<unsigned char> serialData;
+    if(!checkIOStatus(image.saveImageToRAM(serialData, options), true)) ERRORRET;
+
+    WPngImage loadedImage;
+    if(!checkIOStatus(loadedImage.loadImageFromRAM(&serialData[0], serialData.size(),
+                                                   image.currentPixelFormat()), false))
+        ERRORRET;
+    COMPAREIMAGES(WPngImage::Pixel16, loadedImage, image);
+
+    const unsigned threadsAmounts[] = { 2, 4, 7, 0 };
+    for(unsigned i = 0; i < ARRAY_SIZE(threadsAmounts); ++i)
+    {
+        options.threadsAmount = threadsAmounts[i];
+        std::vector<unsigned char> parallelData;
+        if(!checkIOStatus(image.saveImageToRAM(parallelData, options), true)) ERRORRET;
+        if(parallelData != serialData)
+        {
+            std::cout << "Saving with filter strategy " << int(strategy) << " and "
+                      << threadsAmounts[i] << " threads did not produce the same PNG data "
+                      << "as saving with one thread.\n";
+            ERRORRET;
+        }
+    }
+
+    return true;
+}
+
+static bool testSaveOptions()
+{
+    const WPngImage::PngFilterStrategy strategies[] =
+    {
+        WPngImage::kPngFilterStrategy_none, WPngImage::kPngFilterStrategy_sub,
+        WPngImage::kPngFilterStrategy_up, WPngImage::kPngFilterStrategy_average,
+        WPngImage::kPngFilterStrategy_paeth, WPngImage::kPngFilterStrategy_minSum,
+        WPngImage::kPngFilterStrategy_entropy
+    };
+
+    Rng rng(321);
+    WPngImage image8(300, 200, WPngImage::kPixelFormat_RGBA8);
+    WPngImage image16(150, 130, WPngImage::kPixelFormat_RGBA16);
+
+    // Alternate between smooth and noisy bands so that different rows favor different filters.
+    for(int y = 0; y < image8.height(); ++y)
+        for(int x = 0; x < image8.width(); ++x)
+        {
+            if((y / 10) % 2 == 0)
+                image8.set(x, y, WPngImage::Pixel8(x * 255 / 300, y * 255 / 200, 128, 255 - y));
+            else
+                image8.set(x, y, WPngImage::Pixel8(rng() >> 8, rng() >> 8, x, 255 - y));
+        }
+
+    for(int y = 0; y < image16.height(); ++y)
+        for(int x = 0; x < image16.width(); ++x)
+        {
+            if((y / 7) % 3 == 0)
+                image16.set(x, y, WPngImage::Pixel16(rng(), rng(), rng()));
+            else
+                image16.set(x, y, WPngImage::Pixel16(x * 400, y * 500, 1000));
+        }
+
+    for(unsigned i = 0; i < ARRAY_SIZE(strategies); ++i)
+    {
+        if(!testSaveOptions(image8, strategies[i])) ERRORRET;
+        if(!testSaveOptions(image16, strategies[i])) ERRORRET;
+    }
+
+    WPngImage smallImage(40, 30, WPngImage::kPixelFormat_RGBA8);
+    for(int y = 0; y < smallImage.height(); ++y)
+        for(int x = 0; x < smallImage.width(); ++x)
+            smallImage.set(x, y, image8.get8(x * 5, y * 5));
+    if(!testSaveOptions(smallImage, WPngImage::kPngFilterStrategy_bruteForce)) ERRORRET;
+
+    return true;
+}
+
+
+//============================================================================
+// Test the compression modes
+//============================================================================
+static bool testCompression()
+{
+    const WPngImage::PngCompression compressions[] =
+    {
+        WPngImage::kPngCompression_huffmanOnly, WPngImage::kPngCompression_rle,
+        WPngImage::kPngCompression_fastest, WPngImage::kPngCompression_fast
+    };
+    const WPngImage::PngFilterStrategy strategies[] =
+    {
+        WPngImage::kPngFilterStrategy_none, WPngImage::kPngFilterStrategy_up,
+        WPngImage::kPngFilterStrategy_minSum
+    };
+
+    Rng rng(4321);
+    WPngImage image8(257, 190, WPngImage::kPixelFormat_RGBA8);
+    WPngImage image16(300, 120, WPngImage::kPixelFormat_RGBA16);
+
+    // Long runs of the same color (which are what the RLE mode compresses) mixed with noise.
+    for(int y = 0; y < image8.height(); ++y)
+        for(int x = 0; x < image8.width(); ++x)
+        {
+            if(x < 100 || (y / 20) % 2 == 0)
+                image8.set(x, y, WPngImage::Pixel8(x / 50 * 60, 200, y / 30 * 40, 255 - x / 2));
+            else
+                image8.set(x, y, WPngImage::Pixel8(rng() >> 8, rng() >> 8, rng() >> 8, 128));
+        }
+
+    for(int y = 0; y < image16.height(); ++y)
+        for(int x = 0; x < image16.width(); ++x)
+            image16.set(x, y, WPngImage::Pixel16(y * 800, (x / 10) * 5000, rng() & 0xFF, 65535));
+
+    for(unsigned i = 0; i < ARRAY_SIZE(compressions); ++i)
+        for(unsigned j = 0; j < ARRAY_SIZE(strategies); ++j)
+        {
+            WPngImage::SaveOptions options;
+            options.compression = compressions[i];
+            options.filterStrategy = strategies[j];
+
+            for(unsigned k = 0; k < 2; ++k)
+            {
+                const WPngImage& image = k == 0 ? image8 : image16;
+                std::vector<unsigned char> pngData;
+                if(!checkIOStatus(image.saveImageToRAM(pngData, options), true)) ERRORRET;
+
+                WPngImage loadedImage;
+                if(!checkIOStatus(loadedImage.loadImageFromRAM(&pngData[0], pngData.size(),
+                                                               image.currentPixelFormat()),
+                                  false))
+                    ERRORRET;
+                COMPAREIMAGES(WPngImage::Pixel16, loadedImage, image);
+            }
+        }
+
+    // An Encoder reuses the same tables for all the modes, which must not affect the result.
+    WPngImage::Encoder encoder;
+    for(unsigned i = 0; i <= ARRAY_SIZE(compressions); ++i)
+    {
+        WPngImage::SaveOptions options;
+        if(i < ARRAY_SIZE(compressions)) options.compression = compressions[i];
+        std::vector<unsigned char> expectedData, encoderData;
+        if(!checkIOStatus(image8.saveImageToRAM(expectedData, options), true)) ERRORRET;
+        encoder.setOptions(options);
+        if(!checkIOStatus(encoder.saveImageToRAM(image16, encoderData), true)) ERRORRET;
+        encoderData.clear();
+        if(!checkIOStatus(encoder.saveImageToRAM(image8, encoderData), true)) ERRORRET;
+        if(encoderData != expectedData) ERRORRET;
+    }
+
+    // The maximum compression is much slower, so it's only tested with the default filters,
+    // with image16, which is large enough to be compressed in several blocks in parallel.
+    {
+        const WPngImage& image = image16;
+        WPngImage::SaveOptions options;
+        std::vector<unsigned char> defaultData, maximumData, threadedData;
+        if(!checkIOStatus(image.saveImageToRAM(defaultData, options), true)) ERRORRET;
+        options.compression = WPngImage::kPngCompression_maximum;
+        if(!checkIOStatus(image.saveImageToRAM(maximumData, options), true)) ERRORRET;
+        options.threadsAmount = 3;
+        if(!checkIOStatus(image.saveImageToRAM(threadedData, options), true)) ERRORRET;
+        if(threadedData != maximumData) ERRORRET;
+        if(maximumData.size() >= defaultData.size()) ERRORRET;
+
+        WPngImage loadedImage;
+        if(!checkIOStatus(loadedImage.loadImageFromRAM(&maximumData[0], maximumData.size(),
+                                                       image.currentPixelFormat()), false))
+            ERRORRET;
+        COMPAREIMAGES(WPngImage::Pixel16, loadedImage, image);
+    }
+
+    return true;
+}
+
+//============================================================================
+// Test the checksum functions of lodepng against straightforward implementations
+//============================================================================
+#if !WPNGIMAGE_USE_LIBPNG
+#include "../lodepng.h"
+
+static unsigned referenceCrc32(const unsigned char* data, std::size_t length)
+{
+    static unsigned table[256];
+    if(table[1] == 0)
+        for(unsigned n = 0; n < 256; ++n)
+        {
+            unsigned c = n;
+            for(int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+
+    unsigned crc = 0xFFFFFFFFU;
+    for(std::size_t i = 0; i < length; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFU;
+}
+
+static unsigned referenceAdler32(const unsigned char* data, std::size_t length)
+{
+    unsigned s1 = 1, s2 = 0;
+    for(std::size_t i = 0; i < length; ++i)
+    {
+        s1 = (s1 + data[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+static bool testChecksums()
+{
+    Rng rng(9876);
+    std::vector<unsigned char> data(70000);
+    for(std::size_t i = 0; i < data.size(); ++i) data[i] = (unsigned char)(rng() >> 4);
+
+    // All the short lengths at every alignment, which exercise the tail handling,
+    // and a few long ones, which exercise the block-based code paths.
+    const std::size_t longLengths[] = { 511, 1024, 4096 + 7, 65536, 69984 };
+    for(std::size_t offset = 0; offset < 16; ++offset)
+    {
+        for(std::size_t length = 0; length <= 300; ++length)
+            if(lodepng_crc32(&data[offset], length) != referenceCrc32(&data[offset], length))
+            {
+                std::cout << "lodepng_crc32 failed with offset " << offset
+                          << " and length " << length << "\n";
+                ERRORRET;
+            }
+
+        for(unsigned i = 0; i < ARRAY_SIZE(longLengths); ++i)
+            if(lodepng_crc32(&data[offset], longLengths[i]) !=
+               referenceCrc32(&data[offset], longLengths[i]))
+            {
+                std::cout << "lodepng_crc32 failed with offset " << offset
+                          << " and length " << longLengths[i] << "\n";
+                ERRORRET;
+            }
+    }
+
+    // The CRC of "123456789" is the standard check value of CRC-32.
+    if(lodepng_crc32((const unsigned char*)"123456789", 9) != 0xCBF43926U) ERRORRET;
+
+    // The Adler-32 checksum is internal to lodepng, but it's stored at the end of
+    // the zlib stream. Huffman-only compression keeps this fast.
+    LodePNGCompressSettings settings = lodepng_default_compress_settings;
+    settings.use_lz77 = 0;
+    const std::size_t adlerLengths[] = { 0, 1, 31, 32, 33, 100, 5551, 5552, 5553, 5600, 69980 };
+    for(std::size_t offset = 0; offset < 16; offset += 5)
+        for(unsigned i = 0; i < ARRAY_SIZE(adlerLengths); ++i)
+        {
+            const unsigned char* const input = &data[offset];
+            const std::size_t length = adlerLengths[i];
+            std::vector<unsigned char> zlibData, decompressed;
+            if(lodepng::compress(zlibData, input, length, settings) != 0) ERRORRET;
+
+            const unsigned adler = referenceAdler32(input, length);
+            const unsigned char* const trailer = &zlibData[zlibData.size() - 4];
+            if(trailer[0] != (adler >> 24) || trailer[1] != ((adler >> 16) & 0xFF) ||
+               trailer[2] != ((adler >> 8) & 0xFF) || trailer[3] != (adler & 0xFF))
+            {
+                std::cout << "Adler-32 failed with offset " << offset
+                          << " and length " << length << "\n";
+                ERRORRET;
+            }
+
+            // Decompression verifies the checksum.
+            if(lodepng::decompress(decompressed, zlibData) != 0) ERRORRET;
+            if(decompressed.size() != length ||
+               !std::equal(decompressed.begin(), decompressed.end(), input))
+                ERRORRET;
+        }
+
+    return true;
+}
+#endif
+
+//============================================================================
+// Test that saving omits the alpha channel exactly when all pixels are opaque
+//============================================================================
+static bool checkSavedAlphaChannel(int line, const WPngImage& image, bool expectAlpha)
+{
+    std::vector<unsigned char> pngData;
+    if(!checkIOStatus(image.saveImageToRAM(pngData), true)) return false;
+
+    // The color type is at offset 25, in the IHDR chunk which always comes first. The
+    // encoder may also choose a palette or a color key, which use a tRNS chunk for alpha.
+    const char* const kTRNS = "tRNS";
+    const bool hasAlpha =
+        (pngData.size() > 25 && (pngData[25] & 4) != 0) ||
+        std::search(pngData.begin(), pngData.end(), kTRNS, kTRNS + 4) != pngData.end();
+    if(hasAlpha != expectAlpha)
+    {
+        std::cout << "At line " << line << ": Saved image "
+                  << (hasAlpha ? "has" : "does not have") << " an alpha channel.\n";
+        return false;
+    }
+    return true;
+}
+
+#define CHECKALPHA(image, expectAlpha) \
+    if(!checkSavedAlphaChannel(__LINE__, image, expectAlpha)) return false
+
+static bool testOpacityTracking(WPngImage::PixelFormat pixelFormat)
+{
+    WPngImage image(37, 29, WPngImage::Pixel8(10, 20, 30), pixelFormat);
+    CHECKALPHA(image, false);
+
+    image.set(5, 7, WPngImage::Pixel8(10, 20, 30, 254));
+    CHECKALPHA(image, true);
+    image.set(5, 7, WPngImage::Pixel8(10, 20, 30, 255));
+    CHECKALPHA(image, false);
+
+    image.drawPixel(3, 3, WPngImage::Pixel8(200, 0, 0, 100));
+    CHECKALPHA(image, false);
+
+    image.fill(WPngImage::Pixel8(1, 2, 3, 0));
+    CHECKALPHA(image, true);
+    image.drawRect(0, 0, image.width(), image.height(), WPngImage::Pixel8(1, 2, 3), true);
+    CHECKALPHA(image, false);
+
+    image.drawHorLine(0, 10, 20, WPngImage::Pixel8(1, 2, 3, 100));
+    CHECKALPHA(image, false);
+    image.putVertLine(4, 0, 20, WPngImage::Pixel8(1, 2, 3, 100));
+    CHECKALPHA(image, true);
+    image.putImage(0, 0, WPngImage(image.width(), image.height(), WPngImage::Pixel8(4, 5, 6)));
+    CHECKALPHA(image, false);
+
+    image.translate(5, 3, WPngImage::Pixel8(0, 0, 0, 0));
+    CHECKALPHA(image, true);
+    image.translate(-5, -3);
+    CHECKALPHA(image, true);
+    image.fill(WPngImage::Pixel8(7, 8, 9));
+    image.set(0, 5, WPngImage::Pixel8(7, 8, 9, 0));
+    CHECKALPHA(image, true);
+    image.translate(-1, 0);
+    CHECKALPHA(image, false);
+
+#if !WPNGIMAGE_RESTRICT_TO_CPP98
+    image.transform([](WPngImage::PixelF p) { p.a = 0.5f; return p; });
+    CHECKALPHA(image, true);
+    image.transform([](WPngImage::PixelF p) { p.a = 1.0f; return p; });
+    CHECKALPHA(image, false);
+#endif
+
+    image.set(1, 1, WPngImage::Pixel8(1, 2, 3, 4));
+    WPngImage copy = image;
+    CHECKALPHA(copy, true);
+    image.convertToPixelFormat(pixelFormat == WPngImage::kPixelFormat_RGBA8 ?
+                               WPngImage::kPixelFormat_GA16 : WPngImage::kPixelFormat_RGBA8);
+    CHECKALPHA(image, true);
+
+    std::vector<unsigned char> pngData;
+    image.set(1, 1, WPngImage::Pixel8(1, 2, 3, 255));
+    if(!checkIOStatus(image.saveImageToRAM(pngData), true)) ERRORRET;
+    WPngImage loadedImage;
+    if(!checkIOStatus(loadedImage.loadImageFromRAM(&pngData[0], pngData.size(), pixelFormat),
+                      false)) ERRORRET;
+    CHECKALPHA(loadedImage, false);
+
+    // Changes made through the raw pixel data must be seen by subsequent saves.
+    WPngImage rawImage(20, 20, WPngImage::Pixel8(1, 2, 3), WPngImage::kPixelFormat_RGBA8);
+    WPngImage::Pixel8* rawData = rawImage.getRawPixelData8();
+    CHECKALPHA(rawImage, false);
+    rawData[13].a = 0;
+    CHECKALPHA(rawImage, true);
+    rawData[13].a = 255;
+    CHECKALPHA(rawImage, false);
+
+    return true;
+}
+
+static bool testOpacityTracking()
+{
+    const WPngImage::PixelFormat formats[] =
+    {
+        WPngImage::kPixelFormat_GA8, WPngImage::kPixelFormat_GA16, WPngImage::kPixelFormat_GAF,
+        WPngImage::kPixelFormat_RGBA8, WPngImage::kPixelFormat_RGBA16,
+        WPngImage::kPixelFormat_RGBAF
+    };
+
+    for(unsigned i = 0; i < ARRAY_SIZE(formats); ++i)
+        if(!testOpacityTracking(formats[i])) ERRORRET;
+    return true;
+}
+
+
+//============================================================================
+// Test choosing the smallest lossless PNG color type when saving
+//============================================================================
+static bool testColorReduction(int line, const WPngImage& image,
+                               const WPngImage::SaveOptions& options,
+                               unsigned expectedColorType, unsigned expectedBitDepth)
+{
+    std::vector<unsigned char> pngData;
+    if(!checkIOStatus(image.saveImageToRAM(pngData, options), true)) return false;
+
+    // The bit depth and color type are at offsets 24 and 25, in the IHDR chunk.
+    if(pngData.size() < 26 ||
+       pngData[24] != expectedBitDepth || pngData[25] != expectedColorType)
+    {
+        std::cout << "At line " << line << ": Image was saved with color type "
+                  << (pngData.size() < 26 ? -1 : int(pngData[25])) << " and bit depth "
+                  << (pngData.size() < 26 ? -1 : int(pngData[24])) << " instead of "
+                  << expectedColorType << " and " << expectedBitDepth << ".\n";
+        return false;
+    }
+
+    WPngImage loadedImage;
+    if(!checkIOStatus(loadedImage.loadImageFromRAM(&pngData[0], pngData.size(),
+                                                   image.currentPixelFormat()), false))
+        return false;
+    if(!compareImages<WPngImage::Pixel16>(line, loadedImage, image)) return false;
+    return true;
+}
+
+#define CHECKREDUCTION(image, options, colorType, bitDepth) \
+    if(!testColorReduction(__LINE__, image, options, colorType, bitDepth)) return false
+
+static bool testColorReduction()
+{
+    enum { kGray = 0, kRGB = 2, kPalette = 3, kGrayAlpha = 4, kRGBA = 6 };
+    WPngImage::SaveOptions options;
+    Rng rng(555);
+
+    WPngImage image(64, 48, WPngImage::kPixelFormat_RGBA8);
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, WPngImage::Pixel8(x * 4, x * 4, x * 4));
+    CHECKREDUCTION(image, options, kGray, 8);
+
+    image.set(3, 4, WPngImage::Pixel8(10, 10, 10, 128));
+    CHECKREDUCTION(image, options, kPalette, 8);
+
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, WPngImage::Pixel8(x * 4, y * 4, 0, rng() >> 8));
+    CHECKREDUCTION(image, options, kRGBA, 8);
+
+    image.fill(WPngImage::Pixel8(200, 100, 50));
+    image.putRect(10, 10, 20, 20, WPngImage::Pixel8(0, 0, 255, 0), true);
+    image.putRect(15, 15, 5, 5, WPngImage::Pixel8(0, 255, 0, 100), true);
+    CHECKREDUCTION(image, options, kPalette, 2);
+
+    image.set(0, 0, WPngImage::Pixel8(1, 2, 3));
+    image.set(1, 0, WPngImage::Pixel8(4, 5, 6));
+    CHECKREDUCTION(image, options, kPalette, 4);
+
+    options.reduceColors = false;
+    CHECKREDUCTION(image, options, kRGBA, 8);
+    options.reduceColors = true;
+
+    WPngImage image16(40, 30, WPngImage::kPixelFormat_RGBA16);
+    for(int y = 0; y < image16.height(); ++y)
+        for(int x = 0; x < image16.width(); ++x)
+            image16.set(x, y, WPngImage::Pixel16(x * 0x0101 * 6, y * 0x0101 * 8, 0x2323));
+    CHECKREDUCTION(image16, options, kRGB, 8);
+
+    image16.set(5, 5, WPngImage::Pixel16(1000, 2000, 3000));
+    CHECKREDUCTION(image16, options, kRGB, 16);
+
+    image16.fill(WPngImage::Pixel16(0x1212, 0x3434, 0x5656, 0x7878));
+    image16.set(1, 1, WPngImage::Pixel16(0xFFFF, 0, 0));
+    CHECKREDUCTION(image16, options, kPalette, 1);
+
+    options.reduceColors = false;
+    CHECKREDUCTION(image16, options, kRGBA, 16);
+    options.reduceColors = true;
+
+    WPngImage grayImage(50, 50, WPngImage::kPixelFormat_GA16);
+    for(int y = 0; y < grayImage.height(); ++y)
+        for(int x = 0; x < grayImage.width(); ++x)
+            grayImage.set(x, y, WPngImage::Pixel16(rng(), rng()));
+    CHECKREDUCTION(grayImage, options, kGrayAlpha, 16);
+
+    for(int y = 0; y < grayImage.height(); ++y)
+        for(int x = 0; x < grayImage.width(); ++x)
+            grayImage.set(x, y, WPngImage::Pixel16((x + y) * 0x0101));
+    CHECKREDUCTION(grayImage, options, kGray, 8);
+
+    // Gray values which are exact at a lower bit depth are written with it, unless a
+    // palette has fewer bits.
+    const int grayBitDepths[] = { 1, 2, 4 };
+    for(unsigned i = 0; i < ARRAY_SIZE(grayBitDepths); ++i)
+    {
+        const int maxValue = (1 << grayBitDepths[i]) - 1;
+        for(int y = 0; y < grayImage.height(); ++y)
+            for(int x = 0; x < grayImage.width(); ++x)
+            {
+                const int value = (x + y) % (maxValue + 1) * 255 / maxValue;
+                grayImage.set(x, y, WPngImage::Pixel8(WPngImage::Byte(value)));
+            }
+        CHECKREDUCTION(grayImage, options, kGray, grayBitDepths[i]);
+    }
+    grayImage.fill(WPngImage::Pixel8(0));
+    grayImage.set(5, 5, WPngImage::Pixel8(17));
+    CHECKREDUCTION(grayImage, options, kPalette, 1);
+
+    // Fully transparent pixels of one color are written with a color key instead of an
+    // alpha channel, if no opaque pixel has that color.
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, WPngImage::Pixel8(x * 4, y * 4, rng() >> 8));
+    image.putRect(10, 10, 20, 20, WPngImage::Pixel8(0, 0, 255, 0), true);
+    CHECKREDUCTION(image, options, kRGB, 8);
+    image.set(1, 1, WPngImage::Pixel8(0, 0, 255));
+    CHECKREDUCTION(image, options, kRGBA, 8);
+    image.set(1, 1, WPngImage::Pixel8(1, 0, 255));
+    image.set(2, 1, WPngImage::Pixel8(1, 0, 255, 0));
+    CHECKREDUCTION(image, options, kRGBA, 8);
+    image.set(2, 1, WPngImage::Pixel8(0, 0, 255, 0));
+    CHECKREDUCTION(image, options, kRGB, 8);
+    image.set(2, 1, WPngImage::Pixel8(0, 0, 255, 1));
+    CHECKREDUCTION(image, options, kRGBA, 8);
+
+    for(int y = 0; y < image16.height(); ++y)
+        for(int x = 0; x < image16.width(); ++x)
+            image16.set(x, y, WPngImage::Pixel16(rng(), rng(), rng()));
+    image16.putRect(0, 0, 3, 3, WPngImage::Pixel16(100, 200, 300, 0), true);
+    CHECKREDUCTION(image16, options, kRGB, 16);
+
+    for(int y = 0; y < grayImage.height(); ++y)
+        for(int x = 0; x < grayImage.width(); ++x)
+            grayImage.set(x, y, WPngImage::Pixel16(rng()));
+    grayImage.putRect(0, 7, 50, 1, WPngImage::Pixel16(5, 0), true);
+    CHECKREDUCTION(grayImage, options, kGray, 16);
+
+    options.reduceColors = false;
+    CHECKREDUCTION(grayImage, options, kGrayAlpha, 16);
+    options.reduceColors = true;
+
+    return true;
+}
+
+
+//============================================================================
+// Test lossy palette quantization
+//============================================================================
+static unsigned countColors(const WPngImage& image)
+{
+    std::vector<unsigned> colors;
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+        {
+            const WPngImage::Pixel8 p = image.get8(x, y);
+            colors.push_back((unsigned(p.r) << 24) | (p.g << 16) | (p.b << 8) | p.a);
+        }
+    std::sort(colors.begin(), colors.end());
+    return unsigned(std::unique(colors.begin(), colors.end()) - colors.begin());
+}
+
+static bool testPaletteQuantization()
+{
+    enum { kPalette = 3 };
+    Rng rng(1357);
+
+    // An image which already has few enough colors doesn't change.
+    WPngImage image(60, 40, WPngImage::kPixelFormat_RGBA8);
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, WPngImage::Pixel8(x / 6 * 20, y / 4 * 20, 50, x < 30 ? 255 : 128));
+    WPngImage quantized = image;
+    quantized.quantizeToPalette(100);
+    COMPAREIMAGES(WPngImage::Pixel8, quantized, image);
+
+    WPngImage::SaveOptions options;
+    options.paletteColors = 100;
+    CHECKREDUCTION(image, options, kPalette, 8);
+
+    // Gradients with noise have far more colors than the palette.
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, WPngImage::Pixel8(x * 4 + rng() % 8, y * 6 + rng() % 8, rng() % 256,
+                                              x < 5 ? 0 : 255));
+
+    for(unsigned dither = 0; dither < 2; ++dither)
+    {
+        WPngImage quantized1 = image, quantized3 = image;
+        quantized1.quantizeToPalette(16, dither != 0);
+        quantized3.quantizeToPalette(16, dither != 0, 3);
+        COMPAREIMAGES(WPngImage::Pixel8, quantized3, quantized1);
+        if(countColors(quantized1) > 16) ERRORRET;
+
+        // With or without dithering the average error must stay well below the
+        // spacing of 16 colors, and transparent pixels must stay transparent.
+        long errorSum = 0;
+        for(int y = 0; y < image.height(); ++y)
+            for(int x = 0; x < image.width(); ++x)
+            {
+                const WPngImage::Pixel8 p1 = image.get8(x, y), p2 = quantized1.get8(x, y);
+                if(p1.a == 0 && p2.a != 0) ERRORRET;
+                if(p1.a != 0)
+                    errorSum += std::abs(p1.r - p2.r) + std::abs(p1.g - p2.g) +
+                        std::abs(p1.b - p2.b) + std::abs(p1.a - p2.a);
+            }
+        if(errorSum > long(image.width()) * image.height() * 3 * 40) ERRORRET;
+
+        // Saving with a palette quantizes the same way.
+        options.paletteColors = 16;
+        options.ditherPalette = dither != 0;
+        std::vector<unsigned char> pngData, losslessData;
+        if(!checkIOStatus(image.saveImageToRAM(pngData, options), true)) ERRORRET;
+        if(!checkIOStatus(image.saveImageToRAM(losslessData), true)) ERRORRET;
+        if(pngData.size() < 26 || pngData[25] != kPalette || pngData[24] != 4) ERRORRET;
+        if(pngData.size() >= losslessData.size()) ERRORRET;
+
+        WPngImage loadedImage;
+        if(!checkIOStatus(loadedImage.loadImageFromRAM(&pngData[0], pngData.size(),
+                                                       WPngImage::kPixelFormat_RGBA8), false))
+            ERRORRET;
+        for(int y = 0; y < image.height(); ++y)
+            for(int x = 5; x < image.width(); ++x)
+                if(loadedImage.get8(x, y) != quantized1.get8(x, y)) ERRORRET;
+    }
+
+    // Grayscale images stay gray.
+    WPngImage grayImage(50, 50, WPngImage::kPixelFormat_GA16);
+    for(int y = 0; y < grayImage.height(); ++y)
+        for(int x = 0; x < grayImage.width(); ++x)
+            grayImage.set(x, y, WPngImage::Pixel16(rng()));
+    grayImage.quantizeToPalette(8);
+    if(grayImage.currentPixelFormat() != WPngImage::kPixelFormat_GA16) ERRORRET;
+    if(countColors(grayImage) > 8) ERRORRET;
+
+    return true;
+}
+
+
+//============================================================================
+// Test saving many images with the same encoder
+//============================================================================
+static bool testEncoder(WPngImage::Encoder& encoder, const WPngImage& image)
+{
+    std::vector<unsigned char> expectedData, encoderData;
+    if(!checkIOStatus(image.saveImageToRAM(expectedData, encoder.options()), true)) ERRORRET;
+    if(!checkIOStatus(encoder.saveImageToRAM(image, encoderData), true)) ERRORRET;
+    if(encoderData != expectedData)
+    {
+        std::cout << "Saving a " << image.width() << "x" << image.height()
+                  << " image with an encoder did not produce the same PNG data "
+                  << "as saving it directly.\n";
+        ERRORRET;
+    }
+    return true;
+}
+
+static bool testEncoder()
+{
+    Rng rng(777);
+    std::vector<WPngImage> images;
+
+    // Sizes alternate between small images, which use only part of the LZ77 window,
+    // and large ones, which go around it, so that any state left over from the
+    // previous image would show up in the output.
+    const int sizes[][2] = { { 16, 16 }, { 300, 200 }, { 5, 3 }, { 64, 64 }, { 1, 1 },
+                             { 200, 150 }, { 32, 8 } };
+    for(unsigned i = 0; i < ARRAY_SIZE(sizes); ++i)
+    {
+        WPngImage image(sizes[i][0], sizes[i][1],
+                        i % 2 ? WPngImage::kPixelFormat_RGBA16 : WPngImage::kPixelFormat_RGBA8);
+        for(int y = 0; y < image.height(); ++y)
+            for(int x = 0; x < image.width(); ++x)
+            {
+                if((x / 4 + y / 3 + int(i)) % 3 == 0)
+                    image.set(x, y, WPngImage::Pixel16(rng(), rng(), rng(), rng()));
+                else
+                    image.set(x, y, WPngImage::Pixel8(x * 7, y * 3, int(i) * 40));
+            }
+        images.push_back(image);
+    }
+
+    WPngImage paletteImage(40, 40, WPngImage::Pixel8(20, 40, 60));
+    paletteImage.putRect(5, 5, 20, 20, WPngImage::Pixel8(255, 0, 0, 100), true);
+    images.push_back(paletteImage);
+
+    WPngImage::Encoder encoder;
+    for(unsigned round = 0; round < 2; ++round)
+        for(unsigned i = 0; i < images.size(); ++i)
+            if(!testEncoder(encoder, images[i])) ERRORRET;
+
+    WPngImage::SaveOptions options;
+    options.filterStrategy = WPngImage::kPngFilterStrategy_paeth;
+    options.reduceColors = false;
+    encoder.setOptions(options);
+    for(unsigned i = images.size(); i > 0; --i)
+        if(!testEncoder(encoder, images[i - 1])) ERRORRET;
+
+    // The brute force strategy deflates the rows while filtering them, here in several
+    // threads at once.
+    options.filterStrategy = WPngImage::kPngFilterStrategy_bruteForce;
+    options.threadsAmount = 4;
+    encoder.setOptions(options);
+    for(unsigned i = 0; i < images.size(); ++i)
+        if(!testEncoder(encoder, images[i])) ERRORRET;
+
+    for(unsigned i = 0; i < images.size(); ++i)
+    {
+        if(!checkIOStatus(encoder.saveImage(images[i], kTestPngImageFileName), true))
+            ERRORRET;
+        WPngImage loadedImage;
+        if(!checkIOStatus(loadedImage.loadImage(kTestPngImageFileName,
+                                                images[i].currentPixelFormat()), false))
+            ERRORRET;
+        COMPAREIMAGES(WPngImage::Pixel16, loadedImage, images[i]);
+    }
+
+    return true;
+}
+
+
+//============================================================================
+// Test saving a region of an image
+//============================================================================
+static bool testSaveRegion(int line, const WPngImage& image, int x, int y, int width, int height)
+{
+    // Saving the region must produce exactly the same data as saving a copy of it.
+    WPngImage copy = image;
+    copy.resizeCanvas(x, y, width, height);
+    WPngImage::SaveOptions options;
+
+    std::vector<unsigned char> expectedData, regionData, encoderData;
+    if(!checkIOStatus(copy.saveImageToRAM(expectedData, options), true)) return false;
+    if(!checkIOStatus(image.saveImageToRAM(regionData, x, y, width, height, options), true))
+        return false;
+
+    WPngImage::Encoder encoder;
+    if(!checkIOStatus(encoder.saveImageToRAM(image, encoderData, x, y, width, height), true))
+        return false;
+
+    if(regionData != expectedData || encoderData != expectedData)
+    {
+        std::cout << "At line " << line << ": Saving the region " << x << "," << y << ","
+                  << width << "," << height << " did not produce the same PNG data as "
+                  << "saving a copy of it.\n";
+        return false;
+    }
+    return true;
+}
+
+#define CHECKREGION(image, x, y, width, height) \
+    if(!testSaveRegion(__LINE__, image, x, y, width, height)) return false
+
+static bool testSaveRegion()
+{
+    Rng rng(999);
+    WPngImage image8(120, 90, WPngImage::kPixelFormat_RGBA8);
+    for(int y = 0; y < image8.height(); ++y)
+        for(int x = 0; x < image8.width(); ++x)
+            image8.set(x, y, WPngImage::Pixel8(x * 2, y * 2, rng() >> 8, x < 60 ? 255 : y));
+
+    CHECKREGION(image8, 0, 0, 120, 90);
+    CHECKREGION(image8, 10, 20, 30, 40);
+    CHECKREGION(image8, 70, 5, 50, 85);
+    CHECKREGION(image8, 59, 0, 2, 90);
+    CHECKREGION(image8, 119, 89, 1, 1);
+
+    // Only opaque pixels, and only a few colors, inside the region:
+    image8.putRect(20, 30, 16, 16, WPngImage::Pixel8(10, 200, 30), true);
+    image8.putRect(24, 34, 4, 4, WPngImage::Pixel8(255, 255, 255), true);
+    CHECKREGION(image8, 20, 30, 16, 16);
+    CHECKREGION(image8, 0, 0, 60, 90);
+
+    WPngImage image16(70, 50, WPngImage::kPixelFormat_GA16);
+    for(int y = 0; y < image16.height(); ++y)
+        for(int x = 0; x < image16.width(); ++x)
+            image16.set(x, y, WPngImage::Pixel16(rng(), y < 25 ? 65535 : rng()));
+    CHECKREGION(image16, 0, 0, 70, 25);
+    CHECKREGION(image16, 33, 17, 20, 20);
+
+    // Regions extending outside the image are clipped:
+    std::vector<unsigned char> clippedData, expectedData;
+    const WPngImage::SaveOptions options;
+    if(!checkIOStatus(image8.saveImageToRAM(clippedData, -10, 80, 50, 50, options), true))
+        ERRORRET;
+    if(!checkIOStatus(image8.saveImageToRAM(expectedData, 0, 80, 40, 10, options), true))
+        ERRORRET;
+    if(clippedData != expectedData)
+    {
+        std::cout << "Saving a region extending outside the image was not clipped.\n";
+        ERRORRET;
+    }
+
+    // The ends of the region don't overflow:
+    if(!checkIOStatus(image8.saveImageToRAM(clippedData, 80, 70, INT_MAX, INT_MAX - 10,
+                                            options), true) ||
+       !checkIOStatus(image8.saveImageToRAM(expectedData, 80, 70, 40, 20, options), true))
+        ERRORRET;
+    if(clippedData != expectedData)
+    {
+        std::cout << "Saving a region reaching past INT_MAX was not clipped.\n";
+        ERRORRET;
+    }
+
+    // An empty region is an error:
+    const int emptyRegions[][4] =
+    {
+        { 200, 0, 10, 10 }, { 0, 90, 10, 10 }, { -10, 0, 10, 10 }, { 0, 0, 0, 10 },
+        { 0, 0, 10, -5 }, { INT_MIN, 0, INT_MAX, 10 }, { INT_MAX, INT_MAX, INT_MAX, 1 }
+    };
+    for(unsigned i = 0; i < ARRAY_SIZE(emptyRegions); ++i)
+    {
+        std::vector<unsigned char> emptyData;
+        const int* r = emptyRegions[i];
+        if(image8.saveImageToRAM(emptyData, r[0], r[1], r[2], r[3], options) !=
+           WPngImage::kIOStatus_Error_InvalidRegion || !emptyData.empty())
+        {
+            std::cout << "Saving the empty region " << r[0] << "," << r[1] << "," << r[2]
+                      << "," << r[3] << " did not fail.\n";
+            ERRORRET;
+        }
+    }
+
+    return true;
+}
+
+
+//============================================================================
+// Test writing 16-bit rows directly from the pixel data
+//============================================================================
+static bool testSave16BitRows()
+{
+    // Every row width modulo the amount of pixels handled at a time, starting at an odd
+    // pixel, with and without the alpha channel.
+    Rng rng(5555);
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        const WPngImage::PixelFormat pixelFormat =
+            i < 2 ? WPngImage::kPixelFormat_RGBA16 : WPngImage::kPixelFormat_GA16;
+        const bool opaque = i % 2 == 0;
+
+        for(int width = 1; width <= 19; ++width)
+        {
+            WPngImage image(width + 2, 3, pixelFormat);
+            for(int y = 0; y < image.height(); ++y)
+                for(int x = 0; x < image.width(); ++x)
+                    image.set(x, y, WPngImage::Pixel16(rng(), rng(), rng(),
+                                                       opaque ? 65535 : rng()));
+
+            std::vector<unsigned char> pngData;
+            if(!checkIOStatus(image.saveImageToRAM(pngData, 1, 0, width, 3,
+                                                   WPngImage::SaveOptions()), true))
+                ERRORRET;
+
+            WPngImage loadedImage, expectedImage = image;
+            expectedImage.resizeCanvas(1, 0, width, 3);
+            if(!checkIOStatus(loadedImage.loadImageFromRAM(&pngData[0], pngData.size(),
+                                                           pixelFormat), false))
+                ERRORRET;
+            COMPAREIMAGES(WPngImage::Pixel16, loadedImage, expectedImage);
+        }
+    }
+    return true;
+}
+
+
+//============================================================================
+// Test saving many images in parallel
+//============================================================================
+static bool readFile(const char* fileName, std::vector<unsigned char>& data)
+{
+    data.clear();
+    std::FILE* file = std::fopen(fileName, "rb");
+    if(!file) return false;
+    unsigned char buffer[4096];
+    for(std::size_t amount; (amount = std::fread(buffer, 1, sizeof(buffer), file)) > 0;)
+        data.insert(data.end(), buffer, buffer + amount);
+    std::fclose(file);
+    return true;
+}
+
+static bool testSaveImages(const std::vector<WPngImage>& images,
+                           unsigned threadsAmount, std::size_t maxBufferedBytes)
+{
+    // Every other image is saved to a file, the rest to RAM.
+    std::vector<std::string> fileNames(images.size());
+    std::vector<std::vector<unsigned char> > ramData(images.size());
+    std::vector<WPngImage::BatchSaveItem> items;
+    for(std::size_t i = 0; i < images.size(); ++i)
+    {
+        if(i % 2 == 0)
+        {
+            char fileName[64];
+            std::sprintf(fileName, "WPngImage_testing_batch%u.png", unsigned(i));
+            fileNames[i] = fileName;
+            items.push_back(WPngImage::BatchSaveItem(images[i], fileNames[i]));
+        }
+        else if(i % 3 == 0)
+            items.push_back(WPngImage::BatchSaveItem(images[i], ramData[i],
+                                                     WPngImage::kPngFileFormat_RGBA16));
+        else
+            items.push_back(WPngImage::BatchSaveItem(images[i], ramData[i]));
+    }
+
+    // One destination that can't be written:
+    items.push_back(WPngImage::BatchSaveItem(images[0], "nonexistent_directory/image.png"));
+
+    const std::vector<WPngImage::IOStatus> statuses =
+        WPngImage::saveImages(items, WPngImage::SaveOptions(), threadsAmount, maxBufferedBytes);
+    if(statuses.size() != items.size()) ERRORRET;
+
+    for(std::size_t i = 0; i < images.size(); ++i)
+    {
+        if(!checkIOStatus(statuses[i], true)) ERRORRET;
+
+        std::vector<unsigned char> expectedData, data;
+        if(i % 2 == 0)
+        {
+            if(!checkIOStatus(images[i].saveImageToRAM(expectedData), true)) ERRORRET;
+            if(!readFile(fileNames[i].c_str(), data)) ERRORRET;
+            std::remove(fileNames[i].c_str());
+        }
+        else
+        {
+            if(!checkIOStatus(images[i].saveImageToRAM
+                              (expectedData, i % 3 == 0 ? WPngImage::kPngFileFormat_RGBA16 :
+                               WPngImage::kPngFileFormat_none), true))
+                ERRORRET;
+            data = ramData[i];
+        }
+
+        if(data != expectedData)
+        {
+            std::cout << "Image " << i << " saved with " << threadsAmount
+                      << " threads did not produce the same PNG data as saving it alone.\n";
+            ERRORRET;
+        }
+    }
+
+    if(statuses.back() != WPngImage::kIOStatus_Error_CantOpenFile ||
+       statuses.back().fileName != "nonexistent_directory/image.png")
+    {
+        std::cout << "Saving to a nonexistent directory did not return an error.\n";
+        ERRORRET;
+    }
+
+    return true;
+}
+
+static bool testSaveImages()
+{
+    Rng rng(1234);
+    std::vector<WPngImage> images;
+    for(unsigned i = 0; i < 13; ++i)
+    {
+        const int width = 5 + int(rng() % 150), height = 3 + int(rng() % 100);
+        WPngImage image(width, height,
+                        i % 4 == 1 ? WPngImage::kPixelFormat_GA16 :
+                        i % 4 == 2 ? WPngImage::kPixelFormat_RGBAF :
+                        WPngImage::kPixelFormat_RGBA8);
+        for(int y = 0; y < height; ++y)
+            for(int x = 0; x < width; ++x)
+                image.set(x, y, WPngImage::Pixel8(x, y, rng() >> 8, i % 3 ? 255 : x + y));
+        images.push_back(image);
+    }
+
+    if(!testSaveImages(images, 1, 0)) ERRORRET;
+    if(!testSaveImages(images, 3, 0)) ERRORRET;
+    if(!testSaveImages(images, 0, 0)) ERRORRET;
+    if(!testSaveImages(images, 4, 1)) ERRORRET;
+    if(!testSaveImages(images, 4, 100000)) ERRORRET;
+
+    return true;
+}
+
+
+//============================================================================
+// Test saving with the options which compress best
+//============================================================================
+static bool testOptimize()
+{
+    // Few colors with smooth gradients, where the filters and a palette both matter.
+    Rng rng(2468);
+    WPngImage image(90, 70, WPngImage::kPixelFormat_RGBA8);
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, (x / 10 + y / 10) % 3 == 0 ?
+                      WPngImage::Pixel8(x * 2, y * 3, 100, 255) :
+                      WPngImage::Pixel8(rng() % 4 * 50, 20, 200, 255));
+
+    const WPngImage::PngFilterStrategy strategies[] =
+    {
+        WPngImage::kPngFilterStrategy_none, WPngImage::kPngFilterStrategy_minSum,
+        WPngImage::kPngFilterStrategy_bruteForce
+    };
+    std::vector<unsigned char> defaultData;
+    if(!checkIOStatus(image.saveImageToRAM(defaultData), true)) ERRORRET;
+
+    for(unsigned threadsAmount = 1; threadsAmount <= 3; threadsAmount += 2)
+    {
+        WPngImage::OptimizeOptions options;
+        options.threadsAmount = threadsAmount;
+        std::vector<unsigned char> optimizedData;
+        if(!checkIOStatus(image.optimizeToRAM(optimizedData, options), true)) ERRORRET;
+
+        for(unsigned i = 0; i < ARRAY_SIZE(strategies); ++i)
+        {
+            WPngImage::SaveOptions saveOptions;
+            saveOptions.filterStrategy = strategies[i];
+            std::vector<unsigned char> pngData;
+            if(!checkIOStatus(image.saveImageToRAM(pngData, saveOptions), true)) ERRORRET;
+            if(optimizedData.size() > pngData.size()) ERRORRET;
+        }
+
+        WPngImage loadedImage;
+        if(!checkIOStatus(loadedImage.loadImageFromRAM(&optimizedData[0], optimizedData.size(),
+                                                       WPngImage::kPixelFormat_RGBA8), false))
+            ERRORRET;
+        COMPAREIMAGES(WPngImage::Pixel8, loadedImage, image);
+    }
+
+    // When the time runs out only the default options are tried.
+    WPngImage::OptimizeOptions options;
+    options.timeBudget = 1e-9;
+    std::vector<unsigned char> optimizedData;
+    if(!checkIOStatus(image.optimizeToRAM(optimizedData, options), true)) ERRORRET;
+    if(optimizedData != defaultData) ERRORRET;
+
+    if(!checkIOStatus(image.saveImageOptimized(kTestPngImageFileName), true)) ERRORRET;
+    WPngImage loadedImage;
+    if(!checkIOStatus(loadedImage.loadImage(kTestPngImageFileName), false)) ERRORRET;
+    COMPAREIMAGES(WPngImage::Pixel8, loadedImage, image);
+    if(image.saveImageOptimized("nonexistent_directory/image.png", options) !=
+       WPngImage::kIOStatus_Error_CantOpenFile)
+        ERRORRET;
+
+    return true;
+}
+
+
+//============================================================================
+// Test compression backends
+//============================================================================
+#if !WPNGIMAGE_USE_LIBPNG
+// A minimal backend which only uses uncompressed deflate blocks.
+class StoredBlocksBackend: public WPngImage::CompressionBackend
+{
+ public:
+    unsigned deflateCalls, inflateCalls;
+
+    StoredBlocksBackend(): deflateCalls(0), inflateCalls(0) {}
+
+    virtual bool deflate(std::vector<unsigned char>& dest,
+                         const unsigned char* data, std::size_t dataSize,
+                         WPngImage::PngCompression)
+    {
+        ++deflateCalls;
+        std::size_t pos = 0;
+        do
+        {
+            const std::size_t length = std::min(dataSize - pos, std::size_t(65535));
+            dest.push_back(pos + length == dataSize ? 1 : 0);
+            dest.push_back((unsigned char)length);
+            dest.push_back((unsigned char)(length >> 8));
+            dest.push_back((unsigned char)~length);
+            dest.push_back((unsigned char)(~length >> 8));
+            dest.insert(dest.end(), data + pos, data + pos + length);
+            pos += length;
+        } while(pos < dataSize);
+        return true;
+    }
+
+    virtual bool inflate(std::vector<unsigned char>& dest,
+                         const unsigned char* data, std::size_t dataSize)
+    {
+        ++inflateCalls;
+        for(std::size_t pos = 0; pos < dataSize;)
+        {
+            if(pos + 5 > dataSize || (data[pos] & 6) != 0) return false;
+            const bool finalBlock = (data[pos] & 1) != 0;
+            const std::size_t length = data[pos + 1] | (data[pos + 2] << 8);
+            pos += 5;
+            if(pos + length > dataSize) return false;
+            dest.insert(dest.end(), data + pos, data + pos + length);
+            pos += length;
+            if(finalBlock) return true;
+        }
+        return false;
+    }
+};
+
+// Fails everything.
+class FailingBackend: public WPngImage::CompressionBackend
+{
+ public:
+    virtual bool deflate(std::vector<unsigned char>&, const unsigned char*, std::size_t,
+                         WPngImage::PngCompression)
+    { return false; }
+
+    virtual bool inflate(std::vector<unsigned char>&, const unsigned char*, std::size_t)
+    { return false; }
+};
+
+static bool testCompressionBackend()
+{
+    WPngImage image(300, 250, WPngImage::kPixelFormat_RGBA16);
+    Rng rng(777);
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, WPngImage::Pixel16(rng(), x * 200, y * 250, rng() | 1));
+
+    StoredBlocksBackend backend;
+    FailingBackend failingBackend;
+    WPngImage::SaveOptions options;
+    options.compressionBackend = &backend;
+
+    // Per call: the result must be a valid PNG also for the built-in decoder, and the
+    // built-in compression is not readable by the backend.
+    std::vector<unsigned char> storedData, builtinData;
+    if(!checkIOStatus(image.saveImageToRAM(storedData, options), true)) ERRORRET;
+    if(!checkIOStatus(image.saveImageToRAM(builtinData), true)) ERRORRET;
+    if(backend.deflateCalls != 1) ERRORRET;
+    if(storedData.size() < std::size_t(image.width() * image.height() * 8)) ERRORRET;
+
+    WPngImage loadedImage;
+    if(!checkIOStatus(loadedImage.loadImageFromRAM(&storedData[0], storedData.size()), false))
+        ERRORRET;
+    COMPAREIMAGES(WPngImage::Pixel16, loadedImage, image);
+    loadedImage = WPngImage();
+    if(!checkIOStatus(loadedImage.loadImageFromRAM(&storedData[0], storedData.size(),
+                                                   WPngImage::kPngReadConvert_closestMatch,
+                                                   &backend), false))
+        ERRORRET;
+    COMPAREIMAGES(WPngImage::Pixel16, loadedImage, image);
+    if(backend.inflateCalls != 1) ERRORRET;
+    if(loadedImage.loadImageFromRAM(&builtinData[0], builtinData.size(),
+                                    WPngImage::kPixelFormat_RGBA16, &backend)
+       != WPngImage::kIOStatus_Error_PNGLibraryError)
+        ERRORRET;
+
+    // Globally, and a per-call backend overriding the global one.
+    WPngImage::setDefaultCompressionBackend(&backend);
+    if(WPngImage::defaultCompressionBackend() != &backend) ERRORRET;
+    std::vector<unsigned char> pngData;
+    if(!checkIOStatus(image.saveImageToRAM(pngData), true)) ERRORRET;
+    if(pngData != storedData) ERRORRET;
+    if(!checkIOStatus(loadedImage.loadImageFromRAM(&pngData[0], pngData.size()), false))
+        ERRORRET;
+    if(backend.deflateCalls != 2 || backend.inflateCalls != 3) ERRORRET;
+
+    options.compressionBackend = &failingBackend;
+    pngData.clear();
+    const WPngImage::IOStatus status = image.saveImageToRAM(pngData, options);
+    WPngImage::setDefaultCompressionBackend(0);
+    if(status != WPngImage::kIOStatus_Error_PNGLibraryError) ERRORRET;
+    if(backend.deflateCalls != 2) ERRORRET;
+
+    pngData.clear();
+    if(!checkIOStatus(image.saveImageToRAM(pngData), true)) ERRORRET;
+    if(pngData != builtinData) ERRORRET;
+    return true;
+}
+#endif
+
+
 //============================================================================
 // Test the transform functions
 //============================================================================
@@ -2708,19 +3866,217 @@ static bool testTransform(typename Pixel_t::Component_t componentMaxValue,
 
             if(!testTransformWithImage<Pixel_t>(image, componentMaxValue, transformFunc)) ERRORRET;
         }
-    }
+    }
+
+    return true;
+}
+
+static bool testTransform()
+{
+    if(!testTransform<WPngImage::Pixel8>(255, getInvertFunc8())) ERRORRET;
+    if(!testTransform<WPngImage::Pixel8>(255, getInvertFunc16())) ERRORRET;
+    if(!testTransform<WPngImage::Pixel8>(255, getInvertFuncF())) ERRORRET;
+    if(!testTransform<WPngImage::Pixel16>(65535, getInvertFunc16())) ERRORRET;
+    if(!testTransform<WPngImage::Pixel16>(65535, getInvertFuncF())) ERRORRET;
+    if(!testTransform<WPngImage::PixelF>(1.0f, getInvertFuncF())) ERRORRET;
+    return true;
+}
+
+template<typename Pixel_t>
+struct InvertFunctor
+{
+    typename Pixel_t::Component_t maxValue;
+    explicit InvertFunctor(typename Pixel_t::Component_t value): maxValue(value) {}
+    Pixel_t operator()(const Pixel_t& pixel) const { return maxValue - pixel; }
+};
+
+struct CoordinatesFunctor
+{
+    WPngImage::Pixel8 operator()(WPngImage::Pixel8, int x, int y) const
+    { return WPngImage::Pixel8(x, y, x + y, x == 3 && y == 2 ? 100 : 255); }
+};
+
+struct SumFunctor
+{
+    long* sum;
+    explicit SumFunctor(long* s): sum(s) {}
+    void operator()(const WPngImage::Pixel8& pixel) const { *sum += pixel.r + pixel.a; }
+    void operator()(const WPngImage::Pixel8& pixel, int x, int y) const
+    { *sum += (pixel.r + pixel.a) * (x + 1) * (y + 1); }
+};
+
+template<typename Pixel_t, typename TransformFunc_t>
+static bool testTransformTemplates(const WPngImage& image,
+                                   typename Pixel_t::Component_t componentMaxValue,
+                                   TransformFunc_t transformFunc)
+{
+    WPngImage image1 = image, image2 = image;
+    image1.transform(transformFunc);
+    image2.transformT<Pixel_t>(InvertFunctor<Pixel_t>(componentMaxValue));
+    COMPAREIMAGES(WPngImage::PixelF, image2, image1);
+    return true;
+}
+
+template<typename PixelGA_t, typename CT>
+struct GrayInvertFunctor
+{
+    CT maxValue;
+    explicit GrayInvertFunctor(CT value): maxValue(value) {}
+    PixelGA_t operator()(const PixelGA_t& pixel) const
+    {
+        PixelGA_t result = { CT(maxValue - pixel.g), pixel.a };
+        return result;
+    }
+};
+
+template<typename PixelGA_t>
+struct GraySumFunctor
+{
+    double* sum;
+    explicit GraySumFunctor(double* s): sum(s) {}
+    void operator()(const PixelGA_t& pixel) const { *sum += pixel.g + pixel.a; }
+    void operator()(const PixelGA_t& pixel, int x, int y) const
+    { *sum += (pixel.g + pixel.a) * (x + 1) * (y + 1); }
+};
+
+// The gray-alpha templates must give the same result on any pixel format as on the
+// image converted to the gray-alpha format first.
+template<typename PixelGA_t, typename CT>
+static bool testGrayTransformTemplates(const WPngImage& image, WPngImage::PixelFormat grayFormat,
+                                       CT componentMaxValue)
+{
+    WPngImage grayImage = image;
+    grayImage.convertToPixelFormat(grayFormat);
+
+    double sum = 0, expectedSum = 0, sumXY = 0, expectedSumXY = 0;
+    image.forEachPixel<PixelGA_t>(GraySumFunctor<PixelGA_t>(&sum));
+    image.forEachPixelXY<PixelGA_t>(GraySumFunctor<PixelGA_t>(&sumXY));
+    const WPngImage::PixelRows<const PixelGA_t> grayRows =
+        static_cast<const WPngImage&>(grayImage).rows<PixelGA_t>();
+    if(grayRows.empty()) ERRORRET;
+    for(int y = 0; y < grayImage.height(); ++y)
+        for(int x = 0; x < grayImage.width(); ++x)
+        {
+            const PixelGA_t pixel = grayRows[y][x];
+            expectedSum += pixel.g + pixel.a;
+            expectedSumXY += (pixel.g + pixel.a) * (x + 1) * (y + 1);
+        }
+    if(sum != expectedSum || sumXY != expectedSumXY) ERRORRET;
+
+    WPngImage transformed = image;
+    transformed.transformT<PixelGA_t>(GrayInvertFunctor<PixelGA_t, CT>(componentMaxValue));
+    grayImage.transformT<PixelGA_t>(GrayInvertFunctor<PixelGA_t, CT>(componentMaxValue));
+    if(transformed.currentPixelFormat() != image.currentPixelFormat()) ERRORRET;
+    grayImage.convertToPixelFormat(image.currentPixelFormat());
+    COMPAREIMAGES(WPngImage::PixelF, transformed, grayImage);
+    return true;
+}
+
+static bool testTransformTemplates()
+{
+    const WPngImage::PixelFormat formats[] =
+    {
+        WPngImage::kPixelFormat_GA8, WPngImage::kPixelFormat_GA16, WPngImage::kPixelFormat_GAF,
+        WPngImage::kPixelFormat_RGBA8, WPngImage::kPixelFormat_RGBA16,
+        WPngImage::kPixelFormat_RGBAF
+    };
 
+    for(unsigned i = 0; i < ARRAY_SIZE(formats); ++i)
+    {
+        WPngImage image(37, 11, formats[i]);
+        for(int y = 0; y < image.height(); ++y)
+            for(int x = 0; x < image.width(); ++x)
+                image.set(x, y, WPngImage::Pixel8(x * 7, y * 20, 50, 255 - x));
+
+        if(!testTransformTemplates<WPngImage::Pixel8>(image, 255, getInvertFunc8())) ERRORRET;
+        if(!testTransformTemplates<WPngImage::Pixel16>(image, 65535, getInvertFunc16()))
+            ERRORRET;
+        if(!testTransformTemplates<WPngImage::PixelF>(image, 1.0f, getInvertFuncF())) ERRORRET;
+        if(!testGrayTransformTemplates<WPngImage::PixelGA8>
+           (image, WPngImage::kPixelFormat_GA8, WPngImage::Byte(255))) ERRORRET;
+        if(!testGrayTransformTemplates<WPngImage::PixelGA16>
+           (image, WPngImage::kPixelFormat_GA16, WPngImage::UInt16(65535))) ERRORRET;
+        if(!testGrayTransformTemplates<WPngImage::PixelGAF>
+           (image, WPngImage::kPixelFormat_GAF, WPngImage::Float(1.0f))) ERRORRET;
+
+        long sum = 0, expectedSum = 0, sumXY = 0, expectedSumXY = 0;
+        image.forEachPixel<WPngImage::Pixel8>(SumFunctor(&sum));
+        image.forEachPixelXY<WPngImage::Pixel8>(SumFunctor(&sumXY));
+        for(int y = 0; y < image.height(); ++y)
+            for(int x = 0; x < image.width(); ++x)
+            {
+                const WPngImage::Pixel8 pixel = image.get8(x, y);
+                expectedSum += pixel.r + pixel.a;
+                expectedSumXY += (pixel.r + pixel.a) * (x + 1) * (y + 1);
+            }
+        if(sum != expectedSum || sumXY != expectedSumXY) ERRORRET;
+
+        // The opacity tracking must notice the pixels changed by the templates.
+        image.fill(WPngImage::Pixel8(0, 0, 0, 255));
+        if(!image.allPixelsHaveFullAlpha()) ERRORRET;
+        image.transformXYT<WPngImage::Pixel8>(CoordinatesFunctor());
+        if(image.allPixelsHaveFullAlpha()) ERRORRET;
+        const bool isGray = image.isGrayscalePixelFormat();
+        for(int y = 0; y < image.height(); ++y)
+            for(int x = 0; x < image.width(); ++x)
+            {
+                const WPngImage::Pixel8 expected = CoordinatesFunctor()(image.get8(x, y), x, y);
+                const WPngImage::Pixel8 pixel = image.get8(x, y);
+                if(pixel.a != expected.a || (!isGray && pixel != expected)) ERRORRET;
+            }
+    }
     return true;
 }
 
-static bool testTransform()
+
+static WPngImage::Pixel8 makeMarkedPixelTranslucent(WPngImage::Pixel8 pixel)
 {
-    if(!testTransform<WPngImage::Pixel8>(255, getInvertFunc8())) ERRORRET;
-    if(!testTransform<WPngImage::Pixel8>(255, getInvertFunc16())) ERRORRET;
-    if(!testTransform<WPngImage::Pixel8>(255, getInvertFuncF())) ERRORRET;
-    if(!testTransform<WPngImage::Pixel16>(65535, getInvertFunc16())) ERRORRET;
-    if(!testTransform<WPngImage::Pixel16>(65535, getInvertFuncF())) ERRORRET;
-    if(!testTransform<WPngImage::PixelF>(1.0f, getInvertFuncF())) ERRORRET;
+    if(pixel.g == 1) pixel.a = 128;
+    return pixel;
+}
+
+static bool testParallelTransform()
+{
+    const WPngImage::PixelFormat formats[] =
+    {
+        WPngImage::kPixelFormat_GA8, WPngImage::kPixelFormat_RGBA8,
+        WPngImage::kPixelFormat_RGBA16, WPngImage::kPixelFormat_RGBAF
+    };
+
+    for(unsigned i = 0; i < ARRAY_SIZE(formats); ++i)
+    {
+        // Large enough to be split into several chunks.
+        WPngImage image(317, 401, formats[i]);
+        for(int y = 0; y < image.height(); ++y)
+            for(int x = 0; x < image.width(); ++x)
+                image.set(x, y, WPngImage::Pixel8(x, y, x ^ y, 255 - y / 2));
+
+        WPngImage serial = image, parallel = image, serialDest, parallelDest;
+        serial.transform(getInvertFunc16());
+        parallel.transform(getInvertFunc16(), 4);
+        COMPAREIMAGES(WPngImage::PixelF, parallel, serial);
+        image.transform(getInvertFuncF(), serialDest);
+        image.transform(getInvertFuncF(), parallelDest, 4);
+        if(parallelDest.currentPixelFormat() != image.currentPixelFormat()) ERRORRET;
+        COMPAREIMAGES(WPngImage::PixelF, parallelDest, serialDest);
+
+        serial = image;
+        parallel = image;
+        serial.transformXYT<WPngImage::Pixel8>(CoordinatesFunctor());
+        parallel.transformXYT<WPngImage::Pixel8>(CoordinatesFunctor(), 4);
+        COMPAREIMAGES(WPngImage::PixelF, parallel, serial);
+        parallel.transformT<WPngImage::Pixel8>(InvertFunctor<WPngImage::Pixel8>(255), 0);
+        serial.transformT<WPngImage::Pixel8>(InvertFunctor<WPngImage::Pixel8>(255));
+        COMPAREIMAGES(WPngImage::PixelF, parallel, serial);
+
+        // The opacity of the chunks must be combined.
+        image.fill(WPngImage::Pixel8(0, 0, 0, 255));
+        image.transform(makeMarkedPixelTranslucent, 4);
+        if(!image.allPixelsHaveFullAlpha()) ERRORRET;
+        image.set(image.width() - 1, image.height() - 1, WPngImage::Pixel8(1, 1, 1, 255));
+        image.transform(makeMarkedPixelTranslucent, 4);
+        if(image.allPixelsHaveFullAlpha()) ERRORRET;
+    }
     return true;
 }
 
@@ -2803,6 +4159,333 @@ static bool testAlphaPremultiply()
 }
 
 
+
+//============================================================================
+// Test pixel arithmetic
+//============================================================================
+template<typename Pixel_t>
+static WPngImage createArithmeticTestImage(WPngImage::PixelFormat format, unsigned seed)
+{
+    // The width makes the rows end in the middle of the SIMD blocks.
+    WPngImage image(37, 11, format);
+    Rng rng(seed);
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+            image.set(x, y, Pixel_t(toCT<typename Pixel_t::Component_t>(rng() % 65536),
+                                    toCT<typename Pixel_t::Component_t>(rng() % 65536),
+                                    toCT<typename Pixel_t::Component_t>(rng() % 65536),
+                                    toCT<typename Pixel_t::Component_t>(rng() % 65536)));
+    return image;
+}
+
+template<typename Pixel_t>
+static bool testPixelArithmetic(WPngImage::PixelFormat format,
+                                typename Pixel_t::Component_t maxValue,
+                                typename Pixel_t::Component_t offset)
+{
+    const WPngImage image = createArithmeticTestImage<Pixel_t>(format, 1);
+    const WPngImage image2 = createArithmeticTestImage<Pixel_t>(format, 2);
+    const WPngImage::Float offsetF = WPngImage::Float(offset) / WPngImage::Float(maxValue);
+    WPngImage inverted = image, added = image, subtracted = image, multiplied = image;
+    WPngImage divided = image, addedImage = image, subtractedImage = image;
+    WPngImage multipliedImage = image, dividedImage = image, adjusted = image;
+
+    inverted.invert();
+    added.add(offsetF);
+    subtracted.subtract(offsetF);
+    multiplied.multiply(3);
+    divided.divide(2);
+    addedImage.add(image2);
+    subtractedImage.subtract(image2);
+    multipliedImage.multiply(image2);
+    dividedImage.divide(image2);
+    adjusted.adjustBrightnessContrast(offsetF, 1);
+    if(adjusted.currentPixelFormat() != format) ERRORRET;
+
+    for(int y = 0; y < image.height(); ++y)
+        for(int x = 0; x < image.width(); ++x)
+        {
+            const Pixel_t p1 = getPixel<Pixel_t>(image, x, y);
+            const Pixel_t p2 = getPixel<Pixel_t>(image2, x, y);
+            COMPAREP(getPixel<Pixel_t>(inverted, x, y), maxValue - p1);
+            COMPAREP(getPixel<Pixel_t>(added, x, y), p1 + offset);
+            COMPAREP(getPixel<Pixel_t>(subtracted, x, y), p1 - offset);
+            COMPAREP(getPixel<Pixel_t>(multiplied, x, y), p1 * 3);
+            COMPAREP(getPixel<Pixel_t>(divided, x, y), p1 / 2);
+            COMPAREP(getPixel<Pixel_t>(addedImage, x, y), p1 + p2);
+            COMPAREP(getPixel<Pixel_t>(subtractedImage, x, y), p1 - p2);
+            COMPAREP(getPixel<Pixel_t>(multipliedImage, x, y), p1 * p2);
+            COMPAREP(getPixel<Pixel_t>(dividedImage, x, y), p1 / p2);
+            COMPAREP(getPixel<Pixel_t>(adjusted, x, y), p1 + offset);
+        }
+
+    // The grayscale formats must give the same results as the RGBA formats with gray pixels.
+    const WPngImage::PixelFormat grayFormat =
+        format == WPngImage::kPixelFormat_RGBA8 ? WPngImage::kPixelFormat_GA8 :
+        format == WPngImage::kPixelFormat_RGBA16 ? WPngImage::kPixelFormat_GA16 :
+        WPngImage::kPixelFormat_GAF;
+    WPngImage gray = image, gray2 = image2, grayRGBA;
+    gray.convertToPixelFormat(grayFormat);
+    gray2.convertToPixelFormat(grayFormat);
+    grayRGBA = gray;
+    grayRGBA.convertToPixelFormat(format);
+    gray.invert();
+    gray.add(offsetF);
+    gray.multiplyAlpha(0.5f);
+    gray.subtract(gray2);
+    grayRGBA.invert();
+    grayRGBA.add(offsetF);
+    grayRGBA.multiplyAlpha(0.5f);
+    grayRGBA.subtract(gray2);
+    gray.convertToPixelFormat(format);
+    COMPAREIMAGES(Pixel_t, gray, grayRGBA);
+
+    return true;
+}
+
+template<typename Pixel_t>
+static bool testImageMultiplyDivide(const WPngImage& image1, const WPngImage& image2)
+{
+    WPngImage multiplied = image1, divided = image1;
+    multiplied.multiply(image2);
+    divided.divide(image2);
+    for(int y = 0; y < image1.height(); ++y)
+        for(int x = 0; x < image1.width(); ++x)
+        {
+            const Pixel_t p1 = getPixel<Pixel_t>(image1, x, y);
+            const Pixel_t p2 = getPixel<Pixel_t>(image2, x, y);
+            COMPAREP(getPixel<Pixel_t>(multiplied, x, y), p1 * p2);
+            COMPAREP(getPixel<Pixel_t>(divided, x, y), p1 / p2);
+        }
+    return true;
+}
+
+// Every pair of 8-bit components, and 16-bit and float components around the limits of
+// saturation and rounding, including zero divisors.
+static bool testImageMultiplyDivide()
+{
+    WPngImage image1(256, 256), image2(256, 256);
+    for(int y = 0; y < 256; ++y)
+        for(int x = 0; x < 256; ++x)
+        {
+            image1.set(x, y, WPngImage::Pixel8(x, y, x ^ y, 255));
+            image2.set(x, y, WPngImage::Pixel8(y, x, 255 - x, 128));
+        }
+    if(!testImageMultiplyDivide<WPngImage::Pixel8>(image1, image2)) ERRORRET;
+
+    const WPngImage::UInt16 values[] =
+    {
+        0, 1, 2, 3, 127, 128, 255, 256, 257, 1000, 32767, 32768, 32769, 40000, 65534, 65535
+    };
+    const int kValuesAmount = int(ARRAY_SIZE(values));
+    image1.newImage(kValuesAmount, kValuesAmount, WPngImage::kPixelFormat_RGBA16);
+    image2.newImage(kValuesAmount, kValuesAmount, WPngImage::kPixelFormat_RGBA16);
+    for(int y = 0; y < kValuesAmount; ++y)
+        for(int x = 0; x < kValuesAmount; ++x)
+        {
+            image1.set(x, y, WPngImage::Pixel16(values[x], values[y], values[x] / 2, 65535));
+            image2.set(x, y, WPngImage::Pixel16(values[y], values[x], values[y] / 3, 1));
+        }
+    if(!testImageMultiplyDivide<WPngImage::Pixel16>(image1, image2)) ERRORRET;
+
+    image1.convertToPixelFormat(WPngImage::kPixelFormat_RGBAF);
+    image2.convertToPixelFormat(WPngImage::kPixelFormat_RGBAF);
+    image2.set(1, 1, WPngImage::PixelF(-0.0f, 0.0f, -2.5f, 0.5f));
+    if(!testImageMultiplyDivide<WPngImage::PixelF>(image1, image2)) ERRORRET;
+    return true;
+}
+
+static bool testPixelArithmetic()
+{
+    if(!testPixelArithmetic<WPngImage::Pixel8>(WPngImage::kPixelFormat_RGBA8, 255, 40))
+        ERRORRET;
+    if(!testPixelArithmetic<WPngImage::Pixel16>(WPngImage::kPixelFormat_RGBA16, 65535, 10000))
+        ERRORRET;
+    if(!testPixelArithmetic<WPngImage::PixelF>(WPngImage::kPixelFormat_RGBAF, 1.0f, 0.25f))
+        ERRORRET;
+    if(!testImageMultiplyDivide()) ERRORRET;
+
+    WPngImage image(50, 20, WPngImage::PixelF(0.5f, 1.5f, -0.5f, 1));
+    image.invert();
+    if(!image.allPixelsHaveFullAlpha()) ERRORRET;
+    COMPARE(image.getF(3, 3), 0.5f, -0.5f, 1.5f, 1.0f);
+    image.clamp();
+    COMPARE(image.getF(3, 3), 0.5f, 0.0f, 1.0f, 1.0f);
+    image.clampColors(0.25f, 0.75f);
+    COMPARE(image.getF(3, 3), 0.5f, 0.25f, 0.75f, 1.0f);
+    image.adjustBrightnessContrast(0.0f, 2.0f);
+    COMPARE(image.getF(3, 3), 0.5f, 0.0f, 1.0f, 1.0f);
+    image.multiplyAlpha(0.5f);
+    if(image.allPixelsHaveFullAlpha()) ERRORRET;
+    COMPARE(image.getF(3, 3), 0.5f, 0.0f, 1.0f, 0.5f);
+
+    WPngImage image8(50, 20, WPngImage::Pixel8(10, 128, 250, 200));
+    image8.clampColors(0.2f, 0.8f);
+    COMPARE(image8.get8(49, 19), 51, 128, 204, 200);
+    image8.divide(0);
+    COMPARE(image8.get8(49, 19), 255, 255, 255, 200);
+    image8.multiplyAlpha(2);
+    COMPARE(image8.get8(49, 19), 255, 255, 255, 255);
+    if(!image8.allPixelsHaveFullAlpha()) ERRORRET;
+    return true;
+}
+
+static WPngImage::Pixel8 curve8(WPngImage::Pixel8 pixel)
+{
+    return WPngImage::Pixel8(Byte(std::sqrt(pixel.r / 255.0) * 255.0 + 0.5), 255 - pixel.g,
+                             pixel.b / 2, 255 - pixel.a);
+}
+
+static WPngImage::Pixel16 curve16(WPngImage::Pixel16 pixel)
+{
+    return WPngImage::Pixel16(UInt16(std::sqrt(pixel.r / 65535.0) * 65535.0 + 0.5),
+                              65535 - pixel.g, pixel.b / 2, 65535 - pixel.a);
+}
+
+static WPngImage::Pixel8 curveColors8(WPngImage::Pixel8 pixel)
+{
+    return WPngImage::Pixel8(pixel.r / 2, pixel.g / 3, 255 - pixel.b, pixel.a);
+}
+
+static bool testLUT()
+{
+    const WPngImage::PixelFormat formats[] =
+    {
+        WPngImage::kPixelFormat_GA8, WPngImage::kPixelFormat_GA16, WPngImage::kPixelFormat_GAF,
+        WPngImage::kPixelFormat_RGBA8, WPngImage::kPixelFormat_RGBA16,
+        WPngImage::kPixelFormat_RGBAF
+    };
+
+    const WPngImage::LUT8 lut8(curve8), identity8;
+    const WPngImage::LUT16 lut16(curve16);
+    if(lut8.r[64] != 128 || lut8.g[10] != 245 || lut8.b[255] != 127 || lut8.a[0] != 255)
+        ERRORRET;
+    if(identity8.r[200] != 200 || identity8.a[17] != 17) ERRORRET;
+
+    for(unsigned i = 0; i < ARRAY_SIZE(formats); ++i)
+    {
+        const WPngImage image = createArithmeticTestImage<WPngImage::Pixel16>(formats[i], 3);
+        WPngImage image1 = image, image2 = image;
+        image1.applyLUT(lut8);
+        image2.transform(curve8);
+        COMPAREIMAGES(WPngImage::PixelF, image1, image2);
+
+        image1 = image;
+        image2 = image;
+        image1.applyLUT(lut16);
+        image2.transform(curve16);
+        COMPAREIMAGES(WPngImage::PixelF, image1, image2);
+
+        // The opacity must stay known if the alpha table doesn't change anything.
+        image1.fill(WPngImage::Pixel8(10, 100, 200, 255));
+        image1.applyLUT(WPngImage::LUT8(curveColors8));
+        if(!image1.allPixelsHaveFullAlpha()) ERRORRET;
+        image1.applyLUT(lut8);
+        if(image1.allPixelsHaveFullAlpha()) ERRORRET;
+    }
+    return true;
+}
+
+//============================================================================
+// Test planar pixel formats
+//============================================================================
+static WPngImage::PixelF rotateComponentsF(WPngImage::PixelF pixel)
+{
+    return WPngImage::PixelF(pixel.b, pixel.r * 0.5f, pixel.g, 1.0f - pixel.a);
+}
+
+// Applies the same operations to both images, which must give the same results.
+static bool testPlanarOperations(WPngImage& image, WPngImage& planar, const WPngImage& image2)
+{
+    const WPngImage::PixelF color(0.25f, 0.5f, 0.75f, 0.5f);
+    WPngImage* images[] = { &image, &planar };
+
+    for(unsigned i = 0; i < ARRAY_SIZE(images); ++i)
+    {
+        WPngImage& img = *images[i];
+        img.transform(rotateComponentsF);
+        img.set(5, 6, WPngImage::Pixel8(10, 20, 30, 40));
+        img.drawPixel(7, 8, color);
+        img.drawHorLine(1, 2, 30, color);
+        img.putVertLine(3, 0, 10, WPngImage::Pixel16(1000, 2000, 3000, 4000));
+        img.drawImage(10, 3, image2, 2, 2, 20, 6);
+        img.flipHorizontally();
+        img.flipVertically();
+        img.rotate90cw();
+        img.rotate180();
+        img.translate(3, -2, color);
+        img.add(image2);
+        img.multiply(0.75f);
+        img.invert();
+        img.premultiplyAlpha();
+    }
+
+    COMPAREIMAGES(WPngImage::PixelF, image, planar);
+    return true;
+}
+
+static bool testPlanarPixelFormat(WPngImage::PixelFormat format,
+                                  WPngImage::PixelFormat planarFormat)
+{
+    WPngImage image = createArithmeticTestImage<WPngImage::PixelF>(format, 4);
+    const WPngImage image2 = createArithmeticTestImage<WPngImage::PixelF>(format, 5);
+    WPngImage planar = image;
+    planar.convertToPixelFormat(planarFormat);
+    if(planar.currentPixelFormat() != planarFormat || !planar.isPlanarPixelFormat() ||
+       !planar.isFloatPixelFormat() || image.isPlanarPixelFormat() ||
+       planar.isGrayscalePixelFormat() != image.isGrayscalePixelFormat())
+        ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, planar);
+
+    // Each plane holds one component of every pixel.
+    const WPngImage& constPlanar = planar;
+    const unsigned planesAmount = planar.isGrayscalePixelFormat() ? 2 : 4;
+    const int x = 3, y = 2, index = y * planar.width() + x;
+    if(constPlanar.getRawPlaneData(planesAmount) || image.getRawPlaneData(0)) ERRORRET;
+    if(constPlanar.getRawPlaneData(0)[index] != image.getF(x, y).r ||
+       constPlanar.getRawPlaneData(planesAmount - 1)[index] != image.getF(x, y).a)
+        ERRORRET;
+
+    if(!testPlanarOperations(image, planar, image2)) ERRORRET;
+
+    WPngImage copy = planar, parallel = planar;
+    image.transform(rotateComponentsF);
+    copy.transform(rotateComponentsF);
+    parallel.transform(rotateComponentsF, 4);
+    COMPAREIMAGES(WPngImage::PixelF, image, copy);
+    COMPAREIMAGES(WPngImage::PixelF, image, parallel);
+
+    // Saving works through the closest matching file format.
+    std::vector<unsigned char> pngData1, pngData2;
+    if(image.saveImageToRAM(pngData1) != WPngImage::kIOStatus_Ok) ERRORRET;
+    if(copy.saveImageToRAM(pngData2) != WPngImage::kIOStatus_Ok) ERRORRET;
+    if(pngData1 != pngData2) ERRORRET;
+    WPngImage loaded;
+    if(loaded.loadImageFromRAM(&pngData2[0], pngData2.size(), planarFormat) !=
+       WPngImage::kIOStatus_Ok || loaded.currentPixelFormat() != planarFormat)
+        ERRORRET;
+    image.loadImageFromRAM(&pngData1[0], pngData1.size(), format);
+    COMPAREIMAGES(WPngImage::PixelF, image, loaded);
+
+    // The opacity must be rescanned after the planes have been modified through a pointer.
+    planar.fill(WPngImage::PixelF(0.5f, 1.0f));
+    if(!planar.allPixelsHaveFullAlpha()) ERRORRET;
+    WPngImage::Float* alphas = planar.getRawPlaneData(planesAmount - 1);
+    alphas[y * planar.width() + x] = 0.5f;
+    if(planar.allPixelsHaveFullAlpha()) ERRORRET;
+    COMPARE(planar.getF(x, y), 0.5f, 0.5f, 0.5f, 0.5f);
+    return true;
+}
+
+static bool testPlanarPixelFormats()
+{
+    if(!testPlanarPixelFormat(WPngImage::kPixelFormat_RGBAF,
+                              WPngImage::kPixelFormat_RGBAF_Planar)) ERRORRET;
+    if(!testPlanarPixelFormat(WPngImage::kPixelFormat_GAF,
+                              WPngImage::kPixelFormat_GAF_Planar)) ERRORRET;
+    return true;
+}
+
 //============================================================================
 // Test image flipping and rotation
 //============================================================================
@@ -3121,6 +4804,563 @@ static bool testTranslate()
 }
 
 
+//============================================================================
+// Test row span access
+//============================================================================
+static bool testRowSpans()
+{
+    const int width = 13, height = 7;
+
+    WPngImage grayImage(width, height, WPngImage::kPixelFormat_GA8);
+    for(int y = 0; y < height; ++y)
+        for(int x = 0; x < width; ++x)
+            grayImage.set(x, y, WPngImage::Pixel8(x * 10 + y));
+    {
+        const WPngImage& constImage = grayImage;
+        const WPngImage::PixelRows<const WPngImage::PixelGA8> rows =
+            constImage.rows<WPngImage::PixelGA8>();
+        if(rows.empty() || rows.width() != width || rows.height() != height ||
+           rows.stride() < std::size_t(width))
+            ERRORRET;
+        for(int y = 0; y < height; ++y)
+        {
+            if(rows[y].size() != std::size_t(width)) ERRORRET;
+            for(int x = 0; x < width; ++x)
+                if(rows[y][x].g != x * 10 + y || rows[y][x].a != 255) ERRORRET;
+        }
+        if(!constImage.rows<WPngImage::Pixel8>().empty()) ERRORRET;
+        if(!constImage.rowSpan<WPngImage::PixelGA8>(-1).empty()) ERRORRET;
+        if(!constImage.rowSpan<WPngImage::PixelGA8>(height).empty()) ERRORRET;
+    }
+
+    // Writing through a span is seen by everything else, including the alpha tracking.
+    WPngImage::PixelSpan<WPngImage::PixelGA8> graySpan =
+        grayImage.rowSpan<WPngImage::PixelGA8>(3);
+    graySpan[5].g = 1;
+    graySpan[5].a = 2;
+    if(grayImage.get8(5, 3) != WPngImage::Pixel8(1, 1, 1, 2)) ERRORRET;
+    if(grayImage.allPixelsHaveFullAlpha()) ERRORRET;
+    graySpan[5].a = 255;
+    if(!grayImage.allPixelsHaveFullAlpha()) ERRORRET;
+
+    WPngImage image16(width, height, WPngImage::kPixelFormat_RGBA16);
+    WPngImage::PixelRows<WPngImage::Pixel16> rows16 = image16.rows<WPngImage::Pixel16>();
+    for(int y = 0; y < rows16.height(); ++y)
+    {
+        UInt16 value = UInt16(y * 1000);
+        for(WPngImage::Pixel16* p = rows16[y].begin(); p != rows16[y].end(); ++p, ++value)
+            *p = WPngImage::Pixel16(value, value + 1, value + 2, 60000);
+    }
+    for(int y = 0; y < height; ++y)
+        for(int x = 0; x < width; ++x)
+        {
+            const UInt16 value = UInt16(y * 1000 + x);
+            if(image16.get16(x, y) != WPngImage::Pixel16(value, value + 1, value + 2, 60000))
+                ERRORRET;
+        }
+    if(!image16.rows<WPngImage::PixelGA16>().empty()) ERRORRET;
+
+    WPngImage grayImageF(width, height, WPngImage::kPixelFormat_GAF);
+    grayImageF.set(2, 4, WPngImage::PixelF(0.5f, 0.5f, 0.5f, 0.25f));
+    const WPngImage::PixelGAF& pixelF = grayImageF.rowSpan<WPngImage::PixelGAF>(4)[2];
+    if(pixelF.g != 0.5f || pixelF.a != 0.25f) ERRORRET;
+
+    WPngImage emptyImage;
+    if(!emptyImage.rows<WPngImage::Pixel8>().empty()) ERRORRET;
+    return true;
+}
+
+
+//============================================================================
+// Test padded rows
+//============================================================================
+static bool isAlignedTo64(const void* ptr)
+{
+    return reinterpret_cast<std::size_t>(ptr) % 64 == 0;
+}
+
+static bool testPaddedRows(WPngImage::PixelFormat format)
+{
+    WPngImage image = createArithmeticTestImage<WPngImage::Pixel16>(format, 6);
+    const WPngImage image2 = createArithmeticTestImage<WPngImage::Pixel16>(format, 7);
+    WPngImage padded = image;
+    padded.setPaddedRows(true);
+    if(!padded.hasPaddedRows() || image.hasPaddedRows() ||
+       padded.rowStride() <= std::size_t(padded.width()) ||
+       image.rowStride() != std::size_t(image.width()))
+        ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, padded);
+
+    // The stride changes when a rotation changes the width.
+    if(!testPlanarOperations(image, padded, image2)) ERRORRET;
+    image.rotate90ccw();
+    padded.rotate90ccw();
+    if(padded.width() != 37 || padded.rowStride() <= std::size_t(padded.width())) ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, padded);
+
+    WPngImage parallel = padded;
+    image.transform(rotateComponentsF);
+    padded.transform(rotateComponentsF);
+    parallel.transform(rotateComponentsF, 4);
+    COMPAREIMAGES(WPngImage::PixelF, image, padded);
+    COMPAREIMAGES(WPngImage::PixelF, image, parallel);
+    image.applyLUT(WPngImage::LUT16(curve16));
+    padded.applyLUT(WPngImage::LUT16(curve16));
+    image.clamp();
+    padded.clamp();
+    COMPAREIMAGES(WPngImage::PixelF, image, padded);
+
+    std::vector<unsigned char> pngData1, pngData2;
+    if(image.saveImageToRAM(pngData1) != WPngImage::kIOStatus_Ok) ERRORRET;
+    if(padded.saveImageToRAM(pngData2) != WPngImage::kIOStatus_Ok) ERRORRET;
+    if(pngData1 != pngData2) ERRORRET;
+
+    // The setting is kept when the pixel data is replaced.
+    padded.loadImageFromRAM(&pngData1[0], pngData1.size(), format);
+    image.loadImageFromRAM(&pngData1[0], pngData1.size(), format);
+    if(!padded.hasPaddedRows() || padded.rowStride() <= std::size_t(padded.width())) ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, padded);
+    image.resizeCanvas(-2, 3, 50, 20);
+    padded.resizeCanvas(-2, 3, 50, 20);
+    if(padded.rowStride() <= std::size_t(padded.width())) ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, padded);
+
+    padded.setPaddedRows(false);
+    if(padded.rowStride() != std::size_t(padded.width())) ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, padded);
+    return true;
+}
+
+static bool testPaddedRows()
+{
+    const WPngImage::PixelFormat formats[] =
+    {
+        WPngImage::kPixelFormat_GA8, WPngImage::kPixelFormat_GA16, WPngImage::kPixelFormat_GAF,
+        WPngImage::kPixelFormat_RGBA8, WPngImage::kPixelFormat_RGBA16,
+        WPngImage::kPixelFormat_RGBAF, WPngImage::kPixelFormat_GAF_Planar,
+        WPngImage::kPixelFormat_RGBAF_Planar
+    };
+
+    for(unsigned i = 0; i < ARRAY_SIZE(formats); ++i)
+        if(!testPaddedRows(formats[i])) ERRORRET;
+
+    // Padded rows start at cache line boundaries, and rows of a multiple of 4 kB get an
+    // extra cache line.
+    WPngImage image(1024, 3, WPngImage::kPixelFormat_RGBA8);
+    if(!isAlignedTo64(image.getRawPixelData8())) ERRORRET;
+    image.setPaddedRows(true);
+    const WPngImage::PixelRows<WPngImage::Pixel8> rows = image.rows<WPngImage::Pixel8>();
+    if(image.rowStride() != 1040 || rows.stride() != 1040) ERRORRET;
+    for(int y = 0; y < rows.height(); ++y)
+        if(!isAlignedTo64(rows[y].begin())) ERRORRET;
+    rows[2][1023] = WPngImage::Pixel8(1, 2, 3, 4);
+    if(image.get8(1023, 2) != WPngImage::Pixel8(1, 2, 3, 4) || image.allPixelsHaveFullAlpha())
+        ERRORRET;
+
+    WPngImage planar(5, 3, WPngImage::kPixelFormat_RGBAF_Planar);
+    planar.setPaddedRows(true);
+    if(planar.rowStride() != 16) ERRORRET;
+    planar.getRawPlaneData(1)[2 * planar.rowStride() + 4] = 0.5f;
+    if(!isAlignedTo64(planar.getRawPlaneData(3)) || planar.getF(4, 2).g != 0.5f) ERRORRET;
+    return true;
+}
+
+
+//============================================================================
+// Test memory resources
+//============================================================================
+class CountingMemoryResource: public WPngImage::MemoryResource
+{
+ public:
+    std::size_t allocations, allocatedBytes;
+    bool errorFound;
+
+    CountingMemoryResource(): allocations(0), allocatedBytes(0), errorFound(false) {}
+
+    virtual void* allocate(std::size_t bytes, std::size_t alignment)
+    {
+        ++allocations;
+        allocatedBytes += bytes;
+        void* ptr = ::operator new(bytes + alignment);
+        char* data = static_cast<char*>(ptr) + alignment -
+            reinterpret_cast<std::size_t>(ptr) % alignment;
+        mBlocks.push_back(Block(data, bytes, ptr));
+        return data;
+    }
+
+    // Every block must be deallocated with the size it was allocated with.
+    virtual void deallocate(void* ptr, std::size_t bytes, std::size_t)
+    {
+        for(std::size_t i = 0; i < mBlocks.size(); ++i)
+            if(mBlocks[i].data == ptr)
+            {
+                if(mBlocks[i].bytes != bytes) errorFound = true;
+                allocatedBytes -= bytes;
+                ::operator delete(mBlocks[i].block);
+                mBlocks.erase(mBlocks.begin() + i);
+                return;
+            }
+        errorFound = true;
+    }
+
+ private:
+    struct Block
+    {
+        void* data; std::size_t bytes; void* block;
+        Block(void* d, std::size_t b, void* bl): data(d), bytes(b), block(bl) {}
+    };
+    std::vector<Block> mBlocks;
+};
+
+static bool testMemoryResources(WPngImage::PixelFormat format)
+{
+    CountingMemoryResource resource;
+    {
+        const WPngImage image = createArithmeticTestImage<WPngImage::PixelF>(format, 8);
+        WPngImage image2 = image;
+        if(resource.allocations != 0) ERRORRET;
+
+        // Existing pixel data is moved to the resource.
+        image2.setMemoryResource(&resource);
+        if(image2.memoryResource() != &resource || resource.allocatedBytes == 0) ERRORRET;
+        COMPAREIMAGES(WPngImage::PixelF, image, image2);
+
+        // Copies share the pixel data, and new pixel data comes from the same resource.
+        const std::size_t allocatedBytes = resource.allocatedBytes;
+        std::size_t allocations = resource.allocations;
+        WPngImage copy = image2;
+        if(copy.memoryResource() != &resource || resource.allocations != allocations) ERRORRET;
+        copy.rotate90cw();
+        copy.setPaddedRows(true);
+        copy.resizeCanvas(-3, -1, 40, 50);
+        copy.convertToPixelFormat(WPngImage::kPixelFormat_RGBA16);
+        copy.newImage(10, 20, WPngImage::Pixel8(1, 2, 3));
+        if(resource.allocations < allocations + 5) ERRORRET;
+        copy = image;
+        if(copy.memoryResource() != 0 || resource.allocatedBytes != allocatedBytes) ERRORRET;
+
+        // Saving without an Encoder takes its temporary buffers (and with libpng, all of
+        // libpng's allocations) from the resource.
+        std::vector<unsigned char> pngData1, pngData2;
+        if(image.saveImageToRAM(pngData1) != WPngImage::kIOStatus_Ok) ERRORRET;
+        allocations = resource.allocations;
+        if(image2.saveImageToRAM(pngData2) != WPngImage::kIOStatus_Ok) ERRORRET;
+        if(pngData1 != pngData2) ERRORRET;
+        if(resource.allocations == allocations) ERRORRET;
+
+        // The resource given to a load function becomes the resource of the image.
+        WPngImage loaded;
+        if(loaded.loadImageFromRAM(&pngData1[0], pngData1.size(), format, 0, &resource) !=
+           WPngImage::kIOStatus_Ok || loaded.memoryResource() != &resource)
+            ERRORRET;
+        copy = image;
+        copy.loadImageFromRAM(&pngData1[0], pngData1.size(), format);
+        COMPAREIMAGES(WPngImage::PixelF, copy, loaded);
+    }
+
+    if(resource.allocatedBytes != 0 || resource.errorFound) ERRORRET;
+    return true;
+}
+
+static bool testMemoryResources()
+{
+    const WPngImage::PixelFormat formats[] =
+    {
+        WPngImage::kPixelFormat_GA8, WPngImage::kPixelFormat_RGBA16,
+        WPngImage::kPixelFormat_RGBAF, WPngImage::kPixelFormat_RGBAF_Planar
+    };
+
+    for(unsigned i = 0; i < ARRAY_SIZE(formats); ++i)
+        if(!testMemoryResources(formats[i])) ERRORRET;
+
+    // Without a resource of their own, images use the default resource.
+    CountingMemoryResource resource;
+    WPngImage::setDefaultMemoryResource(&resource);
+    if(WPngImage::defaultMemoryResource() != &resource) ERRORRET;
+    WPngImage image(100, 10, WPngImage::Pixel8(10, 20, 30));
+    WPngImage::setDefaultMemoryResource(0);
+    if(resource.allocatedBytes < 100 * 10 * 4 || image.memoryResource() != 0) ERRORRET;
+    image.setMemoryResource(0);
+    if(resource.allocatedBytes != 0 || resource.errorFound) ERRORRET;
+    COMPARE(image.get8(99, 9), 10, 20, 30, 255);
+
+#if WPNGIMAGE_PMR_SUPPORT
+    std::pmr::unsynchronized_pool_resource pool;
+    WPngImage::PmrMemoryResource pmrResource(&pool);
+    WPngImage pmrImage = createArithmeticTestImage<WPngImage::Pixel8>
+        (WPngImage::kPixelFormat_RGBA8, 9);
+    image = pmrImage;
+    pmrImage.setMemoryResource(&pmrResource);
+    pmrImage.rotate90ccw();
+    image.rotate90ccw();
+    COMPAREIMAGES(WPngImage::Pixel8, image, pmrImage);
+#endif
+    return true;
+}
+
+
+//============================================================================
+// Test external pixel buffers
+//============================================================================
+template<typename Pixel_t>
+static bool testExternalBuffer(WPngImage::PixelFormat format)
+{
+    // The image is square, so that rotating it keeps the pixels in the buffer.
+    const int kSize = 11;
+    const std::size_t kStride = 14;
+    const WPngImage::PixelF color(0.25f, 0.5f, 0.75f, 0.5f);
+    WPngImage image = createArithmeticTestImage<WPngImage::PixelF>(format, 10);
+    const WPngImage image2 = createArithmeticTestImage<WPngImage::PixelF>(format, 11);
+    image.resizeCanvas(0, 0, kSize, kSize);
+
+    // The last row has no padding after it.
+    std::vector<Pixel_t> buffer(kStride * (kSize - 1) + kSize);
+    std::memset(static_cast<void*>(&buffer[0]), 0x5A, buffer.size() * sizeof(Pixel_t));
+    const WPngImage& constImage = image;
+    const WPngImage::PixelRows<const Pixel_t> rows = constImage.rows<Pixel_t>();
+    for(int y = 0; y < kSize; ++y)
+        std::copy(rows[y].begin(), rows[y].end(), &buffer[y * kStride]);
+
+    WPngImage view;
+    if(!view.adoptExternalBuffer(&buffer[0], kSize, kSize, kStride, format) ||
+       !view.hasExternalBuffer() || image.hasExternalBuffer() ||
+       view.currentPixelFormat() != format || view.rowStride() != kStride)
+        ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, view);
+
+    // Operations which keep the size and the pixel format modify the buffer.
+    WPngImage* images[] = { &image, &view };
+    for(unsigned i = 0; i < ARRAY_SIZE(images); ++i)
+    {
+        WPngImage& img = *images[i];
+        img.transform(rotateComponentsF);
+        img.set(5, 6, WPngImage::Pixel8(10, 20, 30, 40));
+        img.drawPixel(7, 8, color);
+        img.drawHorLine(1, 2, 30, color);
+        img.drawImage(3, 3, image2, 2, 2, 20, 6);
+        img.flipHorizontally();
+        img.flipVertically();
+        img.rotate90cw();
+        img.rotate180();
+        img.translate(3, -2, color);
+        img.add(image2);
+        img.multiply(0.75f);
+        img.invert();
+        img.premultiplyAlpha();
+        img.applyLUT(WPngImage::LUT8(curve8));
+    }
+
+    if(!view.hasExternalBuffer() || view.rowSpan<Pixel_t>(0).data() != &buffer[0]) ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, view);
+
+    std::vector<unsigned char> pngData1, pngData2;
+    if(image.saveImageToRAM(pngData1) != WPngImage::kIOStatus_Ok) ERRORRET;
+    if(view.saveImageToRAM(pngData2) != WPngImage::kIOStatus_Ok) ERRORRET;
+    if(pngData1 != pngData2) ERRORRET;
+
+    // Copies own their pixels, and operations which create new pixel data leave the buffer
+    // as it was.
+    WPngImage copy = view;
+    copy.fill(color);
+    if(copy.hasExternalBuffer()) ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, view);
+    view.resizeCanvas(0, 0, kSize, kSize + 1);
+    if(view.hasExternalBuffer()) ERRORRET;
+    view.fill(color);
+    if(!view.adoptExternalBuffer(&buffer[0], kSize, kSize, kStride, format)) ERRORRET;
+    COMPAREIMAGES(WPngImage::PixelF, image, view);
+    image.fill(color);
+    view.fill(color);
+    COMPAREIMAGES(WPngImage::PixelF, image, view);
+
+    // Nothing is written between the rows.
+    for(int y = 0; y + 1 < kSize; ++y)
+    {
+        const unsigned char* padding =
+            reinterpret_cast<const unsigned char*>(&buffer[y * kStride + kSize]);
+        for(std::size_t i = 0; i < (kStride - kSize) * sizeof(Pixel_t); ++i)
+            if(padding[i] != 0x5A) ERRORRET;
+    }
+    return true;
+}
+
+static bool testExternalBuffer()
+{
+    if(!testExternalBuffer<WPngImage::PixelGA8>(WPngImage::kPixelFormat_GA8)) ERRORRET;
+    if(!testExternalBuffer<WPngImage::PixelGA16>(WPngImage::kPixelFormat_GA16)) ERRORRET;
+    if(!testExternalBuffer<WPngImage::PixelGAF>(WPngImage::kPixelFormat_GAF)) ERRORRET;
+    if(!testExternalBuffer<WPngImage::Pixel8>(WPngImage::kPixelFormat_RGBA8)) ERRORRET;
+    if(!testExternalBuffer<WPngImage::Pixel16>(WPngImage::kPixelFormat_RGBA16)) ERRORRET;
+    if(!testExternalBuffer<WPngImage::PixelF>(WPngImage::kPixelFormat_RGBAF)) ERRORRET;
+
+    std::vector<WPngImage::Pixel8> frame(20 * 10, WPngImage::Pixel8(10, 20, 30));
+    WPngImage image(2, 2), view;
+    if(image.adoptExternalBuffer(&frame[0], 20, 10, 19) ||
+       image.adoptExternalBuffer(&frame[0], 5, 5, 5, WPngImage::kPixelFormat_RGBAF_Planar) ||
+       image.hasExternalBuffer() || image.width() != 2)
+        ERRORRET;
+
+    // The buffer can be changed directly, so its opacity isn't assumed.
+    if(!view.adoptExternalBuffer(&frame[0], 20, 10, 20) || !view.allPixelsHaveFullAlpha())
+        ERRORRET;
+    frame[5 * 20 + 7].a = 100;
+    if(view.allPixelsHaveFullAlpha()) ERRORRET;
+    COMPARE(view.get8(7, 5), 10, 20, 30, 100);
+
+    std::vector<unsigned char> pngData;
+    if(view.saveImageToRAM(pngData) != WPngImage::kIOStatus_Ok) ERRORRET;
+    if(image.loadImageFromRAM(&pngData[0], pngData.size()) != WPngImage::kIOStatus_Ok)
+        ERRORRET;
+    COMPAREIMAGES(WPngImage::Pixel8, image, view);
+    if(view.isReadOnly()) ERRORRET;
+
+    // A read-only buffer is never written, and its pixels are never copied for that.
+    const std::vector<WPngImage::Pixel8> original = frame;
+    const WPngImage::Pixel8* constFrame = &frame[0];
+    if(!view.adoptExternalBuffer(constFrame, 20, 10, 20) || !view.isReadOnly() ||
+       !view.hasExternalBuffer())
+        ERRORRET;
+    view.set(1, 2, WPngImage::Pixel8(1, 2, 3, 4));
+    view.fill(WPngImage::Pixel8(0, 0, 0));
+    view.transform(rotateComponentsF);
+    view.transformT<WPngImage::Pixel8>(InvertFunctor<WPngImage::Pixel8>(255));
+    view.drawRect(2, 2, 5, 5, WPngImage::Pixel8(255, 0, 0), true);
+    view.rotate90cw();
+    view.add(image);
+    view.applyLUT(WPngImage::LUT8(curve8));
+    view.quantizeToPalette(4, false);
+    if(view.getRawPixelData8() || !view.rows<WPngImage::Pixel8>().empty() ||
+       view.rowSpan<WPngImage::Pixel8>(0).size() != 0)
+        ERRORRET;
+    if(frame != original || !view.hasExternalBuffer() || view.width() != 20) ERRORRET;
+    COMPAREIMAGES(WPngImage::Pixel8, image, view);
+
+    // Copies are modifiable, and so is the image once it has pixel data of its own.
+    WPngImage copy = view;
+    copy.fill(WPngImage::Pixel8(0, 0, 0));
+    if(copy.isReadOnly() || copy.get8(3, 3) != WPngImage::Pixel8(0, 0, 0)) ERRORRET;
+    view.convertToPixelFormat(WPngImage::kPixelFormat_RGBA16);
+    view.fill(WPngImage::Pixel8(0, 0, 0));
+    if(view.isReadOnly() || view.hasExternalBuffer() || frame != original) ERRORRET;
+    return true;
+}
+
+//============================================================================
+// Test shared pixel data
+//============================================================================
+static void modifySet(WPngImage& image) { image.set(5, 6, WPngImage::Pixel8(10, 20, 30, 40)); }
+static void modifyDrawPixel(WPngImage& image)
+{ image.drawPixel(7, 8, WPngImage::PixelF(0.25f, 0.5f, 0.75f, 0.5f)); }
+static void modifyFill(WPngImage& image) { image.fill(WPngImage::Pixel16(1000)); }
+static void modifyTransform(WPngImage& image) { image.transform(rotateComponentsF); }
+static void modifyTransformT(WPngImage& image)
+{ image.transformT<WPngImage::Pixel8>(InvertFunctor<WPngImage::Pixel8>(255)); }
+static void modifyTransformXYT(WPngImage& image)
+{ image.transformXYT<WPngImage::Pixel8>(CoordinatesFunctor()); }
+static void modifyFlip(WPngImage& image) { image.flipHorizontally(); }
+static void modifyRotate(WPngImage& image) { image.rotate90cw(); }
+static void modifyTranslate(WPngImage& image) { image.translate(3, -2); }
+static void modifyDrawImage(WPngImage& image)
+{ image.drawImage(3, 3, createArithmeticTestImage<WPngImage::Pixel8>
+                  (WPngImage::kPixelFormat_RGBA8, 13), 2, 2, 20, 6); }
+static void modifyDrawRect(WPngImage& image)
+{ image.drawRect(2, 3, 10, 5, WPngImage::Pixel8(1, 2, 3), true); }
+static void modifyPremultiply(WPngImage& image) { image.premultiplyAlpha(); }
+static void modifyLUT(WPngImage& image) { image.applyLUT(WPngImage::LUT8(curve8)); }
+static void modifyMultiply(WPngImage& image) { image.multiply(0.75f); }
+static void modifyFileFormat(WPngImage& image)
+{ image.setFileFormat(WPngImage::kPngFileFormat_GA8); }
+static void modifyRows(WPngImage& image)
+{ image.rows<WPngImage::Pixel8>()[4][9] = WPngImage::Pixel8(1, 2, 3, 4); }
+
+// The const version doesn't give the pixel data out for modification.
+static const WPngImage::Pixel8* pixelData(const WPngImage& image)
+{
+    return image.getRawPixelData8();
+}
+
+static bool testSharedPixelData()
+{
+    typedef void(*ModifyFunc)(WPngImage&);
+    const ModifyFunc modifyFuncs[] =
+    {
+        modifySet, modifyDrawPixel, modifyFill, modifyTransform, modifyTransformT,
+        modifyTransformXYT, modifyFlip, modifyRotate, modifyTranslate, modifyDrawImage,
+        modifyDrawRect, modifyPremultiply, modifyLUT, modifyMultiply, modifyFileFormat,
+        modifyRows
+    };
+
+    const WPngImage reference =
+        createArithmeticTestImage<WPngImage::Pixel8>(WPngImage::kPixelFormat_RGBA8, 12);
+
+    for(unsigned i = 0; i < ARRAY_SIZE(modifyFuncs); ++i)
+    {
+        // A copy shares the pixel data until either image is modified.
+        const WPngImage image =
+            createArithmeticTestImage<WPngImage::Pixel8>(WPngImage::kPixelFormat_RGBA8, 12);
+        WPngImage copy1 = image, copy2;
+        copy2 = copy1;
+        if(pixelData(copy1) != pixelData(image) || pixelData(copy2) != pixelData(image))
+            ERRORRET;
+
+        WPngImage expected = reference;
+        modifyFuncs[i](expected);
+        modifyFuncs[i](copy1);
+        if(pixelData(copy1) == pixelData(image) || pixelData(copy2) != pixelData(image))
+            ERRORRET;
+        COMPAREIMAGES(WPngImage::Pixel8, copy1, expected);
+        COMPAREIMAGES(WPngImage::Pixel8, copy2, reference);
+        COMPAREIMAGES(WPngImage::Pixel8, image, reference);
+        if(copy1.originalFileFormat() != expected.originalFileFormat() ||
+           image.originalFileFormat() != reference.originalFileFormat())
+            ERRORRET;
+    }
+
+    // Pixel data whose pointer has been given out isn't shared, because it can be modified
+    // through the pointer.
+    WPngImage image =
+        createArithmeticTestImage<WPngImage::Pixel8>(WPngImage::kPixelFormat_RGBA8, 12);
+    WPngImage::Pixel8* pixels = image.getRawPixelData8();
+    const WPngImage copy = image;
+    if(pixelData(copy) == pixels) ERRORRET;
+    pixels[0] = WPngImage::Pixel8(1, 2, 3, 4);
+    COMPARE(image.get8(0, 0), 1, 2, 3, 4);
+    image.set(0, 0, WPngImage::Pixel8(5, 6, 7, 8));
+    if(image.getRawPixelData8() != pixels) ERRORRET;
+    COMPARE(pixels[0], 5, 6, 7, 8);
+    COMPAREIMAGES(WPngImage::Pixel8, copy, reference);
+    if(copy.allPixelsHaveFullAlpha() != reference.allPixelsHaveFullAlpha()) ERRORRET;
+
+    // Assigning and moving release the previously shared data.
+    WPngImage image2 = copy, image3 = copy;
+    image2 = reference;
+    image3.move(image2);
+    image2 = image3;
+    if(pixelData(image2) != pixelData(image3)) ERRORRET;
+    image3.fill(WPngImage::Pixel8(0));
+    COMPAREIMAGES(WPngImage::Pixel8, image2, reference);
+
+    // Copies sharing the same pixel data can be read by several threads.
+    std::vector<WPngImage> copies(8, reference);
+    std::vector<std::vector<unsigned char> > pngData(copies.size());
+    std::vector<WPngImage::BatchSaveItem> items;
+    for(std::size_t i = 0; i < copies.size(); ++i)
+        items.push_back(WPngImage::BatchSaveItem(copies[i], pngData[i]));
+    const std::vector<WPngImage::IOStatus> statuses =
+        WPngImage::saveImages(items, WPngImage::SaveOptions(), 4);
+
+    std::vector<unsigned char> expectedData;
+    if(!checkIOStatus(reference.saveImageToRAM(expectedData), true)) ERRORRET;
+    for(std::size_t i = 0; i < copies.size(); ++i)
+    {
+        if(!checkIOStatus(statuses[i], true)) ERRORRET;
+        if(pngData[i] != expectedData) ERRORRET;
+        if(pixelData(copies[i]) != pixelData(reference)) ERRORRET;
+    }
+    return true;
+}
+
+
 //============================================================================
 // Test constexprness
 //============================================================================
@@ -3382,10 +5622,36 @@ int main()
     if(!testImages2()) ERRORRET1;
     if(!testImages3()) ERRORRET1;
     if(!testSavingAndLoading()) ERRORRET1;
+    if(!testSaveOptions()) ERRORRET1;
+    if(!testCompression()) ERRORRET1;
+#if !WPNGIMAGE_USE_LIBPNG
+    if(!testChecksums()) ERRORRET1;
+#endif
+    if(!testOpacityTracking()) ERRORRET1;
+    if(!testColorReduction()) ERRORRET1;
+    if(!testPaletteQuantization()) ERRORRET1;
+    if(!testEncoder()) ERRORRET1;
+    if(!testSaveRegion()) ERRORRET1;
+    if(!testSave16BitRows()) ERRORRET1;
+    if(!testSaveImages()) ERRORRET1;
+    if(!testOptimize()) ERRORRET1;
+#if !WPNGIMAGE_USE_LIBPNG
+    if(!testCompressionBackend()) ERRORRET1;
+#endif
     if(!testTransform()) ERRORRET1;
+    if(!testTransformTemplates()) ERRORRET1;
+    if(!testParallelTransform()) ERRORRET1;
     if(!testAlphaPremultiply()) ERRORRET1;
+    if(!testPixelArithmetic()) ERRORRET1;
+    if(!testLUT()) ERRORRET1;
+    if(!testPlanarPixelFormats()) ERRORRET1;
     if(!testFlippingAndRotation()) ERRORRET1;
     if(!testTranslate()) ERRORRET1;
+    if(!testRowSpans()) ERRORRET1;
+    if(!testPaddedRows()) ERRORRET1;
+    if(!testMemoryResources()) ERRORRET1;
+    if(!testExternalBuffer()) ERRORRET1;
+    if(!testSharedPixelData()) ERRORRET1;
 #if !WPNGIMAGE_RESTRICT_TO_CPP98
     if(!testUtils()) ERRORRET1;
 #endif